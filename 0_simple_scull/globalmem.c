@@ -11,6 +11,9 @@
 #include <linux/cdev.h>
 #include <linux/slab.h> //mem management
 #include <linux/uaccess.h> //copy_*_user
+#include <linux/device.h> //class, device_create
+
+#include "globalmem_core.h" //bounds checks, shared with the userspace harness
 
 #define		GLOBAL_MEM_SIZE		0x1000
 //MEM_CLEAR is a naive ioctl cmd
@@ -20,7 +23,7 @@
 #define 	MEM_CLEAR			_IO(GLOBAL_MEM_MAGIC, 0)
 
 
-#define 	GLOBAL_MEM_MAJOR	230
+#define 	GLOBAL_MEM_MAJOR	0 //dynamic, udev creates /dev/globalmem through the class
 
 static int globalmem_major = GLOBAL_MEM_MAJOR;
 
@@ -33,6 +36,7 @@ struct globalmem_dev{
 
 //define a point of cdev
 struct globalmem_dev *globalmem_devp;
+static struct class *globalmem_class;
 
 static int globalmem_open(struct inode *inode, struct file *filp){
 	filp->private_data = globalmem_devp; //setup the private data to be the device pointer
@@ -63,16 +67,13 @@ static long globalmem_ioctl(struct file *filp, unsigned int cmd, unsigned long a
 static ssize_t globalmem_read(struct file *filp, char __user *buf, size_t size, loff_t *ppos){
 
 	unsigned long p = *ppos;
-	unsigned int count = size;
+	unsigned int count = globalmem_span(*ppos, size, GLOBAL_MEM_SIZE);
 	int ret = 0;
 	struct globalmem_dev *dev = filp->private_data;
 
-	if(p >= GLOBAL_MEM_SIZE){
+	if(!count){
 		return 0;
 	}
-	if(count > GLOBAL_MEM_SIZE - p){
-		count = GLOBAL_MEM_SIZE - p;
-	}
 
 	if(copy_to_user(buf, dev->mem + p, count)){ 
 		return -EFAULT;
@@ -89,18 +90,14 @@ static ssize_t globalmem_read(struct file *filp, char __user *buf, size_t size,
 static ssize_t globalmem_write(struct file *filp, const char __user *buf, size_t size, loff_t *ppos){
 
 	unsigned long p = *ppos;
-	unsigned int count = size;
+	unsigned int count = globalmem_span(*ppos, size, GLOBAL_MEM_SIZE);
 	int ret = 0;
 	struct globalmem_dev *dev = filp->private_data;
 
-	if(p >= GLOBAL_MEM_SIZE){
+	if(!count){
 		return 0;
 	}
 
-	if(count > GLOBAL_MEM_SIZE - p){
-		count = GLOBAL_MEM_SIZE - p;
-	}
-
 	if(copy_from_user(dev->mem + p, buf, count)){
 		ret = -EFAULT;
 	} else{
@@ -114,40 +111,10 @@ static ssize_t globalmem_write(struct file *filp, const char __user *buf, size_t
 }
 
 static loff_t globalmem_llseek(struct file *filp, loff_t offset, int orig){
-	loff_t ret = 0;
-	switch(orig){
-	case 0: //seek from the start point of the file
-		if(offset < 0){
-			ret = -EFAULT;
-			break;
-		}
-		if((unsigned int)offset > GLOBAL_MEM_SIZE){
-			ret = -EINVAL;
-			break;
-		}
-		filp->f_pos = (unsigned int) offset;
-		ret = filp->f_pos;
-		break;
-
-	case 1: //seek from the current file position
-		if((filp->f_pos + offset) > GLOBAL_MEM_SIZE){
-			ret = -EINVAL;
-			break;
-		}
-		if((filp->f_pos + offset) < 0){
-			ret = -EINVAL;
-			break;
-		}
-
-		filp->f_pos += offset;
-		ret = filp->f_pos;
-		break;
-
-	default:
-		ret = -EINVAL;
-		break;
-	}
+	loff_t ret = globalmem_seek(filp->f_pos, offset, orig, GLOBAL_MEM_SIZE);
 
+	if(ret >= 0)
+		filp->f_pos = ret;
 	return ret;
 }
 
@@ -176,6 +143,7 @@ static void globalmem_setup_cdev(struct globalmem_dev *dev, int index){
 
 static int __init globalmem_init(void){
 	int ret;
+	struct device *device;
 	dev_t devno = MKDEV(globalmem_major, 0);
 
 	if(globalmem_major){
@@ -195,15 +163,33 @@ static int __init globalmem_init(void){
 	}
 
 	globalmem_setup_cdev(globalmem_devp, 0);
+
+	globalmem_class = class_create("globalmem");
+	if(IS_ERR(globalmem_class)){
+		ret = PTR_ERR(globalmem_class);
+		goto fail_class;
+	}
+	device = device_create(globalmem_class, NULL, devno, NULL, "globalmem");
+	if(IS_ERR(device)){
+		ret = PTR_ERR(device);
+		goto fail_device;
+	}
 	return 0;
 
+fail_device:
+	class_destroy(globalmem_class);
+fail_class:
+	cdev_del(&globalmem_devp->cdev);
+	kfree(globalmem_devp);
 fail_malloc:
-	unregister_chrdev_region(devno, 0);
+	unregister_chrdev_region(devno, 1);
 	return ret;
 }
 
 static void __exit globalmem_exit(void){
 
+	device_destroy(globalmem_class, MKDEV(globalmem_major, 0));
+	class_destroy(globalmem_class);
 	cdev_del(&globalmem_devp->cdev);
 	kfree(globalmem_devp);
 	unregister_chrdev_region(MKDEV(globalmem_major, 0), 1);
@@ -0,0 +1,44 @@
+#ifndef _GLOBALMEM_CORE_H
+#define _GLOBALMEM_CORE_H
+
+//bounds logic of globalmem read/write/llseek, shared by globalmem.c and multi_globalmem.c.
+//it builds in the kernel and, on top of harness/kshim.h, in userspace for the fuzzer.
+#ifdef __KERNEL__
+#include <linux/kernel.h> //min_t
+#include <linux/types.h>
+#include <linux/errno.h>
+#else
+#include "kshim.h"
+#endif
+
+//how many of count bytes at pos fit in a device of size bytes, 0 at or past the end
+static inline size_t globalmem_span(loff_t pos, size_t count, size_t size){
+	if(pos < 0 || pos >= (loff_t)size)
+		return 0;
+	return min_t(size_t, count, size - pos);
+}
+
+//the new file position of llseek, or -EINVAL. orig 0 seeks from the start, 1 from cur.
+//the position may be size (EOF) but not beyond, and the sums never overflow
+static inline loff_t globalmem_seek(loff_t cur, loff_t offset, int orig, size_t size){
+	switch(orig){
+	case 0:
+		if(offset < 0 || offset > (loff_t)size)
+			return -EINVAL;
+		return offset;
+	case 1:
+		if(offset < -cur || offset > (loff_t)size - cur)
+			return -EINVAL;
+		return cur + offset;
+	default:
+		return -EINVAL;
+	}
+}
+
+//whether [off, off + len) lies inside a device of size bytes, without overflowing.
+//the ranges of the in-place ioctls
+static inline bool globalmem_range_ok(u64 off, u64 len, size_t size){
+	return off <= size && len <= size - off;
+}
+
+#endif
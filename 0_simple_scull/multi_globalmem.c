@@ -5,62 +5,1253 @@
 * @Last Modified time: 2019-12-18 15:28:12
 */
 #include <linux/module.h>
+#include <linux/version.h>
 #include <linux/fs.h> //register_chrdev_region
+#include <linux/file.h> //fget, the source of a copy
 #include <linux/cdev.h>
 #include <linux/init.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/device.h> //class, device_create
+#include <linux/crc32c.h> //the crc32 instructions where the CPU has them
+#include <linux/string.h>
+#include <linux/vmalloc.h> //the memory is vmalloc_user, for mmap
+#include <linux/mm.h>
+#include <linux/atomic.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/rwsem.h>
+#include <linux/list.h>
+#include <linux/bitmap.h>
+#include <linux/mutex.h>
+#include <linux/xarray.h>
+#include <linux/srcu.h>
+#include <linux/anon_inodes.h>
+#include <linux/huge_mm.h> //thp_get_unmapped_area, vmf_insert_pfn_pmd
+#include <linux/workqueue.h>
+#include <linux/scatterlist.h>
+#include <crypto/acompress.h>
+#include <asm/tlbflush.h> //flush_tlb_kernel_range
 
+#include "multi_globalmem.h" //ioctl commands
+#include "globalmem_core.h" //bounds checks, shared with the userspace harness
 
-#define GLOBALMEM_SIZE	0x1000
-#define MEM_CLEAR		0x01
-#define GLOABLMEM_MAJOR	230
+
+#define GLOBALMEM_SIZE	0x1000 //default size of each device
+#define GLOBALMEM_SIZE_MAX	(16ULL << 30) //multi-GB, its bitmaps are kvmalloc'ed
+#define GLOABLMEM_MAJOR	0 //dynamic, udev creates /dev/globalmem0..9 through the class
 #define DEVICE_NUM		10
+//read, write and the in-place ioctls lock the stripes their range covers, so disjoint ranges go in parallel.
+//stripe i covers the 4 KiB blocks b with b % GLOBALMEM_STRIPES == i, they repeat every 128 KiB.
+//32 keeps a whole-device op within lockdep's held lock limit
+#define GLOBALMEM_STRIPES	32
+#define GLOBALMEM_STRIPE_SHIFT	12
+#define GLOBALMEM_LOCKS_MAX	16 //user range locks per open file
+#define GLOBALMEM_DIRTY_MAX	4096 //extents per GLOBALMEM_GET_DIRTY
 
 static int globalmem_major = GLOABLMEM_MAJOR;
 module_param(globalmem_major, int, S_IRUGO); //S_IRUGO access 
+static unsigned long globalmem_size = GLOBALMEM_SIZE;
+module_param(globalmem_size, ulong, S_IRUGO);
+static unsigned int globalmem_dirty_shift = 12; //dirty tracking granule, 64 B to 1 MiB
+module_param(globalmem_dirty_shift, uint, S_IRUGO);
+static bool globalmem_huge; //back the devices with PMD sized pages where the allocator has them
+module_param(globalmem_huge, bool, S_IRUGO);
+static char *globalmem_comp = ""; //a crypto acomp algorithm, lz4, zstd ..., to compress the cold pages with
+module_param(globalmem_comp, charp, S_IRUGO);
+static unsigned int globalmem_hot_kb = 1024; //KiB of each device kept in memory, the hot cache
+module_param(globalmem_hot_kb, uint, S_IRUGO | S_IWUSR);
+static unsigned int globalmem_cold_ms = 1000; //how often the cold pages are looked for
+module_param(globalmem_cold_ms, uint, S_IRUGO | S_IWUSR);
 
 struct globalmem_dev{
 	struct cdev cdev;
-	unsigned char mem[GLOBALMEM_SIZE];
+	unsigned char *mem; //size bytes, page aligned so it can be mapped
+	size_t size;
+	wait_queue_head_t wait; //GLOBALMEM_WAIT sleepers and subscriptions, woken by the range written
+	struct rw_semaphore stripe[GLOBALMEM_STRIPES];
+	//the user range locks, GLOBALMEM_LOCK. they are inserted with the stripes of their range held,
+	//so someone holding the stripes sees every lock on them
+	spinlock_t ulock_lock;
+	struct list_head ulocks;
+	unsigned int nr_ulocks;
+	wait_queue_head_t ulock_wait; //someone unlocked
+	//a bit per 1 << dirty_shift bytes written since the last GLOBALMEM_GET_DIRTY, set and taken with
+	//atomic word ops so neither side locks
+	unsigned long *dirty;
+	unsigned long dirty_bits;
+	unsigned int dirty_shift;
+	//the device node the mappings hang off, its i_mapping is where they are write protected again
+	struct mutex map_lock;
+	struct inode *map_inode;
+	//a bit per page made writable by a write fault since it was last write protected, so that write
+	//protecting a range visits only those. set under the page lock, taken under map_lock
+	unsigned long *wmapped;
+	struct globalmem_snap __rcu *snap; //set and cleared with every stripe held
+	//a bit per PMD sized chunk that sits on one aligned huge page, mapped with a single pmd.
+	//NULL on small pages
+	unsigned long *huge;
+	unsigned long huge_chunks; //bits set
+	struct globalmem_cold *cold; //NULL unless globalmem_comp is set
+};
+
+//a device whose pages come and go. mem is an area of kernel address space whose ptes map the pages
+//in memory, the others are compressed in blocks or, all zero, nowhere. a page is only taken out with
+//its stripes held exclusive, so holding them shared keeps the pages of a range in
+struct globalmem_cold{
+	struct globalmem_dev *dev;
+	struct vm_struct *area;
+	unsigned long nr_pages;
+	struct page **pages; //the page in memory or NULL
+	struct xarray blocks; //page index -> its globalmem_cblock, none for an all zero page
+	unsigned long *accessed; //a bit per page used since the last scan went by it
+	unsigned long hand; //where the scan goes on from
+	struct mutex lock; //the crypto request and buf, pages coming in
+	struct crypto_acomp *tfm;
+	struct acomp_req *req;
+	struct crypto_wait wait;
+	u8 *buf; //2 pages, compression output
+	struct delayed_work work;
+	//statistics, the counts under lock
+	unsigned long hot; //pages in memory
+	unsigned long compressed; //pages in blocks
+	unsigned long compressed_bytes;
+	unsigned long evictions;
+	unsigned long incompressible;
+	atomic64_t hits; //pages found in memory by an access
+	atomic64_t misses; //pages brought in
+};
+
+struct globalmem_cblock{
+	unsigned int len;
+	u8 data[];
+};
+
+//a point-in-time view of a device. a block is copied aside the first time it is written after the
+//snapshot, the ones never written are read from the live device
+struct globalmem_snap{
+	struct globalmem_dev *dev;
+	struct xarray blocks; //block index -> the block as it was
+	struct mutex lock; //one copy of a block at a time
+	unsigned long copied;
+	bool broken; //a copy failed for lack of memory, the view is gone
+};
+
+struct globalmem_ulock{
+	struct list_head node; //on dev->ulocks
+	struct globalmem_file *owner;
+	u64 off, len;
+	bool excl;
+};
+
+//someone waiting for a range to change
+struct globalmem_waiter{
+	struct wait_queue_entry wq;
+	u64 off, len;
+	bool changed;
+	wait_queue_head_t *poll; //a subscription wakes the pollers of its file, not a task
+};
+
+struct globalmem_file{
+	struct globalmem_dev *dev;
+	struct globalmem_waiter sub; //on dev->wait while sub.len, changed under its lock
+	wait_queue_head_t poll_wait;
+	unsigned int nr_locks; //its entries on dev->ulocks
+	//the copy engine. pending counts the copies queued and not yet reaped, in flight or in the ring,
+	//so the ring never overflows
+	spinlock_t copy_lock;
+	struct globalmem_copy_comp *ring; //GLOBALMEM_COPY_RING, allocated by the first GLOBALMEM_COPY
+	unsigned int ring_head, ring_len;
+	unsigned int copy_pending;
+	struct mutex reap_lock; //one reaper at a time, what it copied out leaves the ring after
+	atomic_t copy_inflight;
+	struct list_head copy_jobs; //queued or running, under copy_lock
+	bool copy_cancel; //closing, the copies not started yet fail with ECANCELED
+};
+
+//one queued GLOBALMEM_COPY
+struct globalmem_copy_job{
+	struct work_struct work;
+	struct list_head node; //on gf->copy_jobs
+	struct globalmem_file *gf;
+	struct globalmem_dev *src;
+	struct globalmem_copy c;
 };
 
 struct globalmem_dev *globalmem_devp; //define a global pointer for the device
+static struct class *globalmem_class;
+static struct workqueue_struct *globalmem_copy_wq; //unbound, independent copies run in parallel
+static struct lock_class_key globalmem_stripe_keys[GLOBALMEM_STRIPES]; //one class per stripe, taken in order
+DEFINE_STATIC_SRCU(globalmem_snap_srcu); //the writers copying into a snapshot, it is freed after them
+
+//the per page and per block bitmaps of a multi-GB device are too big for kmalloc, freed with kvfree
+static unsigned long *globalmem_bitmap_zalloc(unsigned long nbits){
+	return kvcalloc(BITS_TO_LONGS(nbits), sizeof(unsigned long), GFP_KERNEL);
+}
+
+/*****************stripes******************/
+static u32 globalmem_stripe_mask(u64 off, u64 len){
+	u64 first = off >> GLOBALMEM_STRIPE_SHIFT, last;
+	u32 mask = 0;
+
+	if(!len)
+		return 0;
+	last = (off + len - 1) >> GLOBALMEM_STRIPE_SHIFT;
+	if(last - first >= GLOBALMEM_STRIPES - 1)
+		return ~0U;
+	for(; first <= last; first++)
+		mask |= 1U << (first % GLOBALMEM_STRIPES);
+	return mask;
+}
+
+//always in ascending order, any two callers agree on it
+//subclass tells lockdep the stripes of a second device from those of the first, the copy engine holds both
+static void globalmem_lock_stripes_nested(struct globalmem_dev *dev, u32 mask, bool excl, int subclass){
+	unsigned int i;
+
+	for(i = 0; i < GLOBALMEM_STRIPES; i++){
+		if(!(mask & (1U << i)))
+			continue;
+		if(excl)
+			down_write_nested(&dev->stripe[i], subclass);
+		else
+			down_read_nested(&dev->stripe[i], subclass);
+	}
+}
+
+static void globalmem_lock_stripes(struct globalmem_dev *dev, u32 mask, bool excl){
+	globalmem_lock_stripes_nested(dev, mask, excl, 0);
+}
+
+static void globalmem_unlock_stripes(struct globalmem_dev *dev, u32 mask, bool excl){
+	unsigned int i;
+
+	for(i = 0; i < GLOBALMEM_STRIPES; i++){
+		if(!(mask & (1U << i)))
+			continue;
+		if(excl)
+			up_write(&dev->stripe[i]);
+		else
+			up_read(&dev->stripe[i]);
+	}
+}
+
+/*****************cold pages***************/
+//kernel ptes of the area, set when a page comes in and cleared when it goes out
+static int globalmem_cold_set_pte(pte_t *pte, unsigned long addr, void *data){
+	set_pte_at(&init_mm, addr, pte, pfn_pte(page_to_pfn(data), PAGE_KERNEL));
+	return 0;
+}
+
+static int globalmem_cold_clear_pte(pte_t *pte, unsigned long addr, void *data){
+	pte_clear(&init_mm, addr, pte);
+	return 0;
+}
+
+//decompress page i into a new page and map it, under cold->lock
+static int globalmem_cold_in(struct globalmem_cold *cold, unsigned long i){
+	unsigned long addr = (unsigned long)cold->area->addr + (i << PAGE_SHIFT);
+	struct globalmem_cblock *b = xa_load(&cold->blocks, i);
+	struct scatterlist src, dst;
+	struct page *page;
+	int ret;
+
+	page = alloc_page(GFP_KERNEL);
+	if(!page)
+		return -ENOMEM;
+	if(!b){
+		clear_highpage(page);
+	} else{
+		sg_init_one(&src, b->data, b->len);
+		sg_init_table(&dst, 1);
+		sg_set_page(&dst, page, PAGE_SIZE, 0);
+		acomp_request_set_params(cold->req, &src, &dst, b->len, PAGE_SIZE);
+		ret = crypto_wait_req(crypto_acomp_decompress(cold->req), &cold->wait);
+		if(!ret && cold->req->dlen != PAGE_SIZE)
+			ret = -EIO;
+		if(ret){
+			__free_page(page);
+			return ret;
+		}
+	}
+	ret = apply_to_page_range(&init_mm, addr, PAGE_SIZE, globalmem_cold_set_pte, page);
+	if(ret){
+		__free_page(page);
+		return ret;
+	}
+	if(b){
+		xa_erase(&cold->blocks, i);
+		cold->compressed--;
+		cold->compressed_bytes -= b->len;
+		kfree(b);
+	}
+	cold->hot++;
+	smp_store_release(&cold->pages[i], page); //mapped before it is seen, see globalmem_cold_get
+	return 0;
+}
+
+//bring the pages of [off, off + len) in, with the stripes of the range held
+static int globalmem_cold_get(struct globalmem_dev *dev, u64 off, u64 len){
+	struct globalmem_cold *cold = dev->cold;
+	unsigned long i, last, hits = 0, misses = 0;
+	int ret = 0;
+
+	if(!cold || !len)
+		return 0;
+	last = (off + len - 1) >> PAGE_SHIFT;
+	for(i = off >> PAGE_SHIFT; i <= last; i++){
+		if(!test_bit(i, cold->accessed))
+			set_bit(i, cold->accessed);
+		if(smp_load_acquire(&cold->pages[i])){
+			hits++;
+			continue;
+		}
+		//another holder of the stripe may be bringing it in too
+		mutex_lock(&cold->lock);
+		if(!cold->pages[i]){
+			ret = globalmem_cold_in(cold, i);
+			misses++;
+		}
+		mutex_unlock(&cold->lock);
+		if(ret)
+			break;
+	}
+	atomic64_add(hits, &cold->hits);
+	atomic64_add(misses, &cold->misses);
+	return ret;
+}
+
+//for the paths that take no range lock: the pages of [off, off + len) in and kept in until globalmem_cold_put
+static int globalmem_cold_hold(struct globalmem_dev *dev, u64 off, u64 len){
+	u32 mask = globalmem_stripe_mask(off, len);
+	int ret;
+
+	if(!dev->cold)
+		return 0;
+	globalmem_lock_stripes(dev, mask, false);
+	ret = globalmem_cold_get(dev, off, len);
+	if(ret)
+		globalmem_unlock_stripes(dev, mask, false);
+	return ret;
+}
+
+static void globalmem_cold_put(struct globalmem_dev *dev, u64 off, u64 len){
+	if(dev->cold)
+		globalmem_unlock_stripes(dev, globalmem_stripe_mask(off, len), false);
+}
+
+//page i in for a mapping, and a reference on it, under cold->lock alone. a read or write holds its stripes
+//across the user copy and that copy may fault here, through a mapping of the same device: no stripes then.
+//the reference keeps it in, globalmem_cold_out takes out only a page nobody else holds
+static struct page *globalmem_cold_pin(struct globalmem_dev *dev, unsigned long i){
+	struct globalmem_cold *cold = dev->cold;
+	struct page *page = NULL;
+	bool miss;
+
+	if(!test_bit(i, cold->accessed))
+		set_bit(i, cold->accessed);
+	mutex_lock(&cold->lock);
+	miss = !cold->pages[i];
+	if(!miss || !globalmem_cold_in(cold, i)){
+		page = cold->pages[i];
+		get_page(page);
+	}
+	mutex_unlock(&cold->lock);
+	if(page)
+		atomic64_inc(miss ? &cold->misses : &cold->hits);
+	return page;
+}
+
+//take page i out: dropped when all zero, compressed when that saves a quarter at least. a page with
+//any other reference, a mapping or a pin, stays
+static void globalmem_cold_out(struct globalmem_dev *dev, unsigned long i){
+	struct globalmem_cold *cold = dev->cold;
+	unsigned long addr = (unsigned long)cold->area->addr + (i << PAGE_SHIFT);
+	u32 mask = globalmem_stripe_mask((u64)i << PAGE_SHIFT, PAGE_SIZE);
+	struct globalmem_cblock *b = NULL;
+	struct scatterlist src, dst;
+	struct page *page;
+	unsigned int len;
+
+	globalmem_lock_stripes(dev, mask, true);
+	mutex_lock(&cold->lock);
+	page = cold->pages[i];
+	if(!page || page_ref_count(page) != 1)
+		goto out;
+
+	if(memchr_inv(page_address(page), 0, PAGE_SIZE)){
+		sg_init_table(&src, 1);
+		sg_set_page(&src, page, PAGE_SIZE, 0);
+		sg_init_one(&dst, cold->buf, 2 * PAGE_SIZE);
+		acomp_request_set_params(cold->req, &src, &dst, PAGE_SIZE, 2 * PAGE_SIZE);
+		if(crypto_wait_req(crypto_acomp_compress(cold->req), &cold->wait))
+			goto out;
+		len = cold->req->dlen;
+		if(len > PAGE_SIZE * 3 / 4){
+			cold->incompressible++;
+			set_bit(i, cold->accessed); //not again on the next scan
+			goto out;
+		}
+		b = kmalloc(struct_size(b, data, len), GFP_KERNEL);
+		if(!b)
+			goto out;
+		b->len = len;
+		memcpy(b->data, cold->buf, len);
+		if(xa_err(xa_store(&cold->blocks, i, b, GFP_KERNEL))){
+			kfree(b);
+			goto out;
+		}
+		cold->compressed++;
+		cold->compressed_bytes += len;
+	}
+
+	WRITE_ONCE(cold->pages[i], NULL);
+	apply_to_existing_page_range(&init_mm, addr, PAGE_SIZE, globalmem_cold_clear_pte, NULL);
+	flush_tlb_kernel_range(addr, addr + PAGE_SIZE);
+	__free_page(page);
+	cold->hot--;
+	cold->evictions++;
+out:
+	mutex_unlock(&cold->lock);
+	globalmem_unlock_stripes(dev, mask, true);
+}
+
+//a clock over the pages: one used since the last pass gets another, the others go out while more than
+//hot_pages are in
+static void globalmem_cold_scan(struct globalmem_dev *dev, unsigned long hot_pages){
+	struct globalmem_cold *cold = dev->cold;
+	unsigned long n;
+
+	for(n = 0; n < cold->nr_pages && READ_ONCE(cold->hot) > hot_pages; n++){
+		if(cold->pages[cold->hand] && !test_and_clear_bit(cold->hand, cold->accessed))
+			globalmem_cold_out(dev, cold->hand);
+		if(++cold->hand == cold->nr_pages)
+			cold->hand = 0;
+		cond_resched();
+	}
+}
+
+static void globalmem_cold_work(struct work_struct *work){
+	struct globalmem_cold *cold = container_of(to_delayed_work(work), struct globalmem_cold, work);
+
+	globalmem_cold_scan(cold->dev, (READ_ONCE(globalmem_hot_kb) * 1024UL) >> PAGE_SHIFT);
+	queue_delayed_work(system_unbound_wq, &cold->work, msecs_to_jiffies(max(READ_ONCE(globalmem_cold_ms), 10U)));
+}
+
+//size bytes of zeroes, none of them in memory yet
+static struct globalmem_cold *globalmem_cold_create(size_t size, const char *alg){
+	struct globalmem_cold *cold;
+	int ret = -ENOMEM;
+
+	cold = kzalloc(sizeof(*cold), GFP_KERNEL);
+	if(!cold)
+		return ERR_PTR(-ENOMEM);
+	cold->nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	xa_init(&cold->blocks);
+	mutex_init(&cold->lock);
+	crypto_init_wait(&cold->wait);
+	INIT_DELAYED_WORK(&cold->work, globalmem_cold_work);
+	atomic64_set(&cold->hits, 0);
+	atomic64_set(&cold->misses, 0);
+
+	cold->pages = kvcalloc(cold->nr_pages, sizeof(*cold->pages), GFP_KERNEL);
+	cold->accessed = globalmem_bitmap_zalloc(cold->nr_pages);
+	cold->buf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+	if(!cold->pages || !cold->accessed || !cold->buf)
+		goto fail;
+	cold->area = get_vm_area(cold->nr_pages << PAGE_SHIFT, VM_MAP);
+	if(!cold->area)
+		goto fail;
+	cold->tfm = crypto_alloc_acomp(alg, 0, 0);
+	if(IS_ERR(cold->tfm)){
+		ret = PTR_ERR(cold->tfm);
+		cold->tfm = NULL;
+		goto fail;
+	}
+	cold->req = acomp_request_alloc(cold->tfm);
+	if(!cold->req)
+		goto fail;
+	acomp_request_set_callback(cold->req, CRYPTO_TFM_REQ_MAY_BACKLOG, crypto_req_done, &cold->wait);
+	return cold;
+
+fail:
+	if(cold->tfm)
+		crypto_free_acomp(cold->tfm);
+	if(cold->area)
+		free_vm_area(cold->area);
+	kfree(cold->buf);
+	kvfree(cold->accessed);
+	kvfree(cold->pages);
+	kfree(cold);
+	return ERR_PTR(ret);
+}
+
+//the scans start, the KUnit suite runs them by hand instead
+static void globalmem_cold_start(struct globalmem_cold *cold){
+	queue_delayed_work(system_unbound_wq, &cold->work, msecs_to_jiffies(max(globalmem_cold_ms, 10U)));
+}
+
+static void globalmem_cold_destroy(struct globalmem_cold *cold){
+	struct globalmem_cblock *b;
+	unsigned long i;
+
+	cancel_delayed_work_sync(&cold->work);
+	free_vm_area(cold->area); //unmaps what is in
+	for(i = 0; i < cold->nr_pages; i++)
+		if(cold->pages[i])
+			__free_page(cold->pages[i]);
+	xa_for_each(&cold->blocks, i, b)
+		kfree(b);
+	xa_destroy(&cold->blocks);
+	acomp_request_free(cold->req);
+	crypto_free_acomp(cold->tfm);
+	kfree(cold->buf);
+	kvfree(cold->accessed);
+	kvfree(cold->pages);
+	kfree(cold);
+}
+
+/*****************range locks**************/
+//a user lock of another file is in the way of an access to [off, off + len), under ulock_lock
+static bool globalmem_ulock_busy_locked(struct globalmem_dev *dev, struct globalmem_file *gf,
+		u64 off, u64 len, bool excl){
+	struct globalmem_ulock *l;
+
+	list_for_each_entry(l, &dev->ulocks, node){
+		if(l->owner == gf || (!excl && !l->excl))
+			continue;
+		if(off < l->off + l->len && l->off < off + len)
+			return true;
+	}
+	return false;
+}
+
+static bool globalmem_ulock_busy(struct globalmem_dev *dev, struct globalmem_file *gf, u64 off, u64 len, bool excl){
+	bool ret;
+
+	spin_lock(&dev->ulock_lock);
+	ret = globalmem_ulock_busy_locked(dev, gf, off, len, excl);
+	spin_unlock(&dev->ulock_lock);
+	return ret;
+}
+
+//take the stripes of [off, off + len) for an access by gf, excl for a write, and wait out the user
+//locks of other files on it. the user locks of gf itself let it through, that is what they are for
+//owner's own user locks don't stop it, on another device it has none
+static int globalmem_dev_range_lock(struct globalmem_dev *dev, struct globalmem_file *owner, u64 off, u64 len,
+		bool excl){
+	u32 mask = globalmem_stripe_mask(off, len);
+	int ret;
+
+	if(!len)
+		return 0;
+	while(1){
+		globalmem_lock_stripes(dev, mask, excl);
+		//no lock can be inserted on these stripes now, the count is stable for them
+		if(!READ_ONCE(dev->nr_ulocks) || !globalmem_ulock_busy(dev, owner, off, len, excl)){
+			//and no page of the range taken out
+			ret = globalmem_cold_get(dev, off, len);
+			if(ret)
+				globalmem_unlock_stripes(dev, mask, excl);
+			return ret;
+		}
+		globalmem_unlock_stripes(dev, mask, excl);
+		//a kworker copying for owner gets no signal, a close of owner stops its wait instead
+		ret = wait_event_interruptible(dev->ulock_wait,
+				!globalmem_ulock_busy(dev, owner, off, len, excl) || READ_ONCE(owner->copy_cancel));
+		if(ret)
+			return ret;
+		if(READ_ONCE(owner->copy_cancel))
+			return -ECANCELED;
+	}
+}
+
+static void globalmem_dev_range_unlock(struct globalmem_dev *dev, u64 off, u64 len, bool excl){
+	globalmem_unlock_stripes(dev, globalmem_stripe_mask(off, len), excl);
+}
+
+//a range lock on a second device while one on the first is held. a user lock in the way is -EAGAIN,
+//the caller lets go of the first before it waits, so a lock owner blocked on the first can't hold it up
+static int globalmem_dev_range_lock_nested(struct globalmem_dev *dev, struct globalmem_file *owner, u64 off,
+		u64 len, bool excl){
+	u32 mask = globalmem_stripe_mask(off, len);
+	int ret;
+
+	if(!len)
+		return 0;
+	globalmem_lock_stripes_nested(dev, mask, excl, SINGLE_DEPTH_NESTING);
+	if(READ_ONCE(dev->nr_ulocks) && globalmem_ulock_busy(dev, owner, off, len, excl))
+		ret = -EAGAIN;
+	else
+		ret = globalmem_cold_get(dev, off, len);
+	if(ret)
+		globalmem_unlock_stripes(dev, mask, excl);
+	return ret;
+}
+
+static int globalmem_range_lock(struct globalmem_file *gf, u64 off, u64 len, bool excl){
+	return globalmem_dev_range_lock(gf->dev, gf, off, len, excl);
+}
+
+static void globalmem_range_unlock(struct globalmem_file *gf, u64 off, u64 len, bool excl){
+	globalmem_dev_range_unlock(gf->dev, off, len, excl);
+}
+
+//a lock for everyone but its owner: until GLOBALMEM_UNLOCK or close, the read, write and in-place
+//ioctls of other files wait for it, so a sequence of calls on the range looks atomic to them
+static long globalmem_lock(struct globalmem_file *gf, struct globalmem_lock __user *argp){
+	struct globalmem_dev *dev = gf->dev;
+	struct globalmem_ulock *l;
+	struct globalmem_lock lk;
+	bool excl;
+	u32 mask;
+	int ret;
+
+	if(copy_from_user(&lk, argp, sizeof(lk)))
+		return -EFAULT;
+	if(lk.flags & ~(GLOBALMEM_LOCK_EXCL | GLOBALMEM_LOCK_NONBLOCK))
+		return -EINVAL;
+	if(!lk.len || !globalmem_range_ok(lk.off, lk.len, dev->size))
+		return -EINVAL;
+	if(gf->nr_locks >= GLOBALMEM_LOCKS_MAX)
+		return -ENOLCK;
+	l = kmalloc(sizeof(*l), GFP_KERNEL);
+	if(!l)
+		return -ENOMEM;
+	excl = lk.flags & GLOBALMEM_LOCK_EXCL;
+	l->owner = gf;
+	l->off = lk.off;
+	l->len = lk.len;
+	l->excl = excl;
+	mask = globalmem_stripe_mask(lk.off, lk.len);
+
+	while(1){
+		//the stripes in the mode of the lock: in-flight accesses it conflicts with drain first
+		globalmem_lock_stripes(dev, mask, excl);
+		spin_lock(&dev->ulock_lock);
+		if(!globalmem_ulock_busy_locked(dev, gf, lk.off, lk.len, excl)){
+			list_add_tail(&l->node, &dev->ulocks);
+			WRITE_ONCE(dev->nr_ulocks, dev->nr_ulocks + 1);
+			gf->nr_locks++;
+			spin_unlock(&dev->ulock_lock);
+			globalmem_unlock_stripes(dev, mask, excl);
+			return 0;
+		}
+		spin_unlock(&dev->ulock_lock);
+		globalmem_unlock_stripes(dev, mask, excl);
+
+		if(lk.flags & GLOBALMEM_LOCK_NONBLOCK)
+			ret = -EAGAIN;
+		else
+			ret = wait_event_interruptible(dev->ulock_wait,
+					!globalmem_ulock_busy(dev, gf, lk.off, lk.len, excl));
+		if(ret){
+			kfree(l);
+			return ret;
+		}
+	}
+}
+
+static void globalmem_ulock_del(struct globalmem_dev *dev, struct globalmem_ulock *l){
+	list_del(&l->node);
+	WRITE_ONCE(dev->nr_ulocks, dev->nr_ulocks - 1);
+	l->owner->nr_locks--;
+}
+
+//the exact range of an earlier GLOBALMEM_LOCK of this file
+static long globalmem_unlock(struct globalmem_file *gf, struct globalmem_lock __user *argp){
+	struct globalmem_dev *dev = gf->dev;
+	struct globalmem_ulock *l, *found = NULL;
+	struct globalmem_lock lk;
+
+	if(copy_from_user(&lk, argp, sizeof(lk)))
+		return -EFAULT;
+	spin_lock(&dev->ulock_lock);
+	list_for_each_entry(l, &dev->ulocks, node){
+		if(l->owner == gf && l->off == lk.off && l->len == lk.len){
+			found = l;
+			globalmem_ulock_del(dev, l);
+			break;
+		}
+	}
+	spin_unlock(&dev->ulock_lock);
+	if(!found)
+		return -ENOENT;
+	kfree(found);
+	wake_up_all(&dev->ulock_wait);
+	return 0;
+}
+
+static void globalmem_unlock_all(struct globalmem_file *gf){
+	struct globalmem_dev *dev = gf->dev;
+	struct globalmem_ulock *l, *tmp;
+	LIST_HEAD(dead);
+
+	if(!gf->nr_locks)
+		return;
+	spin_lock(&dev->ulock_lock);
+	list_for_each_entry_safe(l, tmp, &dev->ulocks, node){
+		if(l->owner == gf){
+			globalmem_ulock_del(dev, l);
+			list_add(&l->node, &dead);
+		}
+	}
+	spin_unlock(&dev->ulock_lock);
+	list_for_each_entry_safe(l, tmp, &dead, node)
+		kfree(l);
+	wake_up_all(&dev->ulock_wait);
+}
+
+/*****************dirty tracking***********/
+static void globalmem_dirty_mark(struct globalmem_dev *dev, u64 off, u64 len){
+	unsigned long first, last, i, mask;
+	atomic_long_t *word;
+
+	if(!len)
+		return;
+	first = off >> dev->dirty_shift;
+	last = (off + len - 1) >> dev->dirty_shift;
+	for(i = BIT_WORD(first); i <= BIT_WORD(last); i++){
+		mask = ~0UL;
+		if(i == BIT_WORD(first))
+			mask &= BITMAP_FIRST_WORD_MASK(first);
+		if(i == BIT_WORD(last))
+			mask &= BITMAP_LAST_WORD_MASK(last + 1);
+		word = (atomic_long_t *)&dev->dirty[i];
+		//a hot word is dirty already, don't bounce its cache line for nothing
+		if((atomic_long_read(word) & mask) != mask)
+			atomic_long_or(mask, word);
+	}
+}
+
+static void globalmem_dirty_extent(struct globalmem_dev *dev, struct globalmem_range *ext,
+		unsigned long first, unsigned long end){
+	ext->off = (u64)first << dev->dirty_shift;
+	ext->len = min_t(u64, (u64)end << dev->dirty_shift, dev->size) - ext->off;
+}
+
+//take the dirty bits word by word with xchg and turn them into up to n extents. the bits that
+//don't fit go back, *more says so. a write racing with this lands in this round or the next,
+//its bit is set after its data
+static u32 globalmem_dirty_take(struct globalmem_dev *dev, struct globalmem_range *ext, u32 n, bool *more){
+	unsigned long i, b, w, bit, start = 0;
+	atomic_long_t *word;
+	bool open = false;
+	u32 count = 0;
+
+	*more = false;
+	for(i = 0; i < BITS_TO_LONGS(dev->dirty_bits); i++){
+		word = (atomic_long_t *)&dev->dirty[i];
+		w = atomic_long_read(word) ? atomic_long_xchg(word, 0) : 0;
+		if(!w){
+			if(open)
+				globalmem_dirty_extent(dev, &ext[count++], start, i * BITS_PER_LONG);
+			open = false;
+			continue;
+		}
+		for(b = 0; b < BITS_PER_LONG; b++){
+			bit = i * BITS_PER_LONG + b;
+			if((w & BIT(b)) && !open){
+				if(count == n){
+					atomic_long_or(w & ~(BIT(b) - 1), word);
+					*more = true;
+					return count;
+				}
+				start = bit;
+				open = true;
+			} else if(!(w & BIT(b)) && open){
+				globalmem_dirty_extent(dev, &ext[count++], start, bit);
+				open = false;
+			}
+		}
+	}
+	if(open)
+		globalmem_dirty_extent(dev, &ext[count++], start, dev->dirty_bits);
+	return count;
+}
+
+//write protect again the pages of [off, off + len) that a write fault made writable, a run of them at a time.
+//a write fault that got past page_mkwrite installs its pte later, with the page still locked: taking the lock
+//waits for it, so the unmap gets that pte too. the cost is the pages written through a mapping, not len
+static void globalmem_wrprotect(struct globalmem_dev *dev, u64 off, u64 len){
+	unsigned long first = off >> PAGE_SHIFT, last = DIV_ROUND_UP(off + len, PAGE_SIZE), end, i;
+	struct page *page;
+
+	//what the caller published before is seen by a fault that set its bit after, see globalmem_vm_page_mkwrite
+	smp_mb();
+	//map_lock also keeps two of these from skipping a page the other has taken but not unmapped yet
+	mutex_lock(&dev->map_lock);
+	for(first = find_next_bit(dev->wmapped, last, first); first < last;
+			first = find_next_bit(dev->wmapped, last, end)){
+		end = find_next_zero_bit(dev->wmapped, last, first);
+		for(i = first; i < end; i++){
+			clear_bit(i, dev->wmapped);
+			//a cold page goes out only with its stripes held exclusive, and one that is out is mapped nowhere
+			if(dev->cold)
+				globalmem_lock_stripes(dev, globalmem_stripe_mask((u64)i << PAGE_SHIFT, PAGE_SIZE), false);
+			page = vmalloc_to_page(dev->mem + ((u64)i << PAGE_SHIFT));
+			if(page){
+				lock_page(page);
+				unlock_page(page);
+			}
+			if(dev->cold)
+				globalmem_unlock_stripes(dev, globalmem_stripe_mask((u64)i << PAGE_SHIFT, PAGE_SIZE), false);
+		}
+		//a bit is set only through a mapping, there is a node
+		unmap_mapping_range(dev->map_inode->i_mapping, (u64)first << PAGE_SHIFT,
+				(u64)(end - first) << PAGE_SHIFT, 0);
+	}
+	mutex_unlock(&dev->map_lock);
+}
+
+//a checkpoint: what was written since the last one, and clean from now on. the mapped pages
+//in those extents lose their write permission, so the next store through a mapping faults and marks
+static long globalmem_get_dirty(struct globalmem_dev *dev, struct globalmem_dirty __user *argp){
+	struct globalmem_range *ext;
+	struct globalmem_dirty d;
+	long ret = 0;
+	bool more;
+	u32 i;
+
+	if(copy_from_user(&d, argp, sizeof(d)))
+		return -EFAULT;
+	if(!d.n || d.n > GLOBALMEM_DIRTY_MAX)
+		return -EINVAL;
+	ext = kvmalloc_array(d.n, sizeof(*ext), GFP_KERNEL);
+	if(!ext)
+		return -ENOMEM;
+
+	d.count = globalmem_dirty_take(dev, ext, d.n, &more);
+	d.more = more;
+	d.granule = 1U << dev->dirty_shift;
+
+	for(i = 0; i < d.count; i++)
+		globalmem_wrprotect(dev, ext[i].off, ext[i].len);
+
+	if(copy_to_user(u64_to_user_ptr(d.extents), ext, d.count * sizeof(*ext)) || copy_to_user(argp, &d, sizeof(d))){
+		//nobody saw them, they stay dirty
+		for(i = 0; i < d.count; i++)
+			globalmem_dirty_mark(dev, ext[i].off, ext[i].len);
+		ret = -EFAULT;
+	}
+	kvfree(ext);
+	return ret;
+}
+
+/*****************snapshots****************/
+//snapshot blocks are stripe blocks, a kernel write holds the stripe of every block it copies aside
+#define GLOBALMEM_SNAP_SHIFT	GLOBALMEM_STRIPE_SHIFT
+#define GLOBALMEM_SNAP_BLOCK	(1U << GLOBALMEM_SNAP_SHIFT)
+
+//copy aside the blocks of [off, off + len) the snapshot doesn't have yet. no write that didn't see the
+//snapshot is left in them: the kernel ones were drained by taking the stripes when it was made, an atomic
+//or a mapped store of before is a word and lands whole on one side
+static void globalmem_snap_preserve(struct globalmem_dev *dev, struct globalmem_snap *snap, u64 off, u64 len){
+	unsigned long i = off >> GLOBALMEM_SNAP_SHIFT, last = (off + len - 1) >> GLOBALMEM_SNAP_SHIFT;
+	size_t n;
+	void *copy;
+
+	while(i <= last && xa_load(&snap->blocks, i))
+		i++;
+	if(i > last)
+		return; //all copied already, the common case
+
+	mutex_lock(&snap->lock);
+	for(; i <= last; i++){
+		if(xa_load(&snap->blocks, i))
+			continue;
+		n = min_t(size_t, GLOBALMEM_SNAP_BLOCK, dev->size - ((size_t)i << GLOBALMEM_SNAP_SHIFT));
+		copy = kmalloc(GLOBALMEM_SNAP_BLOCK, GFP_KERNEL);
+		if(copy)
+			memcpy(copy, dev->mem + ((size_t)i << GLOBALMEM_SNAP_SHIFT), n);
+		if(!copy || xa_err(xa_store(&snap->blocks, i, copy, GFP_KERNEL))){
+			//the writer goes on, the snapshot is what gives
+			kfree(copy);
+			WRITE_ONCE(snap->broken, true);
+			break;
+		}
+		snap->copied++;
+	}
+	mutex_unlock(&snap->lock);
+	smp_wmb(); //the copies are in the xarray before the write that follows, see globalmem_snap_read
+}
+
+//before [off, off + len) is written
+static void globalmem_snap_write(struct globalmem_dev *dev, u64 off, u64 len){
+	struct globalmem_snap *snap;
+	int idx;
+
+	if(!len || !rcu_access_pointer(dev->snap))
+		return;
+	idx = srcu_read_lock(&globalmem_snap_srcu);
+	snap = srcu_dereference(dev->snap, &globalmem_snap_srcu);
+	if(snap)
+		globalmem_snap_preserve(dev, snap, off, len);
+	srcu_read_unlock(&globalmem_snap_srcu, idx);
+}
+
+static void globalmem_snap_free(struct globalmem_snap *snap){
+	unsigned long i;
+	void *copy;
+
+	xa_for_each(&snap->blocks, i, copy)
+		kfree(copy);
+	xa_destroy(&snap->blocks);
+	kfree(snap);
+}
+
+//no copy, only the stripes to cut the kernel writes in flight. the pages a mapping made writable are
+//write protected after, their next store faults and copies. no page of the device is visited otherwise
+static struct globalmem_snap *globalmem_snap_create(struct globalmem_dev *dev){
+	struct globalmem_snap *snap;
+	int ret = 0;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if(!snap)
+		return ERR_PTR(-ENOMEM);
+	snap->dev = dev;
+	xa_init(&snap->blocks);
+	mutex_init(&snap->lock);
+
+	globalmem_lock_stripes(dev, ~0U, true);
+	if(rcu_access_pointer(dev->snap))
+		ret = -EBUSY;
+	else
+		rcu_assign_pointer(dev->snap, snap);
+	globalmem_unlock_stripes(dev, ~0U, true);
+	if(ret){
+		kfree(snap);
+		return ERR_PTR(ret);
+	}
+
+	globalmem_wrprotect(dev, 0, dev->size);
+	return snap;
+}
+
+static void globalmem_snap_drop(struct globalmem_snap *snap){
+	struct globalmem_dev *dev = snap->dev;
+
+	globalmem_lock_stripes(dev, ~0U, true);
+	RCU_INIT_POINTER(dev->snap, NULL);
+	globalmem_unlock_stripes(dev, ~0U, true);
+	synchronize_srcu(&globalmem_snap_srcu);
+	globalmem_snap_free(snap);
+}
+
+//the block as it was: the copy if there is one, else the live bytes. a copy made while those were read
+//means a write may have torn them, the copy is read instead. globalmem_snap_preserve orders it before the write
+static ssize_t globalmem_snap_read(struct file *filp, char __user *buf, size_t size, loff_t *ppos){
+	struct globalmem_snap *snap = filp->private_data;
+	struct globalmem_dev *dev = snap->dev;
+	size_t count = globalmem_span(*ppos, size, dev->size), done = 0, n, boff, left;
+	unsigned long idx;
+	int ret;
+	const u8 *copy;
+	loff_t pos;
+
+	while(done < count){
+		pos = *ppos + done;
+		idx = pos >> GLOBALMEM_SNAP_SHIFT;
+		boff = pos & (GLOBALMEM_SNAP_BLOCK - 1);
+		n = min_t(size_t, count - done, GLOBALMEM_SNAP_BLOCK - boff);
+
+		copy = xa_load(&snap->blocks, idx);
+		if(!copy){
+			ret = globalmem_cold_hold(dev, pos, n);
+			if(ret)
+				return ret;
+			left = copy_to_user(buf + done, dev->mem + pos, n);
+			globalmem_cold_put(dev, pos, n);
+			if(left)
+				return -EFAULT;
+			smp_rmb();
+			copy = xa_load(&snap->blocks, idx);
+		}
+		if(copy && copy_to_user(buf + done, copy + boff, n))
+			return -EFAULT;
+		done += n;
+	}
+	if(READ_ONCE(snap->broken))
+		return -EIO;
+	*ppos += done;
+	return done;
+}
+
+static loff_t globalmem_snap_llseek(struct file *filp, loff_t offset, int orig){
+	struct globalmem_snap *snap = filp->private_data;
+	loff_t ret = globalmem_seek(filp->f_pos, offset, orig, snap->dev->size);
+
+	if(ret >= 0)
+		filp->f_pos = ret;
+	return ret;
+}
+
+static int globalmem_snap_release(struct inode *inode, struct file *filp){
+	globalmem_snap_drop(filp->private_data);
+	return 0;
+}
+
+static const struct file_operations globalmem_snap_fops = {
+	.owner = THIS_MODULE,
+	.llseek = globalmem_snap_llseek,
+	.read = globalmem_snap_read,
+	.release = globalmem_snap_release,
+};
+
+static long globalmem_snapshot(struct globalmem_dev *dev){
+	struct globalmem_snap *snap = globalmem_snap_create(dev);
+	int fd;
+
+	if(IS_ERR(snap))
+		return PTR_ERR(snap);
+	fd = anon_inode_getfd("[globalmem_snapshot]", &globalmem_snap_fops, snap, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		globalmem_snap_drop(snap);
+	return fd;
+}
+
+/*****************waiting******************/
+//runs in the writer with the range it wrote, the ones that don't overlap sleep on
+static int globalmem_wake_fn(struct wait_queue_entry *wq, unsigned int mode, int sync, void *key){
+	struct globalmem_waiter *w = container_of(wq, struct globalmem_waiter, wq);
+	struct globalmem_range *r = key;
+
+	if(r->off >= w->off + w->len || w->off >= r->off + r->len)
+		return 0;
+	WRITE_ONCE(w->changed, true);
+	if(w->poll){
+		wake_up_interruptible_poll(w->poll, EPOLLIN | EPOLLRDNORM);
+		return 0;
+	}
+	return default_wake_function(wq, mode, sync, key);
+}
+
+static void globalmem_waiter_init(struct globalmem_waiter *w, u64 off, u64 len){
+	init_waitqueue_func_entry(&w->wq, globalmem_wake_fn);
+	w->wq.private = current;
+	w->off = off;
+	w->len = len;
+	w->changed = false;
+	w->poll = NULL;
+}
+
+//[off, off + len) was written: dirty it and wake who waits on it. wq_has_sleeper orders the store
+//before the look at the queue, set_current_state in the sleeper orders its queueing before its look at the memory
+static void globalmem_changed(struct globalmem_dev *dev, u64 off, u64 len){
+	struct globalmem_range r = { .off = off, .len = len };
+
+	globalmem_dirty_mark(dev, off, len);
+	if(len && wq_has_sleeper(&dev->wait))
+		__wake_up(&dev->wait, TASK_INTERRUPTIBLE, 0, &r);
+}
+
+static u64 globalmem_word(struct globalmem_dev *dev, u64 off, u32 width){
+	if(width == 4)
+		return READ_ONCE(*(u32 *)(dev->mem + off));
+	return READ_ONCE(*(u64 *)(dev->mem + off));
+}
+
+//a word of a cold device may have to be brought in, which sleeps
+static int globalmem_word_get(struct globalmem_dev *dev, u64 off, u32 width, u64 *val){
+	int ret = globalmem_cold_hold(dev, off, width);
+
+	if(ret)
+		return ret;
+	*val = globalmem_word(dev, off, width);
+	globalmem_cold_put(dev, off, width);
+	return 0;
+}
+
+static long globalmem_wait(struct globalmem_dev *dev, struct globalmem_wait __user *argp){
+	struct globalmem_waiter w;
+	struct globalmem_wait wt;
+	long timeout, ret = 0;
+	bool reread;
+	u64 val;
+
+	if(copy_from_user(&wt, argp, sizeof(wt)))
+		return -EFAULT;
+	switch(wt.mode){
+	case GLOBALMEM_WAIT_WORD:
+		if(wt.width != 4 && wt.width != 8)
+			return -EINVAL;
+		if(!globalmem_range_ok(wt.off, wt.width, dev->size) || (wt.off & (wt.width - 1)))
+			return -EINVAL;
+		if(wt.width == 4)
+			wt.val = (u32)wt.val;
+		wt.len = wt.width;
+		break;
+	case GLOBALMEM_WAIT_RANGE:
+		if(!wt.len || !globalmem_range_ok(wt.off, wt.len, dev->size))
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+	timeout = wt.timeout_ns < 0 ? MAX_SCHEDULE_TIMEOUT : nsecs_to_jiffies(wt.timeout_ns);
+	//a cold word is read awake, first and then after each change of it: queued before the read,
+	//a change after it sets w.changed
+	reread = wt.mode == GLOBALMEM_WAIT_WORD && dev->cold;
+
+	globalmem_waiter_init(&w, wt.off, wt.len);
+	add_wait_queue(&dev->wait, &w.wq);
+	while(1){
+		if(reread){
+			WRITE_ONCE(w.changed, false);
+			smp_mb(); //the clear before the read, a writer stores before it wakes
+			ret = globalmem_word_get(dev, wt.off, wt.width, &val);
+			if(ret || val != wt.val)
+				break;
+		}
+		set_current_state(TASK_INTERRUPTIBLE);
+		if(reread){
+			if(READ_ONCE(w.changed)){
+				__set_current_state(TASK_RUNNING);
+				continue;
+			}
+		} else if(wt.mode == GLOBALMEM_WAIT_WORD ? globalmem_word(dev, wt.off, wt.width) != wt.val :
+				READ_ONCE(w.changed)){
+			break;
+		}
+		if(signal_pending(current)){
+			ret = -ERESTARTSYS;
+			break;
+		}
+		if(!timeout){
+			ret = -ETIMEDOUT;
+			break;
+		}
+		timeout = schedule_timeout(timeout);
+	}
+	__set_current_state(TASK_RUNNING);
+	remove_wait_queue(&dev->wait, &w.wq);
+	return ret;
+}
+
+static long globalmem_wake(struct globalmem_dev *dev, struct globalmem_range __user *argp){
+	struct globalmem_range r;
+
+	if(copy_from_user(&r, argp, sizeof(r)))
+		return -EFAULT;
+	if(!globalmem_range_ok(r.off, r.len, dev->size))
+		return -EINVAL;
+	smp_mb(); //the stores through the mapping before the look at the queue, wq_has_sleeper only orders ours
+	globalmem_changed(dev, r.off, r.len);
+	return 0;
+}
+
+//the subscription stays on dev->wait, retargeted under its lock so a wakeup sees one range or the other
+static long globalmem_subscribe(struct globalmem_file *gf, struct globalmem_range __user *argp){
+	struct globalmem_dev *dev = gf->dev;
+	struct globalmem_range r;
+
+	if(copy_from_user(&r, argp, sizeof(r)))
+		return -EFAULT;
+	if(r.len && !globalmem_range_ok(r.off, r.len, dev->size))
+		return -EINVAL;
+
+	spin_lock_irq(&dev->wait.lock);
+	if(gf->sub.len)
+		__remove_wait_queue(&dev->wait, &gf->sub.wq);
+	gf->sub.off = r.off;
+	gf->sub.len = r.len;
+	gf->sub.changed = false;
+	if(r.len)
+		__add_wait_queue_entry_tail(&dev->wait, &gf->sub.wq);
+	spin_unlock_irq(&dev->wait.lock);
+	return 0;
+}
+
+static unsigned int globalmem_poll(struct file *filp, poll_table *wait){
+	struct globalmem_file *gf = filp->private_data;
+	unsigned int mask = POLLOUT | POLLWRNORM; //writes never block
+
+	poll_wait(filp, &gf->poll_wait, wait);
+	if(READ_ONCE(gf->sub.changed))
+		mask |= POLLIN | POLLRDNORM;
+	if(READ_ONCE(gf->ring_len))
+		mask |= POLLPRI; //copy completions to reap
+	return mask;
+}
+
+static void globalmem_file_init(struct globalmem_file *gf, struct globalmem_dev *dev){
+	gf->dev = dev;
+	init_waitqueue_head(&gf->poll_wait);
+	globalmem_waiter_init(&gf->sub, 0, 0);
+	gf->sub.poll = &gf->poll_wait;
+	spin_lock_init(&gf->copy_lock);
+	mutex_init(&gf->reap_lock);
+	atomic_set(&gf->copy_inflight, 0);
+	INIT_LIST_HEAD(&gf->copy_jobs);
+}
 
 static int globalmem_open(struct inode *inode, struct file *filp){
-	//unnecessary to writ the open function
-	//
-	//set the filp->private_data to be the inode->i_cdev;
 	//container_of gets the pointer of globalmem_dev which has inode->i_cdev
 	struct globalmem_dev *dev = container_of(inode->i_cdev, struct globalmem_dev, cdev);
-	filp->private_data = dev;
+	struct globalmem_file *gf;
+
+	gf = kzalloc(sizeof(*gf), GFP_KERNEL);
+	if(!gf)
+		return -ENOMEM;
+	globalmem_file_init(gf, dev);
+	filp->private_data = gf;
 	return 0;
 }
 
+//a copy in flight finishes its chunk, the queued ones come out at once. one waiting for another
+//file's range lock is woken to see the cancel, on whichever of its two devices it waits
+static void globalmem_copy_cancel(struct globalmem_file *gf){
+	struct globalmem_copy_job *job;
+
+	WRITE_ONCE(gf->copy_cancel, true);
+	spin_lock(&gf->copy_lock);
+	list_for_each_entry(job, &gf->copy_jobs, node)
+		wake_up_all(&job->src->ulock_wait);
+	spin_unlock(&gf->copy_lock);
+	wake_up_all(&gf->dev->ulock_wait);
+	wait_var_event(&gf->copy_inflight, !atomic_read(&gf->copy_inflight));
+}
+
 static int globalmem_release(struct inode *inode, struct file *filp){
+	struct globalmem_file *gf = filp->private_data;
+
+	if(gf->sub.len)
+		remove_wait_queue(&gf->dev->wait, &gf->sub.wq);
+	globalmem_unlock_all(gf);
+	globalmem_copy_cancel(gf);
+	kfree(gf->ring);
+	kfree(gf);
 	return 0;
 }
 
 static ssize_t globalmem_read(struct file *filp, char __user *buf, size_t size, loff_t *ppos){
 	unsigned long p = *ppos;
-	unsigned int count = size;
 	int ret = 0;
-	struct globalmem_dev *dev = filp->private_data;
+	struct globalmem_file *gf = filp->private_data;
+	struct globalmem_dev *dev = gf->dev;
+	unsigned int count = globalmem_span(*ppos, size, dev->size);
 
-	if(p >= GLOBALMEM_SIZE)
+	if(!count)
 		return 0;
-	if(count > GLOBALMEM_SIZE - p){
-		count = GLOBALMEM_SIZE - p;
-	}
+	ret = globalmem_range_lock(gf, p, count, false);
+	if(ret)
+		return ret;
 
+	//rearm the subscription first, a write racing with the copy sets it again
+	if(READ_ONCE(gf->sub.changed)){
+		WRITE_ONCE(gf->sub.changed, false);
+		smp_mb();
+	}
 	if(copy_to_user(buf, dev->mem + p, count)){
 		ret = -EFAULT;
 	} else{
 		*ppos += count;
 		ret = count;
 
-		printk(KERN_INFO "Read %u bytes from %lu\n", count, p);
+		pr_debug("Read %u bytes from %lu\n", count, p); //dynamic debug, a printk per read costs more than the copy
 	}
+	globalmem_range_unlock(gf, p, count, false);
 
 	return ret;
 }
@@ -68,23 +1259,28 @@ static ssize_t globalmem_read(struct file *filp, char __user *buf, size_t size,
 static ssize_t globalmem_write(struct file *filp, const char __user *buf, size_t size, loff_t *ppos){
 
 	int ret =  0;
-	struct globalmem_dev *dev = filp->private_data;
-	unsigned int count = size;
+	struct globalmem_file *gf = filp->private_data;
+	struct globalmem_dev *dev = gf->dev;
+	unsigned int count = globalmem_span(*ppos, size, dev->size);
 	unsigned long p = *ppos;
 
-	if(p >= GLOBALMEM_SIZE)
+	if(!count)
 		return 0;
-	if(count > GLOBALMEM_SIZE - p)
-		count = GLOBALMEM_SIZE - p;
+	ret = globalmem_range_lock(gf, p, count, true);
+	if(ret)
+		return ret;
 
+	globalmem_snap_write(dev, p, count);
 	if(copy_from_user(dev->mem+p, buf, count)){ //copy_*_user(*to, *from, count)
 		ret = -EFAULT;
 	} else{
 		*ppos += count;
 		ret = count;
 
-		printk(KERN_INFO "Write %u bytes from %lu\n", count, p);
+		pr_debug("Write %u bytes from %lu\n", count, p);
 	}
+	globalmem_range_unlock(gf, p, count, true);
+	globalmem_changed(dev, p, count); //a faulted copy may have written part of it
 
 	return ret;
 }
@@ -93,50 +1289,585 @@ static loff_t globalmem_llseek(struct file *filp, loff_t offset, int orig){
 
 	//typedef __kernel_loff_t loff_t
 	//typedef long long __kernel_loff_t
-	//offset is actually an unsigned number
-	loff_t ret = 0;
-	switch(orig){
-	case 0:
-		if(offset < 0){
-			ret = -EINVAL;
+	struct globalmem_file *gf = filp->private_data;
+	loff_t ret = globalmem_seek(filp->f_pos, offset, orig, gf->dev->size);
+
+	if(ret >= 0)
+		filp->f_pos = ret;
+	return ret;
+}
+
+/*****************in-place ioctls**********/
+//the computation goes to the data: nothing is copied to userspace and back but the arguments.
+//a long range goes a chunk at a time with the stripes let go and a cond_resched in between,
+//so others get at the device and the CPU; a user lock is what makes the whole range one pass
+#define GLOBALMEM_COPY_CHUNK	(64 * 1024) //the most done with the stripes held, the copy engine's too
+
+//~crc32c(~seed) so 0 starts a standard CRC32C and a result can seed the next call
+static long globalmem_crc32c(struct globalmem_file *gf, struct globalmem_crc __user *argp){
+	struct globalmem_dev *dev = gf->dev;
+	struct globalmem_crc c;
+	u64 done, n;
+	u32 crc;
+	int ret;
+
+	if(copy_from_user(&c, argp, sizeof(c)))
+		return -EFAULT;
+	if(!globalmem_range_ok(c.off, c.len, dev->size))
+		return -EINVAL;
+
+	crc = ~c.seed;
+	for(done = 0; done < c.len; done += n){
+		n = min_t(u64, c.len - done, GLOBALMEM_COPY_CHUNK);
+		ret = globalmem_range_lock(gf, c.off + done, n, false);
+		if(ret)
 			return ret;
+		crc = crc32c(crc, dev->mem + c.off + done, n);
+		globalmem_range_unlock(gf, c.off + done, n, false);
+		cond_resched();
+	}
+	c.crc = ~crc;
+	return put_user(c.crc, &argp->crc);
+}
+
+static int globalmem_get_pattern(u8 *pat, u64 upat, u32 plen){
+	if(!plen || plen > GLOBALMEM_PATTERN_MAX)
+		return -EINVAL;
+	if(copy_from_user(pat, u64_to_user_ptr(upat), plen))
+		return -EFAULT;
+	return 0;
+}
+
+static long globalmem_search(struct globalmem_file *gf, struct globalmem_search __user *argp){
+	struct globalmem_dev *dev = gf->dev;
+	struct globalmem_search sr;
+	u8 pat[GLOBALMEM_PATTERN_MAX];
+	const u8 *p, *end;
+	u64 at, n;
+	int ret;
+
+	if(copy_from_user(&sr, argp, sizeof(sr)))
+		return -EFAULT;
+	if(!globalmem_range_ok(sr.off, sr.len, dev->size))
+		return -EINVAL;
+	ret = globalmem_get_pattern(pat, sr.pattern, sr.plen);
+	if(ret)
+		return ret;
+
+	sr.result = -1;
+	//a chunk of starts at a time, locked with the plen - 1 bytes after it that a match there runs into
+	for(at = sr.off; sr.result < 0 && sr.off + sr.len - at >= sr.plen; at += GLOBALMEM_COPY_CHUNK){
+		n = min_t(u64, sr.off + sr.len - at, GLOBALMEM_COPY_CHUNK + sr.plen - 1);
+		ret = globalmem_range_lock(gf, at, n, false);
+		if(ret)
+			return ret;
+		p = dev->mem + at;
+		end = p + n;
+		//memchr finds the candidates for the first byte, memcmp checks the rest
+		while(end - p >= sr.plen){
+			p = memchr(p, pat[0], end - p - sr.plen + 1);
+			if(!p)
+				break;
+			if(!memcmp(p + 1, pat + 1, sr.plen - 1)){
+				sr.result = p - dev->mem;
+				break;
+			}
+			p++;
 		}
-		if((unsigned int)offset > GLOBALMEM_SIZE){
-			ret = -EINVAL;
+		globalmem_range_unlock(gf, at, n, false);
+		cond_resched();
+	}
+	return put_user(sr.result, &argp->result);
+}
+
+//len bytes from off, the pattern starting over at off
+static int globalmem_fill_range(struct globalmem_file *gf, u64 off, u64 len, const u8 *pat, u32 plen){
+	struct globalmem_dev *dev = gf->dev;
+	unsigned char *dst = dev->mem + off;
+	size_t n, step;
+	int ret;
+
+	ret = globalmem_range_lock(gf, off, len, true);
+	if(ret)
+		return ret;
+	globalmem_snap_write(dev, off, len);
+	if(plen == 1){
+		memset(dst, pat[0], len);
+	} else{
+		n = min_t(size_t, len, plen);
+		memcpy(dst, pat, n);
+		//double what is filled already, a few large memcpys instead of one per copy of the pattern
+		while(n < len){
+			step = min_t(size_t, n, len - n);
+			memcpy(dst + n, dst, step);
+			n += step;
+		}
+	}
+	globalmem_range_unlock(gf, off, len, true);
+	globalmem_changed(dev, off, len);
+	return 0;
+}
+
+static long globalmem_fill(struct globalmem_file *gf, struct globalmem_fill __user *argp){
+	struct globalmem_dev *dev = gf->dev;
+	struct globalmem_fill f;
+	u8 pat[GLOBALMEM_PATTERN_MAX];
+	u64 done, n, chunk;
+	int ret;
+
+	if(copy_from_user(&f, argp, sizeof(f)))
+		return -EFAULT;
+	if(!globalmem_range_ok(f.off, f.len, dev->size))
+		return -EINVAL;
+	ret = globalmem_get_pattern(pat, f.pattern, f.plen);
+	if(ret)
+		return ret;
+
+	//whole copies of the pattern in a chunk, so each one starts it over where the last left off
+	chunk = GLOBALMEM_COPY_CHUNK - GLOBALMEM_COPY_CHUNK % f.plen;
+	for(done = 0; done < f.len; done += n){
+		n = min_t(u64, f.len - done, chunk);
+		ret = globalmem_fill_range(gf, f.off + done, n, pat, f.plen);
+		if(ret)
+			return ret;
+		cond_resched();
+	}
+	return 0;
+}
+
+//one piece of a GLOBALMEM_MOVE, the copy engine's too when a copy stays on one device. one
+//exclusive range over both, simpler than a shared and an exclusive one that may overlap
+static int globalmem_move_range(struct globalmem_file *gf, u64 soff, u64 doff, u64 len){
+	struct globalmem_dev *dev = gf->dev;
+	u64 lo = min(soff, doff), span = max(soff, doff) + len - lo;
+	int ret;
+
+	ret = globalmem_range_lock(gf, lo, span, true);
+	if(ret)
+		return ret;
+	globalmem_snap_write(dev, doff, len);
+	memmove(dev->mem + doff, dev->mem + soff, len);
+	globalmem_range_unlock(gf, lo, span, true);
+	globalmem_changed(dev, doff, len);
+	return 0;
+}
+
+//in chunks, from the end when the destination overlaps the source from above, as memmove does
+static long globalmem_move(struct globalmem_file *gf, struct globalmem_move __user *argp){
+	struct globalmem_dev *dev = gf->dev;
+	struct globalmem_move m;
+	u64 done, n, at;
+	bool back;
+	int ret;
+
+	if(copy_from_user(&m, argp, sizeof(m)))
+		return -EFAULT;
+	if(!globalmem_range_ok(m.src, m.len, dev->size) || !globalmem_range_ok(m.dst, m.len, dev->size))
+		return -EINVAL;
+
+	back = m.dst > m.src && m.dst < m.src + m.len;
+	for(done = 0; done < m.len; done += n){
+		n = min_t(u64, m.len - done, GLOBALMEM_COPY_CHUNK);
+		at = back ? m.len - done - n : done;
+		ret = globalmem_move_range(gf, m.src + at, m.dst + at, n);
+		if(ret)
 			return ret;
+		cond_resched();
+	}
+	return 0;
+}
+
+//the word ops on device memory, atomic_t/atomic64_t are the plain words with CPU atomics on them
+static int globalmem_atomic_op(struct globalmem_dev *dev, struct globalmem_atomic *a){
+	u32 mask;
+	void *p;
+	int ret;
+
+	if(a->width != 4 && a->width != 8)
+		return -EINVAL;
+	if(!globalmem_range_ok(a->off, a->width, dev->size) || (a->off & (a->width - 1)))
+		return -EINVAL;
+	if(a->op > GLOBALMEM_ATOMIC_FETCH_OR)
+		return -EINVAL;
+	//the word's stripe shared on every device, not only a cold one: a snapshot is published under all of
+	//them exclusive, the store below either finds it and copies the block aside or is done before it
+	mask = globalmem_stripe_mask(a->off, a->width);
+	globalmem_lock_stripes(dev, mask, false);
+	ret = globalmem_cold_get(dev, a->off, a->width);
+	if(ret){
+		globalmem_unlock_stripes(dev, mask, false);
+		return ret;
+	}
+	p = dev->mem + a->off;
+	if(a->op != GLOBALMEM_ATOMIC_LOAD)
+		globalmem_snap_write(dev, a->off, a->width);
+
+	if(a->width == 4){
+		atomic_t *v = p;
+
+		switch(a->op){
+		case GLOBALMEM_ATOMIC_LOAD:
+			a->result = (u32)atomic_read(v);
+			smp_mb(); //as ordered as the others
+			break;
+		case GLOBALMEM_ATOMIC_STORE:
+			a->result = (u32)atomic_xchg(v, a->arg);
+			break;
+		case GLOBALMEM_ATOMIC_CAS:
+			a->result = (u32)atomic_cmpxchg(v, a->cmp, a->arg);
+			break;
+		case GLOBALMEM_ATOMIC_FETCH_ADD:
+			a->result = (u32)atomic_fetch_add(a->arg, v);
+			break;
+		case GLOBALMEM_ATOMIC_FETCH_OR:
+			a->result = (u32)atomic_fetch_or(a->arg, v);
+			break;
 		}
-		filp->f_pos = (unsigned int) offset;
-		ret = filp->f_pos;
-		break;
+	} else{
+		atomic64_t *v = p;
 
-	case 1:
-		if(offset + filp->f_pos < 0){
-			ret = -EINVAL;
+		switch(a->op){
+		case GLOBALMEM_ATOMIC_LOAD:
+			a->result = atomic64_read(v);
+			smp_mb();
+			break;
+		case GLOBALMEM_ATOMIC_STORE:
+			a->result = atomic64_xchg(v, a->arg);
+			break;
+		case GLOBALMEM_ATOMIC_CAS:
+			a->result = atomic64_cmpxchg(v, a->cmp, a->arg);
+			break;
+		case GLOBALMEM_ATOMIC_FETCH_ADD:
+			a->result = atomic64_fetch_add(a->arg, v);
+			break;
+		case GLOBALMEM_ATOMIC_FETCH_OR:
+			a->result = atomic64_fetch_or(a->arg, v);
+			break;
+		}
+	}
+	globalmem_unlock_stripes(dev, mask, false);
+
+	//a load or a failed CAS changed nothing
+	if(a->op != GLOBALMEM_ATOMIC_LOAD &&
+			!(a->op == GLOBALMEM_ATOMIC_CAS && a->result != (a->width == 4 ? (u32)a->cmp : a->cmp)))
+		globalmem_changed(dev, a->off, a->width);
+	return 0;
+}
+
+static long globalmem_atomic(struct globalmem_dev *dev, struct globalmem_atomic __user *argp){
+	struct globalmem_atomic a;
+	int ret;
+
+	if(copy_from_user(&a, argp, sizeof(a)))
+		return -EFAULT;
+	ret = globalmem_atomic_op(dev, &a);
+	if(ret)
+		return ret;
+	return put_user(a.result, &argp->result);
+}
+
+static long globalmem_atomic_batch(struct globalmem_dev *dev, struct globalmem_atomic_batch __user *argp){
+	struct globalmem_atomic_batch b;
+	struct globalmem_atomic a, __user *ops;
+	long ret = 0;
+	u32 i;
+
+	if(copy_from_user(&b, argp, sizeof(b)))
+		return -EFAULT;
+	if(b.n > GLOBALMEM_ATOMIC_BATCH_MAX)
+		return -EINVAL;
+	ops = u64_to_user_ptr(b.ops);
+
+	for(i = 0; i < b.n; i++){
+		if(copy_from_user(&a, ops + i, sizeof(a))){
+			ret = -EFAULT;
+			break;
+		}
+		ret = globalmem_atomic_op(dev, &a);
+		if(ret)
+			break;
+		if(put_user(a.result, &ops[i].result)){
+			ret = -EFAULT;
+			break;
+		}
+	}
+	if(put_user(i, &argp->done))
+		return -EFAULT;
+	return ret;
+}
+
+/*****************copy engine**************/
+static const struct file_operations globalmem_fops;
+
+//the device behind the source fd of a copy, which has to be one of ours and open for reading, as a read()
+//of it would. GLOBALMEM_COPY_SAME is the fd the copy was queued on. the devices live as long as the module
+static struct globalmem_dev *globalmem_copy_src(struct file *filp, s32 fd){
+	struct globalmem_dev *dev;
+	struct file *src;
+
+	if(fd == GLOBALMEM_COPY_SAME){
+		if(!(filp->f_mode & FMODE_READ))
+			return ERR_PTR(-EBADF);
+		return ((struct globalmem_file *)filp->private_data)->dev;
+	}
+	src = fget(fd);
+	if(!src)
+		return ERR_PTR(-EBADF);
+	if(src->f_op != &globalmem_fops)
+		dev = ERR_PTR(-EINVAL);
+	else if(!(src->f_mode & FMODE_READ))
+		dev = ERR_PTR(-EBADF);
+	else
+		dev = ((struct globalmem_file *)src->private_data)->dev;
+	fput(src);
+	return dev;
+}
+
+//len bytes from src into gf's device under the range locks of both, one copy. on one device the way
+//GLOBALMEM_MOVE does it, on two they are locked in address order
+static int globalmem_copy_range(struct globalmem_file *gf, struct globalmem_dev *src, u64 soff, u64 doff, u64 len){
+	struct globalmem_dev *dst = gf->dev, *a = src, *b = dst;
+	u64 aoff = soff, boff = doff;
+	bool aexcl = false, bexcl = true;
+	int ret;
+
+	if(src == dst)
+		return globalmem_move_range(gf, soff, doff, len);
+
+	if(a > b){
+		swap(a, b);
+		swap(aoff, boff);
+		swap(aexcl, bexcl);
+	}
+	while(1){
+		ret = globalmem_dev_range_lock(a, gf, aoff, len, aexcl);
+		if(ret)
+			return ret;
+		ret = globalmem_dev_range_lock_nested(b, gf, boff, len, bexcl);
+		if(ret != -EAGAIN)
+			break;
+		globalmem_dev_range_unlock(a, aoff, len, aexcl);
+		ret = wait_event_interruptible(b->ulock_wait,
+				!globalmem_ulock_busy(b, gf, boff, len, bexcl) || READ_ONCE(gf->copy_cancel));
+		if(ret)
 			return ret;
+		if(READ_ONCE(gf->copy_cancel))
+			return -ECANCELED;
+	}
+	if(ret){
+		globalmem_dev_range_unlock(a, aoff, len, aexcl);
+		return ret;
+	}
+	globalmem_snap_write(dst, doff, len);
+	memcpy(dst->mem + doff, src->mem + soff, len);
+	globalmem_dev_range_unlock(b, boff, len, bexcl);
+	globalmem_dev_range_unlock(a, aoff, len, aexcl);
+	globalmem_changed(dst, doff, len);
+	return 0;
+}
+
+static void globalmem_copy_complete(struct globalmem_copy_job *job, int status){
+	struct globalmem_file *gf = job->gf;
+	struct globalmem_copy_comp *comp;
+
+	spin_lock(&gf->copy_lock);
+	list_del(&job->node);
+	comp = &gf->ring[(gf->ring_head + gf->ring_len) % GLOBALMEM_COPY_RING];
+	comp->cookie = job->c.cookie;
+	comp->status = status;
+	comp->pad = 0;
+	WRITE_ONCE(gf->ring_len, gf->ring_len + 1);
+	spin_unlock(&gf->copy_lock);
+	wake_up_interruptible_poll(&gf->poll_wait, EPOLLPRI);
+	//the last touch of gf, release may free it from here
+	if(atomic_dec_and_test(&gf->copy_inflight))
+		wake_up_var(&gf->copy_inflight);
+}
+
+//in chunks, from the end when the destination overlaps the source from above, as memmove does
+static void globalmem_copy_work(struct work_struct *work){
+	struct globalmem_copy_job *job = container_of(work, struct globalmem_copy_job, work);
+	struct globalmem_file *gf = job->gf;
+	struct globalmem_copy *c = &job->c;
+	bool back = job->src == gf->dev && c->dst_off > c->src_off && c->dst_off < c->src_off + c->len;
+	u64 done = 0, n, at;
+	int ret = 0;
+
+	while(done < c->len){
+		if(READ_ONCE(gf->copy_cancel)){
+			ret = -ECANCELED;
+			break;
+		}
+		n = min_t(u64, c->len - done, GLOBALMEM_COPY_CHUNK);
+		at = back ? c->len - done - n : done;
+		ret = globalmem_copy_range(gf, job->src, c->src_off + at, c->dst_off + at, n);
+		if(ret)
+			break;
+		done += n;
+		cond_resched();
+	}
+	globalmem_copy_complete(job, ret);
+	kfree(job);
+}
+
+//queue the copies in order, each runs and completes on its own. done is how many were queued
+static long globalmem_copy(struct file *filp, struct globalmem_copy_batch __user *argp){
+	struct globalmem_file *gf = filp->private_data;
+	struct globalmem_copy_batch b;
+	struct globalmem_copy __user *copies;
+	struct globalmem_copy_comp *ring;
+	struct globalmem_copy_job *job;
+	struct globalmem_dev *src;
+	long ret = 0;
+	u32 i;
+
+	if(!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if(copy_from_user(&b, argp, sizeof(b)))
+		return -EFAULT;
+	copies = u64_to_user_ptr(b.copies);
+
+	if(!READ_ONCE(gf->ring)){
+		ring = kcalloc(GLOBALMEM_COPY_RING, sizeof(*ring), GFP_KERNEL);
+		if(!ring)
+			return -ENOMEM;
+		if(cmpxchg(&gf->ring, NULL, ring))
+			kfree(ring); //another thread of the file was first
+	}
+
+	for(i = 0; i < b.n; i++){
+		job = kmalloc(sizeof(*job), GFP_KERNEL);
+		if(!job){
+			ret = -ENOMEM;
+			break;
+		}
+		if(copy_from_user(&job->c, copies + i, sizeof(job->c))){
+			kfree(job);
+			ret = -EFAULT;
+			break;
 		}
-		if(offset + filp->f_pos > GLOBALMEM_SIZE){
+		src = globalmem_copy_src(filp, job->c.src_fd);
+		if(IS_ERR(src)){
+			kfree(job);
+			ret = PTR_ERR(src);
+			break;
+		}
+		if(!globalmem_range_ok(job->c.src_off, job->c.len, src->size) ||
+				!globalmem_range_ok(job->c.dst_off, job->c.len, gf->dev->size)){
+			kfree(job);
 			ret = -EINVAL;
-			return ret;
+			break;
 		}
-		filp->f_pos += offset;
-		ret = filp->f_pos;
-		break;
-	default:
-		ret = -EINVAL;
+		job->gf = gf;
+		job->src = src;
+		spin_lock(&gf->copy_lock);
+		if(gf->copy_pending == GLOBALMEM_COPY_RING){
+			ret = -EAGAIN;
+		} else{
+			gf->copy_pending++;
+			list_add_tail(&job->node, &gf->copy_jobs);
+		}
+		spin_unlock(&gf->copy_lock);
+		if(ret){
+			kfree(job);
+			break;
+		}
+		INIT_WORK(&job->work, globalmem_copy_work);
+		atomic_inc(&gf->copy_inflight);
+		queue_work(globalmem_copy_wq, &job->work);
 	}
+	if(put_user(i, &argp->done))
+		return -EFAULT;
+	return ret;
+}
 
+//what has completed, up to n, oldest first. never waits, poll for POLLPRI
+static long globalmem_copy_reap(struct globalmem_file *gf, struct globalmem_copy_reap __user *argp){
+	struct globalmem_copy_comp *comps;
+	struct globalmem_copy_reap r;
+	u32 i, n;
+	long ret = 0;
+
+	if(copy_from_user(&r, argp, sizeof(r)))
+		return -EFAULT;
+	if(!r.n || r.n > GLOBALMEM_COPY_RING)
+		return -EINVAL;
+	comps = kmalloc_array(r.n, sizeof(*comps), GFP_KERNEL);
+	if(!comps)
+		return -ENOMEM;
+
+	mutex_lock(&gf->reap_lock);
+	spin_lock(&gf->copy_lock);
+	n = min(r.n, gf->ring_len);
+	for(i = 0; i < n; i++)
+		comps[i] = gf->ring[(gf->ring_head + i) % GLOBALMEM_COPY_RING];
+	spin_unlock(&gf->copy_lock);
+
+	//out of the ring only once they are out to the caller
+	if(copy_to_user(u64_to_user_ptr(r.comps), comps, n * sizeof(*comps)) || put_user(n, &argp->count)){
+		ret = -EFAULT;
+	} else{
+		spin_lock(&gf->copy_lock);
+		gf->ring_head = (gf->ring_head + n) % GLOBALMEM_COPY_RING;
+		WRITE_ONCE(gf->ring_len, gf->ring_len - n);
+		gf->copy_pending -= n;
+		spin_unlock(&gf->copy_lock);
+	}
+	mutex_unlock(&gf->reap_lock);
+	kfree(comps);
 	return ret;
 }
 
 static long globalmem_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
 
-	struct globalmem_dev *dev = filp->private_data;
+	struct globalmem_file *gf = filp->private_data;
+	struct globalmem_dev *dev = gf->dev;
+	const u8 zero = 0;
+	u64 off, n;
+	int ret;
+
 	switch(cmd){
 
 	case MEM_CLEAR:
-		memset(dev->mem, 0, GLOBALMEM_SIZE);
+		for(off = 0; off < dev->size; off += n){
+			n = min_t(u64, dev->size - off, GLOBALMEM_COPY_CHUNK);
+			ret = globalmem_fill_range(gf, off, n, &zero, 1);
+			if(ret)
+				return ret;
+			cond_resched();
+		}
 		printk(KERN_INFO "globalmem is set to zero\n");
 		break;
+	case GLOBALMEM_CRC32C:
+		return globalmem_crc32c(gf, (struct globalmem_crc __user *)arg);
+	case GLOBALMEM_SEARCH:
+		return globalmem_search(gf, (struct globalmem_search __user *)arg);
+	case GLOBALMEM_FILL:
+		return globalmem_fill(gf, (struct globalmem_fill __user *)arg);
+	case GLOBALMEM_MOVE:
+		return globalmem_move(gf, (struct globalmem_move __user *)arg);
+	case GLOBALMEM_ATOMIC:
+		return globalmem_atomic(dev, (struct globalmem_atomic __user *)arg);
+	case GLOBALMEM_ATOMIC_BATCH:
+		return globalmem_atomic_batch(dev, (struct globalmem_atomic_batch __user *)arg);
+	case GLOBALMEM_WAIT:
+		return globalmem_wait(dev, (struct globalmem_wait __user *)arg);
+	case GLOBALMEM_WAKE:
+		return globalmem_wake(dev, (struct globalmem_range __user *)arg);
+	case GLOBALMEM_SUBSCRIBE:
+		return globalmem_subscribe(gf, (struct globalmem_range __user *)arg);
+	case GLOBALMEM_LOCK:
+		return globalmem_lock(gf, (struct globalmem_lock __user *)arg);
+	case GLOBALMEM_UNLOCK:
+		return globalmem_unlock(gf, (struct globalmem_lock __user *)arg);
+	case GLOBALMEM_GET_DIRTY:
+		return globalmem_get_dirty(dev, (struct globalmem_dirty __user *)arg);
+	case GLOBALMEM_SNAPSHOT:
+		return globalmem_snapshot(dev);
+	case GLOBALMEM_COPY:
+		return globalmem_copy(filp, (struct globalmem_copy_batch __user *)arg);
+	case GLOBALMEM_COPY_REAP:
+		return globalmem_copy_reap(gf, (struct globalmem_copy_reap __user *)arg);
 	default:
 		return -EINVAL;
 	}
@@ -146,6 +1877,129 @@ static long globalmem_ioctl(struct file *filp, unsigned int cmd, unsigned long a
 }
 
 
+/*****************mmap******************/
+//the pages are handed out one fault at a time, from the vmalloc_user area behind dev->mem
+static vm_fault_t globalmem_vm_fault(struct vm_fault *vmf){
+	struct globalmem_dev *dev = vmf->vma->vm_private_data;
+	u64 off = (u64)vmf->pgoff << PAGE_SHIFT;
+	struct page *page;
+
+	if(vmf->pgoff >= DIV_ROUND_UP(dev->size, PAGE_SIZE))
+		return VM_FAULT_SIGBUS;
+	//a cold page comes in, the reference taken keeps it in while it is mapped
+	if(dev->cold){
+		page = globalmem_cold_pin(dev, vmf->pgoff);
+		if(!page)
+			return VM_FAULT_OOM;
+	} else{
+		page = vmalloc_to_page(dev->mem + off);
+		get_page(page);
+	}
+	vmf->page = page;
+	return 0;
+}
+
+//the first store to a page after it was mapped or checkpointed. the page has no address_space for
+//the core to check, so it is locked here and VM_FAULT_LOCKED skips that.
+//locked before the page is marked, as in the huge fault: a checkpoint or snapshot that took the bits
+//first then waits on the lock, and zaps the pte this fault installs
+static vm_fault_t globalmem_vm_page_mkwrite(struct vm_fault *vmf){
+	struct globalmem_dev *dev = vmf->vma->vm_private_data;
+	u64 off = (u64)vmf->pgoff << PAGE_SHIFT;
+
+	lock_page(vmf->page);
+	//the bit before the snapshot is looked for: a snapshot made meanwhile either is seen here or write
+	//protects this page, after waiting for the lock
+	set_bit(vmf->pgoff, dev->wmapped);
+	smp_mb__after_atomic();
+	globalmem_snap_write(dev, off, min_t(u64, PAGE_SIZE, dev->size - off));
+	globalmem_dirty_mark(dev, off, min_t(u64, PAGE_SIZE, dev->size - off));
+	return VM_FAULT_LOCKED;
+}
+
+//vmf_insert_pfn_pmd takes a plain pfn from 6.17 on. before, the huge chunks are mapped a page at a time
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+#define GLOBALMEM_HUGE_FAULT
+#endif
+
+#ifdef GLOBALMEM_HUGE_FAULT
+//a chunk on a huge page is mapped with one pmd, anything else falls back to the page faults above.
+//a write to a read only pmd comes here too, it does for the chunk what page_mkwrite does for a page
+static vm_fault_t globalmem_vm_huge_fault(struct vm_fault *vmf, unsigned int order){
+	struct vm_area_struct *vma = vmf->vma;
+	struct globalmem_dev *dev = vma->vm_private_data;
+	unsigned long addr = vmf->address & PMD_MASK;
+	pgoff_t pgoff = vmf->pgoff - ((vmf->address - addr) >> PAGE_SHIFT);
+	u64 off = (u64)pgoff << PAGE_SHIFT;
+	bool write = vmf->flags & FAULT_FLAG_WRITE;
+	struct page *page;
+	vm_fault_t ret;
+	int i;
+
+	if(order != PMD_ORDER || !dev->huge)
+		return VM_FAULT_FALLBACK;
+	if(addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end || !IS_ALIGNED(pgoff, HPAGE_PMD_NR))
+		return VM_FAULT_FALLBACK;
+	if(off + PMD_SIZE > dev->size || !test_bit(off >> PMD_SHIFT, dev->huge))
+		return VM_FAULT_FALLBACK;
+
+	//locked before the chunk is marked: a checkpoint that took the bits first zaps the pmd after it is in
+	page = vmalloc_to_page(dev->mem + off);
+	lock_page(page);
+	if(write){
+		for(i = 0; i < HPAGE_PMD_NR; i++)
+			set_bit(pgoff + i, dev->wmapped);
+		smp_mb__after_atomic();
+		globalmem_snap_write(dev, off, PMD_SIZE);
+		globalmem_dirty_mark(dev, off, PMD_SIZE);
+	}
+	ret = vmf_insert_pfn_pmd(vmf, page_to_pfn(page), write);
+	unlock_page(page);
+	return ret;
+}
+#endif
+
+static const struct vm_operations_struct globalmem_vm_ops = {
+	.fault = globalmem_vm_fault,
+	.page_mkwrite = globalmem_vm_page_mkwrite, //with it the pages map read only until written
+#ifdef GLOBALMEM_HUGE_FAULT
+	.huge_fault = globalmem_vm_huge_fault,
+#endif
+};
+
+//shared only: the point is that every process sees, and the atomic ioctls act on, the same words
+static int globalmem_mmap(struct file *filp, struct vm_area_struct *vma){
+	struct globalmem_file *gf = filp->private_data;
+	struct globalmem_dev *dev = gf->dev;
+	unsigned long pages = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+	int ret = 0;
+
+	if(!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+	if(vma->vm_pgoff >= pages || vma_pages(vma) > pages - vma->vm_pgoff)
+		return -EINVAL;
+
+	//all mappings through one node, a checkpoint write protects them through its i_mapping
+	mutex_lock(&dev->map_lock);
+	if(!dev->map_inode){
+		dev->map_inode = file_inode(filp);
+		ihold(dev->map_inode);
+	} else if(dev->map_inode != file_inode(filp)){
+		ret = -EBUSY;
+	}
+	mutex_unlock(&dev->map_lock);
+	if(ret)
+		return ret;
+
+	vma->vm_ops = &globalmem_vm_ops;
+	vma->vm_private_data = gf->dev;
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	//pfn pmds need a mixed map, VM_HUGEPAGE lets them in with THP in madvise mode too
+	if(dev->huge)
+		vm_flags_set(vma, VM_MIXEDMAP | VM_HUGEPAGE);
+	return 0;
+}
+
 static const struct file_operations globalmem_fops = { //defined in fs.h
 	.owner = THIS_MODULE,
 	.llseek = globalmem_llseek,
@@ -154,9 +2008,148 @@ static const struct file_operations globalmem_fops = { //defined in fs.h
 	.read = globalmem_read,
 	.write = globalmem_write,
 	.unlocked_ioctl = globalmem_ioctl,
+	.mmap = globalmem_mmap,
+	.get_unmapped_area = thp_get_unmapped_area, //PMD aligned when the length allows, for the huge chunks
+	.poll = globalmem_poll,
 };
 
 
+//everything but the cdev, also what the KUnit suite builds its devices with
+static int globalmem_dev_init(struct globalmem_dev *dev, unsigned char *mem, size_t size, unsigned int dirty_shift){
+	int i;
+
+	dev->dirty_shift = dirty_shift;
+	dev->dirty_bits = DIV_ROUND_UP(size, 1UL << dev->dirty_shift);
+	dev->dirty = globalmem_bitmap_zalloc(dev->dirty_bits);
+	if(!dev->dirty)
+		return -ENOMEM;
+	dev->wmapped = globalmem_bitmap_zalloc(DIV_ROUND_UP(size, PAGE_SIZE));
+	if(!dev->wmapped){
+		kvfree(dev->dirty);
+		return -ENOMEM;
+	}
+	mutex_init(&dev->map_lock);
+	dev->mem = mem;
+	dev->size = size;
+	init_waitqueue_head(&dev->wait);
+	for(i = 0; i < GLOBALMEM_STRIPES; i++)
+		__init_rwsem(&dev->stripe[i], "globalmem_stripe", &globalmem_stripe_keys[i]);
+	spin_lock_init(&dev->ulock_lock);
+	INIT_LIST_HEAD(&dev->ulocks);
+	init_waitqueue_head(&dev->ulock_wait);
+	return 0;
+}
+
+//find the chunks of a vmalloc_huge area that got a huge page each. vmalloc falls back to small pages
+//wherever it has to, so any chunk may be either
+static int globalmem_dev_huge(struct globalmem_dev *dev){
+	unsigned long chunks = dev->size >> PMD_SHIFT, n = PMD_SIZE >> PAGE_SHIFT, c, pfn, i;
+
+	if(!IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE) || !chunks)
+		return 0;
+	dev->huge = bitmap_zalloc(chunks, GFP_KERNEL);
+	if(!dev->huge)
+		return -ENOMEM;
+	for(c = 0; c < chunks; c++){
+		pfn = vmalloc_to_pfn(dev->mem + (c << PMD_SHIFT));
+		if(!IS_ALIGNED(pfn, n))
+			continue;
+		for(i = 1; i < n; i++)
+			if(vmalloc_to_pfn(dev->mem + (c << PMD_SHIFT) + (i << PAGE_SHIFT)) != pfn + i)
+				break;
+		if(i == n){
+			set_bit(c, dev->huge);
+			dev->huge_chunks++;
+		}
+	}
+	if(!dev->huge_chunks){
+		bitmap_free(dev->huge);
+		dev->huge = NULL;
+	}
+	return 0;
+}
+
+//what globalmem_dev_init and globalmem_dev_huge set up, and the memory
+static void globalmem_dev_free(struct globalmem_dev *dev){
+	if(dev->map_inode)
+		iput(dev->map_inode);
+	bitmap_free(dev->huge);
+	kvfree(dev->dirty);
+	kvfree(dev->wmapped);
+	if(dev->cold)
+		globalmem_cold_destroy(dev->cold);
+	else
+		vfree(dev->mem);
+}
+
+/*****************sysfs********************/
+//statistics/ of a cold device, like zram's mm_stat one value per file
+#define GLOBALMEM_COLD_ATTR(_name, _val)						\
+static ssize_t _name##_show(struct device *d, struct device_attribute *attr, char *buf){	\
+	struct globalmem_cold *cold = ((struct globalmem_dev *)dev_get_drvdata(d))->cold;	\
+										\
+	return sprintf(buf, "%llu\n", (unsigned long long)(_val));			\
+}										\
+static DEVICE_ATTR_RO(_name)
+
+GLOBALMEM_COLD_ATTR(hot_pages, READ_ONCE(cold->hot));
+GLOBALMEM_COLD_ATTR(compressed_pages, READ_ONCE(cold->compressed));
+GLOBALMEM_COLD_ATTR(compressed_bytes, READ_ONCE(cold->compressed_bytes));
+GLOBALMEM_COLD_ATTR(zero_pages, cold->nr_pages - READ_ONCE(cold->hot) - READ_ONCE(cold->compressed));
+GLOBALMEM_COLD_ATTR(evictions, READ_ONCE(cold->evictions));
+GLOBALMEM_COLD_ATTR(incompressible, READ_ONCE(cold->incompressible));
+GLOBALMEM_COLD_ATTR(hits, atomic64_read(&cold->hits));
+GLOBALMEM_COLD_ATTR(misses, atomic64_read(&cold->misses));
+
+//bytes the compressed pages hold per byte they take, in hundredths
+static ssize_t compr_ratio_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct globalmem_cold *cold = ((struct globalmem_dev *)dev_get_drvdata(d))->cold;
+	unsigned long pages = READ_ONCE(cold->compressed), bytes = READ_ONCE(cold->compressed_bytes);
+
+	return sprintf(buf, "%lu\n", bytes ? (unsigned long)div64_u64((u64)pages * PAGE_SIZE * 100, bytes) : 0);
+}
+static DEVICE_ATTR_RO(compr_ratio);
+
+//accesses that found their pages in memory, in hundredths of a percent
+static ssize_t hit_rate_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct globalmem_cold *cold = ((struct globalmem_dev *)dev_get_drvdata(d))->cold;
+	u64 hits = atomic64_read(&cold->hits), all = hits + atomic64_read(&cold->misses);
+
+	return sprintf(buf, "%llu\n", all ? div64_u64(hits * 10000, all) : 0);
+}
+static DEVICE_ATTR_RO(hit_rate);
+
+static struct attribute *globalmem_cold_attrs[] = {
+	&dev_attr_hot_pages.attr,
+	&dev_attr_compressed_pages.attr,
+	&dev_attr_compressed_bytes.attr,
+	&dev_attr_zero_pages.attr,
+	&dev_attr_evictions.attr,
+	&dev_attr_incompressible.attr,
+	&dev_attr_hits.attr,
+	&dev_attr_misses.attr,
+	&dev_attr_compr_ratio.attr,
+	&dev_attr_hit_rate.attr,
+	NULL,
+};
+
+static umode_t globalmem_cold_visible(struct kobject *kobj, struct attribute *attr, int n){
+	struct globalmem_dev *dev = dev_get_drvdata(kobj_to_dev(kobj));
+
+	return dev->cold ? attr->mode : 0;
+}
+
+static const struct attribute_group globalmem_cold_group = {
+	.name = "statistics",
+	.attrs = globalmem_cold_attrs,
+	.is_visible = globalmem_cold_visible,
+};
+
+static const struct attribute_group *globalmem_groups[] = {
+	&globalmem_cold_group,
+	NULL,
+};
+
 static void globalmem_setup_cdev(struct globalmem_dev *dev, int index){
 
 	int err, devno = MKDEV(globalmem_major, index); //define the device number
@@ -174,8 +2167,18 @@ static void globalmem_setup_cdev(struct globalmem_dev *dev, int index){
 static int __init globalmem_init(void){
 
 	int ret;
+	struct device *device;
 	int i;
 	dev_t devno = MKDEV(globalmem_major, 0); //create a device number
+	struct globalmem_cold *cold;
+	unsigned char *mem;
+
+	if(!globalmem_size || globalmem_size > GLOBALMEM_SIZE_MAX)
+		return -EINVAL;
+	if(globalmem_dirty_shift < 6 || globalmem_dirty_shift > 20)
+		return -EINVAL;
+	if(globalmem_comp[0] && globalmem_huge) //a huge page can't go out a page at a time
+		return -EINVAL;
 
 	// register the major and minor of the device
 	if(globalmem_major){
@@ -195,12 +2198,90 @@ static int __init globalmem_init(void){
 		ret = -ENOMEM;
 		goto fail_malloc;
 	}
+	globalmem_copy_wq = alloc_workqueue("globalmem_copy", WQ_UNBOUND, 0);
+	if(!globalmem_copy_wq){
+		ret = -ENOMEM;
+		goto fail_wq;
+	}
+
+	for(i = 0; i<DEVICE_NUM; i++){
+		cold = NULL;
+		if(globalmem_comp[0]){
+			cold = globalmem_cold_create(globalmem_size, globalmem_comp);
+			if(IS_ERR(cold)){
+				ret = PTR_ERR(cold);
+				goto fail_mem;
+			}
+			mem = cold->area->addr;
+		} else if(globalmem_huge){
+			mem = vmalloc_huge(globalmem_size, GFP_KERNEL | __GFP_ZERO);
+		} else{
+			mem = vmalloc_user(globalmem_size); //zeroed
+		}
+		if(!mem){
+			ret = -ENOMEM;
+			goto fail_mem;
+		}
+		ret = globalmem_dev_init(globalmem_devp + i, mem, globalmem_size, globalmem_dirty_shift);
+		if(ret){
+			if(cold)
+				globalmem_cold_destroy(cold);
+			else
+				vfree(mem);
+			goto fail_mem;
+		}
+		if(cold){
+			globalmem_devp[i].cold = cold;
+			cold->dev = globalmem_devp + i;
+			globalmem_cold_start(cold);
+		}
+		if(globalmem_huge){
+			ret = globalmem_dev_huge(globalmem_devp + i);
+			if(ret){
+				globalmem_dev_free(globalmem_devp + i);
+				goto fail_mem;
+			}
+			pr_info("globalmem%d: %lu of %lu chunks on huge pages\n", i,
+					globalmem_devp[i].huge_chunks, (unsigned long)(globalmem_size >> PMD_SHIFT));
+		}
+	}
 
 	for(i = 0; i<DEVICE_NUM; i++){
 		globalmem_setup_cdev(globalmem_devp+i, i); //config the data struct of globalmem_dev in each mem space 
 	}
 
+	globalmem_class = class_create("multi_globalmem");
+	if(IS_ERR(globalmem_class)){
+		ret = PTR_ERR(globalmem_class);
+		goto fail_class;
+	}
+	//one node per minor: /dev/globalmem0 .. /dev/globalmem9
+	for(i = 0; i<DEVICE_NUM; i++){
+		device = device_create_with_groups(globalmem_class, NULL, MKDEV(globalmem_major, i), globalmem_devp + i,
+				globalmem_groups, "globalmem%d", i);
+		if(IS_ERR(device)){
+			ret = PTR_ERR(device);
+			goto fail_device;
+		}
+	}
+
+	return 0;
 
+fail_device:
+	while(i--)
+		device_destroy(globalmem_class, MKDEV(globalmem_major, i));
+	class_destroy(globalmem_class);
+fail_class:
+	for(i = 0; i<DEVICE_NUM; i++){
+		cdev_del(&(globalmem_devp + i)->cdev);
+	}
+	i = DEVICE_NUM;
+fail_mem:
+	while(i--)
+		globalmem_dev_free(globalmem_devp + i);
+	destroy_workqueue(globalmem_copy_wq);
+fail_wq:
+	kfree(globalmem_devp);
 fail_malloc:
 	unregister_chrdev_region(devno, DEVICE_NUM);
 	return ret;
@@ -211,8 +2292,12 @@ static void __exit globalmem_exit(void){
 
 	int i;
 	for(i = 0; i<DEVICE_NUM; i++){
+		device_destroy(globalmem_class, MKDEV(globalmem_major, i));
 		cdev_del(&(globalmem_devp + i)->cdev); //delete the chrdev in kernel space
+		globalmem_dev_free(globalmem_devp + i);
 	}
+	class_destroy(globalmem_class);
+	destroy_workqueue(globalmem_copy_wq); //idle, every file is closed
 	kfree(globalmem_devp);
 	unregister_chrdev_region(MKDEV(globalmem_major, 0), DEVICE_NUM); //delete the device number
 
@@ -0,0 +1,186 @@
+#ifndef _MULTI_GLOBALMEM_H
+#define _MULTI_GLOBALMEM_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define MEM_CLEAR	0x01 //zero the whole device
+#define GLOBALMEM_IOC_MAGIC	'm'
+
+//the ioctls below work on the device memory in place, no copy to userspace and back.
+//every range is [off, off + len) of the device, EINVAL when it doesn't fit. a long one is done
+//64 KiB at a time and other files may write in between, hold a GLOBALMEM_LOCK over it for one pass
+
+//CRC32C (Castagnoli) of a range. seed is the crc of the data before it, 0 to start,
+//so a crc can be carried over several calls
+struct globalmem_crc{
+	__u64 off;
+	__u64 len;
+	__u32 seed;
+	__u32 crc; //out
+};
+#define GLOBALMEM_CRC32C	_IOWR(GLOBALMEM_IOC_MAGIC, 1, struct globalmem_crc)
+
+#define GLOBALMEM_PATTERN_MAX	256
+
+//first occurrence of plen bytes at pattern in a range. result is its device offset, -1 if there is none
+struct globalmem_search{
+	__u64 off;
+	__u64 len;
+	__u64 pattern; //user pointer
+	__u32 plen; //1..GLOBALMEM_PATTERN_MAX
+	__u32 pad;
+	__s64 result; //out
+};
+#define GLOBALMEM_SEARCH	_IOWR(GLOBALMEM_IOC_MAGIC, 2, struct globalmem_search)
+
+//repeat plen bytes at pattern over a range, the last copy may be cut short
+struct globalmem_fill{
+	__u64 off;
+	__u64 len;
+	__u64 pattern; //user pointer
+	__u32 plen; //1..GLOBALMEM_PATTERN_MAX
+	__u32 pad;
+};
+#define GLOBALMEM_FILL	_IOW(GLOBALMEM_IOC_MAGIC, 3, struct globalmem_fill)
+
+//memmove inside the device, the ranges may overlap
+struct globalmem_move{
+	__u64 dst;
+	__u64 src;
+	__u64 len;
+};
+#define GLOBALMEM_MOVE	_IOW(GLOBALMEM_IOC_MAGIC, 4, struct globalmem_move)
+
+//atomic access to an aligned 32 or 64 bit word of the device, the same CPU atomics as on the
+//words of a MAP_SHARED mmap of it, so processes can mix both. every op is fully ordered and
+//returns the old value: CAS succeeded when result == cmp, STORE is an exchange
+enum globalmem_atomic_op{
+	GLOBALMEM_ATOMIC_LOAD,
+	GLOBALMEM_ATOMIC_STORE,
+	GLOBALMEM_ATOMIC_CAS,
+	GLOBALMEM_ATOMIC_FETCH_ADD,
+	GLOBALMEM_ATOMIC_FETCH_OR,
+};
+
+struct globalmem_atomic{
+	__u64 off; //a multiple of width
+	__u64 arg; //the value to store, add or or in
+	__u64 cmp; //CAS only
+	__u64 result; //out
+	__u32 op; //enum globalmem_atomic_op
+	__u32 width; //4 or 8
+};
+#define GLOBALMEM_ATOMIC	_IOWR(GLOBALMEM_IOC_MAGIC, 5, struct globalmem_atomic)
+
+//n ops in one call, in order. each is atomic on its own, the batch is not. done is how many ran,
+//on an error the ones before it did
+#define GLOBALMEM_ATOMIC_BATCH_MAX	256
+struct globalmem_atomic_batch{
+	__u64 ops; //user pointer to n struct globalmem_atomic, the results are written back there
+	__u32 n;
+	__u32 done; //out
+};
+#define GLOBALMEM_ATOMIC_BATCH	_IOWR(GLOBALMEM_IOC_MAGIC, 6, struct globalmem_atomic_batch)
+
+//a byte range of the device, for GLOBALMEM_WAKE and GLOBALMEM_SUBSCRIBE
+struct globalmem_range{
+	__u64 off;
+	__u64 len;
+};
+
+//futex-like waits. WORD sleeps until the word at off no longer holds val, returning at once if it
+//already doesn't. RANGE sleeps until a write touches [off, off + len).
+//write(), MEM_CLEAR, FILL, MOVE and the atomics wake the waiters they overlap, stores through a
+//mapping can't be seen: follow them with GLOBALMEM_WAKE, as with FUTEX_WAKE
+enum globalmem_wait_mode{
+	GLOBALMEM_WAIT_WORD,
+	GLOBALMEM_WAIT_RANGE,
+};
+
+struct globalmem_wait{
+	__u64 off; //WORD: a multiple of width
+	__u64 len; //RANGE
+	__u64 val; //WORD, compared at width
+	__s64 timeout_ns; //negative waits for ever, ETIMEDOUT when it runs out
+	__u32 mode; //enum globalmem_wait_mode
+	__u32 width; //WORD: 4 or 8
+};
+#define GLOBALMEM_WAIT	_IOW(GLOBALMEM_IOC_MAGIC, 7, struct globalmem_wait)
+#define GLOBALMEM_WAKE	_IOW(GLOBALMEM_IOC_MAGIC, 8, struct globalmem_range)
+
+//one range per open file, len 0 drops it. poll() then reports POLLIN once the range was
+//written since the last read() on that file
+#define GLOBALMEM_SUBSCRIBE	_IOW(GLOBALMEM_IOC_MAGIC, 9, struct globalmem_range)
+
+//byte range locks for sequences of calls. while a file holds one, read(), write(), MEM_CLEAR and the
+//in-place ioctls of other files on the range wait, shared locks only keep the writers out. the holder
+//itself goes through. atomics, waits and mappings don't look at them. released by GLOBALMEM_UNLOCK
+//with the same off and len, or on close
+#define GLOBALMEM_LOCK_EXCL	0x1
+#define GLOBALMEM_LOCK_NONBLOCK	0x2 //EAGAIN instead of waiting
+struct globalmem_lock{
+	__u64 off;
+	__u64 len;
+	__u32 flags;
+	__u32 pad;
+};
+#define GLOBALMEM_LOCK	_IOW(GLOBALMEM_IOC_MAGIC, 10, struct globalmem_lock)
+#define GLOBALMEM_UNLOCK	_IOW(GLOBALMEM_IOC_MAGIC, 11, struct globalmem_lock)
+
+//incremental checkpoints: the extents written since the last call, in offset order and in whole
+//granules of 1 << globalmem_dirty_shift bytes (the module parameter), which are clean again from here.
+//write(), MEM_CLEAR, FILL, MOVE, the atomics, GLOBALMEM_WAKE and stores through a mapping dirty them.
+//read the extents after the call: a write racing with it shows up here or in the next one
+struct globalmem_dirty{
+	__u64 extents; //user pointer to n struct globalmem_range
+	__u32 n; //up to 4096
+	__u32 count; //out, extents filled
+	__u32 granule; //out, bytes
+	__u32 more; //out, 1 when extents didn't fit, they stay dirty for the next call
+};
+#define GLOBALMEM_GET_DIRTY	_IOWR(GLOBALMEM_IOC_MAGIC, 12, struct globalmem_dirty)
+
+//a point-in-time view of the device as a new read only fd (read, pread, lseek), O_CLOEXEC. it copies
+//nothing when taken: a 4 KiB block is copied aside the first time anyone writes it afterwards, so
+//writers go on and the view stays put. one per device at a time (EBUSY), closing the fd drops it.
+//reads of it fail with EIO if a copy could not be allocated
+#define GLOBALMEM_SNAPSHOT	_IO(GLOBALMEM_IOC_MAGIC, 13)
+
+//the copy engine: copies into the device of the fd, which must be open for writing, from another globalmem
+//fd open for reading or from itself, run by a workqueue while the caller goes on. each is locked chunk by
+//chunk like write() is, and its completion lands in a ring of the fd: poll() gives POLLPRI while there are
+//some, GLOBALMEM_COPY_REAP takes them. EAGAIN once GLOBALMEM_COPY_RING are queued and not reaped.
+//close waits for the copy in flight, the others complete with ECANCELED
+#define GLOBALMEM_COPY_RING	256
+#define GLOBALMEM_COPY_SAME	(-1) //src_fd for the fd the copy is queued on, which must be readable too
+struct globalmem_copy{
+	__u64 src_off;
+	__u64 dst_off;
+	__u64 len;
+	__u64 cookie; //handed back in the completion
+	__s32 src_fd; //EBADF when it isn't open for reading, EINVAL when it isn't a globalmem device
+	__u32 pad;
+};
+
+struct globalmem_copy_batch{
+	__u64 copies; //user pointer to n struct globalmem_copy
+	__u32 n;
+	__u32 done; //out, how many were queued, the one at done failed
+};
+#define GLOBALMEM_COPY	_IOWR(GLOBALMEM_IOC_MAGIC, 14, struct globalmem_copy_batch)
+
+struct globalmem_copy_comp{
+	__u64 cookie;
+	__s32 status; //0 or -errno
+	__u32 pad;
+};
+
+struct globalmem_copy_reap{
+	__u64 comps; //user pointer to room for n struct globalmem_copy_comp, 1..GLOBALMEM_COPY_RING
+	__u32 n;
+	__u32 count; //out, oldest first
+};
+#define GLOBALMEM_COPY_REAP	_IOWR(GLOBALMEM_IOC_MAGIC, 15, struct globalmem_copy_reap)
+
+#endif
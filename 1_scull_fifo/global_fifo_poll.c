@@ -15,11 +15,12 @@
 #include <linux/types.h> //all the ssize_t, loff_t
 #include <linux/sched/signal.h>
 #include <linux/slab.h> //mem manage kzalloc()
+#include <linux/device.h> //class, device_create
 #include <linux/poll.h> //poll function
 
 #define GLOBALMEM_SIZE		0x1000
 #define FIFO_CLEAR			0x01	//ioctl cmd
-#define GLOBALFIFO_MAJOR	230
+#define GLOBALFIFO_MAJOR	0 //dynamic, udev creates /dev/globalfifo_poll through the class
 
 static int globalfifo_major = GLOBALFIFO_MAJOR;
 module_param(globalfifo_major, int, S_IRUGO); //config module args: name, type, perm
@@ -34,6 +35,7 @@ struct globalfifo_dev {
 };
 
 struct globalfifo_dev *globalfifo_devp;
+static struct class *globalfifo_class;
 
 
 static int globalfifo_open(struct inode *inode, struct file *filp){
@@ -221,6 +223,7 @@ static void globalfifo_setup_cdev(struct globalfifo_dev *dev, int index){
 
 static int __init globalfifo_init(void){
 	int ret;
+	struct device *device;
 
 	//register the devno
 	dev_t devno = MKDEV(globalfifo_major, 0);
@@ -242,22 +245,40 @@ static int __init globalfifo_init(void){
 		goto fail_malloc;
 	}
 
-	//setup for cdev
-	globalfifo_setup_cdev(globalfifo_devp, 0);
-
-	//init for the mutex and wait queue
+	//init for the mutex and wait queue, before cdev_add makes the device live
 	mutex_init(&globalfifo_devp->mutex);
 	init_waitqueue_head(&globalfifo_devp->r_wait);
 	init_waitqueue_head(&globalfifo_devp->w_wait);
 
+	//setup for cdev
+	globalfifo_setup_cdev(globalfifo_devp, 0);
+
+	globalfifo_class = class_create("globalfifo_poll");
+	if(IS_ERR(globalfifo_class)){
+		ret = PTR_ERR(globalfifo_class);
+		goto fail_class;
+	}
+	device = device_create(globalfifo_class, NULL, devno, NULL, "globalfifo_poll");
+	if(IS_ERR(device)){
+		ret = PTR_ERR(device);
+		goto fail_device;
+	}
+
 	return 0;
 
+fail_device:
+	class_destroy(globalfifo_class);
+fail_class:
+	cdev_del(&globalfifo_devp->cdev);
+	kfree(globalfifo_devp);
 fail_malloc:
 	unregister_chrdev_region(devno, 1);
 	return ret;
 }
 
 static void __exit globalfifo_exit(void){
+	device_destroy(globalfifo_class, MKDEV(globalfifo_major, 0));
+	class_destroy(globalfifo_class);
 	cdev_del(&globalfifo_devp->cdev);
 	kfree(globalfifo_devp);
 	unregister_chrdev_region(MKDEV(globalfifo_major, 0), 1);
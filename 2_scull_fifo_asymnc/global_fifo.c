@@ -11,57 +11,1081 @@
 #include <linux/init.h>
 #include <linux/cdev.h>
 #include <linux/slab.h> //kzalloc
+#include <linux/mm.h> //kvmalloc
+#include <linux/vmalloc.h> //the ring is vmalloc_user, it can be mapped
+#include <linux/device.h> //class, device_create, sysfs attributes
 #include <linux/poll.h>
+#include <linux/kfifo.h> //queue for in-kernel producers
+#include <linux/spinlock.h>
+#include <linux/sched/clock.h> //local_clock for the busy-poll deadline
+#include <linux/percpu.h> //write-behind staging
+#include <linux/workqueue.h>
+#include <linux/jump_label.h> //the latency instrumentation is a static key
+#include <linux/debugfs.h>
+#include <linux/srcu.h> //the recorder slots go away under its writers
+#include <linux/rculist.h> //the writers walk the recorder readers
+#include <linux/filter.h> //classic BPF record filters
+#include <linux/skbuff.h> //what a classic program runs on
 
+#include "globalfifo.h"
+#include "globalfifo_core.h" //the ring, shared with the userspace harness
 
 
-#define GLOBALFIFO_SIZE 0x1000
-#define FIFO_CLEAR 0x01
-#define GLOBALFIFO_MAJOR 231
+#define GLOBALFIFO_SIZE 0x1000 //default capacity
+#define GLOBALFIFO_MAX_SIZE (16 << 20) //upper bound of the capacity attribute
+#define GLOBALFIFO_INJECT_SIZE 0x1000 //must be a power of 2 for kfifo
+#define GLOBALFIFO_MAJOR 0 //dynamic, the node is created by udev through the class
 
 static int globalfifo_major = GLOBALFIFO_MAJOR;
 module_param(globalfifo_major, int, S_IRUGO);
+static unsigned int globalfifo_size = GLOBALFIFO_SIZE; //initial capacity, /sys/class/globalfifo_async/global_fifo/capacity changes it live
+module_param(globalfifo_size, uint, S_IRUGO);
+//busy-poll budget in us for new files, like net.core.busy_read. GLOBALFIFO_SET_BUSY_POLL overrides it per file
+static unsigned int globalfifo_busy_poll;
+module_param(globalfifo_busy_poll, uint, S_IRUGO | S_IWUSR);
+
+#define GLOBALFIFO_BUSY_POLL_MAX 10000 //us, a spinning reader burns a CPU
+#define GLOBALFIFO_GAP_SHIFT 3 //the inter-arrival EWMA weighs a new sample 1/8
+//writes up to this size go in whole or not at all, like PIPE_BUF. 0 keeps the short writes
+static unsigned int globalfifo_atomic_size;
+module_param(globalfifo_atomic_size, uint, S_IRUGO);
+//write-behind: write() only copies into a per-cpu staging buffer, a worker moves it into the fifo in batches
+static bool globalfifo_write_behind;
+module_param(globalfifo_write_behind, bool, S_IRUGO);
+//flight-recorder: writers overwrite the oldest record instead of blocking, see globalfifo_rec_write()
+static bool globalfifo_recorder;
+module_param(globalfifo_recorder, bool, S_IRUGO);
+#define GLOBALFIFO_REC_MIN_SLOTS 16
+#define GLOBALFIFO_STAGE_SIZE 0x4000 //per cpu
+
+//one record per staged write(), seq orders the records of all the cpus
+struct globalfifo_stage_hdr{
+	u64 seq;
+	u32 len;
+	u32 pad;
+};
+
+//a staging shard. it is per cpu so writers on different cpus don't meet, and a mutex because
+//copy_from_user may sleep, a writer that migrates after picking its shard is still correct
+struct globalfifo_stage{
+	struct mutex lock;
+	unsigned char *buf;
+	unsigned int len; //records appended by the writers
+	unsigned int pos; //drainer only: next record to move
+	unsigned int end; //drainer only: end of the records below the cut
+};
+
+//one record of the recorder. the stamp is a per-slot seqcount: 2 * seq + 1 while the writer of seq
+//fills it, 2 * seq + 2 once it is done. readers copy and check that it didn't move
+struct globalfifo_rec_slot{
+	atomic64_t stamp;
+	atomic64_t skip; //seq + 1 of the newest writer that found the slot busy and dropped its record
+	u32 len;
+	unsigned char data[GLOBALFIFO_REC_MAX];
+} ____cacheline_aligned;
+
+struct globalfifo_rec{
+	unsigned int gen; //a reader that saw another one starts over at the oldest record
+	u64 mask; //slots - 1
+	atomic64_t next; //seq of the next record
+	struct sk_buff * __percpu *skb; //what the filters run on, see globalfifo_filter_run()
+	struct globalfifo_rec_slot slot[];
+};
+
+//a classic BPF program attached to one reader, see globalfifo_filter_run()
+struct globalfifo_filter{
+	struct rcu_head rcu;
+	struct bpf_prog *prog;
+	u64 hits, misses; //under the rec_lock of its file
+};
+
+//all counters are updated under dev->mutex
+struct globalfifo_stats{
+	u64 bytes_read;
+	u64 bytes_written;
+	u64 reads;
+	u64 writes;
+	u64 read_sleeps; //a reader had to block
+	u64 write_sleeps;
+	u64 busy_poll_hits; //data came while a reader spun
+	u64 busy_poll_misses; //the budget ran out or the CPU was wanted, the reader slept after all
+	u64 wb_batches; //write-behind drains that moved data, bytes_written counts the bytes
+};
+
+//latency histograms in debugfs, see globalfifo_lat_enqueue() and globalfifo_lock()
+enum globalfifo_lat{
+	GLOBALFIFO_LAT_QUEUE, //a write's bytes queued until the last of them is read
+	GLOBALFIFO_LAT_MUTEX_WAIT,
+	GLOBALFIFO_LAT_MUTEX_HOLD,
+	GLOBALFIFO_LAT_READ_BLOCK, //asleep in r_wait
+	GLOBALFIFO_LAT_WRITE_BLOCK, //asleep in w_wait
+	GLOBALFIFO_NR_LAT,
+};
+
+static const char * const globalfifo_lat_names[GLOBALFIFO_NR_LAT] = {
+	"queue", "mutex_wait", "mutex_hold", "read_block", "write_block",
+};
+
+#define GLOBALFIFO_HIST_BUCKETS 32 //log2 buckets of ns, the last one takes everything above
+#define GLOBALFIFO_TS_SLOTS 256 //writes timed at once, more merge into the newest
+
+//off by default, the hooks cost a patched-out jump then
+static DEFINE_STATIC_KEY_FALSE(globalfifo_lat_key);
+
+//len bytes of one write, queued at t
+struct globalfifo_ts{
+	u64 t;
+	unsigned int len;
+};
 
 struct globalfifo_dev{
 	struct cdev cdev;
-	unsigned int current_len;
-	unsigned char mem[GLOBALFIFO_SIZE];
+	struct device *device;
+	struct globalfifo_ring ring; //ring.len is the current fifo len, ring.size the capacity
+	//mmaps of ring.mem, it can't be resized while there are any. map_lock is taken under mmap_lock,
+	//so never together with the mutex, which is held across copy_to_user faults
+	struct mutex map_lock;
+	atomic_t mapped;
+	bool resizing; //under map_lock, mmap waits for capacity_store
+	unsigned int read_wm; //readers wake up/poll readable at this many bytes, like SO_RCVLOWAT
+	unsigned int write_wm; //writers wake up/poll writable at this much room, like SO_SNDLOWAT
+	unsigned int atomic_size; //writes up to this size are never split, <= ring.size
+	struct globalfifo_stats stats;
+	//latency, all under the mutex but lock_t
+	u64 hist[GLOBALFIFO_NR_LAT][GLOBALFIFO_HIST_BUCKETS];
+	u64 hist_sum[GLOBALFIFO_NR_LAT];
+	struct globalfifo_ts ts[GLOBALFIFO_TS_SLOTS]; //oldest write first
+	unsigned int ts_head, ts_len;
+	unsigned int lat_skip; //bytes queued before timing was on, they are read first
+	u64 lock_t; //when the mutex was taken, 0 if not timed
+	struct dentry *debugfs;
+	u64 last_arrival_ns; //when the last write/inject queued data
+	u64 gap_ewma_ns; //average time between arrivals, 0 until there were two
 	struct mutex mutex;
 	wait_queue_head_t r_wait;
 	wait_queue_head_t w_wait;
 	struct fasync_struct *async_queue;
+	//in-kernel producers may run in irq context and can't take the mutex,
+	//they append here and the readers move the bytes into the ring under the mutex
+	spinlock_t inject_lock;
+	DECLARE_KFIFO(inject, unsigned char, GLOBALFIFO_INJECT_SIZE);
+	//write-behind, the staging is allocated the first time the mode is turned on
+	bool write_behind;
+	struct globalfifo_stage __percpu *stage;
+	struct globalfifo_stage **wb_active; //drainer only: shards with records in this batch
+	atomic64_t wb_next_seq; //seq of the next staged record
+	u64 wb_done; //every record below this seq is in the ring
+	struct work_struct wb_work;
+	wait_queue_head_t wb_wait; //barriers wait here for wb_done
+	//files that blocked in a recorder read, the writers run their filters before waking them
+	struct list_head rec_readers;
+	spinlock_t rec_readers_lock;
+	//recorder mode when set, switched under the mutex and freed after globalfifo_rec_srcu
+	struct globalfifo_rec __rcu *rec;
+	unsigned int rec_gen;
+	atomic64_t rec_lost; //records the readers missed, the sum of the lost fields they were handed
+};
+
+//per open file
+struct globalfifo_file{
+	struct globalfifo_dev *dev;
+	unsigned int busy_poll_us;
+	u64 wb_last; //seq + 1 of the last record this file staged, a barrier waits for wb_done to reach it
+	//recorder cursor, under rec_lock
+	struct mutex rec_lock;
+	unsigned int rec_gen;
+	u64 rec_next; //seq of the next record to read
+	u64 rec_lost; //missed since the last record handed out
+	struct globalfifo_filter __rcu *filter; //set under rec_lock, the writers run it under rcu
+	wait_queue_head_t rec_wait; //blocked recorder reads of this file
+	struct list_head rec_node; //on dev->rec_readers, empty until it first blocks
+	struct rcu_head rcu;
 };
 
 struct globalfifo_dev *globalfifo_devp;
+static struct class *globalfifo_class;
+DEFINE_STATIC_SRCU(globalfifo_rec_srcu);
 
 /***************functions*********************/
+/*****************latency*******************/
+static void globalfifo_hist_add(struct globalfifo_dev *dev, enum globalfifo_lat lat, u64 ns){
+	unsigned int b = ns ? ilog2(ns) + 1 : 0;
+
+	if(b >= GLOBALFIFO_HIST_BUCKETS)
+		b = GLOBALFIFO_HIST_BUCKETS - 1;
+	WRITE_ONCE(dev->hist[lat][b], dev->hist[lat][b] + 1);
+	WRITE_ONCE(dev->hist_sum[lat], dev->hist_sum[lat] + ns);
+}
+
+//0 when timing is off, so the callers can test the stamp instead of the key a second time
+static __always_inline u64 globalfifo_lat_now(void){
+	return static_branch_unlikely(&globalfifo_lat_key) ? ktime_get_ns() : 0;
+}
+
+//the mutex with wait and hold times, every dev->mutex user goes through these
+static __always_inline void globalfifo_lock(struct globalfifo_dev *dev){
+	u64 t = globalfifo_lat_now();
+
+	mutex_lock(&dev->mutex);
+	if(t){
+		dev->lock_t = ktime_get_ns();
+		globalfifo_hist_add(dev, GLOBALFIFO_LAT_MUTEX_WAIT, dev->lock_t - t);
+	}
+}
+
+static __always_inline void globalfifo_unlock(struct globalfifo_dev *dev){
+	if(static_branch_unlikely(&globalfifo_lat_key) && dev->lock_t)
+		globalfifo_hist_add(dev, GLOBALFIFO_LAT_MUTEX_HOLD, ktime_get_ns() - dev->lock_t);
+	dev->lock_t = 0;
+	mutex_unlock(&dev->mutex);
+}
+
+//n bytes went into the ring, under the mutex
+static void __globalfifo_lat_enqueue(struct globalfifo_dev *dev, unsigned int n){
+	struct globalfifo_ts *e;
+
+	if(dev->ts_len == GLOBALFIFO_TS_SLOTS){
+		//out of slots, the bytes are timed from the newest write
+		dev->ts[(dev->ts_head + dev->ts_len - 1) % GLOBALFIFO_TS_SLOTS].len += n;
+		return;
+	}
+	e = &dev->ts[(dev->ts_head + dev->ts_len++) % GLOBALFIFO_TS_SLOTS];
+	e->t = ktime_get_ns();
+	e->len = n;
+}
+
+//n bytes left the ring, every write whose last byte went with them is done
+static void __globalfifo_lat_dequeue(struct globalfifo_dev *dev, unsigned int n){
+	struct globalfifo_ts *e;
+	unsigned int take;
+	u64 now = ktime_get_ns();
+
+	take = min(n, dev->lat_skip);
+	dev->lat_skip -= take;
+	n -= take;
+	while(n && dev->ts_len){
+		e = &dev->ts[dev->ts_head];
+		take = min(n, e->len);
+		e->len -= take;
+		n -= take;
+		if(e->len)
+			break;
+		globalfifo_hist_add(dev, GLOBALFIFO_LAT_QUEUE, now - e->t);
+		dev->ts_head = (dev->ts_head + 1) % GLOBALFIFO_TS_SLOTS;
+		dev->ts_len--;
+	}
+}
+
+static __always_inline void globalfifo_lat_enqueue(struct globalfifo_dev *dev, unsigned int n){
+	if(static_branch_unlikely(&globalfifo_lat_key) && n)
+		__globalfifo_lat_enqueue(dev, n);
+}
+
+static __always_inline void globalfifo_lat_dequeue(struct globalfifo_dev *dev, unsigned int n){
+	if(static_branch_unlikely(&globalfifo_lat_key) && n)
+		__globalfifo_lat_dequeue(dev, n);
+}
+
+//forget the writes in flight, what is queued now is not timed. under the mutex
+static void globalfifo_lat_restart(struct globalfifo_dev *dev){
+	dev->ts_head = 0;
+	dev->ts_len = 0;
+	dev->lat_skip = dev->ring.len;
+}
+
+//move the bytes queued by globalfifo_inject() into the ring, the caller holds dev->mutex.
+//the mutex makes this the only consumer of the kfifo, so no lock is needed on this side
+static void globalfifo_fold_inject(struct globalfifo_dev *dev){
+	unsigned char *p;
+	unsigned int n, span;
+
+	//the free space may wrap, so up to two spans
+	while(!kfifo_is_empty(&dev->inject)){
+		span = globalfifo_ring_tail_span(&dev->ring, &p);
+		if(!span)
+			break;
+		n = kfifo_out(&dev->inject, p, span);
+		globalfifo_ring_produce(&dev->ring, n);
+		globalfifo_lat_enqueue(dev, n);
+	}
+}
+
+//feed the inter-arrival average, from write under the mutex or from inject in any context.
+//the two may race and lose a sample, which a heuristic can afford
+static void globalfifo_note_arrival(struct globalfifo_dev *dev){
+	u64 now = ktime_get_ns(), last = READ_ONCE(dev->last_arrival_ns);
+	u64 gap, ewma;
+
+	WRITE_ONCE(dev->last_arrival_ns, now);
+	if(!last)
+		return;
+	gap = min_t(u64, now - last, NSEC_PER_SEC); //after a long idle, fast traffic wins back quickly
+	ewma = READ_ONCE(dev->gap_ewma_ns);
+	if(ewma)
+		gap = ewma - (ewma >> GLOBALFIFO_GAP_SHIFT) + (gap >> GLOBALFIFO_GAP_SHIFT);
+	WRITE_ONCE(dev->gap_ewma_ns, gap);
+}
+
+//how long a reader of gf should spin: nothing when the next write is due later than the budget,
+//otherwise twice the average gap, capped by the budget
+static u64 globalfifo_spin_ns(struct globalfifo_dev *dev, struct globalfifo_file *gf){
+	u64 budget = (u64)READ_ONCE(gf->busy_poll_us) * NSEC_PER_USEC;
+	u64 gap = READ_ONCE(dev->gap_ewma_ns);
+
+	if(!budget || !gap)
+		return budget;
+	if(gap > budget)
+		return 0;
+	return min(budget, 2 * gap);
+}
+
+//spin without the mutex until want bytes may be there. true means go and look, false means sleep
+static bool globalfifo_busy_poll(struct globalfifo_dev *dev, u64 spin_ns, size_t want){
+	u64 end = local_clock() + spin_ns;
+
+	while(!need_resched() && !signal_pending(current)){
+		//a hint only, the reader rechecks under the mutex
+		if(data_race(READ_ONCE(dev->ring.len)) >= want || !kfifo_is_empty(&dev->inject))
+			return true;
+		if(local_clock() >= end)
+			break;
+		cpu_relax();
+	}
+	return false;
+}
+
+//in-kernel producer, callable from any context including hard irq.
+//either the whole buffer is queued or nothing is, -ENOSPC when it doesn't fit.
+int globalfifo_inject(const void *buf, unsigned int len){
+	struct globalfifo_dev *dev = globalfifo_devp;
+	unsigned long flags;
+	int ret = len;
+
+	spin_lock_irqsave(&dev->inject_lock, flags);
+	if(kfifo_avail(&dev->inject) < len)
+		ret = -ENOSPC;
+	else
+		kfifo_in(&dev->inject, buf, len);
+	spin_unlock_irqrestore(&dev->inject_lock, flags);
+
+	if(ret > 0){
+		globalfifo_note_arrival(dev);
+		wake_up_interruptible(&dev->r_wait);
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+	}
+	return ret;
+}
+EXPORT_SYMBOL_GPL(globalfifo_inject);
+
+/*****************write-behind**************/
+static void globalfifo_stage_free(struct globalfifo_dev *dev){
+	int cpu;
+
+	if(dev->stage){
+		for_each_possible_cpu(cpu)
+			kvfree(per_cpu_ptr(dev->stage, cpu)->buf);
+		free_percpu(dev->stage);
+	}
+	kfree(dev->wb_active);
+	dev->stage = NULL;
+	dev->wb_active = NULL;
+}
+
+//called under dev->mutex before write_behind is first set
+static int globalfifo_stage_alloc(struct globalfifo_dev *dev){
+	struct globalfifo_stage *st;
+	int cpu;
+
+	if(dev->stage)
+		return 0;
+	dev->stage = alloc_percpu(struct globalfifo_stage);
+	dev->wb_active = kcalloc(nr_cpu_ids, sizeof(*dev->wb_active), GFP_KERNEL);
+	if(!dev->stage || !dev->wb_active)
+		goto fail;
+	for_each_possible_cpu(cpu){
+		st = per_cpu_ptr(dev->stage, cpu);
+		mutex_init(&st->lock);
+		st->buf = kvmalloc(GLOBALFIFO_STAGE_SIZE, GFP_KERNEL);
+		if(!st->buf)
+			goto fail;
+	}
+	return 0;
+
+fail:
+	globalfifo_stage_free(dev);
+	return -ENOMEM;
+}
+
+//room a write of count bytes waits for: all of it for an atomic write, else the watermark or count if less
+static bool globalfifo_wb_pending(struct globalfifo_dev *dev){
+	return atomic64_read(&dev->wb_next_seq) > READ_ONCE(dev->wb_done);
+}
+
+//copy into the shard of this cpu and return, -ENOSPC when the shard is full
+static ssize_t globalfifo_stage_write(struct globalfifo_dev *dev, struct globalfifo_file *gf,
+		const char __user *buf, size_t count){
+	struct globalfifo_stage *st = per_cpu_ptr(dev->stage, raw_smp_processor_id());
+	struct globalfifo_stage_hdr hdr = {};
+	unsigned int room;
+	ssize_t ret;
+
+	if(!count)
+		return 0;
+	mutex_lock(&st->lock);
+	room = GLOBALFIFO_STAGE_SIZE - st->len;
+	if(room <= sizeof(hdr)){
+		ret = -ENOSPC;
+		goto out;
+	}
+	//an atomic write is staged whole or written through
+	if(count <= READ_ONCE(dev->atomic_size) && count > room - sizeof(hdr)){
+		ret = -ENOSPC;
+		goto out;
+	}
+	hdr.len = min_t(size_t, count, room - sizeof(hdr));
+	if(copy_from_user(st->buf + st->len + sizeof(hdr), buf, hdr.len)){
+		ret = -EFAULT;
+		goto out;
+	}
+	//taken under the shard lock, see globalfifo_wb_work
+	hdr.seq = atomic64_fetch_inc(&dev->wb_next_seq);
+	memcpy(st->buf + st->len, &hdr, sizeof(hdr));
+	st->len += sizeof(hdr) + hdr.len;
+	WRITE_ONCE(gf->wb_last, hdr.seq + 1);
+	ret = hdr.len;
+out:
+	mutex_unlock(&st->lock);
+	if(ret > 0)
+		queue_work(system_highpri_wq, &dev->wb_work);
+	return ret;
+}
+
+//move a batch of staged records into the ring: one dev->mutex round trip and one reader wakeup.
+//the batch is every record below the seq read first. such a record got its seq under its shard lock
+//before we looked, so it is complete once we hold that lock, and merging the shards by seq
+//keeps the order of every single writer, however it migrated between cpus
+static void globalfifo_wb_work(struct work_struct *work){
+	struct globalfifo_dev *dev = container_of(work, struct globalfifo_dev, wb_work);
+	struct globalfifo_stage *st, *best;
+	struct globalfifo_stage_hdr hdr, bhdr;
+	u64 cut = atomic64_read(&dev->wb_next_seq), done = cut;
+	unsigned int n, drained = 0, nr_active = 0, i;
+	bool wake;
+	int cpu;
+
+	if(!dev->stage) //write-behind was never on
+		return;
+	for_each_possible_cpu(cpu){
+		st = per_cpu_ptr(dev->stage, cpu);
+		mutex_lock(&st->lock);
+		st->pos = 0;
+		for(st->end = 0; st->end < st->len; st->end += sizeof(hdr) + hdr.len){
+			memcpy(&hdr, st->buf + st->end, sizeof(hdr));
+			if(hdr.seq >= cut)
+				break;
+		}
+		mutex_unlock(&st->lock);
+		//writers only append past end, so the records below it can be read unlocked
+		if(st->end)
+			dev->wb_active[nr_active++] = st;
+	}
+	if(!nr_active)
+		return;
+
+	globalfifo_lock(dev);
+	globalfifo_fold_inject(dev);
+	while(1){
+		best = NULL;
+		for(i = 0; i < nr_active; i++){
+			st = dev->wb_active[i];
+			if(st->pos == st->end)
+				continue;
+			memcpy(&hdr, st->buf + st->pos, sizeof(hdr));
+			if(!best || hdr.seq < bhdr.seq){
+				best = st;
+				bhdr = hdr;
+			}
+		}
+		if(!best)
+			break;
+
+		//an atomic record waits for room for all of it, nothing may get between its halves
+		if(bhdr.len <= dev->atomic_size && globalfifo_ring_room(&dev->ring) < bhdr.len)
+			n = 0;
+		else
+			n = globalfifo_ring_put(&dev->ring, best->buf + best->pos + sizeof(bhdr), bhdr.len);
+		drained += n;
+		if(n < bhdr.len){
+			//the ring is full, the rest of the record waits for a reader, see globalfifo_read
+			bhdr.len -= n;
+			best->pos += n;
+			memcpy(best->buf + best->pos, &bhdr, sizeof(bhdr));
+			done = bhdr.seq;
+			break;
+		}
+		best->pos += sizeof(bhdr) + bhdr.len;
+	}
+	if(drained){
+		globalfifo_lat_enqueue(dev, drained); //timed from the drain, not from the staging write
+		dev->stats.bytes_written += drained;
+		dev->stats.wb_batches++;
+		globalfifo_note_arrival(dev);
+	}
+	WRITE_ONCE(dev->wb_done, done);
+	wake = drained && globalfifo_ring_readable(&dev->ring, dev->read_wm);
+	globalfifo_unlock(dev);
+
+	for(i = 0; i < nr_active; i++){
+		st = dev->wb_active[i];
+		mutex_lock(&st->lock);
+		memmove(st->buf, st->buf + st->pos, st->len - st->pos);
+		st->len -= st->pos;
+		st->pos = st->end = 0;
+		mutex_unlock(&st->lock);
+	}
+
+	if(wake){
+		wake_up_interruptible(&dev->r_wait);
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+	}
+	wake_up_interruptible(&dev->wb_wait);
+}
+
+//wait until everything this file staged is in the ring, readers may still have to make room for it
+static int globalfifo_wb_barrier(struct globalfifo_dev *dev, struct globalfifo_file *gf){
+	u64 last = READ_ONCE(gf->wb_last);
+
+	if(READ_ONCE(dev->wb_done) >= last)
+		return 0;
+	queue_work(system_highpri_wq, &dev->wb_work);
+	return wait_event_interruptible(dev->wb_wait, READ_ONCE(dev->wb_done) >= last);
+}
+
+static int globalfifo_fsync(struct file *filp, loff_t start, loff_t end, int datasync){
+	struct globalfifo_file *gf = filp->private_data;
+
+	return globalfifo_wb_barrier(gf->dev, gf);
+}
+
+/*****************filters******************/
+//a reader can attach a classic BPF program, like SO_ATTACH_FILTER, run on every record before the
+//reader is woken for it or it is handed out. it returns how many bytes of the record to keep, 0 skips it.
+//loads are big endian and a load past the end of the record skips it, as on a socket
+static u32 globalfifo_filter_run(struct globalfifo_rec *rec, struct globalfifo_filter *f, const u8 *data, u32 len){
+	struct sk_buff *skb;
+	u32 ret;
+
+	//writers on every CPU run filters at once, the skb is the CPU's
+	preempt_disable();
+	skb = *this_cpu_ptr(rec->skb);
+	skb_trim(skb, 0);
+	skb_put_data(skb, data, len);
+	ret = bpf_prog_run(f->prog, skb);
+	preempt_enable();
+	return ret;
+}
+
+static void globalfifo_filter_free(struct globalfifo_filter *f){
+	if(!f)
+		return;
+	if(f->prog)
+		bpf_prog_destroy(f->prog);
+	kfree(f);
+}
+
+static void globalfifo_filter_free_rcu(struct rcu_head *head){
+	globalfifo_filter_free(container_of(head, struct globalfifo_filter, rcu));
+}
+
+//attach a program to gf, or detach with len 0. the counters start over.
+//records only exist in recorder mode, a fifo has nothing to run it on
+static int globalfifo_set_filter(struct globalfifo_file *gf, struct sock_fprog __user *argp){
+	struct globalfifo_filter *f = NULL, *old;
+	struct sock_fprog fprog;
+	int ret;
+
+	if(copy_from_user(&fprog, argp, sizeof(fprog)))
+		return -EFAULT;
+	if(fprog.len){
+		if(!rcu_access_pointer(gf->dev->rec))
+			return -EOPNOTSUPP;
+		f = kzalloc(sizeof(*f), GFP_KERNEL);
+		if(!f)
+			return -ENOMEM;
+		//checked with bpf_check_classic() and translated to eBPF, JITed where the kernel does that
+		ret = bpf_prog_create_from_user(&f->prog, &fprog, NULL, false);
+		if(ret)
+			goto fail;
+	}
+
+	mutex_lock(&gf->rec_lock);
+	old = rcu_replace_pointer(gf->filter, f, lockdep_is_held(&gf->rec_lock));
+	mutex_unlock(&gf->rec_lock);
+	if(old)
+		call_rcu(&old->rcu, globalfifo_filter_free_rcu); //a writer may be running it
+	return 0;
+
+fail:
+	globalfifo_filter_free(f);
+	return ret;
+}
+
+static int globalfifo_get_filter_stats(struct globalfifo_file *gf, struct globalfifo_filter_stats __user *argp){
+	struct globalfifo_filter_stats st = {};
+	struct globalfifo_filter *f;
+
+	mutex_lock(&gf->rec_lock);
+	f = rcu_dereference_protected(gf->filter, lockdep_is_held(&gf->rec_lock));
+	if(f){
+		st.hits = f->hits;
+		st.misses = f->misses;
+	}
+	mutex_unlock(&gf->rec_lock);
+	if(!f)
+		return -ENOENT;
+	return copy_to_user(argp, &st, sizeof(st)) ? -EFAULT : 0;
+}
+
+/*****************recorder******************/
+static void globalfifo_rec_free(struct globalfifo_rec *rec){
+	int cpu;
+
+	if(!rec)
+		return;
+	if(rec->skb){
+		for_each_possible_cpu(cpu)
+			kfree_skb(*per_cpu_ptr(rec->skb, cpu));
+		free_percpu(rec->skb);
+	}
+	kvfree(rec);
+}
+
+//a sleeping writer is the wrong trade-off for telemetry: in recorder mode write() never waits,
+//the oldest records are overwritten and the readers are told how many they missed
+static struct globalfifo_rec *globalfifo_rec_alloc(unsigned int size){
+	struct globalfifo_rec *rec;
+	unsigned int n = size / sizeof(struct globalfifo_rec_slot);
+	int cpu;
+
+	//about as much memory as the fifo
+	n = n < GLOBALFIFO_REC_MIN_SLOTS ? GLOBALFIFO_REC_MIN_SLOTS : rounddown_pow_of_two(n);
+	rec = kvzalloc(struct_size(rec, slot, n), GFP_KERNEL);
+	if(!rec)
+		return NULL;
+	rec->mask = n - 1;
+	rec->skb = alloc_percpu(struct sk_buff *);
+	if(!rec->skb)
+		goto fail;
+	for_each_possible_cpu(cpu){
+		*per_cpu_ptr(rec->skb, cpu) = alloc_skb(GLOBALFIFO_REC_MAX, GFP_KERNEL);
+		if(!*per_cpu_ptr(rec->skb, cpu))
+			goto fail;
+	}
+	return rec;
+
+fail:
+	globalfifo_rec_free(rec);
+	return NULL;
+}
+
+//wake the files blocked in a recorder read for a record, those whose filter skips it sleep on.
+//NULL data wakes them all
+static void globalfifo_rec_wake_readers(struct globalfifo_dev *dev, struct globalfifo_rec *rec,
+		const u8 *data, u32 len){
+	struct globalfifo_file *gf;
+	struct globalfifo_filter *f;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(gf, &dev->rec_readers, rec_node){
+		if(!wq_has_sleeper(&gf->rec_wait))
+			continue;
+		f = rcu_dereference(gf->filter);
+		if(data && f && !globalfifo_filter_run(rec, f, data, len))
+			continue;
+		wake_up_interruptible(&gf->rec_wait);
+	}
+	rcu_read_unlock();
+}
+
+//switch between fifo and recorder mode. the fifo keeps its data, the records are dropped
+static int globalfifo_set_recorder(struct globalfifo_dev *dev, bool on){
+	struct globalfifo_rec *rec = NULL, *old;
+
+	if(on){
+		rec = globalfifo_rec_alloc(READ_ONCE(dev->ring.size));
+		if(!rec)
+			return -ENOMEM;
+	}
+
+	globalfifo_lock(dev);
+	old = rcu_dereference_protected(dev->rec, lockdep_is_held(&dev->mutex));
+	if(on && old){
+		globalfifo_unlock(dev);
+		globalfifo_rec_free(rec);
+		return 0;
+	}
+	if(rec)
+		rec->gen = ++dev->rec_gen;
+	rcu_assign_pointer(dev->rec, rec);
+	globalfifo_unlock(dev);
+
+	if(old){
+		//writers and readers only sleep in copy_*_user under the srcu
+		synchronize_srcu(&globalfifo_rec_srcu);
+		globalfifo_rec_free(old);
+	}
+	//sleepers go over to the new mode, writers on a full fifo never block in a recorder
+	wake_up_interruptible(&dev->r_wait);
+	wake_up_interruptible(&dev->w_wait);
+	globalfifo_rec_wake_readers(dev, NULL, NULL, 0);
+	return 0;
+}
+
+//one record, always accepted. from the seq to the stamp nothing sleeps or waits for another task:
+//a slot still busy with the writer of an older lap costs this record instead
+static ssize_t globalfifo_rec_write(struct globalfifo_dev *dev, struct globalfifo_rec *rec,
+		const char __user *buf, size_t count){
+	unsigned char tmp[GLOBALFIFO_REC_MAX];
+	struct globalfifo_rec_slot *slot;
+	bool dropped = false, newest;
+	u64 seq, old;
+
+	if(count > GLOBALFIFO_REC_MAX)
+		return -EMSGSIZE;
+	if(copy_from_user(tmp, buf, count))
+		return -EFAULT;
+
+	//no preemption while the slot is busy, a lap of the ring takes far longer than this
+	preempt_disable();
+	seq = atomic64_fetch_inc(&rec->next);
+	slot = &rec->slot[seq & rec->mask];
+	old = atomic64_read(&slot->stamp);
+	if(!(old & 1) && old < 2 * seq + 1 && atomic64_try_cmpxchg(&slot->stamp, &old, 2 * seq + 1)){
+		memcpy(slot->data, tmp, count);
+		slot->len = count;
+		atomic64_set_release(&slot->stamp, 2 * seq + 2);
+	} else{
+		//tell the readers not to wait for seq. only other droppers of this slot can make us retry
+		dropped = true;
+		old = atomic64_read(&slot->skip);
+		while(old <= seq && !atomic64_try_cmpxchg(&slot->skip, &old, seq + 1))
+			;
+	}
+	preempt_enable();
+
+	if(wq_has_sleeper(&dev->r_wait))
+		wake_up_interruptible(&dev->r_wait); //pollers
+	//blocked readers are only woken for a record their filter keeps. a dropped one wakes them all, and so
+	//does one a newer seq was taken behind: a reader stuck on it while the newer one finished needs the wake
+	smp_mb(); //our stamp before the look at next, a newer writer's wake may have found it busy
+	newest = atomic64_read(&rec->next) == seq + 1;
+	globalfifo_rec_wake_readers(dev, rec, dropped || !newest ? NULL : tmp, count);
+	return count;
+}
+
+enum{
+	GLOBALFIFO_REC_READY,
+	GLOBALFIFO_REC_BUSY, //its writer is not done yet
+	GLOBALFIFO_REC_LOST, //overwritten, or dropped by its writer
+};
+
+static int globalfifo_rec_state(struct globalfifo_rec_slot *slot, u64 seq, u64 *stamp){
+	*stamp = atomic64_read_acquire(&slot->stamp);
+	if(*stamp == 2 * seq + 2)
+		return GLOBALFIFO_REC_READY;
+	if(*stamp > 2 * seq + 2)
+		return GLOBALFIFO_REC_LOST;
+	if(*stamp == 2 * seq + 1)
+		return GLOBALFIFO_REC_BUSY;
+	//an older lap, the writer of seq has yet to claim the slot or gave up on it
+	return atomic64_read(&slot->skip) > seq ? GLOBALFIFO_REC_LOST : GLOBALFIFO_REC_BUSY;
+}
+
+//move the cursor of gf into the ring: a new recorder starts at its oldest record,
+//and what was overwritten since the last read counts as lost
+static void globalfifo_rec_sync(struct globalfifo_dev *dev, struct globalfifo_rec *rec,
+		struct globalfifo_file *gf, u64 head){
+	u64 oldest = head > rec->mask + 1 ? head - rec->mask - 1 : 0;
+
+	if(gf->rec_gen != rec->gen){
+		gf->rec_gen = rec->gen;
+		gf->rec_next = oldest;
+		gf->rec_lost = 0;
+	} else if(gf->rec_next < oldest){
+		gf->rec_lost += oldest - gf->rec_next;
+		atomic64_add(oldest - gf->rec_next, &dev->rec_lost);
+		gf->rec_next = oldest;
+	}
+}
+
+//the next record for gf that its filter lets through, copied to tmp. the cursor stays on it,
+//lost and filtered records before it are passed. false when it isn't there yet. under rec_lock
+static bool globalfifo_rec_next(struct globalfifo_dev *dev, struct globalfifo_rec *rec,
+		struct globalfifo_file *gf, u8 *tmp, u32 *len){
+	struct globalfifo_filter *f = rcu_dereference_protected(gf->filter, lockdep_is_held(&gf->rec_lock));
+	struct globalfifo_rec_slot *slot;
+	u64 head, stamp;
+	u32 keep;
+	int state;
+
+	while(1){
+		head = atomic64_read(&rec->next);
+		globalfifo_rec_sync(dev, rec, gf, head);
+		if(gf->rec_next == head)
+			return false;
+
+		slot = &rec->slot[gf->rec_next & rec->mask];
+		state = globalfifo_rec_state(slot, gf->rec_next, &stamp);
+		if(state == GLOBALFIFO_REC_BUSY)
+			return false;
+		if(state == GLOBALFIFO_REC_READY){
+			*len = min_t(u32, READ_ONCE(slot->len), GLOBALFIFO_REC_MAX);
+			memcpy(tmp, slot->data, *len);
+			smp_rmb(); //the copy is done before the stamp is checked again
+			if(atomic64_read(&slot->stamp) != stamp)
+				state = GLOBALFIFO_REC_LOST; //a writer lapped us while we copied
+		}
+		if(state == GLOBALFIFO_REC_LOST){
+			gf->rec_lost++;
+			atomic64_inc(&dev->rec_lost);
+			gf->rec_next++;
+			continue;
+		}
+		if(!f)
+			return true;
+		keep = globalfifo_filter_run(rec, f, tmp, *len);
+		if(keep){
+			*len = min(*len, keep); //counted as a hit once it is handed out
+			return true;
+		}
+		f->misses++;
+		gf->rec_next++;
+	}
+}
+
+//whole records from the cursor of gf, -EAGAIN when the next one isn't there yet
+static ssize_t globalfifo_rec_read(struct globalfifo_dev *dev, struct globalfifo_rec *rec,
+		struct globalfifo_file *gf, char __user *buf, size_t count){
+	unsigned char tmp[GLOBALFIFO_REC_MAX];
+	struct globalfifo_rec_hdr hdr;
+	struct globalfifo_filter *f;
+	size_t done = 0, off;
+	ssize_t ret = 0;
+
+	mutex_lock(&gf->rec_lock);
+	f = rcu_dereference_protected(gf->filter, lockdep_is_held(&gf->rec_lock));
+	while(globalfifo_rec_next(dev, rec, gf, tmp, &hdr.len)){
+		off = ALIGN(done, GLOBALFIFO_REC_ALIGN);
+		if(off + sizeof(hdr) + hdr.len > count){
+			if(!done)
+				ret = -EINVAL; //too small for the next record, like inotify
+			break;
+		}
+		hdr.seq = gf->rec_next;
+		hdr.lost = min_t(u64, gf->rec_lost, U32_MAX);
+		if(copy_to_user(buf + off, &hdr, sizeof(hdr)) || copy_to_user(buf + off + sizeof(hdr), tmp, hdr.len)){
+			ret = -EFAULT;
+			break;
+		}
+		if(f)
+			f->hits++;
+		gf->rec_lost = 0;
+		gf->rec_next++;
+		done = off + sizeof(hdr) + hdr.len;
+	}
+	mutex_unlock(&gf->rec_lock);
+
+	if(done)
+		return done;
+	return ret ? ret : -EAGAIN;
+}
+
+//readable for poll: filtered records are passed here, so they don't make it return
+static bool globalfifo_rec_poll(struct globalfifo_dev *dev, struct globalfifo_rec *rec, struct globalfifo_file *gf){
+	unsigned char tmp[GLOBALFIFO_REC_MAX];
+	bool ret;
+	u32 len;
+
+	mutex_lock(&gf->rec_lock);
+	ret = globalfifo_rec_next(dev, rec, gf, tmp, &len);
+	mutex_unlock(&gf->rec_lock);
+	return ret;
+}
+
+//for the sleeping reader, which can't take rec_lock. a hint, the read rechecks under it
+static bool globalfifo_rec_readable(struct globalfifo_rec *rec, struct globalfifo_file *gf){
+	u64 head = atomic64_read(&rec->next), next = data_race(READ_ONCE(gf->rec_next)), stamp;
+
+	if(data_race(READ_ONCE(gf->rec_gen)) != rec->gen)
+		return head != 0;
+	if(next >= head)
+		return false;
+	if(head - next > rec->mask + 1)
+		return true;
+	return globalfifo_rec_state(&rec->slot[next & rec->mask], next, &stamp) != GLOBALFIFO_REC_BUSY;
+}
+
+//true when a recorder read has something, or the device went back to fifo mode
+static bool globalfifo_rec_wake(struct globalfifo_dev *dev, struct globalfifo_file *gf){
+	struct globalfifo_rec *rec;
+	bool ret;
+	int idx;
+
+	idx = srcu_read_lock(&globalfifo_rec_srcu);
+	rec = srcu_dereference(dev->rec, &globalfifo_rec_srcu);
+	ret = !rec || globalfifo_rec_readable(rec, gf);
+	srcu_read_unlock(&globalfifo_rec_srcu, idx);
+	return ret;
+}
+
+//sleep until a record gf's filter keeps may be there, or the mode changed. the first time gf is put on
+//rec_readers, where the writers look for it, and it stays there until release
+static int globalfifo_rec_wait(struct globalfifo_dev *dev, struct globalfifo_file *gf){
+	spin_lock(&dev->rec_readers_lock);
+	if(list_empty(&gf->rec_node))
+		list_add_tail_rcu(&gf->rec_node, &dev->rec_readers);
+	spin_unlock(&dev->rec_readers_lock);
+	return wait_event_interruptible(gf->rec_wait, globalfifo_rec_wake(dev, gf));
+}
+
 static int globalfifo_fasync(int fd, struct file *filp, int mode){
-	struct globalfifo_dev *dev = filp->private_data;
+	struct globalfifo_file *gf = filp->private_data;
+	struct globalfifo_dev *dev = gf->dev;
 	return fasync_helper(fd, filp, mode, &dev->async_queue); //setup asynchronous for the dev
 }
 
+//everything but the allocation, shared with the KUnit suite
+static void globalfifo_file_init(struct globalfifo_file *gf, struct globalfifo_dev *dev){
+	gf->dev = dev;
+	gf->busy_poll_us = min(READ_ONCE(globalfifo_busy_poll), GLOBALFIFO_BUSY_POLL_MAX);
+	mutex_init(&gf->rec_lock);
+	init_waitqueue_head(&gf->rec_wait);
+	INIT_LIST_HEAD(&gf->rec_node);
+}
+
+//off rec_readers and the filter gone, gf itself has to outlive the writers' rcu walk
+static void globalfifo_file_release(struct globalfifo_file *gf){
+	struct globalfifo_filter *f = rcu_dereference_protected(gf->filter, true); //no other user left
+
+	spin_lock(&gf->dev->rec_readers_lock);
+	if(!list_empty(&gf->rec_node))
+		list_del_rcu(&gf->rec_node);
+	spin_unlock(&gf->dev->rec_readers_lock);
+	if(f)
+		call_rcu(&f->rcu, globalfifo_filter_free_rcu);
+}
+
 static int globalfifo_open(struct inode *inode, struct file *filp){
-	filp->private_data = globalfifo_devp;
+	struct globalfifo_file *gf;
+
+	gf = kzalloc(sizeof(*gf), GFP_KERNEL);
+	if(!gf)
+		return -ENOMEM;
+	globalfifo_file_init(gf, globalfifo_devp);
+	filp->private_data = gf;
 	return 0;
 }
 
 static int globalfifo_release(struct inode *inode, struct file *filp){
+	struct globalfifo_file *gf = filp->private_data;
+
 	globalfifo_fasync(-1, filp, 0);
+	globalfifo_file_release(gf);
+	kfree_rcu(gf, rcu);
 	return 0;
 }
 
+//n bytes left the ring through read or GLOBALFIFO_COMMIT, the caller holds the mutex
+static void globalfifo_consumed(struct globalfifo_dev *dev, unsigned int n){
+	globalfifo_lat_dequeue(dev, n);
+	globalfifo_fold_inject(dev); //room was made, pull in what the kernel producers queued
+	dev->stats.bytes_read += n;
+	dev->stats.reads++;
+
+	if(globalfifo_ring_writable(&dev->ring, dev->write_wm))
+		wake_up_interruptible(&dev->w_wait);
+	if(globalfifo_wb_pending(dev))
+		queue_work(system_highpri_wq, &dev->wb_work); //staged records may have waited for this room
+}
+
+//two-phase consume: look at the data with PEEK or in the mapping, then COMMIT what was handled
+static long globalfifo_peek(struct globalfifo_dev *dev, struct globalfifo_peek __user *argp){
+	struct globalfifo_peek pk;
+	long ret;
+
+	if(copy_from_user(&pk, argp, sizeof(pk)))
+		return -EFAULT;
+	globalfifo_lock(dev);
+	globalfifo_fold_inject(dev);
+	ret = globalfifo_ring_peek(&dev->ring, u64_to_user_ptr(pk.buf), pk.len, pk.skip);
+	globalfifo_unlock(dev);
+	return ret;
+}
+
+static long globalfifo_commit(struct globalfifo_dev *dev, u32 n){
+	globalfifo_lock(dev);
+	if(n > dev->ring.len){
+		globalfifo_unlock(dev);
+		return -EINVAL;
+	}
+	if(n){
+		globalfifo_ring_consume(&dev->ring, n);
+		globalfifo_consumed(dev, n);
+	}
+	globalfifo_unlock(dev);
+	return 0;
+}
+
+static long globalfifo_get_ring(struct globalfifo_dev *dev, struct globalfifo_ring_pos __user *argp){
+	struct globalfifo_ring_pos pos = {};
+
+	globalfifo_lock(dev);
+	globalfifo_fold_inject(dev);
+	pos.head = dev->ring.head;
+	pos.len = dev->ring.len;
+	pos.size = dev->ring.size;
+	globalfifo_unlock(dev);
+	return copy_to_user(argp, &pos, sizeof(pos)) ? -EFAULT : 0;
+}
+
 static long globalfifo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
-	struct globalfifo_dev *dev = filp->private_data;
+	struct globalfifo_file *gf = filp->private_data;
+	struct globalfifo_dev *dev = gf->dev;
+	u32 us;
 
 	switch(cmd){
 	case FIFO_CLEAR:
-		mutex_lock(&dev->mutex);
-		dev->current_len = 0;
-		memset(dev->mem, 0, GLOBALFIFO_SIZE);
-		mutex_unlock(&dev->mutex);
+		globalfifo_lock(dev);
+		globalfifo_ring_clear(&dev->ring);
+		globalfifo_lat_restart(dev);
+		globalfifo_unlock(dev);
+		wake_up_interruptible(&dev->w_wait);
 
 		printk(KERN_INFO "globalfifo is set to zero\n");
 		break;
+	case GLOBALFIFO_SET_BUSY_POLL:
+		if(get_user(us, (u32 __user *)arg))
+			return -EFAULT;
+		if(us > GLOBALFIFO_BUSY_POLL_MAX)
+			return -EINVAL;
+		WRITE_ONCE(gf->busy_poll_us, us);
+		break;
+	case GLOBALFIFO_GET_BUSY_POLL:
+		return put_user(READ_ONCE(gf->busy_poll_us), (u32 __user *)arg);
+	case GLOBALFIFO_WB_BARRIER:
+		return globalfifo_wb_barrier(dev, gf);
+	case GLOBALFIFO_PEEK:
+		return globalfifo_peek(dev, (struct globalfifo_peek __user *)arg);
+	case GLOBALFIFO_COMMIT:
+		if(get_user(us, (u32 __user *)arg))
+			return -EFAULT;
+		return globalfifo_commit(dev, us);
+	case GLOBALFIFO_GET_RING:
+		return globalfifo_get_ring(dev, (struct globalfifo_ring_pos __user *)arg);
+	case GLOBALFIFO_SET_FILTER:
+		return globalfifo_set_filter(gf, (struct sock_fprog __user *)arg);
+	case GLOBALFIFO_GET_FILTER_STATS:
+		return globalfifo_get_filter_stats(gf, (struct globalfifo_filter_stats __user *)arg);
 	default:
 		return -EINVAL;
 	}
@@ -69,44 +1093,150 @@ static long globalfifo_ioctl(struct file *filp, unsigned int cmd, unsigned long
 	return 0;
 }
 
+static void globalfifo_vma_open(struct vm_area_struct *vma){
+	struct globalfifo_dev *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->mapped);
+}
+
+static void globalfifo_vma_close(struct vm_area_struct *vma){
+	struct globalfifo_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->mapped);
+}
+
+static const struct vm_operations_struct globalfifo_vm_ops = {
+	.open = globalfifo_vma_open,
+	.close = globalfifo_vma_close,
+};
+
+//map the ring read-only, so a consumer can parse the data in place. GLOBALFIFO_GET_RING says
+//where it is, GLOBALFIFO_COMMIT releases it. the capacity is fixed while it is mapped
+static int globalfifo_mmap(struct file *filp, struct vm_area_struct *vma){
+	struct globalfifo_file *gf = filp->private_data;
+	struct globalfifo_dev *dev = gf->dev;
+	int ret;
+
+	if(vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE); //no mprotect(PROT_WRITE) later
+
+	mutex_lock(&dev->map_lock);
+	ret = dev->resizing ? -EBUSY : remap_vmalloc_range(vma, dev->ring.mem, vma->vm_pgoff);
+	if(!ret){
+		vma->vm_private_data = dev;
+		vma->vm_ops = &globalfifo_vm_ops;
+		atomic_inc(&dev->mapped);
+	}
+	mutex_unlock(&dev->map_lock);
+	return ret;
+}
+
 static unsigned int globalfifo_poll(struct file *filp, poll_table *wait){
 	unsigned int mask = 0;
-	struct globalfifo_dev *dev = filp->private_data;
+	struct globalfifo_file *gf = filp->private_data;
+	struct globalfifo_dev *dev = gf->dev;
+	struct globalfifo_rec *rec;
+	int idx;
 
-	mutex_lock(&dev->mutex);
+	idx = srcu_read_lock(&globalfifo_rec_srcu);
+	rec = srcu_dereference(dev->rec, &globalfifo_rec_srcu);
+	if(rec){
+		//a recorder is always writable
+		poll_wait(filp, &dev->r_wait, wait);
+		mask = POLLOUT | POLLWRNORM;
+		if(globalfifo_rec_poll(dev, rec, gf))
+			mask |= POLLIN | POLLRDNORM;
+		srcu_read_unlock(&globalfifo_rec_srcu, idx);
+		return mask;
+	}
+	srcu_read_unlock(&globalfifo_rec_srcu, idx);
+
+	globalfifo_lock(dev);
 	poll_wait(filp, &dev->r_wait, wait);
 	poll_wait(filp, &dev->w_wait, wait);
-	if(dev->current_len != 0){
+	globalfifo_fold_inject(dev);
+	if(globalfifo_ring_readable(&dev->ring, dev->read_wm)){
 		mask |= POLLIN | POLLRDNORM;
 	}
-	if(dev->current_len != GLOBALFIFO_SIZE){
+	//like a pipe, writable means an atomic write of any size fits
+	if(globalfifo_ring_writable(&dev->ring, max(dev->write_wm, dev->atomic_size))){
 		mask |= POLLOUT | POLLWRNORM;
 	}
 
-	mutex_unlock(&dev->mutex);
+	globalfifo_unlock(dev);
 	return mask;
 }
 
 
 static ssize_t globalfifo_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos){
 	int ret;
-	struct globalfifo_dev *dev = filp->private_data;
+	struct globalfifo_file *gf = filp->private_data;
+	struct globalfifo_dev *dev = gf->dev;
+	struct globalfifo_rec *rec;
+	bool spun = false;
+	u64 spin_ns, t;
+	int idx;
 	DECLARE_WAITQUEUE(wait, current); //create a wiate queue for the current task
 
-	mutex_lock(&dev->mutex);
+again:
+	while(1){
+		idx = srcu_read_lock(&globalfifo_rec_srcu);
+		rec = srcu_dereference(dev->rec, &globalfifo_rec_srcu);
+		ret = rec ? globalfifo_rec_read(dev, rec, gf, buf, count) : 0;
+		srcu_read_unlock(&globalfifo_rec_srcu, idx);
+		if(!rec)
+			break;
+		if(ret != -EAGAIN || (filp->f_flags & O_NONBLOCK))
+			return ret;
+		//not under the srcu, switching the mode back waits for it
+		if(globalfifo_rec_wait(dev, gf))
+			return -ERESTARTSYS;
+	}
+
+	globalfifo_lock(dev);
 	add_wait_queue(&dev->r_wait, &wait);
 
-	while(dev->current_len == 0){ //nothing to read
+	globalfifo_fold_inject(dev);
+	//a blocking reader waits for the low watermark, or for all it asked for if that is less
+	while(dev->ring.len < globalfifo_ring_read_need(dev->read_wm, count)){
 		if(filp->f_flags & O_NONBLOCK){
+			if(dev->ring.len)
+				break;
 			ret = -EAGAIN;
 			goto out;
 		}
 
+		//busy poll once per read, the sleep/wake round trip costs more than a short spin
+		spin_ns = spun ? 0 : globalfifo_spin_ns(dev, gf);
+		if(spin_ns){
+			bool hit;
+
+			spun = true;
+			globalfifo_unlock(dev);
+			hit = globalfifo_busy_poll(dev, spin_ns, globalfifo_ring_read_need(dev->read_wm, count));
+			globalfifo_lock(dev);
+			if(hit){
+				dev->stats.busy_poll_hits++;
+				globalfifo_fold_inject(dev);
+				continue;
+			}
+			dev->stats.busy_poll_misses++;
+		}
+		dev->stats.read_sleeps++;
+
 		//the device is IO block, but there is nothing to read now
-		__set_current_state(TASK_INTERRUPTIBLE);
-		mutex_unlock(&dev->mutex);
+		set_current_state(TASK_INTERRUPTIBLE);
+		globalfifo_unlock(dev);
 
-		schedule(); //quit CPU, sleep
+		//in-kernel producers don't take the mutex, recheck now that the state is set
+		t = globalfifo_lat_now();
+		if(kfifo_is_empty(&dev->inject))
+			schedule(); //quit CPU, sleep
+		else
+			__set_current_state(TASK_RUNNING);
+		if(t)
+			t = ktime_get_ns() - t;
 		//wake up from sleep
 		if(signal_pending(current)){ //check whether there is a signal to be solve.
 			//signal is activated restart the read function
@@ -114,28 +1244,28 @@ static ssize_t globalfifo_read(struct file *filp, char __user *buf, size_t count
 			goto out2;
 		}
 		// no signal, process the unfinished function
-		mutex_lock(&dev->mutex);
-	}
-
-	if(count > dev->current_len){
-		count = dev->current_len;
+		globalfifo_lock(dev);
+		if(t)
+			globalfifo_hist_add(dev, GLOBALFIFO_LAT_READ_BLOCK, t);
+		//the device went over to recorder mode while we slept
+		if(rcu_access_pointer(dev->rec)){
+			globalfifo_unlock(dev);
+			remove_wait_queue(&dev->r_wait, &wait);
+			goto again;
+		}
+		globalfifo_fold_inject(dev);
 	}
 
-	if(copy_to_user(buf, dev->mem, count)){
+	ret = globalfifo_ring_read(&dev->ring, buf, count);
+	if(ret < 0){
 		//unsuccess, copy_to_user return non-zero
-		ret = -EFAULT;
 		goto out;
 	} else{
-		memcpy(dev->mem, dev->mem+count, dev->current_len - count); //fifo
-		dev->current_len -= count;
-		printk(KERN_INFO "read %d bytes, current_len: %d\n", count, dev->current_len);
-
-		wake_up_interruptible(&dev->w_wait);
-		ret = count;
+		globalfifo_consumed(dev, ret);
 	}
 
 out:
-	mutex_unlock(&dev->mutex);
+	globalfifo_unlock(dev);
 out2:
 	remove_wait_queue(&dev->r_wait, &wait);
 	set_current_state(TASK_RUNNING);
@@ -144,22 +1274,63 @@ out2:
 
 
 static ssize_t globalfifo_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos){
-	struct globalfifo_dev *dev = filp->private_data;
-	int ret;
+	struct globalfifo_file *gf = filp->private_data;
+	struct globalfifo_dev *dev = gf->dev;
+	struct globalfifo_rec *rec;
+	int ret, idx;
+	u64 t;
 	DECLARE_WAITQUEUE(wait, current);
 
-	mutex_lock(&dev->mutex);
+again:
+	idx = srcu_read_lock(&globalfifo_rec_srcu);
+	rec = srcu_dereference(dev->rec, &globalfifo_rec_srcu);
+	if(rec)
+		ret = globalfifo_rec_write(dev, rec, buf, count);
+	srcu_read_unlock(&globalfifo_rec_srcu, idx);
+	if(rec)
+		return ret;
+
+	if(smp_load_acquire(&dev->write_behind)){
+		ret = globalfifo_stage_write(dev, gf, buf, count);
+		if(ret != -ENOSPC)
+			return ret;
+		//the shard is full, write through below once our own records are out
+	}
+	//staged data of this file goes first, also when write-behind was just turned off
+	if(READ_ONCE(gf->wb_last) > READ_ONCE(dev->wb_done)){
+		if(filp->f_flags & O_NONBLOCK){
+			queue_work(system_highpri_wq, &dev->wb_work);
+			return -EAGAIN;
+		}
+		ret = globalfifo_wb_barrier(dev, gf);
+		if(ret)
+			return ret;
+	}
+
+	globalfifo_lock(dev);
 	add_wait_queue(&dev->w_wait, &wait);
 
-	while(dev->current_len == GLOBALFIFO_SIZE){ //no mem to write
+	//a blocking writer waits for the high watermark of room, or for all it wants to write if that is less.
+	//an atomic write waits for all of its room
+	while(globalfifo_ring_room(&dev->ring) < globalfifo_ring_write_need(count, dev->write_wm, dev->atomic_size)){
+		//the mode is switched under the mutex, a writer that was waiting for room takes the recorder path
+		if(rcu_access_pointer(dev->rec)){
+			globalfifo_unlock(dev);
+			remove_wait_queue(&dev->w_wait, &wait);
+			goto again;
+		}
 		if(filp->f_flags & O_NONBLOCK){ //non-block IO
+			if(globalfifo_ring_room(&dev->ring) && count > dev->atomic_size)
+				break;
 			ret = -EAGAIN;
 			goto out;
 		}
+		dev->stats.write_sleeps++;
 
 		__set_current_state(TASK_INTERRUPTIBLE);
-		mutex_unlock(&dev->mutex);
+		globalfifo_unlock(dev);
 
+		t = globalfifo_lat_now();
 		schedule();
 		if(signal_pending(current)){
 			//if there is a signal to be solved, restart the function to check the device availbility
@@ -167,31 +1338,32 @@ static ssize_t globalfifo_write(struct file *filp, const char __user *buf, size_
 			goto out2;
 		}
 
-		mutex_lock(&dev->mutex);
-	}
-
-	if(count > GLOBALFIFO_SIZE - dev->current_len){
-		count = GLOBALFIFO_SIZE - dev->current_len;
+		if(t)
+			t = ktime_get_ns() - t;
+		globalfifo_lock(dev);
+		if(t)
+			globalfifo_hist_add(dev, GLOBALFIFO_LAT_WRITE_BLOCK, t);
 	}
 
-	if(copy_from_user(dev->mem + dev->current_len, buf, count)){ //fail
-		ret = -EFAULT;
+	ret = globalfifo_ring_write(&dev->ring, buf, count);
+	if(ret < 0){ //fail
 		goto out;
 	} else{ //success, fifo
-		dev->current_len += count;
-		printk(KERN_INFO "written %d bytes, current_len: %d\n", count, dev->current_len);
-		wake_up_interruptible(&dev->r_wait);
+		count = ret;
+		globalfifo_lat_enqueue(dev, count);
+		dev->stats.bytes_written += count;
+		dev->stats.writes++;
+		globalfifo_note_arrival(dev);
 
-		if(dev->async_queue){
-			kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
-			printk(KERN_DEBUG, "%s kill SIGIO\n", __func__);
+		if(globalfifo_ring_readable(&dev->ring, dev->read_wm)){
+			wake_up_interruptible(&dev->r_wait);
+			if(dev->async_queue)
+				kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
 		}
-
-		ret = count;
 	}
 
 out:
-	mutex_unlock(&dev->mutex);
+	globalfifo_unlock(dev);
 out2:
 	remove_wait_queue(&dev->w_wait, &wait);
 	set_current_state(TASK_RUNNING);
@@ -199,6 +1371,332 @@ out2:
 }
 
 
+/*****************sysfs attributes**************/
+//tunables under /sys/class/globalfifo_async/global_fifo/, applied under the mutex so no data is lost
+static ssize_t capacity_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->ring.size));
+}
+
+//grow or shrink the buffer, the bytes queued are kept, so it can't go below current_len
+static ssize_t capacity_store(struct device *d, struct device_attribute *attr, const char *buf, size_t len){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+	unsigned char *mem, *old;
+	unsigned int size;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &size);
+	if(ret)
+		return ret;
+	if(!size || size > GLOBALFIFO_MAX_SIZE)
+		return -EINVAL;
+
+	mem = vmalloc_user(size);
+	if(!mem)
+		return -ENOMEM;
+
+	mutex_lock(&dev->map_lock);
+	ret = atomic_read(&dev->mapped) || dev->resizing ? -EBUSY : 0;
+	dev->resizing = !ret;
+	mutex_unlock(&dev->map_lock);
+	if(ret){
+		vfree(mem);
+		return ret;
+	}
+
+	globalfifo_lock(dev);
+	if(size < dev->ring.len){
+		globalfifo_unlock(dev);
+		ret = -EBUSY;
+		vfree(mem);
+		goto out;
+	}
+	old = dev->ring.mem;
+	globalfifo_ring_move(&dev->ring, mem, size);
+	dev->read_wm = min(dev->read_wm, size);
+	dev->write_wm = min(dev->write_wm, size);
+	dev->atomic_size = min(dev->atomic_size, size);
+	globalfifo_unlock(dev);
+
+	vfree(old);
+	wake_up_interruptible(&dev->w_wait); //there may be more room now
+	ret = len;
+out:
+	mutex_lock(&dev->map_lock);
+	dev->resizing = false;
+	mutex_unlock(&dev->map_lock);
+	return ret;
+}
+static DEVICE_ATTR_RW(capacity);
+
+static ssize_t globalfifo_wm_store(struct globalfifo_dev *dev, unsigned int *wm, const char *buf, size_t len){
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if(ret)
+		return ret;
+
+	globalfifo_lock(dev);
+	if(!val || val > dev->ring.size){
+		globalfifo_unlock(dev);
+		return -EINVAL;
+	}
+	*wm = val;
+	globalfifo_unlock(dev);
+
+	//a lower watermark may already be met
+	wake_up_interruptible(&dev->r_wait);
+	wake_up_interruptible(&dev->w_wait);
+	return len;
+}
+
+static ssize_t read_watermark_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->read_wm));
+}
+
+static ssize_t read_watermark_store(struct device *d, struct device_attribute *attr, const char *buf, size_t len){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+
+	return globalfifo_wm_store(dev, &dev->read_wm, buf, len);
+}
+static DEVICE_ATTR_RW(read_watermark);
+
+static ssize_t write_watermark_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->write_wm));
+}
+
+static ssize_t write_watermark_store(struct device *d, struct device_attribute *attr, const char *buf, size_t len){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+
+	return globalfifo_wm_store(dev, &dev->write_wm, buf, len);
+}
+static DEVICE_ATTR_RW(write_watermark);
+
+static ssize_t atomic_size_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->atomic_size));
+}
+
+static ssize_t atomic_size_store(struct device *d, struct device_attribute *attr, const char *buf, size_t len){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if(ret)
+		return ret;
+
+	globalfifo_lock(dev);
+	if(val > dev->ring.size){
+		globalfifo_unlock(dev);
+		return -EINVAL;
+	}
+	dev->atomic_size = val;
+	globalfifo_unlock(dev);
+
+	//a smaller atomic size may let waiting writers in
+	wake_up_interruptible(&dev->w_wait);
+	return len;
+}
+static DEVICE_ATTR_RW(atomic_size);
+
+static ssize_t current_len_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->ring.len));
+}
+static DEVICE_ATTR_RO(current_len);
+
+//what the busy-poll heuristic currently believes, compare it with globalfifo_busy_poll
+static ssize_t arrival_gap_ns_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%llu\n", READ_ONCE(dev->gap_ewma_ns));
+}
+static DEVICE_ATTR_RO(arrival_gap_ns);
+
+static ssize_t write_behind_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%d\n", READ_ONCE(dev->write_behind));
+}
+
+static ssize_t write_behind_store(struct device *d, struct device_attribute *attr, const char *buf, size_t len){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+	bool on;
+	int ret;
+
+	ret = kstrtobool(buf, &on);
+	if(ret)
+		return ret;
+
+	globalfifo_lock(dev);
+	ret = on ? globalfifo_stage_alloc(dev) : 0;
+	if(!ret)
+		smp_store_release(&dev->write_behind, on); //the staging is ready before a writer sees the flag
+	globalfifo_unlock(dev);
+	if(ret)
+		return ret;
+
+	//leftovers go out now rather than with the next write
+	queue_work(system_highpri_wq, &dev->wb_work);
+	return len;
+}
+static DEVICE_ATTR_RW(write_behind);
+
+static ssize_t mode_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%s\n", rcu_access_pointer(dev->rec) ? "recorder" : "fifo");
+}
+
+static ssize_t mode_store(struct device *d, struct device_attribute *attr, const char *buf, size_t len){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+	int ret;
+
+	if(sysfs_streq(buf, "recorder"))
+		ret = globalfifo_set_recorder(dev, true);
+	else if(sysfs_streq(buf, "fifo"))
+		ret = globalfifo_set_recorder(dev, false);
+	else
+		ret = -EINVAL;
+	return ret ? ret : len;
+}
+static DEVICE_ATTR_RW(mode);
+
+static struct attribute *globalfifo_attrs[] = {
+	&dev_attr_capacity.attr,
+	&dev_attr_read_watermark.attr,
+	&dev_attr_write_watermark.attr,
+	&dev_attr_atomic_size.attr,
+	&dev_attr_current_len.attr,
+	&dev_attr_arrival_gap_ns.attr,
+	&dev_attr_write_behind.attr,
+	&dev_attr_mode.attr,
+	NULL,
+};
+
+static const struct attribute_group globalfifo_group = {
+	.attrs = globalfifo_attrs,
+};
+
+//one read-only file per counter in statistics/, like the net devices
+#define GLOBALFIFO_STAT_ATTR(_name)							\
+static ssize_t _name##_show(struct device *d, struct device_attribute *attr, char *buf){	\
+	struct globalfifo_dev *dev = dev_get_drvdata(d);				\
+										\
+	return sprintf(buf, "%llu\n", READ_ONCE(dev->stats._name));			\
+}										\
+static DEVICE_ATTR_RO(_name)
+
+GLOBALFIFO_STAT_ATTR(bytes_read);
+GLOBALFIFO_STAT_ATTR(bytes_written);
+GLOBALFIFO_STAT_ATTR(reads);
+GLOBALFIFO_STAT_ATTR(writes);
+GLOBALFIFO_STAT_ATTR(read_sleeps);
+GLOBALFIFO_STAT_ATTR(write_sleeps);
+GLOBALFIFO_STAT_ATTR(busy_poll_hits);
+GLOBALFIFO_STAT_ATTR(busy_poll_misses);
+GLOBALFIFO_STAT_ATTR(wb_batches);
+
+static ssize_t rec_lost_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct globalfifo_dev *dev = dev_get_drvdata(d);
+
+	return sprintf(buf, "%lld\n", atomic64_read(&dev->rec_lost));
+}
+static DEVICE_ATTR_RO(rec_lost);
+
+static struct attribute *globalfifo_stats_attrs[] = {
+	&dev_attr_bytes_read.attr,
+	&dev_attr_bytes_written.attr,
+	&dev_attr_reads.attr,
+	&dev_attr_writes.attr,
+	&dev_attr_read_sleeps.attr,
+	&dev_attr_write_sleeps.attr,
+	&dev_attr_busy_poll_hits.attr,
+	&dev_attr_busy_poll_misses.attr,
+	&dev_attr_wb_batches.attr,
+	&dev_attr_rec_lost.attr,
+	NULL,
+};
+
+static const struct attribute_group globalfifo_stats_group = {
+	.name = "statistics",
+	.attrs = globalfifo_stats_attrs,
+};
+
+static const struct attribute_group *globalfifo_groups[] = {
+	&globalfifo_group,
+	&globalfifo_stats_group,
+	NULL,
+};
+
+/*****************debugfs********************/
+//debugfs/globalfifo/: latency (histograms), enable (static key), reset
+static int globalfifo_latency_show(struct seq_file *m, void *v){
+	struct globalfifo_dev *dev = m->private;
+	u64 n, count;
+	int lat, b;
+
+	seq_printf(m, "enabled: %d\n", static_key_enabled(&globalfifo_lat_key));
+	//bucket b counts latencies in [2^(b-1), 2^b) ns
+	for(lat = 0; lat < GLOBALFIFO_NR_LAT; lat++){
+		count = 0;
+		for(b = 0; b < GLOBALFIFO_HIST_BUCKETS; b++)
+			count += READ_ONCE(dev->hist[lat][b]);
+		seq_printf(m, "\n%s: %llu samples, avg %llu ns\n", globalfifo_lat_names[lat], count,
+			count ? div64_u64(READ_ONCE(dev->hist_sum[lat]), count) : 0);
+		for(b = 0; b < GLOBALFIFO_HIST_BUCKETS; b++){
+			n = READ_ONCE(dev->hist[lat][b]);
+			if(n)
+				seq_printf(m, "  < %llu ns: %llu\n", 1ULL << b, n);
+		}
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(globalfifo_latency);
+
+static int globalfifo_lat_enable_get(void *data, u64 *val){
+	*val = static_key_enabled(&globalfifo_lat_key);
+	return 0;
+}
+
+static int globalfifo_lat_enable_set(void *data, u64 val){
+	struct globalfifo_dev *dev = data;
+
+	if(!val){
+		static_branch_disable(&globalfifo_lat_key);
+		return 0;
+	}
+	//under the mutex, so no byte goes in untimed and comes out timed
+	globalfifo_lock(dev);
+	if(!static_key_enabled(&globalfifo_lat_key)){
+		globalfifo_lat_restart(dev);
+		static_branch_enable(&globalfifo_lat_key);
+	}
+	globalfifo_unlock(dev);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(globalfifo_lat_enable_fops, globalfifo_lat_enable_get, globalfifo_lat_enable_set, "%llu\n");
+
+static int globalfifo_lat_reset_set(void *data, u64 val){
+	struct globalfifo_dev *dev = data;
+
+	globalfifo_lock(dev);
+	memset(dev->hist, 0, sizeof(dev->hist));
+	memset(dev->hist_sum, 0, sizeof(dev->hist_sum));
+	globalfifo_unlock(dev);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(globalfifo_lat_reset_fops, NULL, globalfifo_lat_reset_set, "%llu\n");
+
 static const struct file_operations globalfifo_fops = {
 	.owner = THIS_MODULE,
 	.read = globalfifo_read,
@@ -208,8 +1706,30 @@ static const struct file_operations globalfifo_fops = {
 	.unlocked_ioctl = globalfifo_ioctl,
 	.poll = globalfifo_poll,
 	.fasync = globalfifo_fasync,
+	.fsync = globalfifo_fsync,
+	.mmap = globalfifo_mmap,
 };
 
+//everything but the cdev, shared with the KUnit suite which builds private devices
+static void globalfifo_dev_init(struct globalfifo_dev *dev, unsigned char *mem, unsigned int size){
+	globalfifo_ring_init(&dev->ring, mem, size);
+	dev->read_wm = 1;
+	dev->write_wm = 1;
+	mutex_init(&dev->mutex);
+	mutex_init(&dev->map_lock);
+	atomic_set(&dev->mapped, 0);
+	init_waitqueue_head(&dev->r_wait);
+	init_waitqueue_head(&dev->w_wait);
+	spin_lock_init(&dev->inject_lock);
+	INIT_KFIFO(dev->inject);
+	atomic64_set(&dev->wb_next_seq, 0);
+	INIT_WORK(&dev->wb_work, globalfifo_wb_work);
+	init_waitqueue_head(&dev->wb_wait);
+	INIT_LIST_HEAD(&dev->rec_readers);
+	spin_lock_init(&dev->rec_readers_lock);
+	atomic64_set(&dev->rec_lost, 0);
+}
+
 static void globalfifo_setup_cdev(struct globalfifo_dev *dev, int index){ //link the operations and add the cdev
 	int err, devno = MKDEV(globalfifo_major, index);
 
@@ -223,8 +1743,12 @@ static void globalfifo_setup_cdev(struct globalfifo_dev *dev, int index){ //link
 
 static int __init globalfifo_init(void){
 	int ret;
+	unsigned char *mem;
 	dev_t devno = MKDEV(globalfifo_major, 0);
 
+	if(!globalfifo_size || globalfifo_size > GLOBALFIFO_MAX_SIZE)
+		return -EINVAL;
+
 	if(globalfifo_major){
 		ret = register_chrdev_region(devno, 1, "globalfifo_async");
 	} else{
@@ -241,15 +1765,62 @@ static int __init globalfifo_init(void){
 		ret = -ENOMEM;
 		goto fail_malloc;
 	}
+	mem = vmalloc_user(globalfifo_size);
+	if(!mem){
+		ret = -ENOMEM;
+		goto fail_mem;
+	}
+	//everything the fops touch is ready before cdev_add makes the device live
+	globalfifo_dev_init(globalfifo_devp, mem, globalfifo_size);
+	globalfifo_devp->atomic_size = min(globalfifo_atomic_size, globalfifo_size);
+	if(globalfifo_write_behind){
+		ret = globalfifo_stage_alloc(globalfifo_devp);
+		if(ret)
+			goto fail_stage;
+		globalfifo_devp->write_behind = true;
+	}
+	if(globalfifo_recorder){
+		ret = globalfifo_set_recorder(globalfifo_devp, true);
+		if(ret)
+			goto fail_rec;
+	}
+
+	globalfifo_devp->debugfs = debugfs_create_dir("globalfifo", NULL);
+	debugfs_create_file("latency", S_IRUGO, globalfifo_devp->debugfs, globalfifo_devp, &globalfifo_latency_fops);
+	debugfs_create_file_unsafe("enable", S_IRUGO | S_IWUSR, globalfifo_devp->debugfs, globalfifo_devp,
+			&globalfifo_lat_enable_fops);
+	debugfs_create_file_unsafe("reset", S_IWUSR, globalfifo_devp->debugfs, globalfifo_devp,
+			&globalfifo_lat_reset_fops);
 
 	globalfifo_setup_cdev(globalfifo_devp, 0);
 
-	mutex_init(&globalfifo_devp->mutex);
-	init_waitqueue_head(&globalfifo_devp->r_wait);
-	init_waitqueue_head(&globalfifo_devp->w_wait);
+	//udev creates /dev/global_fifo, no mknod needed
+	globalfifo_class = class_create("globalfifo_async");
+	if(IS_ERR(globalfifo_class)){
+		ret = PTR_ERR(globalfifo_class);
+		goto fail_class;
+	}
+	globalfifo_devp->device = device_create_with_groups(globalfifo_class, NULL, devno, globalfifo_devp,
+			globalfifo_groups, "global_fifo");
+	if(IS_ERR(globalfifo_devp->device)){
+		ret = PTR_ERR(globalfifo_devp->device);
+		goto fail_device;
+	}
 
 	return 0;
 
+fail_device:
+	class_destroy(globalfifo_class);
+fail_class:
+	cdev_del(&globalfifo_devp->cdev);
+	debugfs_remove_recursive(globalfifo_devp->debugfs);
+	globalfifo_rec_free(rcu_access_pointer(globalfifo_devp->rec));
+fail_rec:
+	globalfifo_stage_free(globalfifo_devp);
+fail_stage:
+	vfree(globalfifo_devp->ring.mem);
+fail_mem:
+	kfree(globalfifo_devp);
 fail_malloc:
 	unregister_chrdev_region(devno, 1);
 	return ret;
@@ -258,7 +1829,15 @@ module_init(globalfifo_init);
 
 
 static void __exit globalfifo_exit(void){
+	device_destroy(globalfifo_class, MKDEV(globalfifo_major, 0));
+	class_destroy(globalfifo_class);
 	cdev_del(&globalfifo_devp->cdev);
+	cancel_work_sync(&globalfifo_devp->wb_work); //staged data is dropped with the device
+	debugfs_remove_recursive(globalfifo_devp->debugfs);
+	globalfifo_stage_free(globalfifo_devp);
+	globalfifo_rec_free(rcu_access_pointer(globalfifo_devp->rec)); //no files are open any more
+	rcu_barrier(); //the filters of closed files
+	vfree(globalfifo_devp->ring.mem);
 	kfree(globalfifo_devp);
 	unregister_chrdev_region(MKDEV(globalfifo_major, 0), 1);
 }
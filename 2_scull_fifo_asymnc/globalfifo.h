@@ -0,0 +1,64 @@
+#ifndef _GLOBALFIFO_H
+#define _GLOBALFIFO_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/filter.h> //struct sock_fprog
+
+#define FIFO_CLEAR	0x01 //drop everything queued
+#define GLOBALFIFO_IOC_MAGIC	'g'
+//busy-poll budget of this open file in us, spent spinning in read before sleeping. 0 turns it off,
+//a new file starts with the globalfifo_busy_poll module parameter
+#define GLOBALFIFO_SET_BUSY_POLL	_IOW(GLOBALFIFO_IOC_MAGIC, 1, __u32)
+#define GLOBALFIFO_GET_BUSY_POLL	_IOR(GLOBALFIFO_IOC_MAGIC, 2, __u32)
+//write-behind: wait until everything this file wrote is in the fifo, same as fsync
+#define GLOBALFIFO_WB_BARRIER	_IO(GLOBALFIFO_IOC_MAGIC, 3)
+
+//read without consuming, like MSG_PEEK: up to len bytes from skip bytes after the oldest one.
+//returns the number copied, 0 when there is nothing past skip
+struct globalfifo_peek{
+	__u64 buf; //user pointer
+	__u32 len;
+	__u32 skip;
+};
+#define GLOBALFIFO_PEEK	_IOWR(GLOBALFIFO_IOC_MAGIC, 4, struct globalfifo_peek)
+//consume n bytes, what a read() would have copied out. EINVAL when fewer are queued
+#define GLOBALFIFO_COMMIT	_IOW(GLOBALFIFO_IOC_MAGIC, 5, __u32)
+//where the data is in the read-only mmap of the ring: len bytes from offset head, wrapping at size.
+//a snapshot, only this reader consumes, so it stays valid until the next COMMIT or read
+struct globalfifo_ring_pos{
+	__u32 head;
+	__u32 len;
+	__u32 size;
+	__u32 pad;
+};
+#define GLOBALFIFO_GET_RING	_IOR(GLOBALFIFO_IOC_MAGIC, 6, struct globalfifo_ring_pos)
+
+//recorder mode: read() returns whole records, each a header and len bytes of data, the next
+//header at the following 8 byte boundary. lost counts the records this reader missed right
+//before this one, overwritten before it got to them. a write is one record of up to GLOBALFIFO_REC_MAX
+struct globalfifo_rec_hdr{
+	__u64 seq;
+	__u32 len;
+	__u32 lost;
+};
+#define GLOBALFIFO_REC_MAX	232
+#define GLOBALFIFO_REC_ALIGN	8
+//attach a classic BPF program to this open file, as SO_ATTACH_FILTER does to a socket. recorder
+//mode only, EOPNOTSUPP on a fifo. it runs on every record: the return value is how many bytes to keep,
+//0 skips the record and the writer doesn't wake a blocked read of this file for it.
+//loads are big endian, past the end of the record they skip it. len 0 detaches
+#define GLOBALFIFO_SET_FILTER	_IOW(GLOBALFIFO_IOC_MAGIC, 7, struct sock_fprog)
+struct globalfifo_filter_stats{
+	__u64 hits; //records handed out
+	__u64 misses; //records skipped
+};
+//ENOENT without a filter
+#define GLOBALFIFO_GET_FILTER_STATS	_IOR(GLOBALFIFO_IOC_MAGIC, 8, struct globalfifo_filter_stats)
+
+#ifdef __KERNEL__
+//queue len bytes from kernel code, safe in any context. all or nothing, -ENOSPC if full
+int globalfifo_inject(const void *buf, unsigned int len);
+#endif
+
+#endif
@@ -0,0 +1,543 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "globalfifo.h" //ioctl commands
+#define MSG_MAGIC	0x676c6f62 //"glob"
+#define MAX_SAMPLES	(1 << 20) //latency samples kept per consumer
+
+//load generator for /dev/global_fifo: N producers, M consumers, one I/O mode for everybody
+enum mode{
+	MODE_BLOCK, //plain blocking read/write
+	MODE_SELECT, //O_NONBLOCK, wait for readiness on EAGAIN
+	MODE_POLL,
+	MODE_EPOLL,
+	MODE_SIGIO, //consumers sleep in sigwaitinfo for the driver's SIGIO, producers block
+	MODE_URING, //one io_uring per thread, one request in flight
+	NR_MODES,
+};
+
+static const char *mode_names[NR_MODES] = {"block", "select", "poll", "epoll", "sigio", "uring"};
+
+//every message starts with this, the rest is filler
+struct msg_hdr{
+	uint32_t magic;
+	uint32_t len;
+	uint64_t t_send;
+};
+
+struct config{
+	const char *path;
+	int producers;
+	int consumers;
+	size_t msg_size;
+	long msgs; //per producer
+	enum mode mode;
+	int json;
+	int busy_poll; //us per consumer fd, -1 keeps the driver default
+};
+
+struct thread_ctx{
+	pthread_t tid;
+	int fd;
+	int epfd;
+	volatile int done;
+	char *buf;
+	uint64_t ops; //successful read/write calls
+	uint64_t bytes;
+	uint64_t again; //EAGAIN before waiting
+	uint64_t short_ops; //partial read/write
+	uint64_t nvcsw; //voluntary context switches, i.e. sleeps/wakeups
+	uint64_t *samples;
+	size_t nr_samples;
+	//io_uring
+	int ring_fd;
+	unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+};
+
+static struct config cfg = {
+	.path = "/dev/global_fifo",
+	.producers = 1,
+	.consumers = 1,
+	.msg_size = 64,
+	.msgs = 100000,
+	.mode = MODE_BLOCK,
+	.busy_poll = -1,
+};
+
+static volatile uint64_t consumed_bytes; //updated with __atomic builtins
+static uint64_t total_bytes;
+
+static uint64_t now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void wakeup_handler(int signum){
+	//only there to interrupt a blocking syscall at the end of the run
+}
+
+/*****************io_uring, raw syscalls*********/
+static int uring_setup(struct thread_ctx *t){
+	struct io_uring_params p;
+	void *sq, *cq;
+	size_t sq_len, cq_len;
+
+	memset(&p, 0, sizeof(p));
+	t->ring_fd = syscall(__NR_io_uring_setup, 4, &p);
+	if(t->ring_fd < 0)
+		return -1;
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, t->ring_fd, IORING_OFF_SQ_RING);
+	cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, t->ring_fd, IORING_OFF_CQ_RING);
+	t->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, t->ring_fd, IORING_OFF_SQES);
+	if(sq == MAP_FAILED || cq == MAP_FAILED || t->sqes == MAP_FAILED)
+		return -1;
+
+	t->sq_tail = sq + p.sq_off.tail;
+	t->sq_mask = sq + p.sq_off.ring_mask;
+	t->sq_array = sq + p.sq_off.array;
+	t->cq_head = cq + p.cq_off.head;
+	t->cq_tail = cq + p.cq_off.tail;
+	t->cq_mask = cq + p.cq_off.ring_mask;
+	t->cqes = cq + p.cq_off.cqes;
+	return 0;
+}
+
+//submit one read or write and wait for its completion, returns like read/write
+static ssize_t uring_rw(struct thread_ctx *t, int op, void *buf, size_t len){
+	unsigned tail = *t->sq_tail, idx = tail & *t->sq_mask, head;
+	struct io_uring_sqe *sqe = &t->sqes[idx];
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = t->fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = -1; //current position, it's a FIFO anyway
+	t->sq_array[idx] = idx;
+	__atomic_store_n(t->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	ret = syscall(__NR_io_uring_enter, t->ring_fd, 1, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	if(ret < 0)
+		return -1;
+
+	head = *t->cq_head;
+	if(head == __atomic_load_n(t->cq_tail, __ATOMIC_ACQUIRE)){
+		errno = EINTR;
+		return -1;
+	}
+	cqe = &t->cqes[head & *t->cq_mask];
+	ret = cqe->res;
+	__atomic_store_n(t->cq_head, head + 1, __ATOMIC_RELEASE);
+	if(ret < 0){
+		errno = -ret;
+		return -1;
+	}
+	return ret;
+}
+
+/*****************readiness waits*****************/
+static int wait_ready(struct thread_ctx *t, int for_write){
+	fd_set fds;
+	struct pollfd pfd;
+	struct epoll_event ev;
+	sigset_t set;
+	struct timespec timeout = {0, 10000000};
+
+	switch(cfg.mode){
+	case MODE_SELECT:
+		FD_ZERO(&fds);
+		FD_SET(t->fd, &fds);
+		return select(t->fd + 1, for_write ? NULL : &fds, for_write ? &fds : NULL, NULL, NULL);
+	case MODE_POLL:
+		pfd.fd = t->fd;
+		pfd.events = for_write ? POLLOUT : POLLIN;
+		return poll(&pfd, 1, -1);
+	case MODE_EPOLL:
+		return epoll_wait(t->epfd, &ev, 1, -1);
+	case MODE_SIGIO:
+		//globalfifo only signals POLL_IN, the short timeout covers a signal consumed by a read
+		sigemptyset(&set);
+		sigaddset(&set, SIGIO);
+		return sigtimedwait(&set, NULL, &timeout);
+	default:
+		return 0;
+	}
+}
+
+static int open_fd(struct thread_ctx *t, int for_write){
+	int nonblock = cfg.mode == MODE_SELECT || cfg.mode == MODE_POLL || cfg.mode == MODE_EPOLL ||
+		(cfg.mode == MODE_SIGIO && !for_write);
+	struct epoll_event ev;
+	struct f_owner_ex owner;
+
+	t->fd = open(cfg.path, (for_write ? O_WRONLY : O_RDONLY) | (nonblock ? O_NONBLOCK : 0));
+	if(t->fd < 0)
+		return -1;
+
+	if(cfg.mode == MODE_EPOLL){
+		t->epfd = epoll_create1(0);
+		memset(&ev, 0, sizeof(ev));
+		ev.events = (for_write ? EPOLLOUT : EPOLLIN) | EPOLLET;
+		if(t->epfd < 0 || epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->fd, &ev) < 0)
+			return -1;
+	}
+	if(cfg.mode == MODE_SIGIO && !for_write){
+		//deliver SIGIO to this thread only, it is blocked and collected with sigtimedwait
+		owner.type = F_OWNER_TID;
+		owner.pid = syscall(SYS_gettid);
+		if(fcntl(t->fd, F_SETOWN_EX, &owner) < 0 ||
+			fcntl(t->fd, F_SETFL, fcntl(t->fd, F_GETFL) | FASYNC) < 0)
+			return -1;
+	}
+	if(!for_write && cfg.busy_poll >= 0){
+		uint32_t us = cfg.busy_poll;
+
+		if(ioctl(t->fd, GLOBALFIFO_SET_BUSY_POLL, &us) < 0)
+			return -1;
+	}
+	if(cfg.mode == MODE_URING && uring_setup(t) < 0)
+		return -1;
+	return 0;
+}
+
+static ssize_t do_io(struct thread_ctx *t, int for_write, void *buf, size_t len){
+	ssize_t n;
+
+	while(1){
+		if(cfg.mode == MODE_URING)
+			n = uring_rw(t, for_write ? IORING_OP_WRITE : IORING_OP_READ, buf, len);
+		else if(for_write)
+			n = write(t->fd, buf, len);
+		else
+			n = read(t->fd, buf, len);
+		if(n >= 0 || errno != EAGAIN)
+			return n;
+
+		t->again++;
+		if(wait_ready(t, for_write) < 0 && errno != EINTR && errno != EAGAIN)
+			return -1;
+		if(!for_write && __atomic_load_n(&consumed_bytes, __ATOMIC_RELAXED) >= total_bytes)
+			return 0;
+	}
+}
+
+static void thread_finish(struct thread_ctx *t){
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	t->nvcsw = ru.ru_nvcsw;
+	t->done = 1;
+}
+
+/*****************threads***********************/
+static void *producer(void *arg){
+	struct thread_ctx *t = arg;
+	struct msg_hdr *hdr = (struct msg_hdr *)t->buf;
+	size_t off;
+	ssize_t n;
+	long i;
+
+	for(i = 0; i < cfg.msgs; i++){
+		hdr->magic = MSG_MAGIC;
+		hdr->len = cfg.msg_size;
+		hdr->t_send = now_ns();
+		for(off = 0; off < cfg.msg_size; off += n){
+			n = do_io(t, 1, t->buf + off, cfg.msg_size - off);
+			if(n < 0){
+				perror("write");
+				goto out;
+			}
+			if(off + n < cfg.msg_size)
+				t->short_ops++;
+			t->ops++;
+			t->bytes += n;
+		}
+	}
+out:
+	thread_finish(t);
+	return NULL;
+}
+
+//a message header at the start of buf, len is its magic and message size
+static int msg_start(const char *buf, size_t len){
+	const struct msg_hdr *hdr = (const struct msg_hdr *)buf;
+
+	if(len < sizeof(uint32_t))
+		return memcmp(buf, &(uint32_t){MSG_MAGIC}, len) == 0; //may still turn into one
+	if(hdr->magic != MSG_MAGIC)
+		return 0;
+	return len < offsetof(struct msg_hdr, t_send) || hdr->len == cfg.msg_size;
+}
+
+static void *consumer(void *arg){
+	struct thread_ctx *t = arg;
+	struct msg_hdr *hdr = (struct msg_hdr *)t->buf;
+	size_t have = 0, skip;
+	uint64_t now;
+	ssize_t n;
+
+	//the SIGIO owner is the calling thread, so consumers set up their own fd
+	if(open_fd(t, 0) < 0){
+		perror("consumer setup");
+		thread_finish(t);
+		return NULL;
+	}
+
+	//reads ask for the rest of the current message, so a short read or a message split with another
+	//reader doesn't shift the ones after it; the buffer is realigned on the next header it holds
+	while(__atomic_load_n(&consumed_bytes, __ATOMIC_RELAXED) < total_bytes){
+		n = do_io(t, 0, t->buf + have, cfg.msg_size - have);
+		if(n < 0){
+			if(errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+		if(n == 0)
+			continue;
+		now = now_ns();
+		t->ops++;
+		t->bytes += n;
+		__atomic_add_fetch(&consumed_bytes, n, __ATOMIC_RELAXED);
+		if((size_t)n < cfg.msg_size - have)
+			t->short_ops++;
+		have += n;
+
+		//drop what can't be the start of a message, the rest of one another reader got the head of
+		for(skip = 0; skip < have && !msg_start(t->buf + skip, have - skip); skip++)
+			;
+		if(!skip && have == cfg.msg_size){
+			//a head whose rest went to another reader shows as the next header inside its body
+			for(skip = sizeof(*hdr); skip < have && !msg_start(t->buf + skip, have - skip); skip++)
+				;
+			if(skip == have){
+				//only whole messages carry a usable timestamp
+				if(t->nr_samples < MAX_SAMPLES)
+					t->samples[t->nr_samples++] = now - hdr->t_send;
+				have = 0;
+				continue;
+			}
+		}
+		memmove(t->buf, t->buf + skip, have - skip);
+		have -= skip;
+	}
+	thread_finish(t);
+	return NULL;
+}
+
+/*****************report************************/
+static int cmp_u64(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(uint64_t *v, size_t n, double p){
+	if(!n)
+		return 0;
+	return v[(size_t)(p * (n - 1))];
+}
+
+static void report(struct thread_ctx *prod, struct thread_ctx *cons, uint64_t elapsed){
+	uint64_t w_ops = 0, r_ops = 0, bytes = 0, w_csw = 0, r_csw = 0, again = 0, short_w = 0, short_r = 0;
+	uint64_t *all, p50, p99, p999;
+	size_t n = 0;
+	double secs = elapsed / 1e9;
+	int i;
+
+	for(i = 0; i < cfg.producers; i++){
+		w_ops += prod[i].ops;
+		w_csw += prod[i].nvcsw;
+		again += prod[i].again;
+		short_w += prod[i].short_ops;
+	}
+	for(i = 0; i < cfg.consumers; i++){
+		r_ops += cons[i].ops;
+		r_csw += cons[i].nvcsw;
+		again += cons[i].again;
+		short_r += cons[i].short_ops;
+		bytes += cons[i].bytes;
+		n += cons[i].nr_samples;
+	}
+
+	all = malloc((n ? n : 1) * sizeof(*all));
+	if(!all){
+		perror("malloc");
+		exit(1);
+	}
+	n = 0;
+	for(i = 0; i < cfg.consumers; i++){
+		memcpy(all + n, cons[i].samples, cons[i].nr_samples * sizeof(*all));
+		n += cons[i].nr_samples;
+	}
+	qsort(all, n, sizeof(*all), cmp_u64);
+	p50 = percentile(all, n, 0.50);
+	p99 = percentile(all, n, 0.99);
+	p999 = percentile(all, n, 0.999);
+	free(all);
+
+	if(cfg.json){
+		printf("{\"mode\": \"%s\", \"busy_poll_us\": %d, \"producers\": %d, \"consumers\": %d, \"msg_size\": %zu, "
+			"\"msgs_per_producer\": %ld, \"elapsed_ns\": %llu, \"bytes\": %llu, "
+			"\"mb_per_s\": %.3f, \"msgs_per_s\": %.1f, \"write_ops\": %llu, \"read_ops\": %llu, "
+			"\"short_writes\": %llu, \"short_reads\": %llu, \"eagain\": %llu, "
+			"\"writer_wakeups_per_op\": %.4f, \"reader_wakeups_per_op\": %.4f, "
+			"\"latency_samples\": %zu, \"latency_ns\": {\"p50\": %llu, \"p99\": %llu, \"p99.9\": %llu}}\n",
+			mode_names[cfg.mode], cfg.busy_poll, cfg.producers, cfg.consumers, cfg.msg_size, cfg.msgs,
+			(unsigned long long)elapsed, (unsigned long long)bytes,
+			bytes / secs / 1e6, bytes / cfg.msg_size / secs,
+			(unsigned long long)w_ops, (unsigned long long)r_ops,
+			(unsigned long long)short_w, (unsigned long long)short_r, (unsigned long long)again,
+			w_ops ? (double)w_csw / w_ops : 0, r_ops ? (double)r_csw / r_ops : 0,
+			n, (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999);
+		return;
+	}
+
+	printf("mode %s, %d producers, %d consumers, %zu byte messages\n",
+		mode_names[cfg.mode], cfg.producers, cfg.consumers, cfg.msg_size);
+	printf("throughput: %.3f MB/s, %.1f msgs/s in %.3f s\n", bytes / secs / 1e6, bytes / cfg.msg_size / secs, secs);
+	printf("ops: %llu writes (%llu short), %llu reads (%llu short), %llu EAGAIN\n",
+		(unsigned long long)w_ops, (unsigned long long)short_w,
+		(unsigned long long)r_ops, (unsigned long long)short_r, (unsigned long long)again);
+	printf("wakeups/op: writer %.4f, reader %.4f\n",
+		w_ops ? (double)w_csw / w_ops : 0, r_ops ? (double)r_csw / r_ops : 0);
+	printf("latency (%zu samples): p50 %llu ns, p99 %llu ns, p99.9 %llu ns\n",
+		n, (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999);
+}
+
+static void usage(const char *prog){
+	fprintf(stderr, "usage: %s [-d dev] [-p producers] [-c consumers] [-s msg_size] [-n msgs_per_producer]\n"
+		"          [-m block|select|poll|epoll|sigio|uring] [-b busy_poll_us] [-j]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]){
+	struct thread_ctx *prod, *cons;
+	struct sigaction sa;
+	sigset_t set;
+	uint64_t start, elapsed;
+	int opt, i, fd, running;
+
+	while((opt = getopt(argc, argv, "d:p:c:s:n:m:b:j")) != -1){
+		switch(opt){
+		case 'd': cfg.path = optarg; break;
+		case 'p': cfg.producers = atoi(optarg); break;
+		case 'c': cfg.consumers = atoi(optarg); break;
+		case 's': cfg.msg_size = strtoul(optarg, NULL, 0); break;
+		case 'n': cfg.msgs = atol(optarg); break;
+		case 'j': cfg.json = 1; break;
+		case 'b': cfg.busy_poll = atoi(optarg); break;
+		case 'm':
+			for(i = 0; i < NR_MODES && strcmp(optarg, mode_names[i]); i++)
+				;
+			if(i == NR_MODES)
+				usage(argv[0]);
+			cfg.mode = i;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(cfg.producers < 1 || cfg.consumers < 1 || cfg.msgs < 1 || cfg.msg_size < sizeof(struct msg_hdr))
+		usage(argv[0]);
+	total_bytes = (uint64_t)cfg.producers * cfg.msgs * cfg.msg_size;
+
+	//SIGUSR1 kicks threads out of blocking calls at the end, SIGIO is only ever waited for
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = wakeup_handler;
+	sigaction(SIGUSR1, &sa, NULL);
+	sigemptyset(&set);
+	sigaddset(&set, SIGIO);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	fd = open(cfg.path, O_RDWR);
+	if(fd == -1){
+		printf("Device open failure\n");
+		return -1;
+	}
+	if(ioctl(fd, FIFO_CLEAR, 0) < 0)
+		printf("ioctl command failure\n");
+	close(fd);
+
+	prod = calloc(cfg.producers, sizeof(*prod));
+	cons = calloc(cfg.consumers, sizeof(*cons));
+	if(!prod || !cons){
+		perror("calloc");
+		return -1;
+	}
+	for(i = 0; i < cfg.producers; i++){
+		prod[i].buf = calloc(1, cfg.msg_size);
+		if(!prod[i].buf){
+			perror("calloc");
+			return -1;
+		}
+		if(open_fd(&prod[i], 1) < 0){
+			perror("producer setup");
+			return -1;
+		}
+	}
+
+	start = now_ns();
+	for(i = 0; i < cfg.consumers; i++){
+		cons[i].buf = calloc(1, cfg.msg_size);
+		cons[i].samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+		if(!cons[i].buf || !cons[i].samples){
+			perror("calloc");
+			return -1;
+		}
+		pthread_create(&cons[i].tid, NULL, consumer, &cons[i]);
+	}
+	for(i = 0; i < cfg.producers; i++)
+		pthread_create(&prod[i].tid, NULL, producer, &prod[i]);
+
+	for(i = 0; i < cfg.producers; i++)
+		pthread_join(prod[i].tid, NULL);
+	//consumers blocked in read() once everything is consumed need a nudge
+	do{
+		running = 0;
+		for(i = 0; i < cfg.consumers; i++){
+			if(!cons[i].done){
+				if(__atomic_load_n(&consumed_bytes, __ATOMIC_RELAXED) >= total_bytes)
+					pthread_kill(cons[i].tid, SIGUSR1);
+				running = 1;
+			}
+		}
+		usleep(1000);
+	} while(running);
+	elapsed = now_ns() - start;
+	for(i = 0; i < cfg.consumers; i++)
+		pthread_join(cons[i].tid, NULL);
+
+	report(prod, cons, elapsed);
+	return 0;
+}
@@ -0,0 +1,162 @@
+#ifndef _GLOBALFIFO_CORE_H
+#define _GLOBALFIFO_CORE_H
+
+//the ring buffer behind globalfifo. no locking in here, the driver calls it under dev->mutex.
+//the wait and wake rules of read() and write() are here too, so the harness waits as the driver does.
+//it builds in the kernel and, on top of harness/kshim.h, in userspace for the fuzzer and the benchmarks.
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/uaccess.h> //copy_*_user
+#include <linux/string.h>
+#include <linux/kernel.h> //min, min_t
+#else
+#include "kshim.h"
+#endif
+
+struct globalfifo_ring{
+	unsigned char *mem;
+	unsigned int size; //capacity of mem
+	unsigned int head; //offset of the oldest byte
+	unsigned int len; //bytes queued, they wrap around the end of mem
+};
+
+static inline void globalfifo_ring_init(struct globalfifo_ring *r, unsigned char *mem, unsigned int size){
+	r->mem = mem;
+	r->size = size;
+	r->head = 0;
+	r->len = 0;
+}
+
+static inline unsigned int globalfifo_ring_room(const struct globalfifo_ring *r){
+	return r->size - r->len;
+}
+
+static inline void globalfifo_ring_clear(struct globalfifo_ring *r){
+	r->head = 0;
+	r->len = 0;
+}
+
+//offset in mem of the byte at position pos from the head
+static inline unsigned int globalfifo_ring_off(const struct globalfifo_ring *r, unsigned int pos){
+	unsigned int off = r->head + pos;
+
+	return off >= r->size ? off - r->size : off;
+}
+
+//copy up to count queued bytes, starting skip bytes after the head, to userspace without consuming them.
+//returns the number copied or -EFAULT
+static inline long globalfifo_ring_peek(const struct globalfifo_ring *r, char __user *buf, size_t count, unsigned int skip){
+	unsigned int n, off, first;
+
+	if(skip >= r->len)
+		return 0;
+	n = min_t(size_t, count, r->len - skip);
+	off = globalfifo_ring_off(r, skip);
+	first = min(n, r->size - off);
+
+	if(copy_to_user(buf, r->mem + off, first))
+		return -EFAULT;
+	if(n > first && copy_to_user(buf + first, r->mem, n - first))
+		return -EFAULT;
+	return n;
+}
+
+//drop n bytes from the head, n <= len
+static inline void globalfifo_ring_consume(struct globalfifo_ring *r, unsigned int n){
+	r->len -= n;
+	//an empty ring restarts at 0, so small messages don't straddle the end
+	r->head = r->len ? globalfifo_ring_off(r, n) : 0;
+}
+
+//copy out and consume, what read() does
+static inline long globalfifo_ring_read(struct globalfifo_ring *r, char __user *buf, size_t count){
+	long ret = globalfifo_ring_peek(r, buf, count, 0);
+
+	if(ret > 0)
+		globalfifo_ring_consume(r, ret);
+	return ret;
+}
+
+//append up to count bytes from userspace. returns the number queued or -EFAULT, in which case nothing is queued
+static inline long globalfifo_ring_write(struct globalfifo_ring *r, const char __user *buf, size_t count){
+	unsigned int n, tail, first;
+
+	n = min_t(size_t, count, globalfifo_ring_room(r));
+	tail = globalfifo_ring_off(r, r->len);
+	first = min(n, r->size - tail);
+
+	if(copy_from_user(r->mem + tail, buf, first))
+		return -EFAULT;
+	if(n > first && copy_from_user(r->mem, buf + first, n - first))
+		return -EFAULT;
+	r->len += n;
+	return n;
+}
+
+//contiguous free space after the tail, for producers that fill the ring themselves (kfifo_out, memcpy).
+//globalfifo_ring_produce() commits what was written there
+static inline unsigned int globalfifo_ring_tail_span(const struct globalfifo_ring *r, unsigned char **p){
+	unsigned int tail = globalfifo_ring_off(r, r->len);
+
+	*p = r->mem + tail;
+	return min(globalfifo_ring_room(r), r->size - tail);
+}
+
+static inline void globalfifo_ring_produce(struct globalfifo_ring *r, unsigned int n){
+	r->len += n;
+}
+
+//append up to n bytes from kernel memory, returns how many fit
+static inline unsigned int globalfifo_ring_put(struct globalfifo_ring *r, const void *src, unsigned int n){
+	unsigned char *p;
+	unsigned int done = 0, span;
+
+	//the free space may wrap, so up to two spans
+	while(done < n){
+		span = min(globalfifo_ring_tail_span(r, &p), n - done);
+		if(!span)
+			break;
+		memcpy(p, (const unsigned char *)src + done, span);
+		globalfifo_ring_produce(r, span);
+		done += span;
+	}
+	return done;
+}
+
+/*****************wait and wake rules**********/
+//bytes a blocking read of count waits for: the low watermark, or all it asked for if that is less
+static inline size_t globalfifo_ring_read_need(unsigned int read_wm, size_t count){
+	return max_t(size_t, 1, min_t(size_t, read_wm, count));
+}
+
+//room a blocking write of count waits for: the high watermark, or all of it if that is less.
+//an atomic write, up to atomic_size, waits for all of its room
+static inline size_t globalfifo_ring_write_need(size_t count, unsigned int write_wm, unsigned int atomic_size){
+	if(count <= atomic_size)
+		return count;
+	return max_t(size_t, 1, min_t(size_t, write_wm, count));
+}
+
+//a producer wakes the readers, and poll says readable, from read_wm bytes on
+static inline bool globalfifo_ring_readable(const struct globalfifo_ring *r, unsigned int read_wm){
+	return r->len >= read_wm;
+}
+
+//a consumer wakes the writers, and poll says writable, from wm bytes of room on
+static inline bool globalfifo_ring_writable(const struct globalfifo_ring *r, unsigned int wm){
+	return globalfifo_ring_room(r) >= wm;
+}
+
+//move the queued bytes into a new buffer of size bytes (size >= len), linearized at offset 0.
+//the caller frees the old mem
+static inline void globalfifo_ring_move(struct globalfifo_ring *r, unsigned char *mem, unsigned int size){
+	unsigned int first = min(r->len, r->size - r->head);
+
+	memcpy(mem, r->mem + r->head, first);
+	memcpy(mem + first, r->mem, r->len - first);
+	r->mem = mem;
+	r->size = size;
+	r->head = 0;
+}
+
+#endif
@@ -6,63 +6,305 @@
 */
 
 #include <linux/module.h>
+#include <linux/version.h>
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
 //#include <linux/timer.h> //timer related functions
+#include <linux/hrtimer.h> //high resolution timer, one per device
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/init.h>
 #include <linux/slab.h> //mem alloc
+#include <linux/mm.h> //kvmalloc_array
 #include <linux/fs.h>
-//#include <linux/mm.h> //unuse
+#include <linux/device.h> //class, device_create
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
 
+#include "second.h"
 
-#define SECOND_MAJOR 248
+#define SECOND_MAJOR 0 //dynamic, udev creates /dev/second through the class
+#define SECOND_HEAP_MIN 16 //initial slots in the timer queue
 
 static int second_major = SECOND_MAJOR;
 module_param(second_major, int, S_IRUGO); //pass the cmd param to module
 
+//tickless: no periodic tick, the count is derived from the open time when it is read.
+//the timer is armed only while somebody sleeps in read/poll for the next second.
+//taken into account at open, so it can be flipped at runtime for new files.
+static bool second_tickless;
+module_param(second_tickless, bool, S_IRUGO | S_IWUSR);
+
+struct second_file;
+
 struct second_cdev{
 	struct cdev cdev;
+	struct hrtimer s_timer; //the only hardware timer, armed for the earliest deadline
+	spinlock_t lock; //protects the timer queue, taken from the hrtimer irq
+	struct second_file **heap; //min-heap of the per-open timers, ordered by expires
+	unsigned int heap_len;
+	unsigned int heap_cap;
+	struct mutex open_mutex; //serializes the growth of the heap in open
+	unsigned int nr_open; //heap_cap is always >= nr_open, so an insert never allocates
+};
+
+//every open file counts its own seconds
+struct second_file{
+	struct second_cdev *dev;
 	atomic_t counter; //indicate the counted seconds
-	struct timer_list s_timer; //define a timer example
+	ktime_t expires; //next tick of this file
+	unsigned int heap_idx; //position in dev->heap
+	bool queued; //in dev->heap, always true for the periodic mode
+	bool tickless;
+	ktime_t base; //open time, the tickless count is computed from it
+	int last_read; //count returned by the last read, poll reports a change against it
+	wait_queue_head_t wait;
+	ktime_t last_tick; //of the handler, for a page mapped after it
+	struct second_page *page; //mmap'able mirror of the counter, see second.h. from the first mmap on
 };
 
 static struct second_cdev *second_cdevp;
+static struct class *second_class;
 
 /***************functions*********************/
 
+/****************timer queue******************/
+//a binary min-heap on expires, every node remembers its index so that release can delete it
+static void second_heap_swap(struct second_cdev *dev, unsigned int i, unsigned int j){
+	struct second_file *tmp = dev->heap[i];
+
+	dev->heap[i] = dev->heap[j];
+	dev->heap[j] = tmp;
+	dev->heap[i]->heap_idx = i;
+	dev->heap[j]->heap_idx = j;
+}
+
+static void second_heap_sift_up(struct second_cdev *dev, unsigned int i){
+	unsigned int parent;
+
+	while(i > 0){
+		parent = (i - 1) / 2;
+		if(ktime_compare(dev->heap[parent]->expires, dev->heap[i]->expires) <= 0)
+			break;
+		second_heap_swap(dev, i, parent);
+		i = parent;
+	}
+}
+
+static void second_heap_sift_down(struct second_cdev *dev, unsigned int i){
+	unsigned int l, r, min;
+
+	while(1){
+		l = 2 * i + 1;
+		r = l + 1;
+		min = i;
+		if(l < dev->heap_len && ktime_compare(dev->heap[l]->expires, dev->heap[min]->expires) < 0)
+			min = l;
+		if(r < dev->heap_len && ktime_compare(dev->heap[r]->expires, dev->heap[min]->expires) < 0)
+			min = r;
+		if(min == i)
+			break;
+		second_heap_swap(dev, i, min);
+		i = min;
+	}
+}
+
+//caller holds dev->lock, returns true if sf became the earliest deadline
+static bool second_heap_insert(struct second_cdev *dev, struct second_file *sf){
+	sf->heap_idx = dev->heap_len;
+	dev->heap[dev->heap_len++] = sf;
+	second_heap_sift_up(dev, sf->heap_idx);
+
+	return sf->heap_idx == 0;
+}
+
+//caller holds dev->lock
+static void second_heap_remove(struct second_cdev *dev, struct second_file *sf){
+	unsigned int i = sf->heap_idx;
+
+	dev->heap_len--;
+	if(i == dev->heap_len)
+		return;
+
+	dev->heap[i] = dev->heap[dev->heap_len];
+	dev->heap[i]->heap_idx = i;
+	second_heap_sift_down(dev, i);
+	second_heap_sift_up(dev, i);
+}
+
+//make room for one more file, called in process context under open_mutex
+static int second_heap_reserve(struct second_cdev *dev){
+	struct second_file **heap, **old;
+	unsigned int cap;
+
+	if(dev->nr_open < dev->heap_cap)
+		return 0;
+
+	cap = dev->heap_cap ? dev->heap_cap * 2 : SECOND_HEAP_MIN;
+	heap = kvmalloc_array(cap, sizeof(*heap), GFP_KERNEL);
+	if(!heap)
+		return -ENOMEM;
+
+	spin_lock_irq(&dev->lock);
+	memcpy(heap, dev->heap, dev->heap_len * sizeof(*heap));
+	old = dev->heap;
+	dev->heap = heap;
+	dev->heap_cap = cap;
+	spin_unlock_irq(&dev->lock);
+
+	kvfree(old);
+	return 0;
+}
+
 /****************irp_handler******************/
-//reset the timer expire, and increment the counter
-static void second_timer_handler(struct timer_list *timer_list){ //look at kernel-4.15.0
+//publish the counter to the mapped page, the handler is the only writer (under dev->lock)
+static void second_page_update(struct second_file *sf, ktime_t now){
+	struct second_page *pg = sf->page;
 
-	mod_timer(&second_cdevp->s_timer, jiffies + HZ);
-	atomic_inc(&second_cdevp->counter);
+	WRITE_ONCE(pg->seq, pg->seq + 1);
+	smp_wmb();
+	WRITE_ONCE(pg->counter, atomic_read(&sf->counter));
+	WRITE_ONCE(pg->last_tick_ns, ktime_to_ns(now));
+	smp_wmb();
+	WRITE_ONCE(pg->seq, pg->seq + 1);
+}
+
+//expire every file whose deadline has passed, then re-arm the hrtimer for the new earliest deadline.
+//however many files are open, only one hardware timer is pending for the device.
+static enum hrtimer_restart second_timer_handler(struct hrtimer *timer){
+	struct second_cdev *dev = container_of(timer, struct second_cdev, s_timer);
+	struct second_file *sf;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	while(dev->heap_len && ktime_compare(dev->heap[0]->expires, now) <= 0){
+		sf = dev->heap[0];
+		if(sf->tickless){
+			//one shot, the sleeper re-arms if it wants the next second as well
+			second_heap_remove(dev, sf);
+			sf->queued = false;
+			atomic_set(&sf->counter, ktime_divns(ktime_sub(now, sf->base), NSEC_PER_SEC));
+		} else{
+			atomic_inc(&sf->counter);
+			sf->expires = ktime_add_ns(sf->expires, NSEC_PER_SEC);
+			second_heap_sift_down(dev, 0);
+		}
+		sf->last_tick = now;
+		if(sf->page)
+			second_page_update(sf, now);
+		wake_up_interruptible(&sf->wait);
+	}
+
+	//restarting from inside the callback is allowed, open may have armed it already
+	if(dev->heap_len)
+		hrtimer_start(timer, dev->heap[0]->expires, HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&dev->lock, flags);
 
-	printk(KERN_INFO "current jiffies is %ld\n", jiffies);
+	return HRTIMER_NORESTART;
 }
 
 /*****************drivers functions *********/
+static int second_count(struct second_file *sf){
+	if(sf->tickless)
+		return ktime_divns(ktime_sub(ktime_get(), sf->base), NSEC_PER_SEC);
+	return atomic_read(&sf->counter);
+}
+
+//tickless only: queue a one shot timer for the next second boundary of this file
+static void second_arm(struct second_file *sf){
+	struct second_cdev *dev = sf->dev;
+	ktime_t now;
+
+	spin_lock_irq(&dev->lock);
+	if(!sf->queued){
+		now = ktime_get();
+		sf->expires = ktime_add_ns(sf->base,
+			(ktime_divns(ktime_sub(now, sf->base), NSEC_PER_SEC) + 1) * NSEC_PER_SEC);
+		sf->queued = true;
+		if(second_heap_insert(dev, sf))
+			hrtimer_start(&dev->s_timer, sf->expires, HRTIMER_MODE_ABS);
+	}
+	spin_unlock_irq(&dev->lock);
+}
+
 static int second_open(struct inode *inode, struct file *filp){
-	//init_timer(&second_cdevp->s_timer);
-	timer_setup(&second_cdevp->s_timer, &second_timer_handler, 0); //v4.15
-	second_cdevp->s_timer.function = &second_timer_handler;
-	second_cdevp->s_timer.expires = jiffies + HZ; //jiffies = tickes, HZ = cpu frequency
+	struct second_cdev *dev = container_of(inode->i_cdev, struct second_cdev, cdev);
+	struct second_file *sf;
+	int ret;
+
+	sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+	if(!sf)
+		return -ENOMEM;
+	sf->dev = dev;
+	atomic_set(&sf->counter, 0);
+	sf->tickless = READ_ONCE(second_tickless);
+	init_waitqueue_head(&sf->wait);
+	sf->base = ktime_get();
+
+	mutex_lock(&dev->open_mutex);
+	ret = second_heap_reserve(dev);
+	if(ret){
+		mutex_unlock(&dev->open_mutex);
+		kfree(sf);
+		return ret;
+	}
+	dev->nr_open++;
 
-	add_timer(&second_cdevp->s_timer);
-	atomic_set(&second_cdevp->counter, 0);
+	if(!sf->tickless){
+		spin_lock_irq(&dev->lock);
+		sf->expires = ktime_add_ns(sf->base, NSEC_PER_SEC);
+		sf->queued = true;
+		if(second_heap_insert(dev, sf))
+			hrtimer_start(&dev->s_timer, sf->expires, HRTIMER_MODE_ABS);
+		spin_unlock_irq(&dev->lock);
+	}
+	mutex_unlock(&dev->open_mutex);
 
+	filp->private_data = sf;
 	return 0;
 }
 
 static int second_release(struct inode *inode, struct file *filp){
-	del_timer(&second_cdevp->s_timer);
+	struct second_file *sf = filp->private_data;
+	struct second_cdev *dev = sf->dev;
 
+	mutex_lock(&dev->open_mutex);
+	spin_lock_irq(&dev->lock);
+	if(sf->queued)
+		second_heap_remove(dev, sf);
+	//a stale expiry with an empty heap is harmless, so don't wait for a running callback
+	if(!dev->heap_len)
+		hrtimer_try_to_cancel(&dev->s_timer);
+	spin_unlock_irq(&dev->lock);
+	dev->nr_open--;
+	mutex_unlock(&dev->open_mutex);
+
+	//the vma holds a reference on filp, so no mapping can outlive this. no page if it never had one
+	free_page((unsigned long)sf->page);
+	kfree(sf);
 	return 0;
 }
 
 
 static ssize_t second_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos){
+	struct second_file *sf = filp->private_data;
 	int counter;
-	counter = atomic_read(&second_cdevp->counter);
+	int ret;
+
+	counter = second_count(sf);
+	//tickless read sleeps until the count moves on, O_NONBLOCK gets the current value
+	if(sf->tickless && counter == sf->last_read && !(filp->f_flags & O_NONBLOCK)){
+		second_arm(sf);
+		ret = wait_event_interruptible(sf->wait, second_count(sf) != sf->last_read);
+		if(ret)
+			return ret;
+		counter = second_count(sf);
+	}
+	sf->last_read = counter;
+
 	if(put_user(counter, (int*) buf)){
 		return -EFAULT;
 	} else{
@@ -70,16 +312,85 @@ static ssize_t second_read(struct file *filp, char __user *buf, size_t count, lo
 	}
 }
 
+static unsigned int second_poll(struct file *filp, poll_table *wait){
+	struct second_file *sf = filp->private_data;
+
+	poll_wait(filp, &sf->wait, wait);
+	if(second_count(sf) != sf->last_read)
+		return POLLIN | POLLRDNORM;
+
+	if(sf->tickless)
+		second_arm(sf);
+	return 0;
+}
+
+//most opens only read(), the page comes with the first mmap. it starts from the last tick and the
+//handler keeps it up from there, it is published under dev->lock as the handler reads it there
+static int second_page_alloc(struct second_file *sf){
+	struct second_cdev *dev = sf->dev;
+	struct second_page *pg;
+
+	if(READ_ONCE(sf->page))
+		return 0;
+	pg = (struct second_page *)get_zeroed_page(GFP_KERNEL);
+	if(!pg)
+		return -ENOMEM;
+	pg->base_ns = ktime_to_ns(sf->base);
+	pg->flags = sf->tickless ? SECOND_PAGE_TICKLESS : 0;
+
+	spin_lock_irq(&dev->lock);
+	if(!sf->page){
+		pg->counter = atomic_read(&sf->counter);
+		pg->last_tick_ns = ktime_to_ns(sf->last_tick);
+		sf->page = pg;
+		pg = NULL;
+	}
+	spin_unlock_irq(&dev->lock);
+	free_page((unsigned long)pg); //another mmap of the file got there first
+	return 0;
+}
+
+//map the counter page read-only, like the vDSO data page
+static int second_mmap(struct file *filp, struct vm_area_struct *vma){
+	struct second_file *sf = filp->private_data;
+	int ret;
+
+	if(vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if(vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	ret = second_page_alloc(sf);
+	if(ret)
+		return ret;
+	vm_flags_clear(vma, VM_MAYWRITE); //no mprotect(PROT_WRITE) later
+
+	return remap_pfn_range(vma, vma->vm_start, virt_to_phys(sf->page) >> PAGE_SHIFT,
+			PAGE_SIZE, vma->vm_page_prot);
+}
 
 static const struct file_operations second_fops = {
 	.owner = THIS_MODULE,
 	.read = second_read,
+	.poll = second_poll,
+	.mmap = second_mmap,
 	.open = second_open,
 	.release = second_release,
 };
 
 
 /************init the drivers********************/
+//everything but the cdev, shared with the KUnit suite
+static void second_cdev_init(struct second_cdev *dev){
+	spin_lock_init(&dev->lock);
+	mutex_init(&dev->open_mutex);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&dev->s_timer, second_timer_handler, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+	hrtimer_init(&dev->s_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	dev->s_timer.function = second_timer_handler;
+#endif
+}
+
 static void second_setup_cdev(struct second_cdev *dev, int index){
 	int err, devno = MKDEV(second_major, index);
 
@@ -93,7 +404,8 @@ static void second_setup_cdev(struct second_cdev *dev, int index){
 
 static int __init second_init(void){
 	int ret;
-	int devno = MKDEV(second_major, 0);
+	struct device *device;
+	dev_t devno = MKDEV(second_major, 0);
 
 	if(second_major){
 		ret = register_chrdev_region(devno, 1, "second");
@@ -113,9 +425,27 @@ static int __init second_init(void){
 		goto fail_malloc;
 	}
 
+	second_cdev_init(second_cdevp);
+
 	second_setup_cdev(second_cdevp, 0);
+
+	second_class = class_create("second");
+	if(IS_ERR(second_class)){
+		ret = PTR_ERR(second_class);
+		goto fail_class;
+	}
+	device = device_create(second_class, NULL, devno, NULL, "second");
+	if(IS_ERR(device)){
+		ret = PTR_ERR(device);
+		goto fail_device;
+	}
 	return 0;
 
+fail_device:
+	class_destroy(second_class);
+fail_class:
+	cdev_del(&second_cdevp->cdev);
+	kfree(second_cdevp);
 fail_malloc:
 	unregister_chrdev_region(devno, 1);
 	return ret;
@@ -123,7 +453,11 @@ fail_malloc:
 module_init(second_init);
 
 static void __exit second_exit(void){
+	device_destroy(second_class, MKDEV(second_major, 0));
+	class_destroy(second_class);
 	cdev_del(&second_cdevp->cdev);
+	hrtimer_cancel(&second_cdevp->s_timer);
+	kvfree(second_cdevp->heap);
 	kfree(second_cdevp);
 	unregister_chrdev_region(MKDEV(second_major, 0), 1);
 }
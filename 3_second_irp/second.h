@@ -0,0 +1,53 @@
+#ifndef _SECOND_H
+#define _SECOND_H
+
+#include <linux/types.h>
+
+#ifndef __KERNEL__
+#include <time.h>
+#endif
+
+#define SECOND_PAGE_TICKLESS	0x1 //counter is only refreshed on demand, derive it from base_ns
+
+//layout of the read-only page that mmap of /dev/second returns.
+//the timer handler is the only writer: seq is odd while an update is in progress,
+//a reader retries until it sees the same even seq before and after its loads.
+struct second_page{
+	__u32 seq;
+	__u32 counter; //seconds counted by this open file
+	__u64 last_tick_ns; //CLOCK_MONOTONIC time of the last tick
+	__u64 base_ns; //CLOCK_MONOTONIC time of open, constant
+	__u32 flags; //SECOND_PAGE_*, constant
+	__u32 pad;
+};
+
+#ifndef __KERNEL__
+//userspace side of the seqcount, no syscall involved.
+//in tickless mode the kernel does not tick, the count comes from the vDSO clock instead
+static inline __u32 second_page_read(const struct second_page *pg, __u64 *last_tick_ns){
+	__u32 seq, counter;
+	__u64 ts;
+	struct timespec now;
+
+	if(pg->flags & SECOND_PAGE_TICKLESS){
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ts = (__u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+		if(last_tick_ns)
+			*last_tick_ns = ts - (ts - pg->base_ns) % 1000000000ULL;
+		return (ts - pg->base_ns) / 1000000000ULL;
+	}
+
+	do{
+		seq = __atomic_load_n(&pg->seq, __ATOMIC_ACQUIRE);
+		counter = __atomic_load_n(&pg->counter, __ATOMIC_RELAXED);
+		ts = __atomic_load_n(&pg->last_tick_ns, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while((seq & 1) || seq != __atomic_load_n(&pg->seq, __ATOMIC_RELAXED));
+
+	if(last_tick_ns)
+		*last_tick_ns = ts;
+	return counter;
+}
+#endif
+
+#endif
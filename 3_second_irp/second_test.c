@@ -9,18 +9,34 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
-int main(){
+#include "second.h"
+
+int main(int argc, char *argv[]){
 
 	int fd;
 	int counter = 0;
 	int old_counter = 0;
+	int use_mmap = argc > 1 && !strcmp(argv[1], "-m"); //-m: read the mapped page, no syscalls
+	struct second_page *pg = NULL;
 
 	fd = open("/dev/second", O_RDONLY);
 	if(fd != -1){
+		if(use_mmap){
+			pg = mmap(NULL, sizeof(*pg), PROT_READ, MAP_SHARED, fd, 0);
+			if(pg == MAP_FAILED){
+				perror("mmap()");
+				return -1;
+			}
+		}
 		while(1){
-			read(fd, &counter, sizeof(unsigned int)); //kernel pass the count to user 
+			if(pg)
+				counter = second_page_read(pg, NULL);
+			else
+				read(fd, &counter, sizeof(unsigned int)); //kernel pass the count to user 
 			if(counter != old_counter){
 				printf("seconds after open /dev/second: %d\n", counter);
 				old_counter = counter;
@@ -0,0 +1,238 @@
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/init.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/interrupt.h> //tasklet
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/kfifo.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "irq_sim.h"
+#include "globalfifo.h"
+
+#define IRQSIM_PENDING 256 //payloads between top and bottom half, power of 2
+#define IRQSIM_RATE_MAX 1000000 //1 MHz, a period of 1 us, past that the timer is all the CPU does
+
+//a software "device": an hrtimer plays the interrupt line (like the one in second.c),
+//the top half timestamps a payload and one of the bottom halves below hands it to globalfifo
+enum irqsim_bh{
+	IRQSIM_BH_DIRECT, //no deferral, the top half injects itself
+	IRQSIM_BH_TASKLET,
+	IRQSIM_BH_WORKQUEUE,
+	IRQSIM_BH_THREADED, //a SCHED_FIFO kthread, what request_threaded_irq would give
+};
+
+static const char * const irqsim_bh_names[] = {
+	[IRQSIM_BH_DIRECT] = "direct",
+	[IRQSIM_BH_TASKLET] = "tasklet",
+	[IRQSIM_BH_WORKQUEUE] = "workqueue",
+	[IRQSIM_BH_THREADED] = "threaded",
+};
+
+//per-stage latency, each one written by a single context
+enum irqsim_stage{
+	IRQSIM_STAGE_IRQ, //t_top - t_expire
+	IRQSIM_STAGE_BH, //t_bottom - t_top
+	IRQSIM_STAGE_INJECT, //time spent in globalfifo_inject
+	IRQSIM_NR_STAGES,
+};
+
+static const char * const irqsim_stage_names[] = {
+	[IRQSIM_STAGE_IRQ] = "irq",
+	[IRQSIM_STAGE_BH] = "bottom_half",
+	[IRQSIM_STAGE_INJECT] = "inject",
+};
+
+static unsigned int irqsim_rate = 1000; //interrupts per second, 1..IRQSIM_RATE_MAX
+module_param(irqsim_rate, uint, S_IRUGO);
+static char *irqsim_bh = "tasklet";
+module_param(irqsim_bh, charp, S_IRUGO);
+
+struct irqsim_dev{
+	struct hrtimer timer;
+	ktime_t period;
+	enum irqsim_bh bh;
+	u64 seq;
+	DECLARE_KFIFO(pending, struct irqsim_payload, IRQSIM_PENDING); //top half in, bottom half out
+	struct tasklet_struct tasklet;
+	struct work_struct work;
+	struct task_struct *thread;
+	u64 hist[IRQSIM_NR_STAGES][IRQSIM_HIST_BUCKETS];
+	u64 overruns; //top half found pending full
+	u64 dropped; //globalfifo had no room
+	struct dentry *debugfs;
+};
+
+static struct irqsim_dev *irqsim_devp;
+
+/***************functions*********************/
+static void irqsim_hist_add(struct irqsim_dev *dev, enum irqsim_stage stage, u64 ns){
+	unsigned int b = ns ? ilog2(ns) + 1 : 0;
+
+	if(b >= IRQSIM_HIST_BUCKETS)
+		b = IRQSIM_HIST_BUCKETS - 1;
+	WRITE_ONCE(dev->hist[stage][b], dev->hist[stage][b] + 1);
+}
+
+static void irqsim_deliver(struct irqsim_dev *dev, struct irqsim_payload *p){
+	u64 t;
+
+	p->t_bottom = ktime_get_ns();
+	irqsim_hist_add(dev, IRQSIM_STAGE_BH, p->t_bottom - p->t_top);
+
+	if(globalfifo_inject(p, sizeof(*p)) < 0)
+		WRITE_ONCE(dev->dropped, dev->dropped + 1);
+
+	t = ktime_get_ns();
+	irqsim_hist_add(dev, IRQSIM_STAGE_INJECT, t - p->t_bottom);
+}
+
+//common body of every deferred bottom half, each of them is single threaded
+static void irqsim_drain(struct irqsim_dev *dev){
+	struct irqsim_payload p;
+
+	while(kfifo_get(&dev->pending, &p))
+		irqsim_deliver(dev, &p);
+}
+
+static void irqsim_tasklet(struct tasklet_struct *t){
+	irqsim_drain(from_tasklet(irqsim_devp, t, tasklet));
+}
+
+static void irqsim_work(struct work_struct *work){
+	irqsim_drain(container_of(work, struct irqsim_dev, work));
+}
+
+static int irqsim_thread(void *data){
+	struct irqsim_dev *dev = data;
+
+	while(!kthread_should_stop()){
+		set_current_state(TASK_INTERRUPTIBLE);
+		if(kfifo_is_empty(&dev->pending) && !kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+		irqsim_drain(dev);
+	}
+	return 0;
+}
+
+/****************irp_handler******************/
+static enum hrtimer_restart irqsim_top_half(struct hrtimer *timer){
+	struct irqsim_dev *dev = container_of(timer, struct irqsim_dev, timer);
+	struct irqsim_payload p;
+
+	p.seq = dev->seq++;
+	p.t_expire = ktime_to_ns(hrtimer_get_expires(timer));
+	p.t_top = ktime_get_ns();
+	irqsim_hist_add(dev, IRQSIM_STAGE_IRQ, p.t_top - p.t_expire);
+
+	if(dev->bh == IRQSIM_BH_DIRECT){
+		irqsim_deliver(dev, &p);
+	} else if(!kfifo_put(&dev->pending, p)){ //single producer, single consumer: lockless
+		dev->overruns++;
+	} else{
+		switch(dev->bh){
+		case IRQSIM_BH_TASKLET:
+			tasklet_schedule(&dev->tasklet);
+			break;
+		case IRQSIM_BH_WORKQUEUE:
+			queue_work(system_highpri_wq, &dev->work);
+			break;
+		default:
+			wake_up_process(dev->thread);
+			break;
+		}
+	}
+
+	hrtimer_forward_now(timer, dev->period);
+	return HRTIMER_RESTART;
+}
+
+/*****************debugfs********************/
+static int irqsim_stats_show(struct seq_file *m, void *v){
+	struct irqsim_dev *dev = m->private;
+	int stage, b;
+
+	seq_printf(m, "bottom_half: %s\nrate: %u\nfired: %llu\noverruns: %llu\ndropped: %llu\n",
+		irqsim_bh_names[dev->bh], irqsim_rate, READ_ONCE(dev->seq),
+		READ_ONCE(dev->overruns), READ_ONCE(dev->dropped));
+
+	//bucket b counts latencies in [2^(b-1), 2^b) ns
+	for(stage = 0; stage < IRQSIM_NR_STAGES; stage++){
+		seq_printf(m, "\n%s:\n", irqsim_stage_names[stage]);
+		for(b = 0; b < IRQSIM_HIST_BUCKETS; b++){
+			if(READ_ONCE(dev->hist[stage][b]))
+				seq_printf(m, "  < %llu ns: %llu\n", 1ULL << b, READ_ONCE(dev->hist[stage][b]));
+		}
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(irqsim_stats);
+
+/************init the device********************/
+static int __init irqsim_init(void){
+	struct irqsim_dev *dev;
+	int bh;
+
+	bh = match_string(irqsim_bh_names, ARRAY_SIZE(irqsim_bh_names), irqsim_bh);
+	if(bh < 0 || !irqsim_rate || irqsim_rate > IRQSIM_RATE_MAX)
+		return -EINVAL;
+
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if(!dev)
+		return -ENOMEM;
+	irqsim_devp = dev;
+
+	dev->bh = bh;
+	dev->period = ns_to_ktime(NSEC_PER_SEC / irqsim_rate);
+	INIT_KFIFO(dev->pending);
+	tasklet_setup(&dev->tasklet, irqsim_tasklet);
+	INIT_WORK(&dev->work, irqsim_work);
+
+	if(dev->bh == IRQSIM_BH_THREADED){
+		dev->thread = kthread_run(irqsim_thread, dev, "irq/irq_sim");
+		if(IS_ERR(dev->thread)){
+			int ret = PTR_ERR(dev->thread);
+
+			kfree(dev);
+			return ret;
+		}
+		sched_set_fifo(dev->thread); //same policy as the irq threads
+	}
+
+	dev->debugfs = debugfs_create_dir("irq_sim", NULL);
+	debugfs_create_file("stats", S_IRUGO, dev->debugfs, dev, &irqsim_stats_fops);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&dev->timer, irqsim_top_half, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&dev->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dev->timer.function = irqsim_top_half;
+#endif
+	hrtimer_start(&dev->timer, dev->period, HRTIMER_MODE_REL);
+
+	printk(KERN_INFO "irq_sim: %u Hz, %s bottom half\n", irqsim_rate, irqsim_bh_names[dev->bh]);
+	return 0;
+}
+module_init(irqsim_init);
+
+static void __exit irqsim_exit(void){
+	struct irqsim_dev *dev = irqsim_devp;
+
+	//stop the source first, then the bottom halves it may have kicked
+	hrtimer_cancel(&dev->timer);
+	tasklet_kill(&dev->tasklet);
+	cancel_work_sync(&dev->work);
+	if(dev->thread)
+		kthread_stop(dev->thread);
+	debugfs_remove_recursive(dev->debugfs);
+	kfree(dev);
+}
+module_exit(irqsim_exit);
+
+MODULE_LICENSE("GPL v2");
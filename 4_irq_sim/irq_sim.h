@@ -0,0 +1,16 @@
+#ifndef _IRQ_SIM_H
+#define _IRQ_SIM_H
+
+#include <linux/types.h>
+
+//one sample as it arrives in /dev/global_fifo, all times are CLOCK_MONOTONIC ns
+struct irqsim_payload{
+	__u64 seq;
+	__u64 t_expire; //when the hrtimer was due, the "hardware" raised the line
+	__u64 t_top; //top half started
+	__u64 t_bottom; //bottom half handed it to globalfifo
+};
+
+#define IRQSIM_HIST_BUCKETS	32 //log2 buckets of ns, the last one takes everything above
+
+#endif
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "irq_sim.h"
+
+//the last stages of the pipeline, only userspace can see them
+enum{
+	STAGE_WAKEUP, //globalfifo got it -> read() returned
+	STAGE_TOTAL, //timer due -> read() returned
+	NR_STAGES,
+};
+
+static const char *stage_names[NR_STAGES] = {"wakeup", "total"};
+static unsigned long long hist[NR_STAGES][IRQSIM_HIST_BUCKETS];
+static volatile sig_atomic_t stop;
+
+static void sigint_handler(int signum){
+	stop = 1;
+}
+
+static unsigned long long now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void hist_add(int stage, unsigned long long ns){
+	int b = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	if(b >= IRQSIM_HIST_BUCKETS)
+		b = IRQSIM_HIST_BUCKETS - 1;
+	hist[stage][b]++;
+}
+
+int main(int argc, char *argv[]){
+	const char *path = argc > 1 ? argv[1] : "/dev/global_fifo";
+	struct irqsim_payload p;
+	unsigned long long t, samples = 0, lost = 0, next_seq = 0;
+	size_t got = 0;
+	ssize_t n;
+	int fd, stage, b;
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1){
+		printf("Device open failure\n");
+		return -1;
+	}
+	signal(SIGINT, sigint_handler);
+
+	while(!stop){
+		//globalfifo is a byte stream, a payload may come in pieces
+		n = read(fd, (char *)&p + got, sizeof(p) - got);
+		if(n <= 0)
+			break;
+		got += n;
+		if(got < sizeof(p))
+			continue;
+		got = 0;
+
+		t = now_ns();
+		hist_add(STAGE_WAKEUP, t - p.t_bottom);
+		hist_add(STAGE_TOTAL, t - p.t_expire);
+		if(samples && p.seq != next_seq)
+			lost += p.seq - next_seq;
+		next_seq = p.seq + 1;
+		samples++;
+	}
+
+	printf("samples: %llu, lost: %llu\n", samples, lost);
+	for(stage = 0; stage < NR_STAGES; stage++){
+		printf("\n%s:\n", stage_names[stage]);
+		for(b = 0; b < IRQSIM_HIST_BUCKETS; b++){
+			if(hist[stage][b])
+				printf("  < %llu ns: %llu\n", 1ULL << b, hist[stage][b]);
+		}
+	}
+	printf("\nkernel stages: cat /sys/kernel/debug/irq_sim/stats\n");
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,560 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+//native replacement for travel_sysfs: same trees, same output, no sed, walked in parallel.
+//-m creates the nodes, -D keeps listening for kobject uevents and applies only the changes,
+//and walks again on SIGHUP or when events were lost.
+
+#define DENTS_BUF	32768
+#define UEVENT_BUF	8192
+
+enum job_kind{
+	JOB_BLOCK, //sysfs/block/X: X/dev and X/*/dev, block nodes
+	JOB_CHILDREN, //sysfs/class/C or sysfs/bus/B/devices: */dev, char nodes
+};
+
+struct job{
+	enum job_kind kind;
+	char path[PATH_MAX];
+};
+
+struct node{
+	char name[NAME_MAX + 1]; //relative to the dev root, may contain '/'
+	char type; //'b' or 'c'
+	unsigned int major, minor;
+};
+
+struct node_list{
+	struct node *v;
+	size_t len, cap;
+};
+
+//linux_dirent64 as getdents64 returns it
+struct kdirent64{
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static const char *sysfs_root = "/sys";
+static const char *dev_root = "/dev";
+static int do_mknod; //-m, otherwise only print like travel_sysfs
+static int nr_threads = 8;
+
+static struct job *jobs; //grown as the top level directories are listed
+static int nr_jobs, cap_jobs;
+static int next_job; //__atomic index into jobs
+
+//daemon mode: the nodes of the last walk and of the uevents since, what a rescan removes is looked for here.
+//nodes in dev_root that didn't come from sysfs_walk are left alone
+static struct node_list known;
+static volatile sig_atomic_t rescan; //SIGHUP
+
+/*****************helpers***********************/
+static int is_dot(const char *name){
+	return name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]));
+}
+
+//call fn for every entry of the directory fd but . and ..
+static void for_each_dirent(int dfd, void (*fn)(int dfd, struct kdirent64 *d, void *arg), void *arg){
+	char buf[DENTS_BUF];
+	struct kdirent64 *d;
+	long n, off;
+
+	while((n = syscall(SYS_getdents64, dfd, buf, sizeof(buf))) > 0){
+		for(off = 0; off < n; off += d->d_reclen){
+			d = (struct kdirent64 *)(buf + off);
+			if(!is_dot(d->d_name))
+				fn(dfd, d, arg);
+		}
+	}
+}
+
+//a node name from a uevent is created under dev_root: not absolute, no empty, . or .. parts,
+//mknodat would leave devfd for a name starting with / and .. climbs out of it
+static int name_ok(const char *name){
+	const char *p, *e;
+
+	if(!*name || *name == '/')
+		return 0;
+	for(p = name; ; p = e + 1){
+		e = strchrnul(p, '/');
+		if(e == p || (e - p == 1 && p[0] == '.') || (e - p == 2 && p[0] == '.' && p[1] == '.'))
+			return 0;
+		if(!*e)
+			return 1;
+	}
+}
+
+static int is_dir_entry(int dfd, struct kdirent64 *d){
+	struct stat st;
+
+	//sysfs links the device dirs in, follow them
+	if(d->d_type == DT_DIR)
+		return 1;
+	if(d->d_type != DT_LNK && d->d_type != DT_UNKNOWN)
+		return 0;
+	return !fstatat(dfd, d->d_name, &st, 0) && S_ISDIR(st.st_mode);
+}
+
+static void node_add(struct node_list *l, const char *name, char type, unsigned int major, unsigned int minor){
+	struct node *n;
+
+	if(l->len == l->cap){
+		l->cap = l->cap ? l->cap * 2 : 256;
+		l->v = realloc(l->v, l->cap * sizeof(*l->v));
+		if(!l->v){
+			perror("realloc");
+			exit(1);
+		}
+	}
+	n = &l->v[l->len++];
+	snprintf(n->name, sizeof(n->name), "%s", name);
+	n->type = type;
+	n->major = major;
+	n->minor = minor;
+}
+
+//read "MAJOR:MINOR\n" from dir/dev. travel_sysfs names the node after the directory,
+//DEVNAME in dir/uevent is preferred when there is one (e.g. bus/usb/001/002)
+static void probe_dev(int dfd, const char *dir, const char *dirname, char type, struct node_list *out){
+	char path[PATH_MAX], buf[4096], name[NAME_MAX + 1];
+	unsigned int major, minor;
+	char *p, *e;
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/dev", dir);
+	fd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(n <= 0)
+		return;
+	buf[n] = 0;
+	if(sscanf(buf, "%u:%u", &major, &minor) != 2)
+		return;
+
+	snprintf(name, sizeof(name), "%s", dirname);
+
+	snprintf(path, sizeof(path), "%s/uevent", dir);
+	fd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
+	if(fd >= 0){
+		n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if(n > 0){
+			buf[n] = 0;
+			p = strstr(buf, "DEVNAME=");
+			if(p && (p == buf || p[-1] == '\n')){
+				p += strlen("DEVNAME=");
+				e = strchr(p, '\n');
+				if(e)
+					*e = 0;
+				if(name_ok(p))
+					snprintf(name, sizeof(name), "%s", p);
+			}
+		}
+	}
+
+	node_add(out, name, type, major, minor);
+}
+
+/*****************parallel walk*****************/
+struct walk_arg{
+	struct node_list *out;
+	char type;
+};
+
+static void probe_child(int dfd, struct kdirent64 *d, void *arg){
+	struct walk_arg *w = arg;
+
+	if(!is_dir_entry(dfd, d))
+		return;
+	probe_dev(dfd, d->d_name, d->d_name, w->type, w->out);
+}
+
+static void run_job(struct job *job, struct node_list *out){
+	struct walk_arg w = {.out = out};
+	int dfd;
+
+	dfd = open(job->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dfd < 0)
+		return;
+
+	if(job->kind == JOB_BLOCK){
+		//the disk itself, then its partitions one level down
+		probe_dev(dfd, ".", strrchr(job->path, '/') + 1, 'b', out);
+		w.type = 'b';
+	} else{
+		w.type = 'c';
+	}
+	for_each_dirent(dfd, probe_child, &w);
+	close(dfd);
+}
+
+static void *worker(void *arg){
+	struct node_list *out = arg;
+	int i;
+
+	while((i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < nr_jobs)
+		run_job(&jobs[i], out);
+	return NULL;
+}
+
+static void add_job(enum job_kind kind, const char *fmt, const char *a, const char *b){
+	struct job *v;
+
+	if(nr_jobs == cap_jobs){
+		cap_jobs = cap_jobs ? cap_jobs * 2 : 64;
+		v = realloc(jobs, cap_jobs * sizeof(*jobs));
+		if(!v){
+			perror("realloc");
+			exit(1);
+		}
+		jobs = v;
+	}
+	jobs[nr_jobs].kind = kind;
+	snprintf(jobs[nr_jobs].path, sizeof(jobs[0].path), fmt, sysfs_root, a, b);
+	nr_jobs++;
+}
+
+static void queue_block(int dfd, struct kdirent64 *d, void *arg){
+	add_job(JOB_BLOCK, "%s/block/%s%s", d->d_name, "");
+}
+
+static void queue_class(int dfd, struct kdirent64 *d, void *arg){
+	//the block class is the same devices as sysfs/block, and they are block nodes
+	if(strcmp(d->d_name, "block"))
+		add_job(JOB_CHILDREN, "%s/class/%s%s", d->d_name, "");
+}
+
+static void queue_bus(int dfd, struct kdirent64 *d, void *arg){
+	add_job(JOB_CHILDREN, "%s/bus/%s/%s", d->d_name, "devices");
+}
+
+static void queue_top(const char *sub, void (*fn)(int, struct kdirent64 *, void *)){
+	char path[PATH_MAX];
+	int dfd;
+
+	snprintf(path, sizeof(path), "%s/%s", sysfs_root, sub);
+	dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dfd < 0)
+		return;
+	for_each_dirent(dfd, fn, NULL);
+	close(dfd);
+}
+
+/*****************node creation*****************/
+static int cmp_node(const void *a, const void *b){
+	const struct node *x = a, *y = b;
+	int r = strcmp(x->name, y->name);
+
+	return r ? r : x->type - y->type;
+}
+
+//bsearch key: a name, in a list sorted with cmp_node
+static int cmp_node_name(const void *key, const void *elem){
+	return strcmp(key, ((const struct node *)elem)->name);
+}
+
+static struct node *node_find(struct node_list *l, const char *name){
+	size_t i;
+
+	for(i = 0; i < l->len; i++)
+		if(!strcmp(l->v[i].name, name))
+			return &l->v[i];
+	return NULL;
+}
+
+//the order goes, the list is sorted again before it is searched
+static void node_del(struct node_list *l, struct node *n){
+	*n = l->v[--l->len];
+}
+
+static void mkdir_parents(int devfd, const char *name){
+	char path[NAME_MAX + 1], *p;
+
+	snprintf(path, sizeof(path), "%s", name);
+	for(p = strchr(path, '/'); p; p = strchr(p + 1, '/')){
+		*p = 0;
+		mkdirat(devfd, path, 0755);
+		*p = '/';
+	}
+}
+
+static void apply_add(int devfd, const struct node *n){
+	mode_t mode = (n->type == 'b' ? S_IFBLK : S_IFCHR) | 0600;
+	dev_t devno = makedev(n->major, n->minor);
+	struct stat st;
+
+	printf("%s/%s %c %u %u\n", dev_root, n->name, n->type, n->major, n->minor);
+	if(!do_mknod)
+		return;
+
+	if(!fstatat(devfd, n->name, &st, AT_SYMLINK_NOFOLLOW)){
+		if((st.st_mode & S_IFMT) == (mode & S_IFMT) && st.st_rdev == devno)
+			return; //already right
+		unlinkat(devfd, n->name, 0);
+	}
+	mkdir_parents(devfd, n->name);
+	if(mknodat(devfd, n->name, mode, devno) && errno != EEXIST)
+		fprintf(stderr, "mknod %s/%s: %s\n", dev_root, n->name, strerror(errno));
+}
+
+static void apply_remove(int devfd, const char *name){
+	printf("rm %s/%s\n", dev_root, name);
+	if(do_mknod && unlinkat(devfd, name, 0) && errno != ENOENT)
+		fprintf(stderr, "unlink %s/%s: %s\n", dev_root, name, strerror(errno));
+}
+
+//walk the trees and add their nodes. the nodes, sorted and each once, are handed back in out when it is set
+static int walk(int devfd, struct node_list *out){
+	struct node_list *lists, all = {0};
+	pthread_t *tids;
+	size_t i, n;
+	int t;
+
+	tids = calloc(nr_threads, sizeof(*tids));
+	lists = calloc(nr_threads, sizeof(*lists));
+	if(!tids || !lists){
+		perror("calloc");
+		return -1;
+	}
+
+	//only the top level directories are listed here, everything below is in the workers
+	nr_jobs = 0;
+	next_job = 0;
+	queue_top("block", queue_block);
+	queue_top("bus", queue_bus);
+	queue_top("class", queue_class);
+
+	for(t = 0; t < nr_threads; t++)
+		pthread_create(&tids[t], NULL, worker, &lists[t]);
+	for(t = 0; t < nr_threads; t++){
+		pthread_join(tids[t], NULL);
+		for(i = 0; i < lists[t].len; i++)
+			node_add(&all, lists[t].v[i].name, lists[t].v[i].type, lists[t].v[i].major, lists[t].v[i].minor);
+		free(lists[t].v);
+	}
+
+	//a device shows up under its bus and its class, create it once
+	qsort(all.v, all.len, sizeof(*all.v), cmp_node);
+	for(i = n = 0; i < all.len; i++){
+		if(n && !cmp_node(&all.v[i], &all.v[n - 1]))
+			continue;
+		all.v[n++] = all.v[i];
+		apply_add(devfd, &all.v[i]);
+	}
+	all.len = n;
+	fflush(stdout);
+
+	if(out)
+		*out = all;
+	else
+		free(all.v);
+	free(lists);
+	free(tids);
+	free(jobs);
+	jobs = NULL;
+	cap_jobs = 0;
+	return 0;
+}
+
+/*****************uevent daemon*****************/
+//kernel messages are "ACTION@DEVPATH\0KEY=VALUE\0...", libudev ones start with "libudev" and are skipped
+static void handle_uevent(int devfd, char *msg, size_t len){
+	const char *action = NULL, *devname = NULL, *subsystem = NULL;
+	char *p, *end = msg + len;
+	struct node n, *old;
+	int major = -1, minor = -1;
+
+	if(!memchr(msg, '@', strnlen(msg, len)))
+		return;
+
+	for(p = msg + strlen(msg) + 1; p < end; p += strlen(p) + 1){
+		if(!strncmp(p, "ACTION=", 7))
+			action = p + 7;
+		else if(!strncmp(p, "DEVNAME=", 8))
+			devname = p + 8;
+		else if(!strncmp(p, "SUBSYSTEM=", 10))
+			subsystem = p + 10;
+		else if(!strncmp(p, "MAJOR=", 6))
+			major = atoi(p + 6);
+		else if(!strncmp(p, "MINOR=", 6))
+			minor = atoi(p + 6);
+	}
+	if(!action || !devname || !name_ok(devname))
+		return;
+
+	if(!strcmp(action, "add") || !strcmp(action, "change")){
+		if(major < 0 || minor < 0)
+			return;
+		snprintf(n.name, sizeof(n.name), "%s", devname);
+		n.type = subsystem && !strcmp(subsystem, "block") ? 'b' : 'c';
+		n.major = major;
+		n.minor = minor;
+		apply_add(devfd, &n);
+		if((old = node_find(&known, n.name)))
+			*old = n;
+		else
+			node_add(&known, n.name, n.type, n.major, n.minor);
+	} else if(!strcmp(action, "remove")){
+		apply_remove(devfd, devname);
+		if((old = node_find(&known, devname)))
+			node_del(&known, old);
+	}
+	fflush(stdout);
+}
+
+//walk again and remove the known nodes the walk didn't find, their remove events may be among the lost ones
+static int resync(int devfd){
+	struct node_list now = {0};
+	size_t i;
+
+	if(walk(devfd, &now))
+		return -1;
+	for(i = 0; i < known.len; i++)
+		if(!bsearch(known.v[i].name, now.v, now.len, sizeof(*now.v), cmp_node_name))
+			apply_remove(devfd, known.v[i].name);
+	fflush(stdout);
+	free(known.v);
+	known = now;
+	return 0;
+}
+
+static void on_sighup(int sig){
+	rescan = 1;
+}
+
+static int uevent_open(void){
+	struct sockaddr_nl addr;
+	int sock, rcvbuf = 4 << 20;
+
+	sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if(sock < 0){
+		perror("socket(NETLINK_KOBJECT_UEVENT)");
+		return -1;
+	}
+	//a hotplug storm must not overflow the socket
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1; //kernel uevents
+	if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+		perror("bind");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+//SIGHUP is blocked but while waiting in ppoll, so one can't slip in between the check and the wait
+static int daemon_loop(int sock, int devfd, const sigset_t *wait_mask){
+	struct pollfd pfd = {.fd = sock, .events = POLLIN};
+	char buf[UEVENT_BUF + 1];
+	struct sockaddr_nl from;
+	socklen_t fromlen;
+	ssize_t n;
+
+	while(1){
+		if(rescan){
+			rescan = 0;
+			resync(devfd);
+		}
+		if(ppoll(&pfd, 1, NULL, wait_mask) < 0){
+			if(errno == EINTR)
+				continue;
+			perror("ppoll");
+			return -1;
+		}
+		fromlen = sizeof(from);
+		n = recvfrom(sock, buf, UEVENT_BUF, MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+		if(n < 0){
+			if(errno == EINTR || errno == EAGAIN)
+				continue;
+			if(errno == ENOBUFS){
+				//events were lost, only a full walk can resync
+				fprintf(stderr, "uevent overrun, rescanning\n");
+				resync(devfd);
+				continue;
+			}
+			perror("recvfrom");
+			return -1;
+		}
+		//any process can send to the group, only the kernel's (port 0) are believed, as udev does
+		if(fromlen != sizeof(from) || from.nl_pid)
+			continue;
+		buf[n] = 0;
+		handle_uevent(devfd, buf, n);
+	}
+}
+
+static void usage(const char *prog){
+	fprintf(stderr, "usage: %s [-s sysfs_root] [-d dev_root] [-j threads] [-m] [-D]\n"
+		"  -m  create the nodes, otherwise only print them\n"
+		"  -D  after the walk, apply kobject uevents as they arrive, walk again on SIGHUP\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]){
+	int opt, daemon = 0, devfd, sock = -1;
+	sigset_t hup, wait_mask;
+
+	while((opt = getopt(argc, argv, "s:d:j:mD")) != -1){
+		switch(opt){
+		case 's': sysfs_root = optarg; break;
+		case 'd': dev_root = optarg; break;
+		case 'j': nr_threads = atoi(optarg); break;
+		case 'm': do_mknod = 1; break;
+		case 'D': daemon = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if(nr_threads < 1)
+		usage(argv[0]);
+
+	devfd = open(dev_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(devfd < 0 && do_mknod){
+		perror(dev_root);
+		return 1;
+	}
+
+	//subscribe before the walk, an event that races with it is queued on the socket.
+	//applying it again after the walk is harmless, add and remove are idempotent
+	if(daemon){
+		struct sigaction sa = {.sa_handler = on_sighup};
+
+		sock = uevent_open();
+		if(sock < 0)
+			return 1;
+		sigemptyset(&hup);
+		sigaddset(&hup, SIGHUP);
+		sigprocmask(SIG_BLOCK, &hup, &wait_mask);
+		sigaction(SIGHUP, &sa, NULL);
+	}
+	if(walk(devfd, daemon ? &known : NULL))
+		return 1;
+	if(daemon)
+		return daemon_loop(sock, devfd, &wait_mask) ? 1 : 0;
+	return 0;
+}
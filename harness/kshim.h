@@ -0,0 +1,105 @@
+#ifndef _KSHIM_H
+#define _KSHIM_H
+
+//just enough of the kernel API for the driver cores (globalfifo_core.h, globalmem_core.h) to build in userspace.
+//userspace pointers are plain pointers, so copy_*_user is a memcpy that never faults.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+#ifndef _GNU_SOURCE
+#error "build with -D_GNU_SOURCE, loff_t comes from glibc"
+#endif
+
+#define __user
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) max((type)(a), (type)(b))
+
+#define READ_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile __typeof__(x) *)&(x) = (v))
+
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n){
+	memcpy(to, from, n);
+	return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n){
+	memcpy(to, from, n);
+	return 0;
+}
+
+#define GFP_KERNEL 0
+
+static inline void *kvzalloc(size_t size, int flags){
+	(void)flags;
+	return calloc(1, size);
+}
+
+static inline void kvfree(const void *p){
+	free((void *)p);
+}
+
+//mutex, on top of pthread
+struct mutex{
+	pthread_mutex_t m;
+};
+
+static inline void mutex_init(struct mutex *lock){
+	pthread_mutex_init(&lock->m, NULL);
+}
+
+static inline void mutex_lock(struct mutex *lock){
+	pthread_mutex_lock(&lock->m);
+}
+
+static inline void mutex_unlock(struct mutex *lock){
+	pthread_mutex_unlock(&lock->m);
+}
+
+//wait queue. the condition is evaluated under the queue's own lock, so a wake_up between
+//the check and the sleep is never lost, the same guarantee prepare_to_wait gives in the kernel
+typedef struct{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq){
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+}
+
+static inline void wake_up_interruptible(wait_queue_head_t *wq){
+	pthread_mutex_lock(&wq->lock);
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+//nothing delivers signals to the harness, so it always returns 0
+#define wait_event_interruptible(wq, condition) ({ \
+	pthread_mutex_lock(&(wq).lock); \
+	while(!(condition)) \
+		pthread_cond_wait(&(wq).cond, &(wq).lock); \
+	pthread_mutex_unlock(&(wq).lock); \
+	0; \
+})
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,121 @@
+//microbenchmarks of the globalfifo ring, run in userspace on top of kshim.h.
+//./ring_bench --benchmark_filter=Spsc for just the threaded case
+#include <benchmark/benchmark.h>
+#include <thread>
+#include <vector>
+
+#include "globalfifo_core.h"
+
+#define RING_SIZE	0x1000
+
+//write then read one message, the ring stays almost empty so nothing wraps
+static void BM_WriteRead(benchmark::State &state){
+	std::vector<unsigned char> mem(RING_SIZE), msg(state.range(0)), out(state.range(0));
+	struct globalfifo_ring r;
+
+	globalfifo_ring_init(&r, mem.data(), RING_SIZE);
+	for(auto _ : state){
+		globalfifo_ring_write(&r, (const char *)msg.data(), msg.size());
+		benchmark::DoNotOptimize(globalfifo_ring_read(&r, (char *)out.data(), out.size()));
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_WriteRead)->RangeMultiplier(4)->Range(16, RING_SIZE);
+
+//keep the ring half full so every message straddles the end sooner or later
+static void BM_WriteReadWrap(benchmark::State &state){
+	std::vector<unsigned char> mem(RING_SIZE), fill(RING_SIZE / 2), msg(state.range(0)), out(state.range(0));
+	struct globalfifo_ring r;
+
+	globalfifo_ring_init(&r, mem.data(), RING_SIZE);
+	globalfifo_ring_write(&r, (const char *)fill.data(), fill.size());
+	for(auto _ : state){
+		globalfifo_ring_write(&r, (const char *)msg.data(), msg.size());
+		benchmark::DoNotOptimize(globalfifo_ring_read(&r, (char *)out.data(), out.size()));
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_WriteReadWrap)->RangeMultiplier(4)->Range(16, RING_SIZE / 2);
+
+//one writer thread and one reader, locked, waiting and woken the way global_fifo.c does it:
+//the same globalfifo_ring_*_need and *_able rules, with the driver's default watermarks
+struct spsc{
+	struct globalfifo_ring r;
+	struct mutex lock;
+	wait_queue_head_t r_wait, w_wait;
+	unsigned int read_wm, write_wm, atomic_size;
+};
+
+static bool spsc_can_read(struct spsc *q, size_t count){
+	bool ok;
+
+	mutex_lock(&q->lock);
+	ok = q->r.len >= globalfifo_ring_read_need(q->read_wm, count);
+	mutex_unlock(&q->lock);
+	return ok;
+}
+
+static bool spsc_can_write(struct spsc *q, size_t count){
+	bool ok;
+
+	mutex_lock(&q->lock);
+	ok = globalfifo_ring_room(&q->r) >= globalfifo_ring_write_need(count, q->write_wm, q->atomic_size);
+	mutex_unlock(&q->lock);
+	return ok;
+}
+
+static void BM_Spsc(benchmark::State &state){
+	std::vector<unsigned char> mem(RING_SIZE), msg(state.range(0));
+	const long total = 1 << 22;
+	struct spsc q;
+
+	globalfifo_ring_init(&q.r, mem.data(), RING_SIZE);
+	mutex_init(&q.lock);
+	init_waitqueue_head(&q.r_wait);
+	init_waitqueue_head(&q.w_wait);
+	q.read_wm = 1;
+	q.write_wm = 1;
+	q.atomic_size = 0; //globalfifo_atomic_size is off by default
+
+	for(auto _ : state){
+		std::thread reader([&]{
+			std::vector<unsigned char> out(msg.size());
+			long done = 0;
+
+			while(done < total){
+				long n;
+				bool wake;
+
+				wait_event_interruptible(q.r_wait, spsc_can_read(&q, out.size()));
+				mutex_lock(&q.lock);
+				n = globalfifo_ring_read(&q.r, (char *)out.data(), out.size());
+				wake = globalfifo_ring_writable(&q.r, q.write_wm);
+				mutex_unlock(&q.lock);
+				if(wake)
+					wake_up_interruptible(&q.w_wait);
+				done += n;
+			}
+		});
+		long sent = 0;
+
+		while(sent < total){
+			size_t count = min_t(long, msg.size(), total - sent);
+			long n;
+			bool wake;
+
+			wait_event_interruptible(q.w_wait, spsc_can_write(&q, count));
+			mutex_lock(&q.lock);
+			n = globalfifo_ring_write(&q.r, (const char *)msg.data(), count);
+			wake = globalfifo_ring_readable(&q.r, q.read_wm);
+			mutex_unlock(&q.lock);
+			if(wake)
+				wake_up_interruptible(&q.r_wait);
+			sent += n;
+		}
+		reader.join();
+	}
+	state.SetBytesProcessed(state.iterations() * total);
+}
+BENCHMARK(BM_Spsc)->RangeMultiplier(8)->Range(64, RING_SIZE)->UseRealTime();
+
+BENCHMARK_MAIN();
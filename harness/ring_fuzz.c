@@ -0,0 +1,210 @@
+//libFuzzer target for the globalfifo ring and the globalmem bounds logic.
+//each input is a program of ops run against the real core and a flat reference model,
+//any disagreement aborts. build with -DSTANDALONE to replay files without libFuzzer.
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "globalfifo_core.h"
+#include "globalmem_core.h"
+
+#define RING_MAX	64
+
+struct model{
+	unsigned char data[RING_MAX];
+	unsigned int len;
+};
+
+struct input{
+	const u8 *p;
+	size_t left;
+};
+
+static u8 next_u8(struct input *in){
+	if(!in->left)
+		return 0;
+	in->left--;
+	return *in->p++;
+}
+
+static u64 next_u64(struct input *in){
+	u64 v = 0;
+	int i;
+
+	for(i = 0; i < 8; i++)
+		v = v << 8 | next_u8(in);
+	return v;
+}
+
+static void check_ring(const struct globalfifo_ring *r, const struct model *m){
+	unsigned int i;
+
+	assert(r->len == m->len);
+	assert(r->len <= r->size);
+	assert(r->head < r->size || (r->head == 0 && r->len == 0));
+	for(i = 0; i < r->len; i++)
+		assert(r->mem[globalfifo_ring_off(r, i)] == m->data[i]);
+}
+
+static void fuzz_ring(struct input *in){
+	struct globalfifo_ring r;
+	struct model m = { .len = 0 };
+	char src[RING_MAX], dst[RING_MAX];
+	unsigned int size = 1 + next_u8(in) % RING_MAX;
+	unsigned int n, skip, i;
+	long ret;
+
+	globalfifo_ring_init(&r, malloc(size), size);
+
+	while(in->left){
+		u8 op = next_u8(in);
+		n = next_u8(in) % (RING_MAX + 1);
+
+		switch(op % 7){
+		case 0: //write
+			for(i = 0; i < n; i++)
+				src[i] = next_u8(in);
+			ret = globalfifo_ring_write(&r, src, n);
+			assert(ret == min(n, size - m.len));
+			memcpy(m.data + m.len, src, ret);
+			m.len += ret;
+			break;
+		case 1: //read
+			ret = globalfifo_ring_read(&r, dst, n);
+			assert(ret == min(n, m.len));
+			assert(!memcmp(dst, m.data, ret));
+			memmove(m.data, m.data + ret, m.len - ret);
+			m.len -= ret;
+			break;
+		case 2: //peek, then consume part of it
+			skip = next_u8(in) % (RING_MAX + 1);
+			ret = globalfifo_ring_peek(&r, dst, n, skip);
+			assert(ret == (skip >= m.len ? 0 : min(n, m.len - skip)));
+			assert(!memcmp(dst, m.data + skip, ret));
+			n = min(n, m.len);
+			globalfifo_ring_consume(&r, n);
+			memmove(m.data, m.data + n, m.len - n);
+			m.len -= n;
+			break;
+		case 3: //fill through the tail span, like the inject fold
+			{
+				unsigned char *p;
+				unsigned int span = globalfifo_ring_tail_span(&r, &p);
+
+				n = min(n, span);
+				for(i = 0; i < n; i++)
+					p[i] = m.data[m.len + i] = next_u8(in);
+				globalfifo_ring_produce(&r, n);
+				m.len += n;
+			}
+			break;
+		case 4: //resize
+			{
+				unsigned int nsize = max(m.len, 1 + n % RING_MAX);
+				unsigned char *old = r.mem;
+
+				globalfifo_ring_move(&r, malloc(nsize), nsize);
+				free(old);
+				size = nsize;
+			}
+			break;
+		case 5:
+			globalfifo_ring_clear(&r);
+			m.len = 0;
+			break;
+		case 6: //append kernel memory, like the write-behind drainer
+			for(i = 0; i < n; i++)
+				src[i] = next_u8(in);
+			ret = globalfifo_ring_put(&r, src, n);
+			assert(ret == min(n, size - m.len));
+			memcpy(m.data + m.len, src, ret);
+			m.len += ret;
+			break;
+		}
+		check_ring(&r, &m);
+	}
+	free(r.mem);
+}
+
+//reference llseek in 128 bits, so it can't overflow where the real one has to be careful
+static loff_t ref_seek(loff_t cur, loff_t offset, int orig, size_t size){
+	__int128 pos;
+
+	if(orig == 0)
+		pos = offset;
+	else if(orig == 1)
+		pos = (__int128)cur + offset;
+	else
+		return -EINVAL;
+	if(pos < 0 || pos > (__int128)size)
+		return -EINVAL;
+	return (loff_t)pos;
+}
+
+static void fuzz_mem(struct input *in){
+	while(in->left){
+		size_t size = next_u8(in) << 8 | next_u8(in);
+		loff_t pos = (loff_t)next_u64(in);
+		loff_t offset = (loff_t)next_u64(in);
+		size_t count = (size_t)next_u64(in);
+		int orig = next_u8(in) % 3;
+		size_t span = globalmem_span(pos, count, size);
+
+		if(pos < 0 || (u64)pos >= size)
+			assert(span == 0);
+		else
+			assert(span == min(count, size - (size_t)pos) && pos + span <= size);
+
+		if(pos >= 0 && (u64)pos <= size)
+			assert(globalmem_seek(pos, offset, orig, size) == ref_seek(pos, offset, orig, size));
+		//the ioctl ranges, pos and count as raw u64s
+		assert(globalmem_range_ok((u64)pos, count, size) == ((unsigned __int128)(u64)pos + count <= size));
+	}
+}
+
+int LLVMFuzzerTestOneInput(const u8 *data, size_t size){
+	struct input in = { data, size };
+
+	if(next_u8(&in) & 1)
+		fuzz_mem(&in);
+	else
+		fuzz_ring(&in);
+	return 0;
+}
+
+#ifdef STANDALONE
+//replay the given files, or random inputs when there are none
+int main(int argc, char *argv[]){
+	static u8 buf[1 << 16];
+	int i, j;
+
+	if(argc > 1){
+		for(i = 1; i < argc; i++){
+			FILE *f = fopen(argv[i], "rb");
+			size_t n;
+
+			if(!f){
+				perror(argv[i]);
+				return 1;
+			}
+			n = fread(buf, 1, sizeof(buf), f);
+			fclose(f);
+			LLVMFuzzerTestOneInput(buf, n);
+		}
+		return 0;
+	}
+
+	srand(1);
+	for(i = 0; i < 100000; i++){
+		size_t n = rand() % 1024;
+
+		for(j = 0; j < (int)n; j++)
+			buf[j] = rand();
+		LLVMFuzzerTestOneInput(buf, n);
+	}
+	printf("100000 random inputs ok\n");
+	return 0;
+}
+#endif
@@ -0,0 +1,848 @@
+//KUnit suite for globalfifo. the driver is built into this object so the tests reach its static
+//functions, they run on private devices and leave /dev/global_fifo alone.
+#include "../2_scull_fifo_asymnc/global_fifo.c"
+#include "ldd_kunit.h"
+
+#define TEST_FIFO_SIZE	16
+
+static unsigned int globalfifo_bench_max_ns = 50000; //per write+read, 0 only reports
+module_param(globalfifo_bench_max_ns, uint, S_IRUGO | S_IWUSR);
+
+static struct globalfifo_dev *globalfifo_test_dev(struct kunit *test, unsigned int size){
+	struct globalfifo_dev *dev = kunit_kzalloc(test, sizeof(*dev), GFP_KERNEL);
+	unsigned char *mem = kunit_kzalloc(test, size, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dev);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, mem);
+	globalfifo_dev_init(dev, mem, size);
+	return dev;
+}
+
+static void globalfifo_test_stage_free(void *data){
+	struct globalfifo_dev *dev = data;
+
+	cancel_work_sync(&dev->wb_work);
+	globalfifo_stage_free(dev);
+}
+
+static void globalfifo_test_write_behind(struct kunit *test, struct globalfifo_dev *dev){
+	KUNIT_ASSERT_EQ(test, globalfifo_stage_alloc(dev), 0);
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, globalfifo_test_stage_free, dev), 0);
+	dev->write_behind = true;
+}
+
+static void globalfifo_test_rec_free(void *data){
+	globalfifo_set_recorder(data, false);
+}
+
+static struct globalfifo_rec *globalfifo_test_recorder(struct kunit *test, struct globalfifo_dev *dev){
+	KUNIT_ASSERT_EQ(test, globalfifo_set_recorder(dev, true), 0);
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, globalfifo_test_rec_free, dev), 0);
+	return rcu_dereference_raw(dev->rec);
+}
+
+//the filter and the place on rec_readers go as on release, gf is kunit memory
+static void globalfifo_test_file_release(void *data){
+	globalfifo_file_release(data);
+	rcu_barrier();
+}
+
+static struct file *globalfifo_test_file(struct kunit *test, struct globalfifo_dev *dev, unsigned int flags){
+	struct file *filp = kunit_kzalloc(test, sizeof(*filp), GFP_KERNEL);
+	struct globalfifo_file *gf = kunit_kzalloc(test, sizeof(*gf), GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, filp);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, gf);
+	globalfifo_file_init(gf, dev);
+	gf->busy_poll_us = 0;
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, globalfifo_test_file_release, gf), 0);
+	filp->private_data = gf;
+	filp->f_flags = flags;
+	return filp;
+}
+
+static void globalfifo_test_fill(struct kunit *test, char __user *ubuf, unsigned char first, size_t n){
+	unsigned char tmp[64];
+	size_t i;
+
+	KUNIT_ASSERT_LE(test, n, sizeof(tmp));
+	for(i = 0; i < n; i++)
+		tmp[i] = first + i;
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, tmp, n), 0);
+}
+
+static void globalfifo_test_expect(struct kunit *test, const char __user *ubuf, unsigned char first, size_t n){
+	unsigned char tmp[64];
+	size_t i;
+
+	KUNIT_ASSERT_LE(test, n, sizeof(tmp));
+	KUNIT_ASSERT_EQ(test, copy_from_user(tmp, ubuf, n), 0);
+	for(i = 0; i < n; i++)
+		KUNIT_EXPECT_EQ_MSG(test, tmp[i], (unsigned char)(first + i), "byte %zu", i);
+}
+
+/*****************ring******************/
+static void globalfifo_test_ring_wrap(struct kunit *test){
+	struct globalfifo_ring r;
+	unsigned char mem[TEST_FIFO_SIZE];
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+
+	globalfifo_ring_init(&r, mem, sizeof(mem));
+	globalfifo_test_fill(test, ubuf, 0, 12);
+	KUNIT_EXPECT_EQ(test, globalfifo_ring_write(&r, ubuf, 12), 12);
+	KUNIT_EXPECT_EQ(test, globalfifo_ring_read(&r, ubuf, 8), 8);
+	globalfifo_test_expect(test, ubuf, 0, 8);
+
+	//4 queued from offset 8, the next 10 bytes run off the end and continue at 0
+	globalfifo_test_fill(test, ubuf, 12, 10);
+	KUNIT_EXPECT_EQ(test, globalfifo_ring_write(&r, ubuf, 10), 10);
+	KUNIT_EXPECT_EQ(test, r.head, 8U);
+	KUNIT_EXPECT_EQ(test, r.len, 14U);
+	//only 2 bytes of room, a short write
+	KUNIT_EXPECT_EQ(test, globalfifo_ring_write(&r, ubuf, 10), 2);
+	KUNIT_EXPECT_EQ(test, globalfifo_ring_room(&r), 0U);
+
+	KUNIT_EXPECT_EQ(test, globalfifo_ring_peek(&r, ubuf, 6, 2), 6);
+	globalfifo_test_expect(test, ubuf, 10, 6);
+	KUNIT_EXPECT_EQ(test, globalfifo_ring_read(&r, ubuf, 14), 14);
+	globalfifo_test_expect(test, ubuf, 8, 14);
+	KUNIT_EXPECT_EQ(test, r.len, 2U);
+	globalfifo_ring_consume(&r, 2);
+	KUNIT_EXPECT_EQ(test, r.head, 0U); //empty restarts at 0
+}
+
+static void globalfifo_test_ring_move(struct kunit *test){
+	struct globalfifo_ring r;
+	unsigned char mem[TEST_FIFO_SIZE], big[2 * TEST_FIFO_SIZE];
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+
+	globalfifo_ring_init(&r, mem, sizeof(mem));
+	globalfifo_test_fill(test, ubuf, 0, 16);
+	globalfifo_ring_write(&r, ubuf, 16);
+	globalfifo_ring_read(&r, ubuf, 10);
+	globalfifo_test_fill(test, ubuf, 16, 8);
+	globalfifo_ring_write(&r, ubuf, 8); //wrapped, 6 at the end and 8 at the start
+
+	globalfifo_ring_move(&r, big, sizeof(big));
+	KUNIT_EXPECT_EQ(test, r.head, 0U);
+	KUNIT_EXPECT_EQ(test, r.len, 14U);
+	KUNIT_EXPECT_EQ(test, r.size, (unsigned int)sizeof(big));
+	KUNIT_EXPECT_EQ(test, globalfifo_ring_read(&r, ubuf, 64), 14);
+	globalfifo_test_expect(test, ubuf, 10, 14);
+}
+
+/*****************fops******************/
+static void globalfifo_test_nonblock(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, O_NONBLOCK);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	loff_t pos = 0;
+
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf, 4, &pos), -EAGAIN);
+	globalfifo_test_fill(test, ubuf, 0, 20);
+	KUNIT_EXPECT_EQ(test, globalfifo_write(filp, ubuf, 20, &pos), TEST_FIFO_SIZE);
+	KUNIT_EXPECT_EQ(test, globalfifo_write(filp, ubuf, 1, &pos), -EAGAIN);
+	KUNIT_EXPECT_EQ(test, globalfifo_poll(filp, NULL), POLLIN | POLLRDNORM);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf, 64, &pos), TEST_FIFO_SIZE);
+	globalfifo_test_expect(test, ubuf, 0, TEST_FIFO_SIZE);
+	KUNIT_EXPECT_EQ(test, globalfifo_poll(filp, NULL), POLLOUT | POLLWRNORM);
+	KUNIT_EXPECT_EQ(test, dev->stats.bytes_read, (u64)TEST_FIFO_SIZE);
+	KUNIT_EXPECT_EQ(test, dev->stats.read_sleeps, 0ULL);
+}
+
+//what the peer does once the test task sleeps in the fifo
+struct globalfifo_test_op{
+	struct file *filp;
+	u64 *sleeps; //wait for this counter to move first, NULL just waits a little
+	char __user *buf;
+	size_t count[2]; //one or two calls, count[1] may be 0
+	bool write;
+};
+
+static int globalfifo_test_peer(struct ldd_kunit_peer *peer){
+	struct globalfifo_test_op *op = peer->data;
+	loff_t pos = 0;
+	int i, ret = 0, n;
+
+	if(!op->sleeps)
+		usleep_range(2000, 3000); //well inside the 10ms spin budget of the busy-poll case
+	else if(!ldd_kunit_wait_u64(op->sleeps, 0))
+		return -ETIMEDOUT;
+	for(i = 0; i < 2 && op->count[i]; i++){
+		if(op->write)
+			n = globalfifo_write(op->filp, op->buf + ret, op->count[i], &pos);
+		else
+			n = globalfifo_read(op->filp, op->buf + ret, op->count[i], &pos);
+		if(n < 0)
+			return n;
+		ret += n;
+		msleep(10); //give a wrong wakeup time to show up
+	}
+	return ret;
+}
+
+static void globalfifo_test_read_wakeup(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, 0);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalfifo_test_op op = {
+		.filp = filp, .sleeps = &dev->stats.read_sleeps,
+		.buf = ubuf + 64, .count = { 5 }, .write = true,
+	};
+	struct ldd_kunit_peer *peer;
+	loff_t pos = 0;
+
+	globalfifo_test_fill(test, op.buf, 40, 5);
+	peer = ldd_kunit_peer_start(test, globalfifo_test_peer, &op, sizeof(op));
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf, 8, &pos), 5);
+	KUNIT_EXPECT_EQ(test, ldd_kunit_peer_wait(peer), 5);
+	globalfifo_test_expect(test, ubuf, 40, 5);
+	KUNIT_EXPECT_EQ(test, dev->stats.read_sleeps, 1ULL);
+}
+
+//with read_watermark 8 the first 4 bytes must not wake the reader
+static void globalfifo_test_read_watermark(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, 0);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalfifo_test_op op = {
+		.filp = filp, .sleeps = &dev->stats.read_sleeps,
+		.buf = ubuf + 64, .count = { 4, 4 }, .write = true,
+	};
+	struct ldd_kunit_peer *peer;
+	loff_t pos = 0;
+
+	dev->read_wm = 8;
+	globalfifo_test_fill(test, op.buf, 0, 8);
+	peer = ldd_kunit_peer_start(test, globalfifo_test_peer, &op, sizeof(op));
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf, 16, &pos), 8);
+	KUNIT_EXPECT_EQ(test, ldd_kunit_peer_wait(peer), 8);
+	globalfifo_test_expect(test, ubuf, 0, 8);
+	KUNIT_EXPECT_EQ(test, dev->stats.read_sleeps, 1ULL);
+}
+
+static void globalfifo_test_write_wakeup(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, 0);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalfifo_test_op op = {
+		.filp = filp, .sleeps = &dev->stats.write_sleeps,
+		.buf = ubuf + 64, .count = { 8 }, .write = false,
+	};
+	struct ldd_kunit_peer *peer;
+	loff_t pos = 0;
+
+	globalfifo_test_fill(test, ubuf, 0, TEST_FIFO_SIZE);
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf, TEST_FIFO_SIZE, &pos), TEST_FIFO_SIZE);
+
+	globalfifo_test_fill(test, ubuf, 16, 8);
+	peer = ldd_kunit_peer_start(test, globalfifo_test_peer, &op, sizeof(op));
+	KUNIT_EXPECT_EQ(test, globalfifo_write(filp, ubuf, 8, &pos), 8);
+	KUNIT_EXPECT_EQ(test, ldd_kunit_peer_wait(peer), 8);
+	globalfifo_test_expect(test, op.buf, 0, 8);
+	KUNIT_EXPECT_EQ(test, dev->ring.len, (unsigned int)TEST_FIFO_SIZE);
+	KUNIT_EXPECT_EQ(test, dev->stats.write_sleeps, 1ULL);
+}
+
+//a write up to atomic_size goes in whole or not at all, a bigger one may still be short
+static void globalfifo_test_atomic_nonblock(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, O_NONBLOCK);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	loff_t pos = 0;
+
+	dev->atomic_size = 8;
+	globalfifo_test_fill(test, ubuf, 0, 20);
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf, 12, &pos), 12);
+	KUNIT_EXPECT_EQ(test, globalfifo_poll(filp, NULL), POLLIN | POLLRDNORM);
+	KUNIT_EXPECT_EQ(test, globalfifo_write(filp, ubuf + 12, 8, &pos), -EAGAIN);
+	KUNIT_EXPECT_EQ(test, dev->ring.len, 12U);
+	KUNIT_EXPECT_EQ(test, globalfifo_write(filp, ubuf + 12, 4, &pos), 4);
+
+	KUNIT_ASSERT_EQ(test, globalfifo_read(filp, ubuf + 64, 12, &pos), 12);
+	globalfifo_test_expect(test, ubuf + 64, 0, 12);
+	KUNIT_EXPECT_EQ(test, globalfifo_write(filp, ubuf, 20, &pos), 12);
+	KUNIT_EXPECT_EQ(test, dev->ring.len, (unsigned int)TEST_FIFO_SIZE);
+}
+
+//the first 4 bytes read leave too little room, the atomic write goes in after the next 4
+static void globalfifo_test_atomic_wakeup(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, 0);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalfifo_test_op op = {
+		.filp = filp, .sleeps = &dev->stats.write_sleeps,
+		.buf = ubuf + 64, .count = { 4, 4 }, .write = false,
+	};
+	struct ldd_kunit_peer *peer;
+	loff_t pos = 0;
+
+	dev->atomic_size = 8;
+	globalfifo_test_fill(test, ubuf, 0, TEST_FIFO_SIZE);
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf, TEST_FIFO_SIZE, &pos), TEST_FIFO_SIZE);
+
+	globalfifo_test_fill(test, ubuf, 16, 8);
+	peer = ldd_kunit_peer_start(test, globalfifo_test_peer, &op, sizeof(op));
+	KUNIT_EXPECT_EQ(test, globalfifo_write(filp, ubuf, 8, &pos), 8);
+	KUNIT_EXPECT_EQ(test, ldd_kunit_peer_wait(peer), 8);
+	globalfifo_test_expect(test, op.buf, 0, 8);
+	KUNIT_EXPECT_EQ(test, dev->ring.len, (unsigned int)TEST_FIFO_SIZE);
+	//woken by the first read with write_watermark 1, then back to sleep
+	KUNIT_EXPECT_EQ(test, dev->stats.write_sleeps, 2ULL);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf + 128, TEST_FIFO_SIZE, &pos), TEST_FIFO_SIZE);
+	globalfifo_test_expect(test, ubuf + 128, 8, TEST_FIFO_SIZE);
+}
+
+//look without consuming, then release part of it
+static void globalfifo_test_peek_commit(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, O_NONBLOCK);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalfifo_peek __user *pk = (struct globalfifo_peek __user *)(ubuf + 256);
+	struct globalfifo_ring_pos __user *upos = (struct globalfifo_ring_pos __user *)(ubuf + 512);
+	u32 __user *n = (u32 __user *)(ubuf + 768);
+	struct globalfifo_peek kpk = { .buf = (u64)(uintptr_t)(ubuf + 64), .len = 4, .skip = 2 };
+	struct globalfifo_ring_pos pos;
+	loff_t off = 0;
+
+	globalfifo_test_fill(test, ubuf, 0, 14);
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf, 14, &off), 14);
+
+	KUNIT_ASSERT_EQ(test, copy_to_user(pk, &kpk, sizeof(kpk)), 0);
+	KUNIT_EXPECT_EQ(test, globalfifo_ioctl(filp, GLOBALFIFO_PEEK, (unsigned long)pk), 4L);
+	globalfifo_test_expect(test, ubuf + 64, 2, 4);
+	KUNIT_EXPECT_EQ(test, dev->ring.len, 14U);
+
+	KUNIT_EXPECT_EQ(test, globalfifo_ioctl(filp, GLOBALFIFO_GET_RING, (unsigned long)upos), 0L);
+	KUNIT_ASSERT_EQ(test, copy_from_user(&pos, upos, sizeof(pos)), 0);
+	KUNIT_EXPECT_EQ(test, pos.head, 0U);
+	KUNIT_EXPECT_EQ(test, pos.len, 14U);
+	KUNIT_EXPECT_EQ(test, pos.size, (u32)TEST_FIFO_SIZE);
+
+	KUNIT_ASSERT_EQ(test, put_user(15, n), 0);
+	KUNIT_EXPECT_EQ(test, globalfifo_ioctl(filp, GLOBALFIFO_COMMIT, (unsigned long)n), -EINVAL);
+	KUNIT_ASSERT_EQ(test, put_user(10, n), 0);
+	KUNIT_EXPECT_EQ(test, globalfifo_ioctl(filp, GLOBALFIFO_COMMIT, (unsigned long)n), 0L);
+	KUNIT_EXPECT_EQ(test, dev->stats.bytes_read, 10ULL);
+
+	//the head moved, the rest wraps past the end
+	KUNIT_EXPECT_EQ(test, globalfifo_write(filp, ubuf, 14, &off), 12);
+	KUNIT_EXPECT_EQ(test, globalfifo_ioctl(filp, GLOBALFIFO_GET_RING, (unsigned long)upos), 0L);
+	KUNIT_ASSERT_EQ(test, copy_from_user(&pos, upos, sizeof(pos)), 0);
+	KUNIT_EXPECT_EQ(test, pos.head, 10U);
+	KUNIT_EXPECT_EQ(test, pos.len, (u32)TEST_FIFO_SIZE);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf + 128, 4, &off), 4);
+	globalfifo_test_expect(test, ubuf + 128, 10, 4);
+}
+
+static void globalfifo_test_spin_budget(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, 0);
+	struct globalfifo_file *gf = filp->private_data;
+
+	KUNIT_EXPECT_EQ(test, globalfifo_spin_ns(dev, gf), 0ULL);
+	gf->busy_poll_us = 50;
+	//no arrivals seen yet, the whole budget
+	KUNIT_EXPECT_EQ(test, globalfifo_spin_ns(dev, gf), 50000ULL);
+	dev->gap_ewma_ns = 10000;
+	KUNIT_EXPECT_EQ(test, globalfifo_spin_ns(dev, gf), 20000ULL);
+	dev->gap_ewma_ns = 40000;
+	KUNIT_EXPECT_EQ(test, globalfifo_spin_ns(dev, gf), 50000ULL);
+	//writes come slower than we would spin, don't bother
+	dev->gap_ewma_ns = 60000;
+	KUNIT_EXPECT_EQ(test, globalfifo_spin_ns(dev, gf), 0ULL);
+
+	//the average moves 1/8 of the way to a new gap
+	dev->gap_ewma_ns = 8000;
+	dev->last_arrival_ns = ktime_get_ns() - 80000;
+	globalfifo_note_arrival(dev);
+	KUNIT_EXPECT_GE(test, dev->gap_ewma_ns, 8000ULL - 1000 + 10000);
+	KUNIT_EXPECT_LT(test, dev->gap_ewma_ns, 8000ULL - 1000 + 20000);
+}
+
+//a spinning reader picks the data up without sleeping, unless the writer needed its CPU
+static void globalfifo_test_busy_poll(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, 0);
+	struct globalfifo_file *gf = filp->private_data;
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalfifo_test_op op = {
+		.filp = filp, .sleeps = NULL, .buf = ubuf + 64, .count = { 5 }, .write = true,
+	};
+	struct ldd_kunit_peer *peer;
+	loff_t pos = 0;
+
+	gf->busy_poll_us = GLOBALFIFO_BUSY_POLL_MAX;
+	globalfifo_test_fill(test, op.buf, 0, 5);
+	peer = ldd_kunit_peer_start(test, globalfifo_test_peer, &op, sizeof(op));
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf, 8, &pos), 5);
+	KUNIT_EXPECT_EQ(test, ldd_kunit_peer_wait(peer), 5);
+	globalfifo_test_expect(test, ubuf, 0, 5);
+	KUNIT_EXPECT_EQ(test, dev->stats.busy_poll_hits + dev->stats.busy_poll_misses, 1ULL);
+	//a hit never sleeps, a miss sleeps once
+	KUNIT_EXPECT_EQ(test, dev->stats.read_sleeps, dev->stats.busy_poll_misses);
+	if(num_online_cpus() > 1)
+		KUNIT_EXPECT_EQ(test, dev->stats.busy_poll_hits, 1ULL);
+}
+
+/*****************write-behind**********/
+static void globalfifo_test_wb_barrier(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, O_NONBLOCK);
+	struct globalfifo_file *gf = filp->private_data;
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	loff_t pos = 0;
+
+	globalfifo_test_write_behind(test, dev);
+	globalfifo_test_fill(test, ubuf, 0, 10);
+	KUNIT_EXPECT_EQ(test, globalfifo_write(filp, ubuf, 6, &pos), 6);
+	KUNIT_EXPECT_EQ(test, globalfifo_write(filp, ubuf + 6, 4, &pos), 4);
+	KUNIT_EXPECT_EQ(test, gf->wb_last, 2ULL);
+	KUNIT_EXPECT_EQ(test, globalfifo_fsync(filp, 0, LLONG_MAX, 0), 0);
+	KUNIT_EXPECT_EQ(test, dev->wb_done, 2ULL);
+	KUNIT_EXPECT_EQ(test, dev->ring.len, 10U);
+	KUNIT_EXPECT_EQ(test, dev->stats.bytes_written, 10ULL);
+	KUNIT_EXPECT_GE(test, dev->stats.wb_batches, 1ULL);
+
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf + 64, 64, &pos), 10);
+	globalfifo_test_expect(test, ubuf + 64, 0, 10);
+}
+
+//stage a record by hand into the shard of cpu
+static void globalfifo_test_stage(struct globalfifo_dev *dev, int cpu, u64 seq, unsigned char first, unsigned int len){
+	struct globalfifo_stage *st = per_cpu_ptr(dev->stage, cpu);
+	struct globalfifo_stage_hdr hdr = { .seq = seq, .len = len };
+	unsigned int i;
+
+	memcpy(st->buf + st->len, &hdr, sizeof(hdr));
+	for(i = 0; i < len; i++)
+		st->buf[st->len + sizeof(hdr) + i] = first + i;
+	st->len += sizeof(hdr) + len;
+}
+
+//one writer that hopped cpus: the drain follows seq, not the shards
+static void globalfifo_test_wb_merge(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, 64);
+	struct file *filp = globalfifo_test_file(test, dev, O_NONBLOCK);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	int a = cpumask_first(cpu_possible_mask), b = cpumask_next(a, cpu_possible_mask);
+	loff_t pos = 0;
+
+	if(b >= nr_cpu_ids)
+		kunit_skip(test, "needs two possible cpus");
+	globalfifo_test_write_behind(test, dev);
+	globalfifo_test_stage(dev, b, 0, 0, 3);
+	globalfifo_test_stage(dev, a, 1, 3, 4);
+	globalfifo_test_stage(dev, b, 2, 7, 5);
+	//seq 3 is past the cut and stays staged
+	atomic64_set(&dev->wb_next_seq, 3);
+	globalfifo_test_stage(dev, a, 3, 12, 2);
+
+	globalfifo_wb_work(&dev->wb_work);
+	KUNIT_EXPECT_EQ(test, dev->wb_done, 3ULL);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf, 64, &pos), 12);
+	globalfifo_test_expect(test, ubuf, 0, 12);
+
+	atomic64_set(&dev->wb_next_seq, 4);
+	globalfifo_wb_work(&dev->wb_work);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf, 64, &pos), 2);
+	globalfifo_test_expect(test, ubuf, 12, 2);
+	KUNIT_EXPECT_EQ(test, per_cpu_ptr(dev->stage, a)->len, 0U);
+	KUNIT_EXPECT_EQ(test, per_cpu_ptr(dev->stage, b)->len, 0U);
+}
+
+//a record larger than the free room is split, the rest goes when a reader makes room
+static void globalfifo_test_wb_ring_full(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, O_NONBLOCK);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	loff_t pos = 0;
+
+	globalfifo_test_write_behind(test, dev);
+	globalfifo_test_stage(dev, raw_smp_processor_id(), 0, 0, 24);
+	atomic64_set(&dev->wb_next_seq, 1);
+
+	globalfifo_wb_work(&dev->wb_work);
+	KUNIT_EXPECT_EQ(test, dev->ring.len, (unsigned int)TEST_FIFO_SIZE);
+	KUNIT_EXPECT_EQ(test, dev->wb_done, 0ULL);
+	KUNIT_EXPECT_TRUE(test, globalfifo_wb_pending(dev));
+
+	//the read queues the drain again
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf, 10, &pos), 10);
+	flush_work(&dev->wb_work);
+	KUNIT_EXPECT_EQ(test, dev->wb_done, 1ULL);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf + 10, 64, &pos), 14);
+	globalfifo_test_expect(test, ubuf, 0, 24);
+}
+
+//bytes queued from atomic context reach the ring on the next read
+static void globalfifo_test_inject_fold(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, O_NONBLOCK);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	unsigned char msg[24];
+	loff_t pos = 0;
+	int i;
+
+	for(i = 0; i < sizeof(msg); i++)
+		msg[i] = i;
+	//more than the ring holds, the rest is folded in as reads make room
+	KUNIT_ASSERT_EQ(test, kfifo_in(&dev->inject, msg, sizeof(msg)), sizeof(msg));
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf, 10, &pos), 10);
+	globalfifo_test_expect(test, ubuf, 0, 10);
+	KUNIT_EXPECT_EQ(test, dev->ring.len, 14U);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf, 64, &pos), 14);
+	globalfifo_test_expect(test, ubuf, 10, 14);
+	KUNIT_EXPECT_TRUE(test, kfifo_is_empty(&dev->inject));
+}
+
+/*****************latency***************/
+static void globalfifo_test_lat_off(void *data){
+	static_branch_disable(&globalfifo_lat_key);
+}
+
+static u64 globalfifo_test_samples(struct globalfifo_dev *dev, enum globalfifo_lat lat){
+	u64 n = 0;
+	int b;
+
+	for(b = 0; b < GLOBALFIFO_HIST_BUCKETS; b++)
+		n += dev->hist[lat][b];
+	return n;
+}
+
+//check the record at off of a recorder read
+static void globalfifo_test_rec_expect(struct kunit *test, const char __user *ubuf, size_t off,
+		u64 seq, u32 len, u32 lost, unsigned char first){
+	struct globalfifo_rec_hdr hdr;
+
+	KUNIT_ASSERT_EQ(test, copy_from_user(&hdr, ubuf + off, sizeof(hdr)), 0);
+	KUNIT_EXPECT_EQ(test, hdr.seq, seq);
+	KUNIT_EXPECT_EQ(test, hdr.len, len);
+	KUNIT_EXPECT_EQ(test, hdr.lost, lost);
+	globalfifo_test_expect(test, ubuf + off + sizeof(hdr), first, len);
+}
+
+//20 records into 16 slots: the writer never blocks and the reader is told about the 4 it missed
+static void globalfifo_test_rec_overwrite(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, O_NONBLOCK);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalfifo_rec *rec = globalfifo_test_recorder(test, dev);
+	size_t stride = ALIGN(sizeof(struct globalfifo_rec_hdr) + 4, GLOBALFIFO_REC_ALIGN);
+	loff_t pos = 0;
+	int i;
+
+	KUNIT_EXPECT_EQ(test, rec->mask, (u64)GLOBALFIFO_REC_MIN_SLOTS - 1);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf, 64, &pos), -EAGAIN);
+	for(i = 0; i < 20; i++){
+		globalfifo_test_fill(test, ubuf, i, 4);
+		KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf, 4, &pos), 4);
+	}
+	KUNIT_EXPECT_EQ(test, globalfifo_write(filp, ubuf, GLOBALFIFO_REC_MAX + 1, &pos), -EMSGSIZE);
+	KUNIT_EXPECT_EQ(test, globalfifo_poll(filp, NULL), POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM);
+	KUNIT_EXPECT_EQ(test, dev->ring.len, 0U);
+
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf + 64, 8, &pos), -EINVAL);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf + 64, 2048, &pos), 15 * stride + sizeof(struct globalfifo_rec_hdr) + 4);
+	globalfifo_test_rec_expect(test, ubuf + 64, 0, 4, 4, 4, 4);
+	globalfifo_test_rec_expect(test, ubuf + 64, stride, 5, 4, 0, 5);
+	globalfifo_test_rec_expect(test, ubuf + 64, 15 * stride, 19, 4, 0, 19);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->rec_lost), 4LL);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf + 64, 2048, &pos), -EAGAIN);
+	KUNIT_EXPECT_EQ(test, globalfifo_poll(filp, NULL), POLLOUT | POLLWRNORM);
+
+	//back to a fifo, the bytes go to the ring again
+	KUNIT_ASSERT_EQ(test, globalfifo_set_recorder(dev, false), 0);
+	KUNIT_EXPECT_EQ(test, globalfifo_write(filp, ubuf, 4, &pos), 4);
+	KUNIT_EXPECT_EQ(test, dev->ring.len, 4U);
+}
+
+//a slot still busy with an older writer costs the new record, the reader skips it without waiting
+static void globalfifo_test_rec_skip(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, O_NONBLOCK);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalfifo_rec *rec = globalfifo_test_recorder(test, dev);
+	size_t stride = ALIGN(sizeof(struct globalfifo_rec_hdr) + 2, GLOBALFIFO_REC_ALIGN);
+	loff_t pos = 0;
+
+	globalfifo_test_fill(test, ubuf, 0, 6);
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf, 2, &pos), 2);
+	atomic64_set(&rec->slot[1].stamp, 1); //odd, a writer is in there
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf + 2, 2, &pos), 2);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&rec->slot[1].skip), 2LL);
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf + 4, 2, &pos), 2);
+
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf + 64, 2048, &pos), stride + sizeof(struct globalfifo_rec_hdr) + 2);
+	globalfifo_test_rec_expect(test, ubuf + 64, 0, 0, 2, 0, 0);
+	globalfifo_test_rec_expect(test, ubuf + 64, stride, 2, 2, 1, 4);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->rec_lost), 1LL);
+
+	//a record whose writer is still busy is waited for
+	atomic64_set(&rec->next, 4);
+	atomic64_set(&rec->slot[3].stamp, 2 * 3 + 1);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf + 64, 2048, &pos), -EAGAIN);
+	KUNIT_EXPECT_EQ(test, globalfifo_poll(filp, NULL), POLLOUT | POLLWRNORM);
+}
+
+//a blocking recorder read sleeps until a record comes
+static void globalfifo_test_rec_wakeup(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, 0);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalfifo_test_op op = {
+		.filp = filp, .sleeps = NULL, .buf = ubuf + 64, .count = { 5 }, .write = true,
+	};
+	struct ldd_kunit_peer *peer;
+	loff_t pos = 0;
+
+	globalfifo_test_recorder(test, dev);
+	globalfifo_test_fill(test, op.buf, 40, 5);
+	peer = ldd_kunit_peer_start(test, globalfifo_test_peer, &op, sizeof(op));
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf + 128, 256, &pos), sizeof(struct globalfifo_rec_hdr) + 5);
+	KUNIT_EXPECT_EQ(test, ldd_kunit_peer_wait(peer), 5);
+	globalfifo_test_rec_expect(test, ubuf + 128, 0, 0, 5, 0, 40);
+}
+
+//a writer asleep on a full fifo goes over to the recorder when the mode is switched, and doesn't block
+static void globalfifo_test_rec_switch_writer(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, O_NONBLOCK);
+	struct file *wfilp = globalfifo_test_file(test, dev, 0);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalfifo_test_op op = {
+		.filp = wfilp, .sleeps = NULL, .buf = ubuf + 64, .count = { 4 }, .write = true,
+	};
+	struct ldd_kunit_peer *peer;
+	loff_t pos = 0;
+
+	globalfifo_test_fill(test, ubuf, 0, TEST_FIFO_SIZE);
+	globalfifo_test_fill(test, op.buf, 40, 4);
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf, TEST_FIFO_SIZE, &pos), TEST_FIFO_SIZE);
+	peer = ldd_kunit_peer_start(test, globalfifo_test_peer, &op, sizeof(op));
+	KUNIT_ASSERT_TRUE(test, ldd_kunit_wait_u64(&dev->stats.write_sleeps, 0));
+	globalfifo_test_recorder(test, dev);
+	KUNIT_EXPECT_EQ(test, ldd_kunit_peer_wait(peer), 4);
+	KUNIT_EXPECT_EQ(test, dev->ring.len, (unsigned int)TEST_FIFO_SIZE);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf + 128, 256, &pos), sizeof(struct globalfifo_rec_hdr) + 4);
+	globalfifo_test_rec_expect(test, ubuf + 128, 0, 0, 4, 0, 40);
+}
+
+//keep 3 bytes of the records starting with 7, skip the others
+static void globalfifo_test_set_filter(struct kunit *test, struct file *filp, char __user *ubuf){
+	struct sock_filter insns[] = {
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 7, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 3),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog fprog = { .len = ARRAY_SIZE(insns), .filter = (struct sock_filter __user *)(ubuf + 64) };
+
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf + 64, insns, sizeof(insns)), 0);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &fprog, sizeof(fprog)), 0);
+	KUNIT_ASSERT_EQ(test, globalfifo_ioctl(filp, GLOBALFIFO_SET_FILTER, (unsigned long)ubuf), 0L);
+}
+
+static void globalfifo_test_rec_filter(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, O_NONBLOCK);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalfifo_filter_stats __user *ust = (struct globalfifo_filter_stats __user *)(ubuf + 512);
+	size_t stride = ALIGN(sizeof(struct globalfifo_rec_hdr) + 3, GLOBALFIFO_REC_ALIGN);
+	struct sock_filter bad = BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0); //doesn't return
+	struct sock_fprog fprog = { .len = 1, .filter = (struct sock_filter __user *)(ubuf + 64) };
+	struct globalfifo_filter_stats st;
+	loff_t pos = 0;
+
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf + 64, &bad, sizeof(bad)), 0);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &fprog, sizeof(fprog)), 0);
+	//a fifo has no records to run it on
+	KUNIT_EXPECT_EQ(test, globalfifo_ioctl(filp, GLOBALFIFO_SET_FILTER, (unsigned long)ubuf), -EOPNOTSUPP);
+	globalfifo_test_recorder(test, dev);
+	KUNIT_EXPECT_EQ(test, globalfifo_ioctl(filp, GLOBALFIFO_GET_FILTER_STATS, (unsigned long)ust), -ENOENT);
+	KUNIT_EXPECT_EQ(test, globalfifo_ioctl(filp, GLOBALFIFO_SET_FILTER, (unsigned long)ubuf), -EINVAL);
+	globalfifo_test_set_filter(test, filp, ubuf);
+
+	globalfifo_test_fill(test, ubuf + 256, 7, 5);
+	globalfifo_test_fill(test, ubuf + 264, 8, 5);
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf + 256, 5, &pos), 5);
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf + 264, 5, &pos), 5);
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf + 256, 2, &pos), 2);
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf + 264, 1, &pos), 1);
+
+	//the last record is a miss, poll passes it
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf + 1024, 2048, &pos), stride + sizeof(struct globalfifo_rec_hdr) + 2);
+	globalfifo_test_rec_expect(test, ubuf + 1024, 0, 0, 3, 0, 7);
+	globalfifo_test_rec_expect(test, ubuf + 1024, stride, 2, 2, 0, 7);
+	KUNIT_EXPECT_EQ(test, globalfifo_poll(filp, NULL), POLLOUT | POLLWRNORM);
+	KUNIT_EXPECT_EQ(test, globalfifo_ioctl(filp, GLOBALFIFO_GET_FILTER_STATS, (unsigned long)ust), 0L);
+	KUNIT_ASSERT_EQ(test, copy_from_user(&st, ust, sizeof(st)), 0);
+	KUNIT_EXPECT_EQ(test, st.hits, 2ULL);
+	KUNIT_EXPECT_EQ(test, st.misses, 2ULL);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->rec_lost), 0LL);
+
+	//detached, everything again
+	fprog.len = 0;
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &fprog, sizeof(fprog)), 0);
+	KUNIT_EXPECT_EQ(test, globalfifo_ioctl(filp, GLOBALFIFO_SET_FILTER, (unsigned long)ubuf), 0L);
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf + 264, 1, &pos), 1);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf + 1024, 2048, &pos), sizeof(struct globalfifo_rec_hdr) + 1);
+	globalfifo_test_rec_expect(test, ubuf + 1024, 0, 4, 1, 0, 8);
+}
+
+//the writer runs the filter of a blocked reader: a record it skips doesn't even wake it, the one it wants ends the read
+static void globalfifo_test_rec_filter_wakeup(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, 0);
+	struct globalfifo_file *gf = filp->private_data;
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalfifo_test_op op = {
+		.filp = filp, .sleeps = NULL, .buf = ubuf + 1024, .count = { 256 }, .write = false,
+	};
+	struct ldd_kunit_peer *peer;
+	unsigned long nvcsw;
+	loff_t pos = 0;
+	int i;
+
+	globalfifo_test_recorder(test, dev);
+	globalfifo_test_set_filter(test, filp, ubuf);
+	globalfifo_test_fill(test, ubuf + 256, 8, 2);
+	globalfifo_test_fill(test, ubuf + 258, 7, 4);
+	peer = ldd_kunit_peer_start(test, globalfifo_test_peer, &op, sizeof(op));
+	for(i = 0; i < 1000 && !wq_has_sleeper(&gf->rec_wait); i++)
+		msleep(1);
+	KUNIT_ASSERT_TRUE(test, wq_has_sleeper(&gf->rec_wait));
+
+	//a reader that was woken sleeps again, which its voluntary switches would show
+	nvcsw = READ_ONCE(peer->task->nvcsw);
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf + 256, 2, &pos), 2);
+	msleep(20);
+	KUNIT_EXPECT_EQ(test, READ_ONCE(peer->task->nvcsw), nvcsw);
+	KUNIT_EXPECT_FALSE(test, completion_done(&peer->done));
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf + 258, 4, &pos), 4);
+	KUNIT_EXPECT_EQ(test, ldd_kunit_peer_wait(peer), sizeof(struct globalfifo_rec_hdr) + 3);
+	globalfifo_test_rec_expect(test, ubuf + 1024, 0, 1, 3, 0, 7);
+	KUNIT_EXPECT_EQ(test, rcu_dereference_raw(gf->filter)->misses, 1ULL);
+}
+
+//a write is timed when its last byte is read, bytes queued before timing was on are skipped
+static void globalfifo_test_latency(struct kunit *test){
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, TEST_FIFO_SIZE);
+	struct file *filp = globalfifo_test_file(test, dev, O_NONBLOCK);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	loff_t pos = 0;
+
+	if(static_key_enabled(&globalfifo_lat_key))
+		kunit_skip(test, "latency timing is on for the real device");
+	globalfifo_test_fill(test, ubuf, 0, 16);
+	KUNIT_ASSERT_EQ(test, globalfifo_write(filp, ubuf, 3, &pos), 3);
+
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, globalfifo_test_lat_off, NULL), 0);
+	globalfifo_lock(dev);
+	globalfifo_lat_restart(dev);
+	static_branch_enable(&globalfifo_lat_key);
+	globalfifo_unlock(dev);
+	KUNIT_EXPECT_EQ(test, dev->lat_skip, 3U);
+
+	KUNIT_EXPECT_EQ(test, globalfifo_write(filp, ubuf, 6, &pos), 6);
+	KUNIT_EXPECT_EQ(test, globalfifo_write(filp, ubuf, 4, &pos), 4);
+	KUNIT_EXPECT_EQ(test, dev->ts_len, 2U);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf, 8, &pos), 8);
+	KUNIT_EXPECT_EQ(test, globalfifo_test_samples(dev, GLOBALFIFO_LAT_QUEUE), 0ULL);
+	KUNIT_EXPECT_EQ(test, globalfifo_read(filp, ubuf, 8, &pos), 5);
+	KUNIT_EXPECT_EQ(test, globalfifo_test_samples(dev, GLOBALFIFO_LAT_QUEUE), 2ULL);
+	KUNIT_EXPECT_EQ(test, dev->ts_len, 0U);
+	//two writes and two reads, each took the mutex once
+	KUNIT_EXPECT_EQ(test, globalfifo_test_samples(dev, GLOBALFIFO_LAT_MUTEX_WAIT), 4ULL);
+	KUNIT_EXPECT_EQ(test, globalfifo_test_samples(dev, GLOBALFIFO_LAT_MUTEX_HOLD), 4ULL);
+}
+
+/*****************benchmarks************/
+static const unsigned int globalfifo_bench_sizes[] = { 64, 512, 4096 };
+
+static void globalfifo_bench_desc(const unsigned int *size, char *desc){
+	snprintf(desc, KUNIT_PARAM_DESC_SIZE, "%u bytes", *size);
+}
+KUNIT_ARRAY_PARAM(globalfifo_bench, globalfifo_bench_sizes, globalfifo_bench_desc);
+
+#define GLOBALFIFO_BENCH_OPS 20000
+
+//the ring alone, always half full so the messages keep crossing the end
+static void globalfifo_bench_ring(struct kunit *test){
+	unsigned int size = *(const unsigned int *)test->param_value;
+	unsigned int cap = 4 * size;
+	unsigned char *mem = kunit_kzalloc(test, cap, GFP_KERNEL);
+	char __user *ubuf = ldd_kunit_ubuf(test, 2 * size);
+	struct globalfifo_ring r;
+	ktime_t start;
+	int i;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, mem);
+	globalfifo_ring_init(&r, mem, cap);
+	globalfifo_ring_write(&r, ubuf, 2 * size - 1); //odd, so the copies are misaligned too
+
+	start = ktime_get();
+	for(i = 0; i < GLOBALFIFO_BENCH_OPS; i++){
+		if(globalfifo_ring_write(&r, ubuf, size) != size ||
+				globalfifo_ring_read(&r, ubuf + size, size) != size)
+			break;
+	}
+	KUNIT_ASSERT_EQ(test, i, GLOBALFIFO_BENCH_OPS);
+	ldd_kunit_bench(test, "ring", GLOBALFIFO_BENCH_OPS, 2ULL * GLOBALFIFO_BENCH_OPS * size, start,
+			globalfifo_bench_max_ns);
+}
+
+//the whole write()/read() path: mutex, watermarks, wakeups, stats
+static void globalfifo_bench_fops(struct kunit *test){
+	unsigned int size = *(const unsigned int *)test->param_value;
+	struct globalfifo_dev *dev = globalfifo_test_dev(test, 4 * size);
+	struct file *filp = globalfifo_test_file(test, dev, O_NONBLOCK);
+	char __user *ubuf = ldd_kunit_ubuf(test, size);
+	loff_t pos = 0;
+	ktime_t start;
+	int i;
+
+	start = ktime_get();
+	for(i = 0; i < GLOBALFIFO_BENCH_OPS; i++){
+		if(globalfifo_write(filp, ubuf, size, &pos) != size ||
+				globalfifo_read(filp, ubuf, size, &pos) != size)
+			break;
+	}
+	KUNIT_ASSERT_EQ(test, i, GLOBALFIFO_BENCH_OPS);
+	ldd_kunit_bench(test, "fops", GLOBALFIFO_BENCH_OPS, 2ULL * GLOBALFIFO_BENCH_OPS * size, start,
+			globalfifo_bench_max_ns);
+}
+
+static struct kunit_case globalfifo_test_cases[] = {
+	KUNIT_CASE(globalfifo_test_ring_wrap),
+	KUNIT_CASE(globalfifo_test_ring_move),
+	KUNIT_CASE(globalfifo_test_nonblock),
+	KUNIT_CASE(globalfifo_test_read_wakeup),
+	KUNIT_CASE(globalfifo_test_read_watermark),
+	KUNIT_CASE(globalfifo_test_write_wakeup),
+	KUNIT_CASE(globalfifo_test_atomic_nonblock),
+	KUNIT_CASE(globalfifo_test_atomic_wakeup),
+	KUNIT_CASE(globalfifo_test_peek_commit),
+	KUNIT_CASE(globalfifo_test_spin_budget),
+	KUNIT_CASE(globalfifo_test_busy_poll),
+	KUNIT_CASE(globalfifo_test_inject_fold),
+	KUNIT_CASE(globalfifo_test_wb_barrier),
+	KUNIT_CASE(globalfifo_test_wb_merge),
+	KUNIT_CASE(globalfifo_test_wb_ring_full),
+	KUNIT_CASE(globalfifo_test_latency),
+	KUNIT_CASE(globalfifo_test_rec_overwrite),
+	KUNIT_CASE(globalfifo_test_rec_skip),
+	KUNIT_CASE(globalfifo_test_rec_wakeup),
+	KUNIT_CASE(globalfifo_test_rec_switch_writer),
+	KUNIT_CASE(globalfifo_test_rec_filter),
+	KUNIT_CASE(globalfifo_test_rec_filter_wakeup),
+	KUNIT_CASE_PARAM_ATTR(globalfifo_bench_ring, globalfifo_bench_gen_params, { .speed = KUNIT_SPEED_SLOW }),
+	KUNIT_CASE_PARAM_ATTR(globalfifo_bench_fops, globalfifo_bench_gen_params, { .speed = KUNIT_SPEED_SLOW }),
+	{}
+};
+
+static struct kunit_suite globalfifo_test_suite = {
+	.name = "globalfifo",
+	.test_cases = globalfifo_test_cases,
+};
+kunit_test_suite(globalfifo_test_suite);
@@ -0,0 +1,1222 @@
+//KUnit suite for multi_globalmem, built into this object like globalfifo_kunit.c
+#include "../0_simple_scull/multi_globalmem.c"
+#include "ldd_kunit.h"
+#include <linux/random.h>
+
+static unsigned int globalmem_bench_max_ns = 50000; //per write+read, 0 only reports
+module_param(globalmem_bench_max_ns, uint, S_IRUGO | S_IWUSR);
+
+/*****************bounds****************/
+struct globalmem_seek_case{
+	const char *name;
+	loff_t cur;
+	loff_t offset;
+	int orig;
+	loff_t ret;
+};
+
+static const struct globalmem_seek_case globalmem_seek_cases[] = {
+	{ "set start", 100, 0, 0, 0 },
+	{ "set eof", 0, GLOBALMEM_SIZE, 0, GLOBALMEM_SIZE },
+	{ "set past eof", 0, GLOBALMEM_SIZE + 1, 0, -EINVAL },
+	{ "set negative", 0, -1, 0, -EINVAL },
+	{ "cur forward", 10, 20, 1, 30 },
+	{ "cur back to 0", 10, -10, 1, 0 },
+	{ "cur before 0", 10, -11, 1, -EINVAL },
+	{ "cur to eof", 10, GLOBALMEM_SIZE - 10, 1, GLOBALMEM_SIZE },
+	{ "cur past eof", 10, GLOBALMEM_SIZE - 9, 1, -EINVAL },
+	{ "cur overflow", GLOBALMEM_SIZE, LLONG_MAX, 1, -EINVAL },
+	{ "cur underflow", 1, LLONG_MIN, 1, -EINVAL },
+	{ "seek end", 0, 0, 2, -EINVAL },
+};
+
+static void globalmem_seek_desc(const struct globalmem_seek_case *c, char *desc){
+	strscpy(desc, c->name, KUNIT_PARAM_DESC_SIZE);
+}
+KUNIT_ARRAY_PARAM(globalmem_seek, globalmem_seek_cases, globalmem_seek_desc);
+
+static void globalmem_test_seek(struct kunit *test){
+	const struct globalmem_seek_case *c = test->param_value;
+
+	KUNIT_EXPECT_EQ(test, globalmem_seek(c->cur, c->offset, c->orig, GLOBALMEM_SIZE), c->ret);
+}
+
+static void globalmem_test_span(struct kunit *test){
+	KUNIT_EXPECT_EQ(test, globalmem_span(0, 10, GLOBALMEM_SIZE), 10);
+	KUNIT_EXPECT_EQ(test, globalmem_span(0, SIZE_MAX, GLOBALMEM_SIZE), GLOBALMEM_SIZE);
+	KUNIT_EXPECT_EQ(test, globalmem_span(GLOBALMEM_SIZE - 3, 10, GLOBALMEM_SIZE), 3);
+	KUNIT_EXPECT_EQ(test, globalmem_span(GLOBALMEM_SIZE, 10, GLOBALMEM_SIZE), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_span(LLONG_MAX, 10, GLOBALMEM_SIZE), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_span(-1, 10, GLOBALMEM_SIZE), 0);
+}
+
+/*****************fops******************/
+//another open file of the device of filp
+static struct file *globalmem_test_open(struct kunit *test, struct globalmem_dev *dev){
+	struct globalmem_file *gf = kunit_kzalloc(test, sizeof(*gf), GFP_KERNEL);
+	struct file *filp = kunit_kzalloc(test, sizeof(*filp), GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, gf);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, filp);
+	globalmem_file_init(gf, dev);
+	filp->private_data = gf;
+	filp->f_mode = FMODE_READ | FMODE_WRITE;
+	return filp;
+}
+
+static void globalmem_test_dev_free(void *data){
+	struct globalmem_dev *dev = data;
+
+	kvfree(dev->dirty);
+	kvfree(dev->wmapped); //the rest is kunit's
+}
+
+static struct file *globalmem_test_file_dirty(struct kunit *test, size_t size, unsigned int dirty_shift){
+	struct globalmem_dev *dev = kunit_kzalloc(test, sizeof(*dev), GFP_KERNEL);
+	unsigned char *mem = kunit_kzalloc(test, size, GFP_KERNEL); //nothing maps it here
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dev);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, mem);
+	KUNIT_ASSERT_EQ(test, globalmem_dev_init(dev, mem, size, dirty_shift), 0);
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, globalmem_test_dev_free, dev), 0);
+	return globalmem_test_open(test, dev);
+}
+
+static struct file *globalmem_test_file_size(struct kunit *test, size_t size){
+	return globalmem_test_file_dirty(test, size, 12);
+}
+
+static struct file *globalmem_test_file(struct kunit *test){
+	return globalmem_test_file_size(test, GLOBALMEM_SIZE);
+}
+
+static struct globalmem_dev *globalmem_test_dev(struct file *filp){
+	return ((struct globalmem_file *)filp->private_data)->dev;
+}
+
+static void globalmem_test_rw(struct kunit *test){
+	struct file *filp = globalmem_test_file(test);
+	struct globalmem_dev *dev = globalmem_test_dev(filp);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	char out[8];
+	loff_t pos;
+
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, "abcdefgh", 8), 0);
+
+	//a write across the end is cut short, at the end it writes nothing
+	pos = GLOBALMEM_SIZE - 3;
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, ubuf, 8, &pos), 3);
+	KUNIT_EXPECT_EQ(test, pos, (loff_t)GLOBALMEM_SIZE);
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, ubuf, 8, &pos), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(dev->mem + GLOBALMEM_SIZE - 3, "abc", 3), 0);
+
+	pos = GLOBALMEM_SIZE - 2;
+	KUNIT_EXPECT_EQ(test, globalmem_read(filp, ubuf, 8, &pos), 2);
+	KUNIT_ASSERT_EQ(test, copy_from_user(out, ubuf, 2), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(out, "bc", 2), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_read(filp, ubuf, 8, &pos), 0);
+
+	//positions the VFS can hand in without llseek, pread with a huge offset
+	pos = LLONG_MAX;
+	KUNIT_EXPECT_EQ(test, globalmem_read(filp, ubuf, 8, &pos), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, ubuf, 8, &pos), 0);
+
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, MEM_CLEAR, 0), 0);
+	KUNIT_EXPECT_TRUE(test, !memchr_inv(dev->mem, 0, GLOBALMEM_SIZE));
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, 0xff, 0), -EINVAL);
+}
+
+static void globalmem_test_llseek(struct kunit *test){
+	struct file *filp = globalmem_test_file(test);
+
+	KUNIT_EXPECT_EQ(test, globalmem_llseek(filp, 100, 0), 100);
+	KUNIT_EXPECT_EQ(test, globalmem_llseek(filp, -50, 1), 50);
+	//a failed seek leaves f_pos alone
+	KUNIT_EXPECT_EQ(test, globalmem_llseek(filp, GLOBALMEM_SIZE, 1), -EINVAL);
+	KUNIT_EXPECT_EQ(test, filp->f_pos, 50);
+	KUNIT_EXPECT_EQ(test, globalmem_llseek(filp, 0, 2), -EINVAL);
+	KUNIT_EXPECT_EQ(test, filp->f_pos, 50);
+}
+
+/*****************in-place ioctls*******/
+static void globalmem_test_crc32c(struct kunit *test){
+	struct file *filp = globalmem_test_file(test);
+	struct globalmem_dev *dev = globalmem_test_dev(filp);
+	struct globalmem_crc __user *uc = (struct globalmem_crc __user *)ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalmem_crc c = { .off = 100, .len = 9 };
+
+	memcpy(dev->mem + 100, "123456789", 9);
+	KUNIT_ASSERT_EQ(test, copy_to_user(uc, &c, sizeof(c)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_CRC32C, (unsigned long)uc), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(&c, uc, sizeof(c)), 0);
+	KUNIT_EXPECT_EQ(test, c.crc, 0xe3069283U); //the CRC32C check value
+
+	//in two pieces, the first crc seeds the second
+	c.len = 5;
+	KUNIT_ASSERT_EQ(test, copy_to_user(uc, &c, sizeof(c)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_CRC32C, (unsigned long)uc), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(&c, uc, sizeof(c)), 0);
+	c.seed = c.crc;
+	c.off = 105;
+	c.len = 4;
+	KUNIT_ASSERT_EQ(test, copy_to_user(uc, &c, sizeof(c)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_CRC32C, (unsigned long)uc), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(&c, uc, sizeof(c)), 0);
+	KUNIT_EXPECT_EQ(test, c.crc, 0xe3069283U);
+
+	c.off = GLOBALMEM_SIZE - 1;
+	c.len = 2;
+	KUNIT_ASSERT_EQ(test, copy_to_user(uc, &c, sizeof(c)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_CRC32C, (unsigned long)uc), -EINVAL);
+}
+
+static s64 globalmem_test_search(struct kunit *test, struct file *filp, char __user *ubuf,
+		u64 off, u64 len, const char *pat){
+	struct globalmem_search __user *us = (struct globalmem_search __user *)ubuf;
+	struct globalmem_search sr = {
+		.off = off, .len = len, .pattern = (u64)(uintptr_t)(ubuf + 256), .plen = strlen(pat),
+	};
+	long ret;
+
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf + 256, pat, sr.plen), 0);
+	KUNIT_ASSERT_EQ(test, copy_to_user(us, &sr, sizeof(sr)), 0);
+	ret = globalmem_ioctl(filp, GLOBALMEM_SEARCH, (unsigned long)us);
+	if(ret)
+		return ret;
+	KUNIT_ASSERT_EQ(test, copy_from_user(&sr, us, sizeof(sr)), 0);
+	return sr.result;
+}
+
+static void globalmem_test_search_fill_move(struct kunit *test){
+	struct file *filp = globalmem_test_file(test);
+	struct globalmem_dev *dev = globalmem_test_dev(filp);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalmem_fill f = { .off = 300, .len = 8, .pattern = (u64)(uintptr_t)(ubuf + 256), .plen = 3 };
+	struct globalmem_move m = { .dst = 402, .src = 400, .len = 5 };
+
+	memcpy(dev->mem + 200, "abcabd", 6);
+	KUNIT_EXPECT_EQ(test, globalmem_test_search(test, filp, ubuf, 200, 6, "abd"), 203LL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_search(test, filp, ubuf, 200, 5, "abd"), -1LL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_search(test, filp, ubuf, 0, GLOBALMEM_SIZE, "d"), 205LL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_search(test, filp, ubuf, 0, GLOBALMEM_SIZE, ""), -EINVAL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_search(test, filp, ubuf, GLOBALMEM_SIZE, 1, "a"), -EINVAL);
+
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf + 256, "xyz", 3), 0);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &f, sizeof(f)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_FILL, (unsigned long)ubuf), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(dev->mem + 300, "xyzxyzxy\0", 9), 0);
+	f.plen = 1;
+	f.len = GLOBALMEM_SIZE - 1000;
+	f.off = 1000;
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &f, sizeof(f)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_FILL, (unsigned long)ubuf), 0);
+	KUNIT_EXPECT_TRUE(test, !memchr_inv(dev->mem + 1000, 'x', GLOBALMEM_SIZE - 1000));
+
+	//overlapping, forwards
+	memcpy(dev->mem + 400, "12345", 5);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &m, sizeof(m)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_MOVE, (unsigned long)ubuf), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(dev->mem + 400, "1212345", 7), 0);
+	m.dst = GLOBALMEM_SIZE - 4;
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &m, sizeof(m)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_MOVE, (unsigned long)ubuf), -EINVAL);
+}
+
+#define GLOBALMEM_TEST_CHUNKS_SIZE	(4 * GLOBALMEM_COPY_CHUNK)
+
+//ranges of several chunks come out as if done in one pass, across the chunk ends too
+static void globalmem_test_chunks(struct kunit *test){
+	struct file *filp = globalmem_test_file_size(test, GLOBALMEM_TEST_CHUNKS_SIZE);
+	struct globalmem_dev *dev = globalmem_test_dev(filp);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalmem_crc c = { .off = 0, .len = GLOBALMEM_TEST_CHUNKS_SIZE };
+	struct globalmem_fill f = {
+		.off = 1, .len = GLOBALMEM_TEST_CHUNKS_SIZE - 1, .pattern = (u64)(uintptr_t)(ubuf + 256), .plen = 3,
+	};
+	struct globalmem_move m = { .dst = 1000, .src = 100, .len = 2 * GLOBALMEM_COPY_CHUNK + 5 };
+	u8 *before;
+	u64 i;
+
+	before = kunit_kmalloc(test, GLOBALMEM_TEST_CHUNKS_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, before);
+	get_random_bytes(dev->mem, GLOBALMEM_TEST_CHUNKS_SIZE);
+	memcpy(before, dev->mem, GLOBALMEM_TEST_CHUNKS_SIZE);
+
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &c, sizeof(c)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_CRC32C, (unsigned long)ubuf), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(&c, ubuf, sizeof(c)), 0);
+	KUNIT_EXPECT_EQ(test, c.crc, ~crc32c(~0U, before, GLOBALMEM_TEST_CHUNKS_SIZE));
+
+	//a match that starts in one chunk and ends in the next
+	memset(dev->mem, 0, GLOBALMEM_TEST_CHUNKS_SIZE);
+	memcpy(dev->mem + 2 * GLOBALMEM_COPY_CHUNK - 2, "abd", 3);
+	KUNIT_EXPECT_EQ(test, globalmem_test_search(test, filp, ubuf, 0, GLOBALMEM_TEST_CHUNKS_SIZE, "abd"),
+			2LL * GLOBALMEM_COPY_CHUNK - 2);
+	KUNIT_EXPECT_EQ(test, globalmem_test_search(test, filp, ubuf, 0, 2 * GLOBALMEM_COPY_CHUNK, "abd"), -1LL);
+
+	//the pattern goes on where the last chunk left it
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf + 256, "xyz", 3), 0);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &f, sizeof(f)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_FILL, (unsigned long)ubuf), 0);
+	for(i = 1; i < GLOBALMEM_TEST_CHUNKS_SIZE; i++)
+		if(dev->mem[i] != "xyz"[(i - 1) % 3])
+			break;
+	KUNIT_EXPECT_EQ(test, i, (u64)GLOBALMEM_TEST_CHUNKS_SIZE);
+
+	//overlapping from above, it has to go from the end
+	get_random_bytes(dev->mem, GLOBALMEM_TEST_CHUNKS_SIZE);
+	memcpy(before, dev->mem, GLOBALMEM_TEST_CHUNKS_SIZE);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &m, sizeof(m)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_MOVE, (unsigned long)ubuf), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(dev->mem + 1000, before + 100, m.len), 0);
+
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, MEM_CLEAR, 0), 0);
+	KUNIT_EXPECT_TRUE(test, !memchr_inv(dev->mem, 0, GLOBALMEM_TEST_CHUNKS_SIZE));
+}
+
+/*****************atomics***************/
+static long globalmem_test_atomic(struct file *filp, struct globalmem_atomic __user *ua, u32 op, u32 width,
+		u64 off, u64 arg, u64 cmp, u64 *result){
+	struct globalmem_atomic a = { .off = off, .arg = arg, .cmp = cmp, .op = op, .width = width };
+	long ret;
+
+	if(copy_to_user(ua, &a, sizeof(a)))
+		return -EFAULT;
+	ret = globalmem_ioctl(filp, GLOBALMEM_ATOMIC, (unsigned long)ua);
+	if(!ret && get_user(*result, &ua->result))
+		return -EFAULT;
+	return ret;
+}
+
+static void globalmem_test_atomic_ops(struct kunit *test){
+	struct file *filp = globalmem_test_file(test);
+	struct globalmem_dev *dev = globalmem_test_dev(filp);
+	struct globalmem_atomic __user *ua = ldd_kunit_ubuf(test, PAGE_SIZE);
+	u64 old;
+
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, GLOBALMEM_ATOMIC_STORE, 4, 8, 0x1ffffffffULL, 0, &old), 0);
+	KUNIT_EXPECT_EQ(test, old, 0ULL);
+	KUNIT_EXPECT_EQ(test, *(u32 *)(dev->mem + 8), 0xffffffffU); //truncated to the width
+	KUNIT_EXPECT_EQ(test, *(u32 *)(dev->mem + 12), 0U);
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, GLOBALMEM_ATOMIC_FETCH_ADD, 4, 8, 2, 0, &old), 0);
+	KUNIT_EXPECT_EQ(test, old, 0xffffffffULL);
+	KUNIT_EXPECT_EQ(test, *(u32 *)(dev->mem + 8), 1U); //wraps
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, GLOBALMEM_ATOMIC_FETCH_OR, 4, 8, 6, 0, &old), 0);
+	KUNIT_EXPECT_EQ(test, old, 1ULL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, GLOBALMEM_ATOMIC_LOAD, 4, 8, 0, 0, &old), 0);
+	KUNIT_EXPECT_EQ(test, old, 7ULL);
+
+	//a failed CAS leaves the word and reports what is there
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, GLOBALMEM_ATOMIC_CAS, 8, 16, 5, 1, &old), 0);
+	KUNIT_EXPECT_EQ(test, old, 0ULL);
+	KUNIT_EXPECT_EQ(test, *(u64 *)(dev->mem + 16), 0ULL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, GLOBALMEM_ATOMIC_CAS, 8, 16, 1ULL << 40, 0, &old), 0);
+	KUNIT_EXPECT_EQ(test, old, 0ULL);
+	KUNIT_EXPECT_EQ(test, *(u64 *)(dev->mem + 16), 1ULL << 40);
+
+	//unaligned, past the end, bad width or op
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, GLOBALMEM_ATOMIC_LOAD, 8, 4, 0, 0, &old), -EINVAL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, GLOBALMEM_ATOMIC_LOAD, 4, GLOBALMEM_SIZE, 0, 0, &old), -EINVAL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, GLOBALMEM_ATOMIC_LOAD, 2, 0, 0, 0, &old), -EINVAL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, 99, 4, 0, 0, 0, &old), -EINVAL);
+}
+
+static void globalmem_test_atomic_batch(struct kunit *test){
+	struct file *filp = globalmem_test_file(test);
+	struct globalmem_dev *dev = globalmem_test_dev(filp);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalmem_atomic_batch __user *ub = (struct globalmem_atomic_batch __user *)ubuf;
+	struct globalmem_atomic __user *uops = (struct globalmem_atomic __user *)(ubuf + 64);
+	struct globalmem_atomic ops[3] = {
+		{ .off = 0, .arg = 10, .op = GLOBALMEM_ATOMIC_FETCH_ADD, .width = 8 },
+		{ .off = 0, .arg = 20, .op = GLOBALMEM_ATOMIC_FETCH_ADD, .width = 8 },
+		{ .off = 3, .op = GLOBALMEM_ATOMIC_LOAD, .width = 4 }, //unaligned
+	};
+	struct globalmem_atomic_batch b = { .ops = (u64)(uintptr_t)uops, .n = 3 };
+
+	KUNIT_ASSERT_EQ(test, copy_to_user(uops, ops, sizeof(ops)), 0);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ub, &b, sizeof(b)), 0);
+	//the ops before the bad one ran and say so
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_ATOMIC_BATCH, (unsigned long)ub), -EINVAL);
+	KUNIT_ASSERT_EQ(test, copy_from_user(&b, ub, sizeof(b)), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(ops, uops, sizeof(ops)), 0);
+	KUNIT_EXPECT_EQ(test, b.done, 2U);
+	KUNIT_EXPECT_EQ(test, ops[0].result, 0ULL);
+	KUNIT_EXPECT_EQ(test, ops[1].result, 10ULL);
+	KUNIT_EXPECT_EQ(test, *(u64 *)dev->mem, 30ULL);
+
+	b.n = GLOBALMEM_ATOMIC_BATCH_MAX + 1;
+	KUNIT_ASSERT_EQ(test, copy_to_user(ub, &b, sizeof(b)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_ATOMIC_BATCH, (unsigned long)ub), -EINVAL);
+}
+
+#define GLOBALMEM_ATOMIC_RACE 10000
+
+struct globalmem_adder{
+	struct file *filp;
+	struct globalmem_atomic __user *ua; //its own, the test task uses none
+};
+
+static int globalmem_atomic_adder(struct ldd_kunit_peer *peer){
+	struct globalmem_adder *adder = peer->data;
+	u64 old;
+	int i, ret = 0;
+
+	for(i = 0; i < GLOBALMEM_ATOMIC_RACE && !ret; i++)
+		ret = globalmem_test_atomic(adder->filp, adder->ua, GLOBALMEM_ATOMIC_FETCH_ADD, 8, 64, 1, 0, &old);
+	return ret;
+}
+
+//fetch-add from the ioctl against plain atomics on the same word, as a mapping would do them
+static void globalmem_test_atomic_race(struct kunit *test){
+	struct globalmem_adder adder = { .filp = globalmem_test_file(test), .ua = ldd_kunit_ubuf(test, PAGE_SIZE) };
+	struct globalmem_dev *dev = globalmem_test_dev(adder.filp);
+	struct ldd_kunit_peer *peer;
+	int i;
+
+	peer = ldd_kunit_peer_start(test, globalmem_atomic_adder, &adder, sizeof(adder));
+	for(i = 0; i < GLOBALMEM_ATOMIC_RACE; i++)
+		atomic64_inc((atomic64_t *)(dev->mem + 64));
+	KUNIT_EXPECT_EQ(test, ldd_kunit_peer_wait(peer), 0);
+	KUNIT_EXPECT_EQ(test, *(u64 *)(dev->mem + 64), 2ULL * GLOBALMEM_ATOMIC_RACE);
+}
+
+/*****************waiting***************/
+static long globalmem_test_wait(struct file *filp, struct globalmem_wait __user *uw, u32 mode, u32 width,
+		u64 off, u64 len, u64 val, s64 timeout_ns){
+	struct globalmem_wait w = {
+		.off = off, .len = len, .val = val, .timeout_ns = timeout_ns, .mode = mode, .width = width,
+	};
+
+	if(copy_to_user(uw, &w, sizeof(w)))
+		return -EFAULT;
+	return globalmem_ioctl(filp, GLOBALMEM_WAIT, (unsigned long)uw);
+}
+
+static void globalmem_test_wait_now(struct kunit *test){
+	struct file *filp = globalmem_test_file(test);
+	struct globalmem_dev *dev = globalmem_test_dev(filp);
+	struct globalmem_wait __user *uw = ldd_kunit_ubuf(test, PAGE_SIZE);
+
+	*(u32 *)(dev->mem + 8) = 5;
+	*(u64 *)(dev->mem + 16) = 0x100000005ULL;
+	//compared at the width, a word that already differs doesn't sleep
+	KUNIT_EXPECT_EQ(test, globalmem_test_wait(filp, uw, GLOBALMEM_WAIT_WORD, 4, 8, 0, 0x700000005ULL, 0), -ETIMEDOUT);
+	KUNIT_EXPECT_EQ(test, globalmem_test_wait(filp, uw, GLOBALMEM_WAIT_WORD, 4, 8, 0, 6, -1), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_test_wait(filp, uw, GLOBALMEM_WAIT_WORD, 8, 16, 0, 5, -1), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_test_wait(filp, uw, GLOBALMEM_WAIT_WORD, 8, 16, 0, 0x100000005ULL, 1000), -ETIMEDOUT);
+	KUNIT_EXPECT_EQ(test, globalmem_test_wait(filp, uw, GLOBALMEM_WAIT_RANGE, 0, 0, 16, 0, 0), -ETIMEDOUT);
+
+	KUNIT_EXPECT_EQ(test, globalmem_test_wait(filp, uw, GLOBALMEM_WAIT_WORD, 8, 4, 0, 0, 0), -EINVAL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_wait(filp, uw, GLOBALMEM_WAIT_RANGE, 0, 0, 0, 0, 0), -EINVAL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_wait(filp, uw, GLOBALMEM_WAIT_RANGE, 0, 1, GLOBALMEM_SIZE, 0, 0), -EINVAL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_wait(filp, uw, 7, 0, 0, 16, 0, 0), -EINVAL);
+	KUNIT_EXPECT_TRUE(test, !waitqueue_active(&dev->wait));
+}
+
+struct globalmem_writer{
+	struct file *filp;
+	char __user *ubuf; //its own
+	u64 phase;
+};
+
+static bool globalmem_test_sleeper(struct globalmem_dev *dev){
+	int i;
+
+	for(i = 0; i < 1000 && !waitqueue_active(&dev->wait); i++)
+		msleep(1);
+	return waitqueue_active(&dev->wait);
+}
+
+static int globalmem_test_writer(struct ldd_kunit_peer *peer){
+	struct globalmem_writer *wr = peer->data;
+	struct globalmem_dev *dev = globalmem_test_dev(wr->filp);
+	struct globalmem_range r = { .off = 64, .len = 8 };
+	loff_t pos = 0;
+
+	if(!globalmem_test_sleeper(dev))
+		return -ETIMEDOUT;
+	//next to the range, the sleeper must stay asleep
+	if(globalmem_write(wr->filp, wr->ubuf, 64, &pos) != 64)
+		return -EIO;
+	msleep(20);
+	WRITE_ONCE(wr->phase, 1);
+	pos = 71;
+	if(globalmem_write(wr->filp, wr->ubuf, 1, &pos) != 1)
+		return -EIO;
+
+	//a store like one through a mapping, which only the explicit wake announces
+	while(waitqueue_active(&dev->wait))
+		msleep(1);
+	if(!globalmem_test_sleeper(dev))
+		return -ETIMEDOUT;
+	if(copy_to_user(wr->ubuf, &r, sizeof(r)))
+		return -EFAULT;
+	WRITE_ONCE(wr->phase, 2);
+	WRITE_ONCE(*(u32 *)(dev->mem + 64), 1);
+	return globalmem_ioctl(wr->filp, GLOBALMEM_WAKE, (unsigned long)wr->ubuf);
+}
+
+//the writer wakes by range: a write beside the waited range doesn't end the wait, one inside it does
+static void globalmem_test_wait_wakeup(struct kunit *test){
+	struct globalmem_writer wr = { .filp = globalmem_test_file(test), .ubuf = ldd_kunit_ubuf(test, PAGE_SIZE) };
+	struct globalmem_wait __user *uw = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct ldd_kunit_peer *peer;
+	struct globalmem_writer *pw; //the copy the writer moves on
+
+	peer = ldd_kunit_peer_start(test, globalmem_test_writer, &wr, sizeof(wr));
+	pw = peer->data;
+	KUNIT_EXPECT_EQ(test, globalmem_test_wait(wr.filp, uw, GLOBALMEM_WAIT_RANGE, 0, 64, 8, 0, -1), 0);
+	KUNIT_EXPECT_EQ(test, READ_ONCE(pw->phase), 1ULL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_wait(wr.filp, uw, GLOBALMEM_WAIT_WORD, 4, 64, 0, 0, -1), 0);
+	KUNIT_EXPECT_EQ(test, READ_ONCE(pw->phase), 2ULL);
+	KUNIT_EXPECT_EQ(test, ldd_kunit_peer_wait(peer), 0);
+}
+
+static void globalmem_test_subscribe(struct kunit *test){
+	struct file *filp = globalmem_test_file(test);
+	struct globalmem_dev *dev = globalmem_test_dev(filp);
+	struct file *other = globalmem_test_open(test, dev);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalmem_range r = { .off = 100, .len = 10 };
+	loff_t pos;
+
+	KUNIT_EXPECT_EQ(test, globalmem_poll(filp, NULL), POLLOUT | POLLWRNORM);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &r, sizeof(r)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_SUBSCRIBE, (unsigned long)ubuf), 0);
+
+	pos = 90;
+	KUNIT_EXPECT_EQ(test, globalmem_write(other, ubuf + 256, 10, &pos), 10);
+	KUNIT_EXPECT_EQ(test, globalmem_poll(filp, NULL), POLLOUT | POLLWRNORM);
+	KUNIT_EXPECT_EQ(test, globalmem_write(other, ubuf + 256, 1, &pos), 1);
+	KUNIT_EXPECT_EQ(test, globalmem_poll(filp, NULL), POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM);
+	//still changed until this file reads
+	KUNIT_EXPECT_EQ(test, globalmem_poll(filp, NULL), POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM);
+	pos = 0;
+	KUNIT_EXPECT_EQ(test, globalmem_read(other, ubuf + 256, 8, &pos), 8);
+	KUNIT_EXPECT_EQ(test, globalmem_poll(filp, NULL), POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM);
+	KUNIT_EXPECT_EQ(test, globalmem_read(filp, ubuf + 256, 8, &pos), 8);
+	KUNIT_EXPECT_EQ(test, globalmem_poll(filp, NULL), POLLOUT | POLLWRNORM);
+
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(other, MEM_CLEAR, 0), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_poll(filp, NULL), POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM);
+
+	//len 0 drops it, and the pending change with it
+	r.len = 0;
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &r, sizeof(r)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_SUBSCRIBE, (unsigned long)ubuf), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_poll(filp, NULL), POLLOUT | POLLWRNORM);
+	KUNIT_EXPECT_TRUE(test, !waitqueue_active(&dev->wait));
+	r.off = GLOBALMEM_SIZE;
+	r.len = 1;
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &r, sizeof(r)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_SUBSCRIBE, (unsigned long)ubuf), -EINVAL);
+}
+
+/*****************range locks***********/
+static void globalmem_test_stripes(struct kunit *test){
+	KUNIT_EXPECT_EQ(test, globalmem_stripe_mask(0, 0), 0U);
+	KUNIT_EXPECT_EQ(test, globalmem_stripe_mask(0, 1), 1U);
+	KUNIT_EXPECT_EQ(test, globalmem_stripe_mask(4095, 2), 3U);
+	KUNIT_EXPECT_EQ(test, globalmem_stripe_mask(5 << 12, 4096), 1U << 5);
+	//the stripes wrap around
+	KUNIT_EXPECT_EQ(test, globalmem_stripe_mask(31 << 12, 8192), (1U << 31) | 1U);
+	KUNIT_EXPECT_EQ(test, globalmem_stripe_mask(33 << 12, 1), 2U);
+	KUNIT_EXPECT_EQ(test, globalmem_stripe_mask(1, GLOBALMEM_STRIPES << 12), ~0U);
+	KUNIT_EXPECT_EQ(test, globalmem_stripe_mask(0, (u64)GLOBALMEM_SIZE_MAX), ~0U);
+}
+
+static long globalmem_test_lock(struct file *filp, struct globalmem_lock __user *ul, unsigned int cmd,
+		u64 off, u64 len, u32 flags){
+	struct globalmem_lock lk = { .off = off, .len = len, .flags = flags };
+
+	if(copy_to_user(ul, &lk, sizeof(lk)))
+		return -EFAULT;
+	return globalmem_ioctl(filp, cmd, (unsigned long)ul);
+}
+
+struct globalmem_locked_op{
+	struct file *filp;
+	char __user *ubuf; //its own
+	loff_t pos;
+	bool write;
+};
+
+static int globalmem_test_locked_op(struct ldd_kunit_peer *peer){
+	struct globalmem_locked_op *op = peer->data;
+
+	if(op->write)
+		return globalmem_write(op->filp, op->ubuf, 8, &op->pos);
+	return globalmem_read(op->filp, op->ubuf, 8, &op->pos);
+}
+
+//a write of another file into a locked range waits for the unlock, the holder's own doesn't
+static void globalmem_test_range_lock(struct kunit *test){
+	struct file *filp = globalmem_test_file(test);
+	struct globalmem_dev *dev = globalmem_test_dev(filp);
+	struct file *other = globalmem_test_open(test, dev);
+	struct globalmem_lock __user *ul = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalmem_locked_op op = { .filp = other, .ubuf = ldd_kunit_ubuf(test, PAGE_SIZE), .pos = 96, .write = true };
+	struct ldd_kunit_peer *peer;
+	loff_t pos = 0;
+
+	KUNIT_EXPECT_EQ(test, globalmem_test_lock(filp, ul, GLOBALMEM_LOCK, 0, 100, GLOBALMEM_LOCK_EXCL), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_test_lock(other, ul, GLOBALMEM_LOCK, 99, 10, GLOBALMEM_LOCK_NONBLOCK), -EAGAIN);
+	KUNIT_EXPECT_EQ(test, globalmem_test_lock(other, ul, GLOBALMEM_LOCK, 100, 10, GLOBALMEM_LOCK_NONBLOCK), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, (char __user *)ul + 64, 8, &pos), 8);
+	//shared locks share, and keep writers out
+	KUNIT_EXPECT_EQ(test, globalmem_test_lock(filp, ul, GLOBALMEM_LOCK, 105, 1, GLOBALMEM_LOCK_NONBLOCK), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_test_lock(filp, ul, GLOBALMEM_LOCK, 100, 1,
+			GLOBALMEM_LOCK_EXCL | GLOBALMEM_LOCK_NONBLOCK), -EAGAIN);
+
+	peer = ldd_kunit_peer_start(test, globalmem_test_locked_op, &op, sizeof(op));
+	msleep(20);
+	KUNIT_EXPECT_FALSE(test, completion_done(&peer->done));
+	KUNIT_EXPECT_EQ(test, globalmem_test_lock(filp, ul, GLOBALMEM_UNLOCK, 0, 99, 0), -ENOENT);
+	KUNIT_EXPECT_EQ(test, globalmem_test_lock(filp, ul, GLOBALMEM_UNLOCK, 0, 100, 0), 0);
+	KUNIT_EXPECT_EQ(test, ldd_kunit_peer_wait(peer), 8);
+
+	//bad ranges and flags
+	KUNIT_EXPECT_EQ(test, globalmem_test_lock(filp, ul, GLOBALMEM_LOCK, 0, 0, 0), -EINVAL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_lock(filp, ul, GLOBALMEM_LOCK, GLOBALMEM_SIZE, 1, 0), -EINVAL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_lock(filp, ul, GLOBALMEM_LOCK, 0, 1, 0x80), -EINVAL);
+
+	//what release does
+	globalmem_unlock_all(filp->private_data);
+	globalmem_unlock_all(other->private_data);
+	KUNIT_EXPECT_TRUE(test, list_empty(&dev->ulocks));
+	KUNIT_EXPECT_EQ(test, dev->nr_ulocks, 0U);
+}
+
+//a reader waits for an exclusive lock, the per file limit holds
+static void globalmem_test_range_lock_read(struct kunit *test){
+	struct file *filp = globalmem_test_file(test);
+	struct globalmem_dev *dev = globalmem_test_dev(filp);
+	struct file *other = globalmem_test_open(test, dev);
+	struct globalmem_lock __user *ul = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalmem_locked_op op = { .filp = other, .ubuf = ldd_kunit_ubuf(test, PAGE_SIZE), .pos = 4 };
+	struct ldd_kunit_peer *peer;
+	int i;
+
+	KUNIT_EXPECT_EQ(test, globalmem_test_lock(filp, ul, GLOBALMEM_LOCK, 8, 8, GLOBALMEM_LOCK_EXCL), 0);
+	peer = ldd_kunit_peer_start(test, globalmem_test_locked_op, &op, sizeof(op));
+	msleep(20);
+	KUNIT_EXPECT_FALSE(test, completion_done(&peer->done));
+	globalmem_unlock_all(filp->private_data);
+	KUNIT_EXPECT_EQ(test, ldd_kunit_peer_wait(peer), 8);
+
+	for(i = 0; i < GLOBALMEM_LOCKS_MAX; i++)
+		KUNIT_EXPECT_EQ(test, globalmem_test_lock(filp, ul, GLOBALMEM_LOCK, i, 1, 0), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_test_lock(filp, ul, GLOBALMEM_LOCK, i, 1, 0), -ENOLCK);
+	globalmem_unlock_all(filp->private_data);
+}
+
+/*****************dirty tracking********/
+static long globalmem_test_get_dirty(struct file *filp, char __user *ubuf, u32 n, struct globalmem_dirty *d,
+		struct globalmem_range *ext){
+	struct globalmem_dirty __user *ud = (struct globalmem_dirty __user *)ubuf;
+	long ret;
+
+	d->extents = (u64)(uintptr_t)(ubuf + 64);
+	d->n = n;
+	if(copy_to_user(ud, d, sizeof(*d)))
+		return -EFAULT;
+	ret = globalmem_ioctl(filp, GLOBALMEM_GET_DIRTY, (unsigned long)ud);
+	if(ret)
+		return ret;
+	if(copy_from_user(d, ud, sizeof(*d)) || copy_from_user(ext, ubuf + 64, d->count * sizeof(*ext)))
+		return -EFAULT;
+	return 0;
+}
+
+//64 byte granules over 8 KiB, two or more bitmap words
+static void globalmem_test_dirty(struct kunit *test){
+	struct file *filp = globalmem_test_file_dirty(test, 8192, 6);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalmem_atomic __user *ua = (struct globalmem_atomic __user *)(ubuf + 2048);
+	struct globalmem_range ext[4];
+	struct globalmem_dirty d = {};
+	loff_t pos;
+	u64 old;
+
+	KUNIT_EXPECT_EQ(test, globalmem_test_get_dirty(filp, ubuf, 4, &d, ext), 0L);
+	KUNIT_EXPECT_EQ(test, d.count, 0U);
+	KUNIT_EXPECT_EQ(test, d.granule, 64U);
+
+	//one byte dirties its granule, a write across the word boundary at bit 64 stays one extent
+	pos = 100;
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, ubuf, 1, &pos), 1);
+	pos = 64 * 64 - 10;
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, ubuf, 20, &pos), 20);
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, GLOBALMEM_ATOMIC_FETCH_ADD, 8, 8184, 1, 0, &old), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, GLOBALMEM_ATOMIC_LOAD, 8, 5000, 0, 0, &old), 0);
+
+	KUNIT_EXPECT_EQ(test, globalmem_test_get_dirty(filp, ubuf, 4, &d, ext), 0L);
+	KUNIT_ASSERT_EQ(test, d.count, 3U);
+	KUNIT_EXPECT_EQ(test, d.more, 0U);
+	KUNIT_EXPECT_EQ(test, ext[0].off, 64ULL);
+	KUNIT_EXPECT_EQ(test, ext[0].len, 64ULL);
+	KUNIT_EXPECT_EQ(test, ext[1].off, 63ULL * 64);
+	KUNIT_EXPECT_EQ(test, ext[1].len, 128ULL);
+	KUNIT_EXPECT_EQ(test, ext[2].off, 8192ULL - 64);
+	KUNIT_EXPECT_EQ(test, ext[2].len, 64ULL);
+	//and clean after
+	KUNIT_EXPECT_EQ(test, globalmem_test_get_dirty(filp, ubuf, 4, &d, ext), 0L);
+	KUNIT_EXPECT_EQ(test, d.count, 0U);
+
+	//what doesn't fit stays for the next call
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, MEM_CLEAR, 0), 0);
+	pos = 0;
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, ubuf, 1, &pos), 1);
+	KUNIT_EXPECT_EQ(test, globalmem_test_get_dirty(filp, ubuf, 1, &d, ext), 0L);
+	KUNIT_EXPECT_EQ(test, d.count, 1U);
+	KUNIT_EXPECT_EQ(test, d.more, 0U);
+	KUNIT_EXPECT_EQ(test, ext[0].len, 8192ULL);
+	pos = 0;
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, ubuf, 1, &pos), 1);
+	pos = 640;
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, ubuf, 1, &pos), 1);
+	KUNIT_EXPECT_EQ(test, globalmem_test_get_dirty(filp, ubuf, 1, &d, ext), 0L);
+	KUNIT_EXPECT_EQ(test, d.count, 1U);
+	KUNIT_EXPECT_EQ(test, d.more, 1U);
+	KUNIT_EXPECT_EQ(test, ext[0].off, 0ULL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_get_dirty(filp, ubuf, 1, &d, ext), 0L);
+	KUNIT_EXPECT_EQ(test, d.count, 1U);
+	KUNIT_EXPECT_EQ(test, d.more, 0U);
+	KUNIT_EXPECT_EQ(test, ext[0].off, 640ULL);
+
+	KUNIT_EXPECT_EQ(test, globalmem_test_get_dirty(filp, ubuf, 0, &d, ext), -EINVAL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_get_dirty(filp, ubuf, GLOBALMEM_DIRTY_MAX + 1, &d, ext), -EINVAL);
+}
+
+/*****************snapshots***********/
+//a snapshot file like the one anon_inode_getfd hands out
+static struct file *globalmem_test_snap(struct kunit *test, struct globalmem_dev *dev){
+	struct file *snap_filp = kunit_kzalloc(test, sizeof(*snap_filp), GFP_KERNEL);
+	struct globalmem_snap *snap;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, snap_filp);
+	snap = globalmem_snap_create(dev);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, snap);
+	snap_filp->private_data = snap;
+	return snap_filp;
+}
+
+static void globalmem_test_snapshot(struct kunit *test){
+	struct file *filp = globalmem_test_file_size(test, 4 * GLOBALMEM_SNAP_BLOCK);
+	struct globalmem_dev *dev = globalmem_test_dev(filp);
+	size_t size = dev->size;
+	char __user *ubuf = ldd_kunit_ubuf(test, 2 * size);
+	struct globalmem_atomic __user *ua = (struct globalmem_atomic __user *)(ubuf + size + 512);
+	struct globalmem_fill f = { .off = 3 * GLOBALMEM_SNAP_BLOCK, .len = 16, .pattern = (u64)(uintptr_t)(ubuf + size), .plen = 1 };
+	struct file *snap_filp;
+	struct globalmem_snap *snap;
+	u8 *before, *out;
+	loff_t pos;
+	u64 old;
+
+	before = kunit_kmalloc(test, size, GFP_KERNEL);
+	out = kunit_kmalloc(test, size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, before);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, out);
+	get_random_bytes(before, size);
+	memcpy(dev->mem, before, size);
+
+	snap_filp = globalmem_test_snap(test, dev);
+	snap = snap_filp->private_data;
+	KUNIT_EXPECT_TRUE(test, IS_ERR(globalmem_snap_create(dev))); //one at a time
+	KUNIT_EXPECT_EQ(test, snap->copied, 0UL);
+
+	//a write across a block boundary, a fill and an atomic, each copies its blocks once
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, "live", 4), 0);
+	pos = GLOBALMEM_SNAP_BLOCK - 2;
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, ubuf, 4, &pos), 4);
+	pos = 10;
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, ubuf, 4, &pos), 4);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf + size, "z", 1), 0);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf + size + 256, &f, sizeof(f)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_FILL, (unsigned long)(ubuf + size + 256)), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, GLOBALMEM_ATOMIC_LOAD, 8, 2 * GLOBALMEM_SNAP_BLOCK, 0, 0, &old), 0);
+	KUNIT_EXPECT_EQ(test, snap->copied, 3UL);
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, GLOBALMEM_ATOMIC_FETCH_ADD, 8, 3 * GLOBALMEM_SNAP_BLOCK, 1, 0, &old), 0);
+	KUNIT_EXPECT_EQ(test, snap->copied, 3UL);
+	KUNIT_EXPECT_EQ(test, memcmp(dev->mem + 10, "live", 4), 0);
+	KUNIT_EXPECT_EQ(test, dev->mem[3 * GLOBALMEM_SNAP_BLOCK + 15], 'z');
+
+	//the snapshot still reads as before, in one go and in pieces over the blocks
+	pos = 0;
+	KUNIT_EXPECT_EQ(test, globalmem_snap_read(snap_filp, ubuf, 2 * size, &pos), (ssize_t)size);
+	KUNIT_ASSERT_EQ(test, copy_from_user(out, ubuf, size), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(out, before, size), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_snap_llseek(snap_filp, GLOBALMEM_SNAP_BLOCK - 100, 0), (loff_t)GLOBALMEM_SNAP_BLOCK - 100);
+	pos = snap_filp->f_pos;
+	KUNIT_EXPECT_EQ(test, globalmem_snap_read(snap_filp, ubuf, 300, &pos), 300);
+	KUNIT_ASSERT_EQ(test, copy_from_user(out, ubuf, 300), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(out, before + GLOBALMEM_SNAP_BLOCK - 100, 300), 0);
+	pos = size;
+	KUNIT_EXPECT_EQ(test, globalmem_snap_read(snap_filp, ubuf, 8, &pos), 0);
+
+	//MEM_CLEAR copies only the blocks left
+	KUNIT_EXPECT_EQ(test, globalmem_ioctl(filp, MEM_CLEAR, 0), 0);
+	KUNIT_EXPECT_EQ(test, snap->copied, 4UL);
+	pos = 0;
+	KUNIT_EXPECT_EQ(test, globalmem_snap_read(snap_filp, ubuf, size, &pos), (ssize_t)size);
+	KUNIT_ASSERT_EQ(test, copy_from_user(out, ubuf, size), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(out, before, size), 0);
+
+	//dropped, the writes copy nothing and another can be taken
+	KUNIT_EXPECT_EQ(test, globalmem_snap_release(NULL, snap_filp), 0);
+	KUNIT_EXPECT_NULL(test, rcu_access_pointer(dev->snap));
+	pos = 0;
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, ubuf, 4, &pos), 4);
+	snap_filp = globalmem_test_snap(test, dev);
+	KUNIT_EXPECT_EQ(test, globalmem_snap_release(NULL, snap_filp), 0);
+}
+
+/*****************cold pages**********/
+static void globalmem_test_dev_release(void *data){
+	globalmem_dev_free(data);
+}
+
+//a file of a cold device with nothing in, skipped where there is no lz4
+static struct file *globalmem_test_file_cold(struct kunit *test, size_t size){
+	struct globalmem_dev *dev = kunit_kzalloc(test, sizeof(*dev), GFP_KERNEL);
+	struct globalmem_cold *cold;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dev);
+	cold = globalmem_cold_create(size, "lz4");
+	if(IS_ERR(cold))
+		kunit_skip(test, "no lz4 acomp, %ld", PTR_ERR(cold));
+	if(globalmem_dev_init(dev, cold->area->addr, size, 12)){
+		globalmem_cold_destroy(cold);
+		KUNIT_ASSERT_FAILURE(test, "globalmem_dev_init");
+	}
+	dev->cold = cold;
+	cold->dev = dev;
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, globalmem_test_dev_release, dev), 0);
+	return globalmem_test_open(test, dev);
+}
+
+static void globalmem_test_cold(struct kunit *test){
+	size_t size = 4 * PAGE_SIZE;
+	struct file *filp = globalmem_test_file_cold(test, size);
+	struct globalmem_dev *dev = globalmem_test_dev(filp);
+	struct globalmem_cold *cold = dev->cold;
+	char __user *ubuf = ldd_kunit_ubuf(test, size + PAGE_SIZE);
+	struct globalmem_atomic __user *ua = (struct globalmem_atomic __user *)(ubuf + size);
+	u8 *page0, *page1, *out;
+	loff_t pos;
+	u64 old;
+	int i;
+
+	page0 = kunit_kmalloc(test, PAGE_SIZE, GFP_KERNEL);
+	page1 = kunit_kmalloc(test, PAGE_SIZE, GFP_KERNEL);
+	out = kunit_kmalloc(test, PAGE_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, page0);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, page1);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, out);
+	for(i = 0; i < PAGE_SIZE; i++)
+		page0[i] = "globalmem "[i % 10];
+	get_random_bytes(page1, PAGE_SIZE);
+
+	//nothing is in at first, a write or a read brings its pages in
+	KUNIT_EXPECT_EQ(test, cold->hot, 0UL);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, page0, PAGE_SIZE), 0);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf + PAGE_SIZE, page1, PAGE_SIZE), 0);
+	pos = 0;
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, ubuf, 2 * PAGE_SIZE, &pos), (ssize_t)(2 * PAGE_SIZE));
+	pos = 2 * PAGE_SIZE;
+	KUNIT_EXPECT_EQ(test, globalmem_read(filp, ubuf, PAGE_SIZE, &pos), (ssize_t)PAGE_SIZE);
+	KUNIT_ASSERT_EQ(test, copy_from_user(out, ubuf, PAGE_SIZE), 0);
+	KUNIT_EXPECT_TRUE(test, !memchr_inv(out, 0, PAGE_SIZE));
+	KUNIT_EXPECT_EQ(test, cold->hot, 3UL);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&cold->misses), 3LL);
+
+	//the first pass only clears the accessed bits, the second takes the pages out: the text compressed,
+	//the zero page dropped, the random one kept
+	globalmem_cold_scan(dev, 0);
+	KUNIT_EXPECT_EQ(test, cold->hot, 3UL);
+	globalmem_cold_scan(dev, 0);
+	KUNIT_EXPECT_EQ(test, cold->hot, 1UL);
+	KUNIT_EXPECT_EQ(test, cold->compressed, 1UL);
+	KUNIT_EXPECT_LT(test, cold->compressed_bytes, PAGE_SIZE / 4);
+	KUNIT_EXPECT_EQ(test, cold->evictions, 2UL);
+	KUNIT_EXPECT_EQ(test, cold->incompressible, 1UL);
+	KUNIT_EXPECT_NULL(test, cold->pages[0]);
+	KUNIT_EXPECT_NOT_NULL(test, cold->pages[1]);
+
+	//and back as they were
+	pos = 0;
+	KUNIT_EXPECT_EQ(test, globalmem_read(filp, ubuf, 2 * PAGE_SIZE, &pos), (ssize_t)(2 * PAGE_SIZE));
+	KUNIT_ASSERT_EQ(test, copy_from_user(out, ubuf, PAGE_SIZE), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(out, page0, PAGE_SIZE), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(out, ubuf + PAGE_SIZE, PAGE_SIZE), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(out, page1, PAGE_SIZE), 0);
+	KUNIT_EXPECT_EQ(test, cold->compressed, 0UL);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&cold->misses), 4LL);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&cold->hits), 1LL);
+
+	//the paths without a range lock bring pages in too
+	KUNIT_EXPECT_EQ(test, globalmem_test_atomic(filp, ua, GLOBALMEM_ATOMIC_FETCH_ADD, 8, 3 * PAGE_SIZE, 5, 0, &old), 0);
+	KUNIT_EXPECT_EQ(test, old, 0ULL);
+	KUNIT_EXPECT_EQ(test, *(u64 *)(dev->mem + 3 * PAGE_SIZE), 5ULL);
+	KUNIT_EXPECT_EQ(test, cold->hot, 3UL);
+}
+
+static void globalmem_test_fput(void *data){
+	fput(data);
+}
+
+//only what a mapping needs, the file is not the device's own and releases nothing
+static const struct file_operations globalmem_test_map_fops = {
+	.owner = THIS_MODULE,
+	.mmap = globalmem_mmap,
+};
+
+//a write whose buffer is a mapping of the same device: the copy faults with the stripes held, the fault must
+//bring the cold page in without them. the mapped pages stay in after
+static void globalmem_test_cold_mmap(struct kunit *test){
+	size_t size = 4 * PAGE_SIZE;
+	struct file *filp = globalmem_test_file_cold(test, size);
+	struct globalmem_dev *dev = globalmem_test_dev(filp);
+	struct globalmem_cold *cold = dev->cold;
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct file *map_filp, *snap_filp;
+	struct globalmem_snap *snap;
+	char __user *map;
+	u8 *out;
+	loff_t pos;
+	int i;
+
+	out = kunit_kmalloc(test, PAGE_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, out);
+	map_filp = anon_inode_getfile("[globalmem_test]", &globalmem_test_map_fops, filp->private_data, O_RDWR);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, map_filp);
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, globalmem_test_fput, map_filp), 0);
+	map = (char __user *)kunit_vm_mmap(test, map_filp, 0, size, PROT_READ | PROT_WRITE, MAP_SHARED, 0);
+	KUNIT_ASSERT_NE(test, (unsigned long)map, 0UL);
+
+	//page 0 written and taken out again
+	for(i = 0; i < PAGE_SIZE; i++)
+		out[i] = "globalmem "[i % 10];
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, out, PAGE_SIZE), 0);
+	pos = 0;
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, ubuf, PAGE_SIZE, &pos), (ssize_t)PAGE_SIZE);
+	globalmem_cold_scan(dev, 0);
+	globalmem_cold_scan(dev, 0);
+	KUNIT_ASSERT_NULL(test, cold->pages[0]);
+
+	//onto itself, the source faults in under the stripe of page 0 the write holds, then onto page 1
+	pos = 0;
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, map, PAGE_SIZE, &pos), (ssize_t)PAGE_SIZE);
+	KUNIT_EXPECT_EQ(test, globalmem_write(filp, map, PAGE_SIZE, &pos), (ssize_t)PAGE_SIZE);
+	KUNIT_EXPECT_EQ(test, memcmp(dev->mem, out, PAGE_SIZE), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(dev->mem + PAGE_SIZE, out, PAGE_SIZE), 0);
+	//and a read into a mapped page
+	pos = 0;
+	KUNIT_EXPECT_EQ(test, globalmem_read(filp, map + 2 * PAGE_SIZE, PAGE_SIZE, &pos), (ssize_t)PAGE_SIZE);
+	KUNIT_EXPECT_EQ(test, memcmp(dev->mem + 2 * PAGE_SIZE, out, PAGE_SIZE), 0);
+
+	//the mapping holds pages 0 and 2, only page 1 can go out
+	globalmem_cold_scan(dev, 0);
+	globalmem_cold_scan(dev, 0);
+	KUNIT_EXPECT_NOT_NULL(test, cold->pages[0]);
+	KUNIT_EXPECT_NULL(test, cold->pages[1]);
+	KUNIT_EXPECT_NOT_NULL(test, cold->pages[2]);
+
+	//a snapshot write protects page 2 alone, the one a store through the mapping made writable. the next
+	//store there faults again and copies its block
+	KUNIT_EXPECT_FALSE(test, test_bit(0, dev->wmapped));
+	KUNIT_EXPECT_TRUE(test, test_bit(2, dev->wmapped));
+	snap_filp = globalmem_test_snap(test, dev);
+	snap = snap_filp->private_data;
+	KUNIT_EXPECT_FALSE(test, test_bit(2, dev->wmapped));
+	KUNIT_ASSERT_EQ(test, copy_to_user(map + 2 * PAGE_SIZE, "x", 1), 0);
+	KUNIT_EXPECT_EQ(test, snap->copied, 1UL);
+	KUNIT_EXPECT_TRUE(test, test_bit(2, dev->wmapped));
+	KUNIT_EXPECT_EQ(test, globalmem_snap_release(NULL, snap_filp), 0);
+}
+
+/*****************copy engine*********/
+#define GLOBALMEM_TEST_COPY_SIZE	(4 * GLOBALMEM_COPY_CHUNK)
+
+static long globalmem_test_copy_submit(struct file *filp, char __user *ubuf, const struct globalmem_copy *c, u32 n,
+		u32 *done){
+	struct globalmem_copy_batch b = { .copies = (u64)(uintptr_t)(ubuf + sizeof(b)), .n = n };
+	long ret;
+
+	if(copy_to_user(ubuf + sizeof(b), c, n * sizeof(*c)) || copy_to_user(ubuf, &b, sizeof(b)))
+		return -EFAULT;
+	ret = globalmem_ioctl(filp, GLOBALMEM_COPY, (unsigned long)ubuf);
+	if(get_user(*done, &((struct globalmem_copy_batch __user *)ubuf)->done))
+		return -EFAULT;
+	return ret;
+}
+
+//poll until n completions are in, then reap them
+static void globalmem_test_copy_reap(struct kunit *test, struct file *filp, char __user *ubuf, u32 n,
+		struct globalmem_copy_comp *comps){
+	struct globalmem_copy_reap r = { .comps = (u64)(uintptr_t)(ubuf + sizeof(r)), .n = n };
+	struct globalmem_file *gf = filp->private_data;
+	int i;
+
+	for(i = 0; i < 5000 && READ_ONCE(gf->ring_len) < n; i++)
+		msleep(1);
+	KUNIT_ASSERT_TRUE(test, globalmem_poll(filp, NULL) & POLLPRI);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &r, sizeof(r)), 0);
+	KUNIT_ASSERT_EQ(test, globalmem_ioctl(filp, GLOBALMEM_COPY_REAP, (unsigned long)ubuf), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(&r, ubuf, sizeof(r)), 0);
+	KUNIT_ASSERT_EQ(test, r.count, n);
+	KUNIT_ASSERT_EQ(test, copy_from_user(comps, ubuf + sizeof(r), n * sizeof(*comps)), 0);
+}
+
+static void globalmem_test_copy(struct kunit *test){
+	struct file *filp = globalmem_test_file_size(test, GLOBALMEM_TEST_COPY_SIZE);
+	struct file *other = globalmem_test_file_size(test, GLOBALMEM_TEST_COPY_SIZE);
+	struct globalmem_dev *dev = globalmem_test_dev(filp), *src = globalmem_test_dev(other);
+	struct globalmem_file *gf = filp->private_data;
+	struct file *locker = globalmem_test_open(test, dev);
+	char __user *ubuf = ldd_kunit_ubuf(test, PAGE_SIZE);
+	struct globalmem_copy c[2] = {
+		//overlapping from above over several chunks, it has to go from the end
+		{ .src_off = 100, .dst_off = 1000, .len = 2 * GLOBALMEM_COPY_CHUNK + 5, .cookie = 1,
+			.src_fd = GLOBALMEM_COPY_SAME },
+		{ .src_off = 0, .dst_off = 3 * GLOBALMEM_COPY_CHUNK, .len = 10, .cookie = 2,
+			.src_fd = GLOBALMEM_COPY_SAME },
+	};
+	struct globalmem_copy_comp comps[2];
+	u8 *before;
+	u32 done;
+	int i;
+
+	if(!globalmem_copy_wq)
+		kunit_skip(test, "no copy workqueue, the module didn't init");
+	before = kunit_kmalloc(test, GLOBALMEM_TEST_COPY_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, before);
+	get_random_bytes(dev->mem, GLOBALMEM_TEST_COPY_SIZE);
+	memcpy(before, dev->mem, GLOBALMEM_TEST_COPY_SIZE);
+
+	KUNIT_EXPECT_EQ(test, globalmem_test_copy_submit(filp, ubuf, c, 2, &done), 0L);
+	KUNIT_EXPECT_EQ(test, done, 2U);
+	globalmem_test_copy_reap(test, filp, ubuf, 2, comps);
+	for(i = 0; i < 2; i++)
+		KUNIT_EXPECT_EQ(test, comps[i].status, 0);
+	KUNIT_EXPECT_EQ(test, comps[0].cookie + comps[1].cookie, 3ULL); //in the order they finished
+	KUNIT_EXPECT_EQ(test, memcmp(dev->mem + 1000, before + 100, c[0].len), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(dev->mem + 3 * GLOBALMEM_COPY_CHUNK, before, 10), 0);
+	KUNIT_EXPECT_EQ(test, gf->copy_pending, 0U);
+	KUNIT_EXPECT_FALSE(test, globalmem_poll(filp, NULL) & POLLPRI);
+
+	//between two devices, one chunk of it straight
+	memset(src->mem, 0x5a, GLOBALMEM_TEST_COPY_SIZE);
+	KUNIT_EXPECT_EQ(test, globalmem_copy_range(gf, src, 0, 10, GLOBALMEM_COPY_CHUNK), 0);
+	KUNIT_EXPECT_TRUE(test, !memchr_inv(dev->mem + 10, 0x5a, GLOBALMEM_COPY_CHUNK));
+
+	//a bad one stops the batch where it is, the ones before it are queued
+	c[1].src_fd = -2;
+	KUNIT_EXPECT_EQ(test, globalmem_test_copy_submit(filp, ubuf, c, 2, &done), -EBADF);
+	KUNIT_EXPECT_EQ(test, done, 1U);
+	globalmem_test_copy_reap(test, filp, ubuf, 1, comps);
+	KUNIT_EXPECT_EQ(test, comps[0].cookie, 1ULL);
+	c[0].len = GLOBALMEM_TEST_COPY_SIZE;
+	KUNIT_EXPECT_EQ(test, globalmem_test_copy_submit(filp, ubuf, c, 1, &done), -EINVAL);
+	KUNIT_EXPECT_EQ(test, done, 0U);
+
+	//it writes into the file and reads the source through it, both have to be open for that
+	c[0].len = 10;
+	filp->f_mode = FMODE_READ;
+	KUNIT_EXPECT_EQ(test, globalmem_test_copy_submit(filp, ubuf, c, 1, &done), -EBADF);
+	filp->f_mode = FMODE_WRITE;
+	KUNIT_EXPECT_EQ(test, globalmem_test_copy_submit(filp, ubuf, c, 1, &done), -EBADF);
+	KUNIT_EXPECT_EQ(test, done, 0U);
+	filp->f_mode = FMODE_READ | FMODE_WRITE;
+
+	//one waiting for another file's range lock comes out with ECANCELED on close
+	KUNIT_EXPECT_EQ(test, globalmem_test_lock(locker, (struct globalmem_lock __user *)ubuf, GLOBALMEM_LOCK,
+			0, GLOBALMEM_TEST_COPY_SIZE, GLOBALMEM_LOCK_EXCL), 0);
+	KUNIT_EXPECT_EQ(test, globalmem_test_copy_submit(filp, ubuf, c, 1, &done), 0L);
+	KUNIT_EXPECT_EQ(test, done, 1U);
+	msleep(20);
+	KUNIT_EXPECT_EQ(test, atomic_read(&gf->copy_inflight), 1);
+	globalmem_copy_cancel(gf);
+	globalmem_test_copy_reap(test, filp, ubuf, 1, comps);
+	KUNIT_EXPECT_EQ(test, comps[0].status, -ECANCELED);
+	globalmem_unlock_all(locker->private_data);
+
+	kfree(gf->ring); //the file is never released here
+}
+
+/*****************benchmarks************/
+#define GLOBALMEM_BENCH_OPS 20000
+
+static void globalmem_bench_copy(struct kunit *test){
+	struct file *filp = globalmem_test_file(test);
+	char __user *ubuf = ldd_kunit_ubuf(test, GLOBALMEM_SIZE);
+	loff_t pos;
+	ktime_t start;
+	int i;
+
+	start = ktime_get();
+	for(i = 0; i < GLOBALMEM_BENCH_OPS; i++){
+		pos = 0;
+		if(globalmem_write(filp, ubuf, GLOBALMEM_SIZE, &pos) != GLOBALMEM_SIZE)
+			break;
+		pos = 0;
+		if(globalmem_read(filp, ubuf, GLOBALMEM_SIZE, &pos) != GLOBALMEM_SIZE)
+			break;
+	}
+	KUNIT_ASSERT_EQ(test, i, GLOBALMEM_BENCH_OPS);
+	ldd_kunit_bench(test, "copy", GLOBALMEM_BENCH_OPS, 2ULL * GLOBALMEM_BENCH_OPS * GLOBALMEM_SIZE, start,
+			globalmem_bench_max_ns);
+}
+
+#define GLOBALMEM_BENCH_WRITERS 16
+#define GLOBALMEM_BENCH_REGION (1 << GLOBALMEM_STRIPE_SHIFT) //a stripe each, nothing shared
+
+struct globalmem_bench_writer{
+	struct file *filp;
+	char __user *ubuf;
+	loff_t off;
+	struct completion *go;
+};
+
+static int globalmem_bench_writer_fn(struct ldd_kunit_peer *peer){
+	struct globalmem_bench_writer *w = peer->data;
+	loff_t pos;
+	int i;
+
+	if(wait_for_completion_killable(w->go)) //the test stopped before the start
+		return -EINTR;
+	for(i = 0; i < GLOBALMEM_BENCH_OPS; i++){
+		pos = w->off;
+		if(globalmem_write(w->filp, w->ubuf, GLOBALMEM_BENCH_REGION, &pos) != GLOBALMEM_BENCH_REGION)
+			return -EIO;
+	}
+	return 0;
+}
+
+//writers on disjoint regions, 1, 2, 4 ... of them up to the CPUs. with the stripes the ns/op
+//stays about flat as they are added, a device wide lock would make it grow with the count
+static void globalmem_bench_disjoint(struct kunit *test){
+	unsigned int max = min_t(unsigned int, num_online_cpus(), GLOBALMEM_BENCH_WRITERS), n, i;
+	struct file *filp = globalmem_test_file_size(test, GLOBALMEM_BENCH_WRITERS * GLOBALMEM_BENCH_REGION);
+	struct globalmem_bench_writer *w = kunit_kcalloc(test, max, sizeof(*w), GFP_KERNEL);
+	struct completion *go = kunit_kzalloc(test, sizeof(*go), GFP_KERNEL);
+	struct ldd_kunit_peer *peer[GLOBALMEM_BENCH_WRITERS];
+	char name[32];
+	ktime_t start;
+	int ret;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, w);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, go);
+	for(i = 0; i < max; i++){
+		w[i].filp = globalmem_test_open(test, globalmem_test_dev(filp));
+		w[i].ubuf = ldd_kunit_ubuf(test, GLOBALMEM_BENCH_REGION);
+		w[i].off = i * GLOBALMEM_BENCH_REGION;
+		w[i].go = go;
+	}
+	for(n = 1; n <= max; n *= 2){
+		init_completion(go);
+		for(i = 0; i < n; i++)
+			peer[i] = ldd_kunit_peer_start(test, globalmem_bench_writer_fn, w + i, sizeof(*w));
+		start = ktime_get();
+		complete_all(go);
+		ret = 0;
+		for(i = 0; i < n; i++)
+			ret |= ldd_kunit_peer_wait(peer[i]);
+		KUNIT_ASSERT_EQ(test, ret, 0);
+		snprintf(name, sizeof(name), "disjoint writers x%u", n);
+		//per op of each writer, the wall time of the round over its ops
+		ldd_kunit_bench(test, name, GLOBALMEM_BENCH_OPS, (u64)n * GLOBALMEM_BENCH_OPS * GLOBALMEM_BENCH_REGION,
+				start, 0);
+	}
+}
+
+#define GLOBALMEM_BENCH_HUGE_SIZE	(32U << 20)
+#define GLOBALMEM_BENCH_LINE	64
+#define GLOBALMEM_BENCH_CHASE	(1U << 20)
+
+//a dependent load per op over one random cycle through the lines of the device, so each op waits for
+//a TLB walk when the reach of the TLB is short of the device. Sattolo's shuffle makes it a single cycle
+static void globalmem_bench_chase(struct kunit *test, const char *name, struct globalmem_dev *dev){
+	u32 lines = dev->size / GLOBALMEM_BENCH_LINE, i, j, tmp, at = 0;
+	u32 *line;
+	ktime_t start;
+
+	for(i = 0; i < lines; i++)
+		*(u32 *)(dev->mem + (size_t)i * GLOBALMEM_BENCH_LINE) = i;
+	for(i = lines - 1; i > 0; i--){
+		j = get_random_u32_below(i);
+		line = (u32 *)(dev->mem + (size_t)i * GLOBALMEM_BENCH_LINE);
+		tmp = *line;
+		*line = *(u32 *)(dev->mem + (size_t)j * GLOBALMEM_BENCH_LINE);
+		*(u32 *)(dev->mem + (size_t)j * GLOBALMEM_BENCH_LINE) = tmp;
+	}
+
+	start = ktime_get();
+	for(i = 0; i < GLOBALMEM_BENCH_CHASE; i++)
+		at = READ_ONCE(*(u32 *)(dev->mem + (size_t)at * GLOBALMEM_BENCH_LINE));
+	ldd_kunit_bench(test, name, GLOBALMEM_BENCH_CHASE, 0, start, 0);
+	KUNIT_EXPECT_LT(test, at, lines);
+}
+
+static void globalmem_bench_vfree(void *data){
+	vfree(data);
+}
+
+//the same chase over small pages and over what globalmem_huge=1 allocates
+static void globalmem_bench_random(struct kunit *test){
+	struct globalmem_dev *dev = kunit_kzalloc(test, sizeof(*dev), GFP_KERNEL);
+	char name[64];
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dev);
+	dev->size = GLOBALMEM_BENCH_HUGE_SIZE;
+
+	dev->mem = vmalloc_user(dev->size);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dev->mem);
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, globalmem_bench_vfree, dev->mem), 0);
+	globalmem_bench_chase(test, "random read, small pages", dev);
+
+	dev->mem = vmalloc_huge(dev->size, GFP_KERNEL | __GFP_ZERO);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dev->mem);
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, globalmem_bench_vfree, dev->mem), 0);
+	KUNIT_ASSERT_EQ(test, globalmem_dev_huge(dev), 0);
+	snprintf(name, sizeof(name), "random read, %lu of %lu chunks huge", dev->huge_chunks,
+			(unsigned long)(dev->size >> PMD_SHIFT));
+	globalmem_bench_chase(test, name, dev);
+	bitmap_free(dev->huge);
+}
+
+static struct kunit_case globalmem_test_cases[] = {
+	KUNIT_CASE_PARAM(globalmem_test_seek, globalmem_seek_gen_params),
+	KUNIT_CASE(globalmem_test_span),
+	KUNIT_CASE(globalmem_test_rw),
+	KUNIT_CASE(globalmem_test_llseek),
+	KUNIT_CASE(globalmem_test_crc32c),
+	KUNIT_CASE(globalmem_test_search_fill_move),
+	KUNIT_CASE(globalmem_test_chunks),
+	KUNIT_CASE(globalmem_test_atomic_ops),
+	KUNIT_CASE(globalmem_test_atomic_batch),
+	KUNIT_CASE(globalmem_test_atomic_race),
+	KUNIT_CASE(globalmem_test_wait_now),
+	KUNIT_CASE(globalmem_test_wait_wakeup),
+	KUNIT_CASE(globalmem_test_subscribe),
+	KUNIT_CASE(globalmem_test_stripes),
+	KUNIT_CASE(globalmem_test_range_lock),
+	KUNIT_CASE(globalmem_test_range_lock_read),
+	KUNIT_CASE(globalmem_test_dirty),
+	KUNIT_CASE(globalmem_test_snapshot),
+	KUNIT_CASE(globalmem_test_cold),
+	KUNIT_CASE(globalmem_test_cold_mmap),
+	KUNIT_CASE(globalmem_test_copy),
+	KUNIT_CASE_SLOW(globalmem_bench_copy),
+	KUNIT_CASE_SLOW(globalmem_bench_disjoint),
+	KUNIT_CASE_SLOW(globalmem_bench_random),
+	{}
+};
+
+static struct kunit_suite globalmem_test_suite = {
+	.name = "globalmem",
+	.test_cases = globalmem_test_cases,
+};
+kunit_test_suite(globalmem_test_suite);
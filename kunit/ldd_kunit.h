@@ -0,0 +1,109 @@
+#ifndef _LDD_KUNIT_H
+#define _LDD_KUNIT_H
+
+//helpers shared by the suites: userspace buffers, a second task to block against, timing
+#include <kunit/test.h>
+#include <linux/kthread.h>
+#include <linux/sched/signal.h> //allow_signal, send_sig
+#include <linux/sched/task.h> //get_task_struct
+#include <linux/completion.h>
+#include <linux/sched/mm.h> //kthread_use_mm
+#include <linux/mman.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+
+//copy_*_user needs a real user address, kunit gives the test task an mm for it
+static inline void __user *ldd_kunit_ubuf(struct kunit *test, size_t size){
+	unsigned long addr = kunit_vm_mmap(test, NULL, 0, size, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE, 0);
+
+	KUNIT_ASSERT_NE_MSG(test, addr, 0, "no user memory, the suite needs an MMU");
+	return (void __user *)addr;
+}
+
+//runs fn in a kthread sharing the mm of the test, so both sides can copy to the same user buffers.
+//a failed assertion ends the test task at once, so nothing the peer uses may sit on its stack: the peer
+//is kunit memory, data is copied next to it, and a cleanup action stops the peer before the rest goes
+struct ldd_kunit_peer{
+	struct mm_struct *mm;
+	struct task_struct *task;
+	int (*fn)(struct ldd_kunit_peer *peer);
+	void *data; //the copy
+	int ret;
+	struct completion done;
+};
+
+static inline int ldd_kunit_peer_thread(void *data){
+	struct ldd_kunit_peer *peer = data;
+
+	allow_signal(SIGKILL); //see ldd_kunit_peer_stop
+	kthread_use_mm(peer->mm);
+	peer->ret = peer->fn(peer);
+	kthread_unuse_mm(peer->mm);
+	complete(&peer->done);
+	return 0;
+}
+
+//a peer still blocked in a driver is interrupted, the waits there are interruptible as they are for read()
+static inline void ldd_kunit_peer_stop(void *data){
+	struct ldd_kunit_peer *peer = data;
+
+	if(!completion_done(&peer->done))
+		send_sig(SIGKILL, peer->task, 1);
+	wait_for_completion(&peer->done);
+	put_task_struct(peer->task);
+}
+
+static inline struct ldd_kunit_peer *ldd_kunit_peer_start(struct kunit *test,
+		int (*fn)(struct ldd_kunit_peer *peer), const void *data, size_t size){
+	struct ldd_kunit_peer *peer = kunit_kzalloc(test, sizeof(*peer) + size, GFP_KERNEL);
+	struct task_struct *task;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, peer);
+	peer->mm = current->mm;
+	peer->fn = fn;
+	peer->data = peer + 1;
+	memcpy(peer->data, data, size);
+	init_completion(&peer->done);
+	task = kthread_create(ldd_kunit_peer_thread, peer, "ldd_kunit_peer");
+	KUNIT_ASSERT_FALSE(test, IS_ERR(task));
+	peer->task = get_task_struct(task);
+	wake_up_process(task);
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, ldd_kunit_peer_stop, peer), 0);
+	return peer;
+}
+
+static inline int ldd_kunit_peer_wait(struct ldd_kunit_peer *peer){
+	wait_for_completion(&peer->done);
+	return peer->ret;
+}
+
+//poll until *counter moves, so the peer acts only once the test task is really asleep
+static inline bool ldd_kunit_wait_u64(u64 *counter, u64 old){
+	int i;
+
+	for(i = 0; i < 1000; i++){
+		if(READ_ONCE(*counter) != old)
+			return true;
+		msleep(1);
+	}
+	return false;
+}
+
+//report one benchmark and fail it above max_ns per op, 0 only reports.
+//the budgets are loose on purpose, they catch an accidental sleep or O(n^2), not a few percent
+static inline void ldd_kunit_bench(struct kunit *test, const char *name, u64 ops, u64 bytes,
+		ktime_t start, unsigned int max_ns){
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	u64 per_op = div64_u64(ns, ops);
+
+	if(bytes)
+		kunit_info(test, "%s: %llu ops, %llu ns/op, %llu MB/s\n", name, ops, per_op,
+				ns ? div64_u64(bytes * 1000, ns) : 0);
+	else
+		kunit_info(test, "%s: %llu ops, %llu ns/op\n", name, ops, per_op);
+	if(max_ns)
+		KUNIT_EXPECT_LE_MSG(test, per_op, (u64)max_ns, "%s is slower than the budget", name);
+}
+
+#endif
@@ -0,0 +1,240 @@
+//KUnit suite for second, built into this object like globalfifo_kunit.c.
+//the timer cases use a private device, so its hrtimer only serves the files opened here
+#include "../3_second_irp/second.c"
+#include "ldd_kunit.h"
+#include <linux/random.h>
+
+#define SECOND_TEST_FILES	64
+
+static unsigned int second_bench_max_ns = 20000; //per heap insert+remove, 0 only reports
+module_param(second_bench_max_ns, uint, S_IRUGO | S_IWUSR);
+
+static void second_test_exit_dev(void *data){
+	struct second_cdev *dev = data;
+
+	hrtimer_cancel(&dev->s_timer);
+	kvfree(dev->heap);
+}
+
+static struct second_cdev *second_test_dev(struct kunit *test){
+	struct second_cdev *dev = kunit_kzalloc(test, sizeof(*dev), GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dev);
+	second_cdev_init(dev);
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, second_test_exit_dev, dev), 0);
+	return dev;
+}
+
+//open through the real fop, the inode only has to lead back to the cdev
+static struct file *second_test_open(struct kunit *test, struct second_cdev *dev, bool tickless){
+	struct inode *inode = kunit_kzalloc(test, sizeof(*inode), GFP_KERNEL);
+	struct file *filp = kunit_kzalloc(test, sizeof(*filp), GFP_KERNEL);
+	bool saved = second_tickless;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, inode);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, filp);
+	inode->i_cdev = &dev->cdev;
+	filp->f_inode = inode;
+
+	//open samples the module parameter, the suite runs alone so borrowing it is fine
+	second_tickless = tickless;
+	KUNIT_ASSERT_EQ(test, second_open(inode, filp), 0);
+	second_tickless = saved;
+	return filp;
+}
+
+static void second_test_release(struct file *filp){
+	second_release(filp->f_inode, filp);
+}
+
+//every parent no later than its children, every node knows where it is
+static void second_test_heap_check(struct kunit *test, struct second_cdev *dev){
+	unsigned int i;
+
+	for(i = 0; i < dev->heap_len; i++){
+		KUNIT_EXPECT_EQ(test, dev->heap[i]->heap_idx, i);
+		if(i)
+			KUNIT_EXPECT_LE(test, ktime_compare(dev->heap[(i - 1) / 2]->expires, dev->heap[i]->expires), 0);
+	}
+}
+
+/*****************heap******************/
+static void second_test_heap(struct kunit *test){
+	struct second_cdev *dev = second_test_dev(test);
+	struct second_file *sf = kunit_kcalloc(test, SECOND_TEST_FILES, sizeof(*sf), GFP_KERNEL);
+	ktime_t last;
+	bool sorted;
+	int i;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, sf);
+	for(i = 0; i < SECOND_TEST_FILES; i++){
+		dev->nr_open = i;
+		KUNIT_ASSERT_EQ(test, second_heap_reserve(dev), 0);
+	}
+	KUNIT_EXPECT_GE(test, dev->heap_cap, (unsigned int)SECOND_TEST_FILES);
+
+	spin_lock_irq(&dev->lock);
+	for(i = 0; i < SECOND_TEST_FILES; i++){
+		sf[i].expires = get_random_u32_below(1000);
+		second_heap_insert(dev, &sf[i]);
+	}
+	spin_unlock_irq(&dev->lock);
+	second_test_heap_check(test, dev);
+
+	//delete from the middle, as release does
+	spin_lock_irq(&dev->lock);
+	for(i = 0; i < SECOND_TEST_FILES; i += 3)
+		second_heap_remove(dev, &sf[i]);
+	spin_unlock_irq(&dev->lock);
+	second_test_heap_check(test, dev);
+
+	//popping the top gives the deadlines in order, checked outside the lock since a failure allocates
+	last = 0;
+	sorted = true;
+	spin_lock_irq(&dev->lock);
+	while(dev->heap_len){
+		if(ktime_before(dev->heap[0]->expires, last))
+			sorted = false;
+		last = dev->heap[0]->expires;
+		second_heap_remove(dev, dev->heap[0]);
+	}
+	spin_unlock_irq(&dev->lock);
+	KUNIT_EXPECT_TRUE(test, sorted);
+}
+
+/*****************timer*****************/
+//run the handler as if the deadline had passed, the page mirrors the count
+static void second_test_periodic_tick(struct kunit *test){
+	struct second_cdev *dev = second_test_dev(test);
+	struct file *filp = second_test_open(test, dev, false);
+	struct second_file *sf = filp->private_data;
+	ktime_t due;
+
+	KUNIT_EXPECT_TRUE(test, sf->queued);
+	KUNIT_EXPECT_TRUE(test, hrtimer_active(&dev->s_timer));
+	KUNIT_EXPECT_NULL(test, sf->page); //not before the first mmap
+
+	spin_lock_irq(&dev->lock);
+	due = ktime_sub_ns(ktime_get(), 1);
+	sf->expires = due;
+	spin_unlock_irq(&dev->lock);
+
+	local_irq_disable(); //the handler runs in hard irq context
+	second_timer_handler(&dev->s_timer);
+	local_irq_enable();
+
+	KUNIT_EXPECT_EQ(test, atomic_read(&sf->counter), 1);
+	KUNIT_EXPECT_EQ(test, ktime_sub(sf->expires, due), (ktime_t)NSEC_PER_SEC);
+
+	//a page mapped late starts from the last tick, the next ones go through the seqcount
+	KUNIT_ASSERT_EQ(test, second_page_alloc(sf), 0);
+	KUNIT_EXPECT_EQ(test, sf->page->counter, 1U);
+	KUNIT_EXPECT_EQ(test, sf->page->last_tick_ns, (u64)ktime_to_ns(sf->last_tick));
+	KUNIT_EXPECT_EQ(test, sf->page->base_ns, (u64)ktime_to_ns(sf->base));
+	KUNIT_EXPECT_EQ(test, sf->page->seq, 0U);
+
+	spin_lock_irq(&dev->lock);
+	sf->expires = ktime_sub_ns(ktime_get(), 1);
+	spin_unlock_irq(&dev->lock);
+	local_irq_disable();
+	second_timer_handler(&dev->s_timer);
+	local_irq_enable();
+	KUNIT_EXPECT_EQ(test, sf->page->counter, 2U);
+	KUNIT_EXPECT_EQ(test, sf->page->seq, 2U);
+	KUNIT_EXPECT_TRUE(test, sf->queued);
+	KUNIT_EXPECT_EQ(test, dev->heap_len, 1U);
+
+	second_test_release(filp);
+	KUNIT_EXPECT_EQ(test, dev->heap_len, 0U);
+}
+
+//the real hrtimer, one second after open the count is 1
+static void second_test_periodic_timer(struct kunit *test){
+	struct second_cdev *dev = second_test_dev(test);
+	struct file *filp = second_test_open(test, dev, false);
+	struct second_file *sf = filp->private_data;
+	ktime_t start = sf->base;
+	long left;
+	s64 ms;
+
+	left = wait_event_interruptible_timeout(sf->wait, atomic_read(&sf->counter) == 1, 3 * HZ);
+	ms = ktime_ms_delta(ktime_get(), start);
+	KUNIT_EXPECT_GT(test, left, 0);
+	KUNIT_EXPECT_GE(test, ms, 1000);
+	KUNIT_EXPECT_LT(test, ms, 1500);
+
+	second_test_release(filp);
+}
+
+//tickless: the count comes from the clock, the timer is a one shot armed by the sleeper
+static void second_test_tickless(struct kunit *test){
+	struct second_cdev *dev = second_test_dev(test);
+	struct file *filp = second_test_open(test, dev, true);
+	struct second_file *sf = filp->private_data;
+	long left;
+
+	KUNIT_EXPECT_FALSE(test, sf->queued);
+	KUNIT_EXPECT_EQ(test, dev->heap_len, 0U);
+
+	//pretend the file was opened 3.9s ago, the next second is 100ms away
+	sf->base = ktime_sub_ms(ktime_get(), 3900);
+	sf->last_read = 3;
+	KUNIT_EXPECT_EQ(test, second_count(sf), 3);
+	KUNIT_EXPECT_EQ(test, second_poll(filp, NULL), 0U);
+	KUNIT_EXPECT_TRUE(test, sf->queued);
+	KUNIT_EXPECT_EQ(test, ktime_sub(sf->expires, sf->base), (ktime_t)(4 * NSEC_PER_SEC));
+
+	//the handler wakes with wake_up_interruptible, so sleep interruptible as read does
+	left = wait_event_interruptible_timeout(sf->wait, !READ_ONCE(sf->queued), HZ);
+	KUNIT_EXPECT_GT(test, left, 0);
+	KUNIT_EXPECT_EQ(test, atomic_read(&sf->counter), 4);
+	KUNIT_EXPECT_EQ(test, dev->heap_len, 0U);
+	KUNIT_EXPECT_EQ(test, second_poll(filp, NULL), POLLIN | POLLRDNORM);
+
+	second_test_release(filp);
+}
+
+/*****************benchmarks************/
+#define SECOND_BENCH_FILES	1024
+#define SECOND_BENCH_ROUNDS	100
+
+//the cost release/open pay per file, at a realistic heap depth
+static void second_bench_heap(struct kunit *test){
+	struct second_cdev *dev = second_test_dev(test);
+	struct second_file *sf = kunit_kcalloc(test, SECOND_BENCH_FILES, sizeof(*sf), GFP_KERNEL);
+	ktime_t start;
+	int i, r;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, sf);
+	dev->heap = kvmalloc_array(SECOND_BENCH_FILES, sizeof(*dev->heap), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, dev->heap);
+	dev->heap_cap = SECOND_BENCH_FILES;
+	for(i = 0; i < SECOND_BENCH_FILES; i++)
+		sf[i].expires = get_random_u32();
+
+	start = ktime_get();
+	for(r = 0; r < SECOND_BENCH_ROUNDS; r++){
+		spin_lock_irq(&dev->lock);
+		for(i = 0; i < SECOND_BENCH_FILES; i++)
+			second_heap_insert(dev, &sf[i]);
+		for(i = 0; i < SECOND_BENCH_FILES; i++)
+			second_heap_remove(dev, &sf[i]);
+		spin_unlock_irq(&dev->lock);
+	}
+	ldd_kunit_bench(test, "heap", SECOND_BENCH_ROUNDS * SECOND_BENCH_FILES, 0, start, second_bench_max_ns);
+}
+
+static struct kunit_case second_test_cases[] = {
+	KUNIT_CASE(second_test_heap),
+	KUNIT_CASE(second_test_periodic_tick),
+	KUNIT_CASE_SLOW(second_test_periodic_timer),
+	KUNIT_CASE(second_test_tickless),
+	KUNIT_CASE_SLOW(second_bench_heap),
+	{}
+};
+
+static struct kunit_suite second_test_suite = {
+	.name = "second",
+	.test_cases = second_test_cases,
+};
+kunit_test_suite(second_test_suite);